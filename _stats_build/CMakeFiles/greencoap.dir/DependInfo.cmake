@@ -0,0 +1,26 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/greencoap.c" "CMakeFiles/greencoap.dir/greencoap.c.o" "gcc" "CMakeFiles/greencoap.dir/greencoap.c.o.d"
+  )
+
+# Pairs of files generated by the same build rule.
+set(CMAKE_MULTIPLE_OUTPUT_PAIRS
+  "/root/repo/_stats_build/libgreencoap.so" "/root/repo/_stats_build/libgreencoap.so.0.0.1"
+  "/root/repo/_stats_build/libgreencoap.so.1" "/root/repo/_stats_build/libgreencoap.so.0.0.1"
+  )
+
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,13 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/greencoap.dir/greencoap.c.o"
+  "CMakeFiles/greencoap.dir/greencoap.c.o.d"
+  "libgreencoap.pdb"
+  "libgreencoap.so"
+  "libgreencoap.so.0.0.1"
+  "libgreencoap.so.1"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/greencoap.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/greencoap_bench.dir/bench.c.o"
+  "CMakeFiles/greencoap_bench.dir/bench.c.o.d"
+  "greencoap_bench"
+  "greencoap_bench.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/greencoap_bench.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/greencoap_bench_trusted.dir/bench.c.o"
+  "CMakeFiles/greencoap_bench_trusted.dir/bench.c.o.d"
+  "greencoap_bench_trusted"
+  "greencoap_bench_trusted.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/greencoap_bench_trusted.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
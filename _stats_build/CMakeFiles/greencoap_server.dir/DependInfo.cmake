@@ -0,0 +1,27 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/greencoap_server.c" "CMakeFiles/greencoap_server.dir/greencoap_server.c.o" "gcc" "CMakeFiles/greencoap_server.dir/greencoap_server.c.o.d"
+  )
+
+# Pairs of files generated by the same build rule.
+set(CMAKE_MULTIPLE_OUTPUT_PAIRS
+  "/root/repo/_stats_build/libgreencoap_server.so" "/root/repo/_stats_build/libgreencoap_server.so.0.0.1"
+  "/root/repo/_stats_build/libgreencoap_server.so.1" "/root/repo/_stats_build/libgreencoap_server.so.0.0.1"
+  )
+
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  "/root/repo/_stats_build/CMakeFiles/greencoap.dir/DependInfo.cmake"
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
@@ -0,0 +1,13 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/greencoap_server.dir/greencoap_server.c.o"
+  "CMakeFiles/greencoap_server.dir/greencoap_server.c.o.d"
+  "libgreencoap_server.pdb"
+  "libgreencoap_server.so"
+  "libgreencoap_server.so.0.0.1"
+  "libgreencoap_server.so.1"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/greencoap_server.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/greencoap_test.dir/test.c.o"
+  "CMakeFiles/greencoap_test.dir/test.c.o.d"
+  "greencoap_test"
+  "greencoap_test.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/greencoap_test.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/greencoap_test_cpp.dir/test.cpp.o"
+  "CMakeFiles/greencoap_test_cpp.dir/test.cpp.o.d"
+  "greencoap_test_cpp"
+  "greencoap_test_cpp.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/greencoap_test_cpp.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
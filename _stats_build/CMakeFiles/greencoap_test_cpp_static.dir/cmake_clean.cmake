@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/greencoap_test_cpp_static.dir/test.cpp.o"
+  "CMakeFiles/greencoap_test_cpp_static.dir/test.cpp.o.d"
+  "greencoap_test_cpp_static"
+  "greencoap_test_cpp_static.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/greencoap_test_cpp_static.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
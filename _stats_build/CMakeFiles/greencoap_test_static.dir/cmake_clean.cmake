@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/greencoap_test_static.dir/test.c.o"
+  "CMakeFiles/greencoap_test_static.dir/test.c.o.d"
+  "greencoap_test_static"
+  "greencoap_test_static.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/greencoap_test_static.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,14 @@
+# CMake generated Testfile for 
+# Source directory: /root/repo
+# Build directory: /root/repo/_stats_build
+# 
+# This file includes the relevant testing commands required for 
+# testing this directory and lists subdirectories to be tested as well.
+add_test(greencoap_test "greencoap_test")
+set_tests_properties(greencoap_test PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;52;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(greencoap_test_static "greencoap_test_static")
+set_tests_properties(greencoap_test_static PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;58;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(greencoap_test_cpp "greencoap_test_cpp")
+set_tests_properties(greencoap_test_cpp PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;63;add_test;/root/repo/CMakeLists.txt;0;")
+add_test(greencoap_test_cpp_static "greencoap_test_cpp_static")
+set_tests_properties(greencoap_test_cpp_static PROPERTIES  _BACKTRACE_TRIPLES "/root/repo/CMakeLists.txt;67;add_test;/root/repo/CMakeLists.txt;0;")
@@ -0,0 +1,1105 @@
+#ifdef GREENCOAP_SERVER
+#define _GNU_SOURCE
+#endif
+#include "greencoap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef GREENCOAP_SERVER
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "greencoap_server.h"
+#endif
+
+#define L(x) (sizeof(x) - 1)
+#define BENCH_BUFLEN 2048
+#define BENCH_DEFAULT_ITER 1000000
+
+/**
+ * A synthetic message in the benchmark corpus.
+ */
+typedef struct bench_msg_t {
+  const char* name;
+  int (*build)(coap_serializer_t* s, uint16_t mid, size_t* len);
+  char buf[BENCH_BUFLEN];
+  size_t len;
+} bench_msg_t;
+
+/**
+ * Sink for values computed by the benchmarks so that the compiler can not
+ * drop the measured work.
+ */
+static volatile size_t sink_;
+
+static const char token_[8] = {0x5a, 0x3c, 0x11, 0x42, 0x7e, 0x01, 0x99, 0x23};
+static char block_[1024];
+static char proxy_uri_[300];
+
+static double now_ns_() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1e9 + (double)ts.tv_nsec;
+}
+
+static int build_empty_ack_(coap_serializer_t* s, uint16_t mid, size_t* len) {
+  if (coap_serializer_init(s, T_ACK, 0, 0)) {
+    return -1;
+  }
+  return coap_serializer_exec(s, mid, NULL, NULL, 0, len);
+}
+
+static int build_get_path_(coap_serializer_t* s, uint16_t mid, size_t* len) {
+  if (coap_serializer_init(s, T_CON, C_GET, 4) ||
+      coap_serializer_add_opt(s, O_URI_HOST, "gw.example.com",
+                              L("gw.example.com")) ||
+      coap_serializer_add_opt(s, O_URI_PATH, "api", L("api")) ||
+      coap_serializer_add_opt(s, O_URI_PATH, "v1", L("v1")) ||
+      coap_serializer_add_opt(s, O_URI_PATH, "sensors", L("sensors")) ||
+      coap_serializer_add_opt(s, O_URI_PATH, "temperature",
+                              L("temperature")) ||
+      coap_serializer_add_opt_uint(s, O_ACCEPT, F_APPLICATION_JSON)) {
+    return -1;
+  }
+  return coap_serializer_exec(s, mid, token_, NULL, 0, len);
+}
+
+static int build_observe_(coap_serializer_t* s, uint16_t mid, size_t* len) {
+  if (coap_serializer_init(s, T_NON, C_CONTENT, 4) ||
+      coap_serializer_add_opt_uint(s, O_OBSERVE, 0x1234) ||
+      coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_APPLICATION_JSON) ||
+      coap_serializer_add_opt_uint(s, O_MAX_AGE, 30)) {
+    return -1;
+  }
+  return coap_serializer_exec(s, mid, token_, "{\"t\":22.3,\"h\":41}",
+                              L("{\"t\":22.3,\"h\":41}"), len);
+}
+
+static int build_block2_(coap_serializer_t* s, uint16_t mid, size_t* len) {
+  if (coap_serializer_init(s, T_ACK, C_CONTENT, 8) ||
+      coap_serializer_add_opt(s, O_ETAG, "\x01\x02\x03\x04", 4) ||
+      coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT,
+                                   F_APPLICATION_OCTET_STREAM) ||
+      coap_serializer_add_opt_uint(s, O_BLOCK2, (17 << 4) | 0x08 | 6)) {
+    return -1;
+  }
+  return coap_serializer_exec(s, mid, token_, block_, sizeof(block_), len);
+}
+
+static int build_proxy_uri_(coap_serializer_t* s, uint16_t mid, size_t* len) {
+  if (coap_serializer_init(s, T_CON, C_GET, 2) ||
+      coap_serializer_add_opt(s, O_PROXY_URI, proxy_uri_,
+                              sizeof(proxy_uri_))) {
+    return -1;
+  }
+  return coap_serializer_exec(s, mid, token_, NULL, 0, len);
+}
+
+static int build_mixed_opts_(coap_serializer_t* s, uint16_t mid,
+                             size_t* len) {
+  if (coap_serializer_init(s, T_CON, C_PUT, 4) ||
+      coap_serializer_add_opt(s, O_IF_MATCH, "\x10\x20", 2) ||
+      coap_serializer_add_opt(s, O_URI_HOST, "node7.local", L("node7.local")) ||
+      coap_serializer_add_opt(s, O_ETAG, "\x0a\x0b\x0c", 3) ||
+      coap_serializer_add_opt_uint(s, O_OBSERVE, 0) ||
+      coap_serializer_add_opt_uint(s, O_URI_PORT, 5683) ||
+      coap_serializer_add_opt(s, O_LOCATION_PATH, "old", L("old")) ||
+      coap_serializer_add_opt(s, O_URI_PATH, "fw", L("fw")) ||
+      coap_serializer_add_opt(s, O_URI_PATH, "image", L("image")) ||
+      coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT,
+                                   F_APPLICATION_OCTET_STREAM) ||
+      coap_serializer_add_opt_uint(s, O_MAX_AGE, 3600) ||
+      coap_serializer_add_opt(s, O_URI_QUERY, "rev=42", L("rev=42")) ||
+      coap_serializer_add_opt_uint(s, O_ACCEPT, F_APPLICATION_JSON) ||
+      coap_serializer_add_opt_uint(s, O_BLOCK2, 0x06) ||
+      coap_serializer_add_opt_uint(s, O_BLOCK1, 0x2E) ||
+      coap_serializer_add_opt(s, O_PROXY_SCHEME, "coap", L("coap")) ||
+      coap_serializer_add_opt_uint(s, O_SIZE1, 65536)) {
+    return -1;
+  }
+  return coap_serializer_exec(s, mid, token_, "\x00\x01", 2, len);
+}
+
+static bench_msg_t corpus_[] = {
+  {"empty-ack", build_empty_ack_},
+  {"get-uri-path", build_get_path_},
+  {"observe-notify", build_observe_},
+  {"block2-1k", build_block2_},
+  {"proxy-uri", build_proxy_uri_},
+  {"mixed-opts", build_mixed_opts_},
+};
+
+#define CORPUS_LEN (sizeof(corpus_) / sizeof(corpus_[0]))
+
+static void on_begin_(void* cookie) { (*(size_t*)cookie)++; }
+
+static void on_header_(void* cookie, coap_type_t type, coap_code_t code,
+                       uint16_t mid, const char* token, uint8_t token_len) {
+  *(size_t*)cookie += type + code + mid + token_len;
+}
+
+static void on_opt_(void* cookie, uint16_t opt, const void* val,
+                    uint16_t len) {
+  *(size_t*)cookie += opt + len;
+}
+
+#ifndef GREENCOAP_NO_CALLBACKS
+static void on_payload_(void* cookie, const char* buf, size_t len) {
+  *(size_t*)cookie += len;
+}
+#endif
+
+static void on_complete_(void* cookie) { (*(size_t*)cookie)++; }
+
+static void report_(const char* name, const char* op, size_t iter,
+                    size_t bytes, double elapsed) {
+  printf("%-16s %-20s %10.1f ns/msg %12.0f msg/s %10.1f MB/s\n", name, op,
+         elapsed / iter, iter / (elapsed / 1e9),
+         bytes / (elapsed / 1e9) / (1024 * 1024));
+}
+
+static void bench_serialize_(bench_msg_t* m, coap_serializer_t* s,
+                             size_t iter) {
+  size_t i;
+  size_t len = 0;
+  double begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    m->build(s, (uint16_t)i, &len);
+    sink_ += len;
+  }
+  report_(m->name, "serialize", iter, iter * m->len, now_ns_() - begin);
+}
+
+static void bench_parse_(bench_msg_t* m, coap_parser_t* p, size_t iter,
+                         const char* op) {
+  size_t i;
+  double begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    if (coap_parser_exec(p, m->buf, m->len)) {
+      fprintf(stderr, "%s: parse failed\n", m->name);
+      exit(1);
+    }
+  }
+  report_(m->name, op, iter, iter * m->len, now_ns_() - begin);
+}
+
+static void bench_parse_lookup_(bench_msg_t* m, coap_parser_t* p,
+                                size_t iter) {
+  size_t i;
+  size_t it;
+  size_t len;
+  const char* val;
+  double begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_exec(p, m->buf, m->len);
+    it = 0;
+    while (coap_parser_get_path(p, &it, &val, &len) == COAP_OK) {
+      sink_ += len;
+    }
+    if (coap_parser_get_opt(p, O_CONTENT_FORMAT, &val, &len) == COAP_OK) {
+      sink_ += len;
+    }
+    if (coap_parser_get_opt(p, O_ACCEPT, &val, &len) == COAP_OK) {
+      sink_ += len;
+    }
+  }
+  report_(m->name, "parse+lookup", iter, iter * m->len, now_ns_() - begin);
+}
+
+/**
+ * Decode the uint options one by one with a byte loop, as callers did
+ * before coap_parser_get_uint_opts.
+ */
+static void bench_uint_loop_(bench_msg_t* m, coap_parser_t* p, size_t iter) {
+  static const uint16_t opts[] = {O_OBSERVE, O_URI_PORT, O_CONTENT_FORMAT,
+                                  O_MAX_AGE, O_ACCEPT,   O_BLOCK2,
+                                  O_BLOCK1,  O_SIZE2,    O_SIZE1};
+  size_t i, j, k;
+  size_t len;
+  const char* val;
+  uint32_t v;
+  double begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_exec(p, m->buf, m->len);
+    for (j = 0; j < sizeof(opts) / sizeof(opts[0]); j++) {
+      if (coap_parser_get_opt(p, opts[j], &val, &len) == COAP_OK) {
+        for (v = 0, k = 0; k < len; k++) {
+          v = v << 8 | (uint8_t)val[k];
+        }
+        sink_ += v;
+      }
+    }
+  }
+  report_(m->name, "parse+uint-loop", iter, iter * m->len, now_ns_() - begin);
+}
+
+static void bench_uint_opts_(bench_msg_t* m, coap_parser_t* p, size_t iter) {
+  size_t i;
+  coap_uint_opts_t u;
+  double begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_exec(p, m->buf, m->len);
+    coap_parser_get_uint_opts(p, &u);
+    sink_ += u.observe + u.content_format + u.max_age + u.block2.num;
+  }
+  report_(m->name, "parse+uint-opts", iter, iter * m->len, now_ns_() - begin);
+}
+
+static void bench_parse_lazy_(bench_msg_t* m, coap_parser_t* p,
+                              size_t iter) {
+  size_t i;
+  uint16_t mid = 0;
+  uint8_t token_len = 0;
+  const char* token;
+  double begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_exec_lazy(p, m->buf, m->len);
+    coap_parser_get_mid(p, &mid);
+    coap_parser_get_token(p, &token, &token_len);
+    sink_ += mid + token_len;
+  }
+  report_(m->name, "parse-lazy-header", iter, iter * m->len,
+          now_ns_() - begin);
+}
+
+static void bench_round_trip_(bench_msg_t* m, coap_serializer_t* s,
+                              coap_parser_t* p, char* buf, size_t iter,
+                              const char* op) {
+  size_t i;
+  size_t len = 0;
+  double begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    m->build(s, (uint16_t)i, &len);
+    if (coap_parser_exec(p, buf, len)) {
+      fprintf(stderr, "%s: round-trip failed\n", m->name);
+      exit(1);
+    }
+  }
+  report_(m->name, op, iter, iter * m->len, now_ns_() - begin);
+}
+
+static void bench_batch_(coap_parser_t* p, size_t iter) {
+  coap_datagram_t msgs[CORPUS_LEN];
+  uint8_t type[CORPUS_LEN], code[CORPUS_LEN];
+  uint8_t token_offset[CORPUS_LEN], token_len[CORPUS_LEN];
+  uint16_t mid[CORPUS_LEN];
+  size_t payload_offset[CORPUS_LEN], payload_len[CORPUS_LEN];
+  int status[CORPUS_LEN];
+  coap_batch_t res = {type,      code,           mid,         token_offset,
+                      token_len, payload_offset, payload_len, status};
+  size_t bytes = 0;
+  size_t i, j;
+  double begin;
+
+  for (j = 0; j < CORPUS_LEN; j++) {
+    msgs[j].buf = corpus_[j].buf;
+    msgs[j].len = corpus_[j].len;
+    bytes += corpus_[j].len;
+  }
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    for (j = 0; j < CORPUS_LEN; j++) {
+      coap_parser_exec(p, msgs[j].buf, msgs[j].len);
+      sink_ += coap_parser_get_mid(p, &mid[j]);
+    }
+  }
+  report_("corpus", "parse-loop", iter * CORPUS_LEN, iter * bytes,
+          now_ns_() - begin);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_exec_batch(p, msgs, CORPUS_LEN, &res);
+    sink_ += mid[0];
+  }
+  report_("corpus", "parse-batch", iter * CORPUS_LEN, iter * bytes,
+          now_ns_() - begin);
+}
+
+static void bench_serialize_iov_(bench_msg_t* m, coap_serializer_t* s,
+                                 size_t iter) {
+  struct iovec iov[2];
+  size_t iov_len;
+  size_t len = 0;
+  size_t i;
+  double begin;
+
+  coap_serializer_init(s, T_ACK, C_CONTENT, 8);
+  coap_serializer_add_opt(s, O_ETAG, "\x01\x02\x03\x04", 4);
+  coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT,
+                               F_APPLICATION_OCTET_STREAM);
+  coap_serializer_add_opt_uint(s, O_BLOCK2, (17 << 4) | 0x08 | 6);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_serializer_exec_iov(s, (uint16_t)i, token_, block_, sizeof(block_),
+                             iov, &iov_len, &len);
+    sink_ += iov_len;
+  }
+  report_(m->name, "exec-iov", iter, iter * len, now_ns_() - begin);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_serializer_exec(s, (uint16_t)i, token_, block_, sizeof(block_), &len);
+    sink_ += len;
+  }
+  report_(m->name, "exec-copy", iter, iter * len, now_ns_() - begin);
+}
+
+/**
+ * Forward a request to a backend: replace Uri-Host and drop Proxy-Scheme,
+ * once by re-serializing every option and once with coap_editor_t.
+ */
+static void bench_editor_(bench_msg_t* m, coap_parser_t* p, char* buf,
+                          size_t iter) {
+  coap_serializer_t* s = NULL;
+  coap_editor_t* e = NULL;
+  const char* val = NULL;
+  const char* payload = NULL;
+  size_t len = 0, payload_len = 0, msg_len = 0;
+  uint16_t opt = 0;
+  size_t i, j;
+  double begin;
+
+  coap_serializer_create(&s, malloc(coap_serializer_size()),
+                         coap_serializer_size(), buf, BENCH_BUFLEN);
+  coap_editor_create(&e, malloc(coap_editor_size()), coap_editor_size(), buf,
+                     BENCH_BUFLEN);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_exec(p, m->buf, m->len);
+    coap_serializer_init(s, T_CON, C_PUT, 4);
+    for (j = 0; coap_parser_get_opt_at(p, j, &opt, &val, &len) == COAP_OK;
+         j++) {
+      if (opt == O_URI_HOST) {
+        coap_serializer_add_opt(s, opt, "backend", L("backend"));
+      } else if (opt != O_PROXY_SCHEME) {
+        coap_serializer_add_opt(s, opt, val, len);
+      }
+    }
+    coap_parser_get_payload(p, &payload, &payload_len);
+    coap_serializer_exec(s, (uint16_t)i, token_, payload, payload_len,
+                         &msg_len);
+    sink_ += msg_len;
+  }
+  report_(m->name, "proxy-rebuild", iter, iter * m->len, now_ns_() - begin);
+
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_exec(p, m->buf, m->len);
+    coap_editor_init(e, p);
+    coap_editor_remove_opt(e, O_URI_HOST);
+    coap_editor_remove_opt(e, O_PROXY_SCHEME);
+    coap_editor_add_opt(e, O_URI_HOST, "backend", L("backend"));
+    coap_editor_set_header(e, T_CON, C_PUT, (uint16_t)i);
+    coap_editor_exec(e, &msg_len);
+    sink_ += msg_len;
+  }
+  report_(m->name, "proxy-edit", iter, iter * m->len, now_ns_() - begin);
+  free(s);
+  free(e);
+}
+
+#define BENCH_REPLY_BATCH 32
+
+/**
+ * Answer a CON request with an empty ACK and with a piggybacked 2.05, once
+ * through the parser getters and coap_serializer_init/exec and once with the
+ * reply API, plus empty ACKs for a batch of requests.
+ */
+static void bench_reply_(bench_msg_t* m, coap_parser_t* p, char* buf,
+                         size_t iter) {
+  coap_serializer_t* s = NULL;
+  coap_datagram_t msgs[BENCH_REPLY_BATCH];
+  uint8_t type[BENCH_REPLY_BATCH], code[BENCH_REPLY_BATCH];
+  uint8_t token_offset[BENCH_REPLY_BATCH], token_len[BENCH_REPLY_BATCH];
+  uint16_t mid[BENCH_REPLY_BATCH];
+  size_t payload_offset[BENCH_REPLY_BATCH], payload_len[BENCH_REPLY_BATCH];
+  int status[BENCH_REPLY_BATCH];
+  coap_batch_t res = {type,      code,           mid,         token_offset,
+                      token_len, payload_offset, payload_len, status};
+  coap_type_t t = T_CON;
+  uint16_t req_mid = 0;
+  const char* token = NULL;
+  uint8_t tkl = 0;
+  size_t len = 0, acked = 0;
+  size_t i;
+  double begin;
+
+  coap_serializer_create(&s, malloc(coap_serializer_size()),
+                         coap_serializer_size(), buf, BENCH_BUFLEN);
+  coap_parser_exec_lazy(p, m->buf, m->len);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_get_type(p, &t);
+    coap_parser_get_mid(p, &req_mid);
+    coap_serializer_init(s, t == T_CON ? T_ACK : T_RST, 0, 0);
+    coap_serializer_exec(s, req_mid, NULL, NULL, 0, &len);
+    sink_ += len;
+  }
+  report_(m->name, "ack-serializer", iter, iter * 4, now_ns_() - begin);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_reply_empty(p, T_ACK, buf, BENCH_BUFLEN, &len);
+    sink_ += len;
+  }
+  report_(m->name, "ack-reply", iter, iter * 4, now_ns_() - begin);
+
+  for (i = 0; i < BENCH_REPLY_BATCH; i++) {
+    msgs[i].buf = m->buf;
+    msgs[i].len = m->len;
+  }
+  coap_parser_exec_batch(p, msgs, BENCH_REPLY_BATCH, &res);
+  begin = now_ns_();
+  for (i = 0; i < iter / BENCH_REPLY_BATCH; i++) {
+    coap_reply_empty_batch(&res, BENCH_REPLY_BATCH, buf, BENCH_BUFLEN, NULL,
+                           &acked);
+    sink_ += acked;
+  }
+  report_(m->name, "ack-batch", iter / BENCH_REPLY_BATCH * BENCH_REPLY_BATCH,
+          iter / BENCH_REPLY_BATCH * BENCH_REPLY_BATCH * 4,
+          now_ns_() - begin);
+
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_get_mid(p, &req_mid);
+    coap_parser_get_token(p, &token, &tkl);
+    coap_serializer_init(s, T_ACK, C_CONTENT, tkl);
+    coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN);
+    coap_serializer_exec(s, req_mid, token, "22.3 C", 6, &len);
+    sink_ += len;
+  }
+  report_(m->name, "piggyback-serializer", iter, iter * len,
+          now_ns_() - begin);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_serializer_init_reply(s, p, C_CONTENT, 0);
+    coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN);
+    coap_serializer_exec_reply(s, "22.3 C", 6, &len);
+    sink_ += len;
+  }
+  report_(m->name, "piggyback-reply", iter, iter * len, now_ns_() - begin);
+  free(s);
+}
+
+/**
+ * Store a 2.05 response to a GET in a coap_cache_t and answer the request
+ * from it, which patches only the header, the token and the Max-Age.
+ */
+static void bench_cache_(bench_msg_t* m, coap_parser_t* p, char* buf,
+                         size_t iter) {
+  char res[64];
+  size_t size = coap_cache_size(64, 256);
+  coap_cache_t* c = NULL;
+  coap_parser_t* q = NULL;
+  coap_serializer_t* s = NULL;
+  size_t res_len = 0;
+  size_t len = 0;
+  size_t i;
+  double begin;
+
+  coap_serializer_create(&s, malloc(coap_serializer_size()),
+                         coap_serializer_size(), res, sizeof(res));
+  coap_serializer_init(s, T_ACK, C_CONTENT, 0);
+  coap_serializer_add_opt(s, O_ETAG, "v1", 2);
+  coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN);
+  coap_serializer_add_opt_uint(s, O_MAX_AGE, 30);
+  coap_serializer_exec(s, 1, NULL, "22.3 C", 6, &res_len);
+  coap_parser_create(&q, malloc(coap_parser_size()), coap_parser_size());
+  coap_parser_exec(q, res, res_len);
+  coap_cache_create(&c, malloc(size), size, 64, 256);
+  coap_parser_exec(p, m->buf, m->len);
+
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    sink_ += coap_cache_put(c, p, q, 0);
+  }
+  report_(m->name, "cache-put", iter, iter * res_len, now_ns_() - begin);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_cache_get(c, p, 0, 0, buf, BENCH_BUFLEN, &len);
+    sink_ += len;
+  }
+  report_(m->name, "cache-hit", iter, iter * len, now_ns_() - begin);
+  free(c);
+  free(q);
+  free(s);
+}
+
+static void bench_template_(size_t iter) {
+  char tmpl_buf[64];
+  char buf[BENCH_BUFLEN];
+  const char payload[] = "{\"t\":22.3,\"h\":41}";
+  coap_template_t* t = NULL;
+  size_t len = 0;
+  size_t i;
+  uint8_t slot;
+  uint32_t vals[1];
+  double begin;
+
+  coap_template_create(&t, malloc(coap_template_size()), coap_template_size(),
+                       tmpl_buf, sizeof(tmpl_buf));
+  coap_template_init(t, T_NON, C_CONTENT, 4);
+  coap_template_add_opt_slot(t, O_OBSERVE, 3, &slot);
+  coap_template_add_opt_uint(t, O_CONTENT_FORMAT, F_APPLICATION_JSON);
+  coap_template_add_opt_uint(t, O_MAX_AGE, 30);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    vals[slot] = (uint32_t)i;
+    coap_template_exec(t, buf, BENCH_BUFLEN, (uint16_t)i, token_, vals,
+                       payload, L(payload), &len);
+    sink_ += len;
+  }
+  report_("observe-notify", "template", iter, iter * len, now_ns_() - begin);
+  free(t);
+}
+
+static void bench_dedup_(size_t iter) {
+  const size_t capacity = 262144;
+  size_t size = coap_dedup_size(capacity, 64);
+  coap_dedup_t* d = NULL;
+  const char* res;
+  size_t res_len = 0;
+  uint8_t ep[6] = {10, 0, 0, 0, 0x16, 0x33};
+  uint32_t n;
+  size_t i;
+  double begin;
+
+  coap_dedup_create(&d, malloc(size), size, capacity, 64);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    // Every message arrives twice, as in a retransmission storm, and the
+    // clock advances 1 ms per message so that entries expire.
+    n = (uint32_t)(i >> 1);
+    memcpy(ep, &n, 4);
+    if (coap_dedup_check(d, ep, sizeof(ep), (uint16_t)n, (uint32_t)i, &res,
+                         &res_len) == COAP_OK) {
+      coap_dedup_set_response(d, ep, sizeof(ep), (uint16_t)n, (uint32_t)i,
+                              "\x60\x00\x00\x01", 4);
+    }
+    sink_ += res_len;
+  }
+  report_("dedup", "check", iter, iter * 4, now_ns_() - begin);
+  free(d);
+}
+
+static void bench_retx_(size_t iter) {
+  const size_t outstanding = 50000;
+  size_t size = coap_retx_size(65536);
+  coap_retx_t* r = NULL;
+  coap_retx_event_t events[64];
+  const char msg[4] = {0x40, 0x01, 0x00, 0x00};
+  uint8_t ep[6] = {10, 0, 0, 0, 0x16, 0x33};
+  uint32_t now = 0;
+  size_t n = 0;
+  size_t i;
+  double begin;
+
+  coap_retx_create(&r, malloc(size), size, 65536, now, 1);
+  for (i = 0; i < outstanding; i++) {
+    memcpy(ep, &i, 4);
+    coap_retx_add(r, ep, sizeof(ep), (uint16_t)i, msg, sizeof(msg), NULL, now);
+  }
+  begin = now_ns_();
+  for (i = outstanding; i < outstanding + iter; i++) {
+    // ACK the oldest message and send a new one; the clock advances 1 ms
+    // every 16 messages.
+    memcpy(ep, &(uint32_t){i - outstanding}, 4);
+    coap_retx_cancel(r, ep, sizeof(ep), (uint16_t)(i - outstanding), NULL);
+    memcpy(ep, &(uint32_t){i}, 4);
+    coap_retx_add(r, ep, sizeof(ep), (uint16_t)i, msg, sizeof(msg), NULL, now);
+    if ((i & 15) == 0) {
+      now++;
+      do {
+        coap_retx_poll(r, now, events, 64, &n);
+        sink_ += n;
+      } while (n == 64);
+    }
+  }
+  report_("retx", "ack+add", iter, iter * sizeof(msg), now_ns_() - begin);
+  free(r);
+}
+
+static void bench_exchange_(size_t iter) {
+  const size_t pending = 50000;
+  size_t size = coap_exchange_size(pending + 1);
+  coap_exchange_t* x = NULL;
+  char (*tokens)[8] = malloc(pending * 8);
+  void* cookie;
+  size_t i;
+  double begin;
+
+  coap_exchange_create(&x, malloc(size), size, pending + 1, 1);
+  for (i = 0; i < pending; i++) {
+    coap_exchange_add(x, (uint16_t)i, tokens[i], 8, NULL);
+  }
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    // Complete the oldest request and pipeline a new one in its place.
+    char* token = tokens[i % pending];
+    coap_exchange_match(x, token, 8, &cookie);
+    coap_exchange_remove(x, token, 8, &cookie);
+    coap_exchange_add(x, (uint16_t)(i + pending), token, 8, NULL);
+    sink_ += (uint8_t)token[0];
+  }
+  report_("exchange", "match+add", iter, iter * 8, now_ns_() - begin);
+  free(tokens);
+  free(x);
+}
+
+static void bench_observe_() {
+  const size_t observers = 50000;
+  size_t size = coap_observe_size(observers);
+  coap_observe_t* o = NULL;
+  coap_serializer_t* s = NULL;
+  coap_notification_t out[64];
+  char sbuf[256];
+  char payload[64];
+  uint8_t ep[6] = {10, 0, 0, 0, 0x16, 0x33};
+  uint32_t token;
+  uint16_t mid = 0;
+  size_t msg_len;
+  size_t total = 0;
+  size_t i, n = 0;
+  double begin;
+
+  memset(payload, 0x5A, sizeof(payload));
+  coap_observe_create(&o, malloc(size), size, observers);
+  for (i = 0; i < observers; i++) {
+    token = (uint32_t)i;
+    memcpy(ep, &token, 4);
+    coap_observe_register(o, ep, sizeof(ep), (const char*)&token, 4, 0, 0,
+                          NULL);
+  }
+  coap_serializer_create(&s, malloc(coap_serializer_size()),
+                         coap_serializer_size(), sbuf, sizeof(sbuf));
+
+  // One serializer run per observer.
+  begin = now_ns_();
+  for (i = 0; i < observers; i++) {
+    token = (uint32_t)i;
+    coap_serializer_init(s, T_NON, C_CONTENT, 4);
+    coap_serializer_add_opt(s, O_ETAG, "e1", 2);
+    coap_serializer_add_opt_uint(s, O_OBSERVE, (uint32_t)i);
+    coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, 50);
+    coap_serializer_add_opt_uint(s, O_MAX_AGE, 30);
+    coap_serializer_exec(s, mid++, (const char*)&token, payload,
+                         sizeof(payload), &msg_len);
+    total += msg_len;
+  }
+  report_("observe", "serialize-each", observers, total, now_ns_() - begin);
+
+  // Serialize once, then patch per observer.
+  total = 0;
+  begin = now_ns_();
+  coap_serializer_init(s, T_NON, C_CONTENT, 0);
+  coap_serializer_add_opt(s, O_ETAG, "e1", 2);
+  coap_serializer_add_opt_uint(s, O_OBSERVE, 0);
+  coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, 50);
+  coap_serializer_add_opt_uint(s, O_MAX_AGE, 30);
+  coap_serializer_exec(s, 0, NULL, payload, sizeof(payload), &msg_len);
+  coap_observe_notify(o, sbuf, msg_len);
+  do {
+    coap_observe_emit(o, 0, &mid, out, 64, &n);
+    for (i = 0; i < n; i++) {
+      total += out[i].len;
+    }
+  } while (n > 0);
+  report_("observe", "fan-out", observers, total, now_ns_() - begin);
+  sink_ += total;
+  free(s);
+  free(o);
+}
+
+static void bench_block_() {
+  const size_t image_len = 1 << 20;
+  char* image = malloc(image_len);
+  char sbuf[64];
+  char msg[1100];
+  size_t size = coap_reasm_size(1, image_len);
+  coap_reasm_t* r = NULL;
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  coap_block_t req = {0, 0, 6};
+  coap_block_t b = {0, 0, 0};
+  struct iovec iov[2] = {{NULL, 0}, {NULL, 0}};
+  size_t iov_len, msg_len, chunk_len = 0, body_len = 0;
+  const char* chunk;
+  const char* body;
+  const char* payload = NULL;
+  size_t payload_len = 0;
+  uint8_t ep[6] = {10, 0, 0, 1, 0x16, 0x33};
+  uint32_t val = 0;
+  size_t blocks = 0;
+  double begin;
+
+  memset(image, 0x5A, image_len);
+  coap_reasm_create(&r, malloc(size), size, 1, image_len);
+  coap_serializer_create(&s, malloc(coap_serializer_size()),
+                         coap_serializer_size(), sbuf, sizeof(sbuf));
+  coap_parser_create(&p, malloc(coap_parser_size()), coap_parser_size());
+
+  // Serve the image with Block2 and reassemble it from Block1 requests.
+  begin = now_ns_();
+  do {
+    coap_block2_slice(image, image_len, &req, 6, &b, &chunk, &chunk_len);
+    coap_block_encode(&b, &val);
+    coap_serializer_init(s, T_CON, C_PUT, 1);
+    coap_serializer_add_opt_uint(s, O_BLOCK1, val);
+    coap_serializer_exec_iov(s, (uint16_t)b.num, "t", chunk, chunk_len, iov,
+                             &iov_len, &msg_len);
+    memcpy(msg, iov[0].iov_base, iov[0].iov_len);
+    memcpy(&msg[iov[0].iov_len], iov[1].iov_base, iov[1].iov_len);
+    coap_parser_exec(p, msg, msg_len);
+    coap_parser_get_block(p, O_BLOCK1, &b);
+    coap_parser_get_payload(p, &payload, &payload_len);
+    coap_reasm_add(r, ep, sizeof(ep), "t", 1, &b, payload, payload_len, 0,
+                   &body, &body_len);
+    req.num++;
+    blocks++;
+  } while (b.more);
+  report_("block-1k", "slice+reasm", blocks, image_len, now_ns_() - begin);
+  sink_ += body_len;
+  free(image);
+  free(r);
+  free(s);
+  free(p);
+}
+
+static void bench_router_(size_t iter) {
+  static const char* kinds[] = {"temperature", "humidity", "pressure", "co2"};
+  size_t size = coap_router_size(1024, 1024, 16384);
+  coap_router_t* r = NULL;
+  coap_parser_t* p = NULL;
+  bench_msg_t* m = &corpus_[1];
+  coap_code_t res;
+  void* cookie;
+  char path[64];
+  size_t i, j;
+  double begin;
+
+  // /api/v1/sensors/temperature among a few hundred routes.
+  coap_router_create(&r, malloc(size), size, 1024, 1024, 16384);
+  for (i = 0; i < 64; i++) {
+    for (j = 0; j < 4; j++) {
+      snprintf(path, sizeof(path), "/api/v%zu/sensors/%s", i, kinds[j]);
+      coap_router_add(r, path, C_GET, (void*)(i * 4 + j + 1));
+    }
+  }
+  coap_router_add(r, "/api/*/status", C_GET, NULL);
+  coap_router_add(r, "/fw/**", C_POST, NULL);
+  coap_router_compile(r);
+  coap_parser_create(&p, malloc(coap_parser_size()), coap_parser_size());
+
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_parser_exec(p, m->buf, m->len);
+    if (coap_router_match(r, p, &cookie, &res) == COAP_OK) {
+      sink_ += (size_t)cookie;
+    }
+  }
+  report_(m->name, "parse+route", iter, iter * m->len, now_ns_() - begin);
+  free(p);
+  free(r);
+}
+
+static void bench_pool_(size_t iter) {
+  size_t size = coap_pool_size(64, 1152);
+  void* mem = malloc(size);
+  coap_pool_t* pool = NULL;
+  coap_pool_item_t* item = NULL;
+  coap_serializer_t* s = NULL;
+  bench_msg_t* m = &corpus_[0];
+  char* buf;
+  size_t i, len;
+  double begin;
+
+  // The pool aligns itself within |mem|, so |mem| is what gets freed.
+  coap_pool_create(&pool, mem, size, 64, 1152);
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_pool_acquire(pool, &item);
+    m->build(item->serializer, (uint16_t)i, &len);
+    sink_ += len;
+    coap_pool_release(pool, item);
+  }
+  report_(m->name, "pool+serialize", iter, iter * len, now_ns_() - begin);
+
+  // The same with a serializer and buffer from malloc for every message.
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    buf = malloc(1152);
+    coap_serializer_create(&s, malloc(coap_serializer_size()),
+                           coap_serializer_size(), buf, 1152);
+    m->build(s, (uint16_t)i, &len);
+    sink_ += len;
+    free(s);
+    free(buf);
+  }
+  report_(m->name, "malloc+serialize", iter, iter * len, now_ns_() - begin);
+  free(mem);
+}
+
+static void bench_stream_(size_t iter) {
+  static char stream[64 * 64];
+  size_t size = coap_stream_size(64);
+  coap_stream_t* st = NULL;
+  coap_serializer_t* s = NULL;
+  coap_parser_settings_t settings = {0};
+  size_t stream_len = 0;
+  size_t completes = 0;
+  size_t i, j, n, len = 0;
+  char buf[128];
+  double begin;
+
+  // GETs like get-uri-path, framed back to back and read in MSS chunks.
+  coap_serializer_create(&s, malloc(coap_serializer_size()),
+                         coap_serializer_size(), buf, sizeof(buf));
+  begin = now_ns_();
+  for (i = 0; i < iter; i++) {
+    coap_serializer_init_framed(s, C_GET, 4);
+    coap_serializer_add_opt(s, O_URI_HOST, "gw.example.com",
+                            L("gw.example.com"));
+    coap_serializer_add_opt(s, O_URI_PATH, "api", L("api"));
+    coap_serializer_add_opt(s, O_URI_PATH, "v1", L("v1"));
+    coap_serializer_add_opt(s, O_URI_PATH, "sensors", L("sensors"));
+    coap_serializer_add_opt(s, O_URI_PATH, "temperature", L("temperature"));
+    coap_serializer_add_opt_uint(s, O_ACCEPT, F_APPLICATION_JSON);
+    coap_serializer_exec_framed(s, token_, NULL, 0, &len);
+    sink_ += len;
+  }
+  report_("tcp-get", "serialize-framed", iter, iter * len, now_ns_() - begin);
+  for (i = 0; i < 64; i++) {
+    memcpy(&stream[stream_len], buf, len);
+    stream_len += len;
+  }
+
+  settings.cookie = &completes;
+  settings.on_begin = on_begin_;
+  settings.on_header = on_header_;
+  settings.on_opt = on_opt_;
+  settings.on_complete = on_complete_;
+  coap_stream_create(&st, malloc(size), size, 64, 1152);
+  coap_stream_init(st, &settings);
+  begin = now_ns_();
+  for (i = 0; i < iter / 64; i++) {
+    for (j = 0; j < stream_len; j += n) {
+      n = stream_len - j < 1460 ? stream_len - j : 1460;
+      coap_stream_exec(st, &stream[j], n);
+    }
+  }
+  report_("tcp-get", "stream-parse", iter / 64 * 64, iter / 64 * stream_len,
+          now_ns_() - begin);
+  sink_ += completes;
+  free(st);
+  free(s);
+}
+
+#ifdef GREENCOAP_SERVER
+/**
+ * A load generating client: one socket sending batches of 32 GETs and
+ * waiting for their responses.
+ */
+typedef struct bench_client_t {
+  uint16_t port;
+  double deadline;
+  size_t responses;
+  pthread_t thread;
+} bench_client_t;
+
+static void bench_server_handler_(void* cookie, const coap_parser_t* p,
+                                  coap_serializer_t* s, const void* peer,
+                                  size_t peer_len, size_t* res_len) {
+  const char* token;
+  uint8_t token_len;
+  uint16_t mid;
+  coap_parser_get_mid(p, &mid);
+  coap_parser_get_token(p, &token, &token_len);
+  coap_serializer_init(s, T_ACK, C_CONTENT, token_len);
+  coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN);
+  coap_serializer_exec(s, mid, token, "22.3 C", L("22.3 C"), res_len);
+}
+
+static void* bench_client_(void* arg) {
+  bench_client_t* c = (bench_client_t*)arg;
+  struct mmsghdr msgs[32];
+  struct iovec iov[32];
+  char bufs[32][64];
+  struct sockaddr_in addr;
+  struct timeval tv = {0, 100000};
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int i, n;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(c->port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  connect(fd, (struct sockaddr*)&addr, sizeof(addr));
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < 32; i++) {
+    iov[i].iov_base = bufs[i];
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  while (now_ns_() < c->deadline) {
+    for (i = 0; i < 32; i++) {
+      memcpy(bufs[i], corpus_[1].buf, corpus_[1].len);
+      bufs[i][3] = (char)i;
+      iov[i].iov_len = corpus_[1].len;
+    }
+    sendmmsg(fd, msgs, 32, 0);
+    for (i = 0; i < 32; i++) {
+      iov[i].iov_len = sizeof(bufs[i]);
+    }
+    for (n = 0; n < 32;) {
+      i = recvmmsg(fd, msgs + n, 32 - n, MSG_WAITFORONE, NULL);
+      if (i <= 0) {
+        break;
+      }
+      n += i;
+    }
+    c->responses += n;
+  }
+  close(fd);
+  return NULL;
+}
+
+/**
+ * Scaling report of the server runtime on loopback for 1 to N workers and
+ * each I/O backend, with as many client threads as workers.
+ */
+static void bench_server_() {
+  static const char* ios[] = {"auto", "io_uring", "epoll"};
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  coap_server_config_t c = {"127.0.0.1", 0, 1, 32, 0, 1,
+                            bench_server_handler_, NULL, 0};
+  bench_client_t clients[64];
+  coap_server_t* srv;
+  char name[32];
+  size_t responses;
+  size_t workers;
+  size_t i;
+  double begin;
+
+  for (c.io = COAP_SERVER_IO_URING; c.io <= COAP_SERVER_IO_EPOLL; c.io++) {
+    for (workers = 1;
+         workers <= (size_t)(cpus > 0 ? cpus : 1) && workers <= 64;
+         workers *= 2) {
+      c.workers = workers;
+      srv = malloc(coap_server_size(&c));
+      if (coap_server_create(&srv, srv, coap_server_size(&c), &c) ||
+          coap_server_start(srv)) {
+        fprintf(stderr, "server: can not start %zu %s workers\n", workers,
+                ios[c.io]);
+        free(srv);
+        break;
+      }
+      begin = now_ns_();
+      for (i = 0; i < workers; i++) {
+        coap_server_get_port(srv, &clients[i].port);
+        clients[i].deadline = begin + 1e9;
+        clients[i].responses = 0;
+        pthread_create(&clients[i].thread, NULL, bench_client_, &clients[i]);
+      }
+      responses = 0;
+      for (i = 0; i < workers; i++) {
+        pthread_join(clients[i].thread, NULL);
+        responses += clients[i].responses;
+      }
+      snprintf(name, sizeof(name), "%s workers=%zu", ios[c.io], workers);
+      report_("udp-loopback", name, responses, responses * corpus_[1].len,
+              now_ns_() - begin);
+      coap_server_stop(srv);
+      free(srv);
+    }
+  }
+}
+#endif
+
+int main(int argc, char** argv) {
+  char buf[BENCH_BUFLEN];
+  size_t iter = BENCH_DEFAULT_ITER;
+  size_t counter = 0;
+  size_t i;
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  coap_stats_t stats = {0};
+#ifndef GREENCOAP_NO_CALLBACKS
+  coap_parser_settings_t settings = {
+    &counter, on_begin_, on_header_, on_opt_, on_payload_, on_complete_,
+  };
+#endif
+
+  if (argc > 1) {
+    iter = strtoul(argv[1], NULL, 10);
+  }
+  if (iter == 0) {
+    fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+  memset(block_, 0xA5, sizeof(block_));
+  memset(proxy_uri_, 'a', sizeof(proxy_uri_));
+  memcpy(proxy_uri_, "coap://", L("coap://"));
+
+  coap_parser_create(&p, malloc(coap_parser_size()), coap_parser_size());
+  for (i = 0; i < CORPUS_LEN; i++) {
+    coap_serializer_create(&s, malloc(coap_serializer_size()),
+                           coap_serializer_size(), corpus_[i].buf,
+                           BENCH_BUFLEN);
+    if (corpus_[i].build(s, 0, &corpus_[i].len)) {
+      fprintf(stderr, "%s: build failed\n", corpus_[i].name);
+      return 1;
+    }
+    free(s);
+  }
+
+  printf("iterations: %zu\n", iter);
+  for (i = 0; i < CORPUS_LEN; i++) {
+    coap_serializer_create(&s, malloc(coap_serializer_size()),
+                           coap_serializer_size(), buf, BENCH_BUFLEN);
+    bench_serialize_(&corpus_[i], s, iter);
+
+    coap_parser_init(p, NULL);
+    bench_parse_(&corpus_[i], p, iter, "parse");
+    bench_parse_lookup_(&corpus_[i], p, iter);
+    bench_parse_lazy_(&corpus_[i], p, iter);
+    bench_uint_loop_(&corpus_[i], p, iter);
+    bench_uint_opts_(&corpus_[i], p, iter);
+    bench_round_trip_(&corpus_[i], s, p, buf, iter, "round-trip");
+    // The counters cost nothing unless built with GREENCOAP_STATS.
+    coap_parser_set_stats(p, &stats);
+    coap_serializer_set_stats(s, &stats);
+    bench_round_trip_(&corpus_[i], s, p, buf, iter, "round-trip+stats");
+    coap_parser_set_stats(p, NULL);
+
+#ifndef GREENCOAP_NO_CALLBACKS
+    coap_parser_init(p, &settings);
+    bench_parse_(&corpus_[i], p, iter, "parse+callbacks");
+    bench_round_trip_(&corpus_[i], s, p, buf, iter, "round-trip+callbacks");
+#endif
+    free(s);
+  }
+  coap_parser_init(p, NULL);
+  bench_batch_(p, iter);
+  bench_template_(iter);
+  bench_dedup_(iter);
+  bench_retx_(iter);
+  bench_exchange_(iter);
+  bench_observe_();
+  bench_block_();
+  bench_router_(iter);
+  bench_pool_(iter);
+  bench_stream_(iter);
+#ifdef GREENCOAP_SERVER
+  bench_server_();
+#endif
+  coap_serializer_create(&s, malloc(coap_serializer_size()),
+                         coap_serializer_size(), buf, BENCH_BUFLEN);
+  bench_serialize_iov_(&corpus_[3], s, iter);
+  free(s);
+  bench_editor_(&corpus_[5], p, buf, iter);
+  bench_reply_(&corpus_[1], p, buf, iter);
+  bench_cache_(&corpus_[1], p, buf, iter);
+  sink_ += counter + stats.parsed;
+  free(p);
+  return 0;
+}
@@ -6,11 +6,72 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "greencoap.h"
 
 #define COAP_VERSION (1 << 30)
 #define COAP_LEN_HEADER 4
+#ifndef COAP_MAXLEN_TOKEN
 #define COAP_MAXLEN_TOKEN 8
+#elif COAP_MAXLEN_TOKEN > 8
+#error "COAP_MAXLEN_TOKEN can not exceed 8"
+#endif
+#ifndef COAP_MAXLEN_OPT
+#define COAP_MAXLEN_OPT (65535 + 269)
+#endif
+#ifndef COAP_MAXNUM_OPTS
+#define COAP_MAXNUM_OPTS 32
+#elif COAP_MAXNUM_OPTS > 65535
+#error "COAP_MAXNUM_OPTS can not exceed 65535"
+#endif
+#ifndef COAP_MAXNUM_SLOTS
+#define COAP_MAXNUM_SLOTS 4
+#endif
+#define COAP_NONE 0xFFFFFFFF
+
+/**
+ * Compile-time switches, see greencoap.h. They are plain constants so that
+ * the code they disable is still compiled and checked.
+ */
+#ifdef GREENCOAP_NO_VALIDATION
+#define COAP_VALIDATE 0
+#else
+#define COAP_VALIDATE 1
+#endif
+#ifdef GREENCOAP_NO_CALLBACKS
+#define COAP_CALLBACKS 0
+#else
+#define COAP_CALLBACKS 1
+#endif
+
+/**
+ * Add to a counter of an attached coap_stats_t. Only the owning thread
+ * writes it, so a relaxed store is enough for concurrent coap_stats_add.
+ */
+#ifdef GREENCOAP_STATS
+#define COAP_STATS_ADD(stats, field, n)                                     \
+  do {                                                                      \
+    if (stats) {                                                            \
+      __atomic_store_n(&(stats)->field, (stats)->field + (n),               \
+                       __ATOMIC_RELAXED);                                   \
+    }                                                                       \
+  } while (0)
+#else
+#define COAP_STATS_ADD(stats, field, n) \
+  do {                                  \
+  } while (0)
+#endif
+#define COAP_STATS_OPT(opt) \
+  ((opt) < COAP_STATS_NUM_OPTS - 1 ? (opt) : COAP_STATS_NUM_OPTS - 1)
+
+/**
+ * Position of an option value in the parsed buffer.
+ */
+typedef struct coap_opt_ref_t {
+  uint32_t offset;
+  uint32_t len;
+  uint16_t num;
+} coap_opt_ref_t;
 
 /**
  * CoAP serializer.
@@ -23,6 +84,46 @@ struct coap_serializer_t {
   uint16_t sum_of_delta;
   uint8_t token_len;
   uint8_t executed;
+  uint8_t code;
+  uint8_t signaling;  // 7.xx options are numbered per signal, not checked
+  uint8_t framed;     // finalized by coap_serializer_exec_framed
+  int8_t shift;       // offset of the token against the datagram layout
+  coap_stats_t* stats;
+};
+
+/**
+ * An option staged in a coap_builder_t. uint values are stored inline.
+ */
+typedef struct coap_builder_opt_t {
+  const char* val;
+  uint32_t len;
+  uint16_t num;
+  char uint_val[4];
+} coap_builder_opt_t;
+
+/**
+ * CoAP option builder. Options are staged in any order and encoded by the
+ * embedded serializer in ascending order on exec.
+ */
+struct coap_builder_t {
+  coap_serializer_t s;
+  uint16_t opts_len;
+  uint8_t encoded;
+  coap_builder_opt_t opts[COAP_MAXNUM_OPTS];
+};
+
+/**
+ * CoAP message template. The header and options are encoded once by the
+ * embedded serializer; slots point at fixed-width uint option values that
+ * are patched on every exec.
+ */
+struct coap_template_t {
+  coap_serializer_t s;
+  uint8_t slots_len;
+  struct {
+    uint16_t offset;
+    uint8_t width;
+  } slots[COAP_MAXNUM_SLOTS];
 };
 
 /**
@@ -39,17 +140,176 @@ struct coap_parser_t {
   uint16_t mid;
   uint8_t token_len;
   uint8_t executed;
+  uint8_t finished;
+  int8_t finish_status;
+  uint16_t opts_len;
+  uint8_t opts_overflow;  // more than COAP_MAXNUM_OPTS options, not indexed
+  uint64_t opts_present;
+  coap_opt_ref_t opts[COAP_MAXNUM_OPTS];
   void* cookie;
   coap_parser_cb_t on_begin;
   coap_parser_cb_header_t on_header;
   coap_parser_cb_opt_t on_opt;
   coap_parser_cb_payload_t on_payload;
   coap_parser_cb_t on_complete;
+  coap_stats_t* stats;
 };
 
-static uint8_t is_well_known_(uint16_t opt) {
-  if (opt <= 255) return 1;
-  return 0;
+/**
+ * States of coap_stream_t. Each state collects one field of a frame.
+ */
+enum {
+  COAP_ST_LEN = 0,  // Len and TKL
+  COAP_ST_EXT_LEN,  // extended length
+  COAP_ST_CODE,     // code and token
+  COAP_ST_OPT,      // option delta and length, or the payload marker
+  COAP_ST_OPT_EXT,  // extended option delta and length
+  COAP_ST_OPT_VAL,  // option value
+  COAP_ST_PAYLOAD,
+  COAP_ST_FAILED,
+};
+
+/**
+ * Streaming parser of RFC 8323 frames. A field that is whole in the chunk
+ * is handed out in place; one that straddles chunks is gathered in |hdr|,
+ * or in |scratch| for option values.
+ */
+struct coap_stream_t {
+  size_t max_len;
+  size_t max_opt_len;
+  size_t body;    // bytes left of the options and payload
+  uint32_t need;  // length of the field being collected
+  uint32_t have;  // bytes of it gathered from earlier chunks
+  uint32_t opt;
+  uint8_t state;
+  uint8_t code;
+  uint8_t token_len;
+  char hdr[16];
+  char* scratch;
+  void* cookie;
+  coap_parser_cb_t on_begin;
+  coap_parser_cb_header_t on_header;
+  coap_parser_cb_opt_t on_opt;
+  coap_parser_cb_payload_t on_payload;
+  coap_parser_cb_t on_complete;
+  coap_stats_t* stats;
+};
+
+/**
+ * Option descriptor flags. The lower bits hold the option format.
+ */
+#define COAP_OPT_EMPTY 0x00
+#define COAP_OPT_OPAQUE 0x01
+#define COAP_OPT_UINT 0x02
+#define COAP_OPT_STRING 0x03
+#define COAP_OPT_FORMAT 0x03
+#define COAP_OPT_KNOWN 0x10
+#define COAP_OPT_REPEATABLE 0x20
+
+#define COAP_OPT_DESC(format, flags, min, max) \
+  { (format) | (flags) | COAP_OPT_KNOWN, (min), (max) }
+#define COAP_OPT_DESC_NONE \
+  { 0, 0, 0 }
+
+/**
+ * Format, length bounds and flags of an option.
+ */
+typedef struct coap_opt_desc_t {
+  uint8_t flags;
+  uint8_t min_len;
+  uint16_t max_len;
+} coap_opt_desc_t;
+
+/**
+ * Descriptors of the options numbered from 0 to 255. Options in this range
+ * that are not listed here are rejected, all options above it are regarded
+ * as Repeatable options.
+
+  +-----+---+---+---+---+----------------+--------+--------+----------+
+  | No. | C | U | N | R | Name           | Format | Length | Default  |
+  +-----+---+---+---+---+----------------+--------+--------+----------+
+  |   1 | x |   |   | x | If-Match       | opaque | 0-8    | (none)   |
+  |   3 | x | x | - |   | Uri-Host       | string | 1-255  | (see     |
+  |     |   |   |   |   |                |        |        | below)   |
+  |   4 |   |   |   | x | ETag           | opaque | 1-8    | (none)   |
+  |   5 | x |   |   |   | If-None-Match  | empty  | 0      | (none)   |
+  |   6 |   | x | - |   | Observe        | uint   | 0-3    | (none)   |
+  |   7 | x | x | - |   | Uri-Port       | uint   | 0-2    | (see     |
+  |     |   |   |   |   |                |        |        | below)   |
+  |   8 |   |   |   | x | Location-Path  | string | 0-255  | (none)   |
+  |   9 | x | x | - |   | OSCORE         | opaque | 0-255  | (none)   |
+  |  11 | x | x | - | x | Uri-Path       | string | 0-255  | (none)   |
+  |  12 |   |   |   |   | Content-Format | uint   | 0-2    | (none)   |
+  |  14 |   | x | - |   | Max-Age        | uint   | 0-4    | 60       |
+  |  15 | x | x | - | x | Uri-Query      | string | 0-255  | (none)   |
+  |  17 | x |   |   |   | Accept         | uint   | 0-2    | (none)   |
+  |  20 |   |   |   | x | Location-Query | string | 0-255  | (none)   |
+  |  23 | x | x | - |   | Block2         | uint   | 0-3    | (none)   |
+  |  27 | x | x | - |   | Block1         | uint   | 0-3    | (none)   |
+  |  28 |   |   | x |   | Size2          | uint   | 0-4    | (none)   |
+  |  35 | x | x | - |   | Proxy-Uri      | string | 1-1034 | (none)   |
+  |  39 | x | x | - |   | Proxy-Scheme   | string | 1-255  | (none)   |
+  |  60 |   |   | x |   | Size1          | uint   | 0-4    | (none)   |
+  +-----+---+---+---+---+----------------+--------+--------+----------+
+ */
+static const coap_opt_desc_t opt_desc_[256] = {
+  COAP_OPT_DESC_NONE,                                            // 0
+  COAP_OPT_DESC(COAP_OPT_OPAQUE, COAP_OPT_REPEATABLE, 0, 8),     // 1
+  COAP_OPT_DESC_NONE,                                            // 2
+  COAP_OPT_DESC(COAP_OPT_STRING, 0, 1, 255),                     // 3
+  COAP_OPT_DESC(COAP_OPT_OPAQUE, COAP_OPT_REPEATABLE, 1, 8),     // 4
+  COAP_OPT_DESC(COAP_OPT_EMPTY, 0, 0, 0),                        // 5
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 3),                         // 6
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 2),                         // 7
+  COAP_OPT_DESC(COAP_OPT_STRING, COAP_OPT_REPEATABLE, 0, 255),   // 8
+  COAP_OPT_DESC(COAP_OPT_OPAQUE, 0, 0, 255),                     // 9
+  COAP_OPT_DESC_NONE,                                            // 10
+  COAP_OPT_DESC(COAP_OPT_STRING, COAP_OPT_REPEATABLE, 0, 255),   // 11
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 2),                         // 12
+  COAP_OPT_DESC_NONE,                                            // 13
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 4),                         // 14
+  COAP_OPT_DESC(COAP_OPT_STRING, COAP_OPT_REPEATABLE, 0, 255),   // 15
+  COAP_OPT_DESC_NONE,                                            // 16
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 2),                         // 17
+  COAP_OPT_DESC_NONE,                                            // 18
+  COAP_OPT_DESC_NONE,                                            // 19
+  COAP_OPT_DESC(COAP_OPT_STRING, COAP_OPT_REPEATABLE, 0, 255),   // 20
+  COAP_OPT_DESC_NONE,                                            // 21
+  COAP_OPT_DESC_NONE,                                            // 22
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 3),                         // 23
+  COAP_OPT_DESC_NONE,                                            // 24
+  COAP_OPT_DESC_NONE,                                            // 25
+  COAP_OPT_DESC_NONE,                                            // 26
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 3),                         // 27
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 4),                         // 28
+  COAP_OPT_DESC_NONE,                                            // 29
+  COAP_OPT_DESC_NONE,                                            // 30
+  COAP_OPT_DESC_NONE,                                            // 31
+  COAP_OPT_DESC_NONE,                                            // 32
+  COAP_OPT_DESC_NONE,                                            // 33
+  COAP_OPT_DESC_NONE,                                            // 34
+  COAP_OPT_DESC(COAP_OPT_STRING, 0, 1, 1034),                    // 35
+  COAP_OPT_DESC_NONE,                                            // 36
+  COAP_OPT_DESC_NONE,                                            // 37
+  COAP_OPT_DESC_NONE,                                            // 38
+  COAP_OPT_DESC(COAP_OPT_STRING, 0, 1, 255),                     // 39
+  COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE,    // 40-42
+  COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE,    // 43-45
+  COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE,    // 46-48
+  COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE,    // 49-51
+  COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE,    // 52-54
+  COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE,    // 55-57
+  COAP_OPT_DESC_NONE, COAP_OPT_DESC_NONE,                        // 58-59
+  COAP_OPT_DESC(COAP_OPT_UINT, 0, 0, 4),                         // 60
+};
+
+/**
+ * Check the length of an option against its descriptor. Unknown options are
+ * always invalid.
+ */
+static int invalid_opt_(const coap_opt_desc_t* d, size_t len) {
+  return !(d->flags & COAP_OPT_KNOWN) |
+         (len - d->min_len > (size_t)(d->max_len - d->min_len));
 }
 
 static int validate_type_code_(uint8_t type, uint8_t code) {
@@ -109,6 +369,58 @@ static int validate_type_code_(uint8_t type, uint8_t code) {
   return 0;
 }
 
+/**
+ * Messages on reliable transports have no type. The empty message and the
+ * 7.xx signals are valid there only.
+ */
+static int validate_framed_code_(uint8_t code) {
+  if (code == 0 || (code >= C_CSM && code <= C_ABORT)) {
+    return 0;
+  }
+  return validate_type_code_(T_CON, code);
+}
+
+/**
+ * Count a rejected message and pass its status through.
+ */
+static int coap_stats_err_(coap_stats_t* stats, coap_stats_err_t reason,
+                           int rc) {
+  COAP_STATS_ADD(stats, errors[reason], 1);
+  return rc;
+}
+
+/**
+ * Count an option rejected by its descriptor by the check that failed.
+ */
+static int coap_stats_opt_err_(coap_stats_t* stats, const coap_opt_desc_t* d,
+                               uint32_t opt, size_t len) {
+  if (!(d->flags & COAP_OPT_KNOWN)) {
+    return coap_stats_err_(stats, COAP_STATS_ERR_OPT_UNKNOWN, COAP_ERR_SYNTAX);
+  }
+  if (invalid_opt_(d, len)) {
+    COAP_STATS_ADD(stats, opt_length_errors[COAP_STATS_OPT(opt)], 1);
+    return coap_stats_err_(stats, COAP_STATS_ERR_OPT_LENGTH, COAP_ERR_SYNTAX);
+  }
+  return coap_stats_err_(stats, COAP_STATS_ERR_OPT_REPEAT, COAP_ERR_SYNTAX);
+}
+
+static int is_uint_opt_(uint16_t opt) {
+  return opt > 255 ||
+         (opt_desc_[opt].flags & (COAP_OPT_KNOWN | COAP_OPT_FORMAT)) ==
+           (COAP_OPT_KNOWN | COAP_OPT_UINT);
+}
+
+/**
+ * Encode a uint option value in network byte order with as few bytes as
+ * possible and return the number of bytes.
+ */
+static size_t encode_uint_(uint32_t val, char* dst) {
+  uint32_t nbo = htonl(val);
+  size_t len = (val > 0xFFFFFF) + (val > 0xFFFF) + (val > 0xFF) + (val > 0);
+  memcpy(dst, (const char*)&nbo + 4 - len, len);
+  return len;
+}
+
 static int coap_s_write_(coap_serializer_t* s, const char* src,
                          size_t src_len) {
   if (s->buf_len - s->cursor < src_len) {
@@ -153,18 +465,16 @@ int coap_serializer_create(coap_serializer_t** s, void* buf, size_t len,
   return COAP_OK;
 }
 
-int coap_serializer_init(coap_serializer_t* s, uint8_t type, uint8_t code,
-                         uint8_t token_len) {
-  if (s == NULL || token_len > COAP_MAXLEN_TOKEN) {
-    return COAP_ERR_ARG;
-  }
-  if (validate_type_code_(type, code)) {
-    return COAP_ERR_ARG;
-  }
+static int coap_s_init_(coap_serializer_t* s, uint8_t type, uint8_t code,
+                        uint8_t token_len) {
   s->cursor = 0;
   s->sum_of_delta = 0;
   s->token_len = token_len;
   s->executed = 0;
+  s->code = code;
+  s->signaling = 0;
+  s->framed = 0;
+  s->shift = 0;
   coap_s_write_uint32_(
     s, htonl(COAP_VERSION | (type << 28) | (code << 16) | (token_len << 24)));
   if (s->cursor + token_len > s->buf_len) {
@@ -174,119 +484,50 @@ int coap_serializer_init(coap_serializer_t* s, uint8_t type, uint8_t code,
   return COAP_OK;
 }
 
+int coap_serializer_init(coap_serializer_t* s, uint8_t type, uint8_t code,
+                         uint8_t token_len) {
+  if (s == NULL || token_len > COAP_MAXLEN_TOKEN) {
+    return COAP_ERR_ARG;
+  }
+  if (COAP_VALIDATE && validate_type_code_(type, code)) {
+    return COAP_ERR_ARG;
+  }
+  return coap_s_init_(s, type, code, token_len);
+}
+
+int coap_serializer_init_framed(coap_serializer_t* s, uint8_t code,
+                                uint8_t token_len) {
+  int rc;
+  if (s == NULL || token_len > COAP_MAXLEN_TOKEN) {
+    return COAP_ERR_ARG;
+  }
+  if (COAP_VALIDATE && validate_framed_code_(code)) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_s_init_(s, T_CON, code, token_len);
+  s->signaling = (code >> 5) == 7;
+  return rc;
+}
+
 int coap_serializer_add_opt(coap_serializer_t* s, uint16_t opt, const char* val,
                             size_t len) {
-  /**
-  +-----+---+---+---+---+----------------+--------+--------+----------+
-  | No. | C | U | N | R | Name           | Format | Length | Default  |
-  +-----+---+---+---+---+----------------+--------+--------+----------+
-  |   1 | x |   |   | x | If-Match       | opaque | 0-8    | (none)   |
-  |   3 | x | x | - |   | Uri-Host       | string | 1-255  | (see     |
-  |     |   |   |   |   |                |        |        | below)   |
-  |   4 |   |   |   | x | ETag           | opaque | 1-8    | (none)   |
-  |   5 | x |   |   |   | If-None-Match  | empty  | 0      | (none)   |
-  |   7 | x | x | - |   | Uri-Port       | uint   | 0-2    | (see     |
-  |     |   |   |   |   |                |        |        | below)   |
-  |   8 |   |   |   | x | Location-Path  | string | 0-255  | (none)   |
-  |  11 | x | x | - | x | Uri-Path       | string | 0-255  | (none)   |
-  |  12 |   |   |   |   | Content-Format | uint   | 0-2    | (none)   |
-  |  14 |   | x | - |   | Max-Age        | uint   | 0-4    | 60       |
-  |  15 | x | x | - | x | Uri-Query      | string | 0-255  | (none)   |
-  |  17 | x |   |   |   | Accept         | uint   | 0-2    | (none)   |
-  |  20 |   |   |   | x | Location-Query | string | 0-255  | (none)   |
-  |  35 | x | x | - |   | Proxy-Uri      | string | 1-1034 | (none)   |
-  |  39 | x | x | - |   | Proxy-Scheme   | string | 1-255  | (none)   |
-  |  60 |   |   | x |   | Size1          | uint   | 0-4    | (none)   |
-  +-----+---+---+---+---+----------------+--------+--------+----------+
-  */
+  const coap_opt_desc_t* d;
   uint8_t opt_delta_and_len = 0;
-  if (s == NULL || len > 65535 + 269) {
+  if (s == NULL || len > COAP_MAXLEN_OPT || (val == NULL && len > 0)) {
     return COAP_ERR_ARG;
   }
   if (s->executed) {
     return COAP_ERR_INVALID_CALL;
   }
-  if (is_well_known_(opt)) {
-    switch (opt) {
-      // empty
-      case O_IF_NONE_MATCH:
-        if (val != NULL || len != 0) {
-          return COAP_ERR_ARG;
-        }
-        if (s->sum_of_delta == opt) {
-          return COAP_ERR_INVALID_CALL;
-        }
-        break;
-      // opaque
-      case O_ETAG:
-        if (val == NULL || len == 0) {
-          return COAP_ERR_ARG;
-        }
-      case O_IF_MATCH:
-        if (len > 8) {
-          return COAP_ERR_ARG;
-        }
-        break;
-      // uint
-      case O_URI_PORT:
-      case O_CONTENT_FORMAT:
-      case O_ACCEPT:
-        if (len > 2) {
-          return COAP_ERR_ARG;
-        }
-        if (s->sum_of_delta == opt) {
-          return COAP_ERR_INVALID_CALL;
-        }
-        break;
-      case O_OBSERVE:
-        if (len > 3) {
-          return COAP_ERR_ARG;
-        }
-        if (s->sum_of_delta == opt) {
-          return COAP_ERR_INVALID_CALL;
-        }
-        break;
-      case O_MAX_AGE:
-      case O_SIZE1:
-        if (len > 4) {
-          return COAP_ERR_ARG;
-        }
-        if (s->sum_of_delta == opt) {
-          return COAP_ERR_INVALID_CALL;
-        }
-        break;
-      // string
-      case O_URI_HOST:
-      case O_PROXY_SCHEME:
-        if (val == NULL || len == 0 || len > 255) {
-          return COAP_ERR_ARG;
-        }
-        if (s->sum_of_delta == opt) {
-          return COAP_ERR_INVALID_CALL;
-        }
-        break;
-      case O_LOCATION_PATH:
-      case O_URI_PATH:
-      case O_URI_QUERY:
-      case O_LOCATION_QUERY:
-        if (len > 255) {
-          return COAP_ERR_ARG;
-        }
-        break;
-      case O_PROXY_URI:
-        if (val == NULL || len == 0 || len > 1034) {
-          return COAP_ERR_ARG;
-        }
-        if (s->sum_of_delta == opt) {
-          return COAP_ERR_INVALID_CALL;
-        }
-        break;
-      default:
-        return COAP_ERR_ARG;
+  if (COAP_VALIDATE && opt <= 255 && !s->signaling) {
+    d = &opt_desc_[opt];
+    if (invalid_opt_(d, len)) {
+      return COAP_ERR_ARG;
+    }
+    if (!(d->flags & COAP_OPT_REPEATABLE) && s->sum_of_delta == opt) {
+      return COAP_ERR_INVALID_CALL;
     }
   }
-  // Except well-known options, all other options are regarded as Repeatable
-  // options.
   if (s->sum_of_delta > opt) {
     return COAP_ERR_INVALID_CALL;
   }
@@ -317,7 +558,7 @@ int coap_serializer_add_opt(coap_serializer_t* s, uint16_t opt, const char* val,
       return COAP_ERR_LIMIT;
     }
   } else {
-    if (coap_s_write_uint16_(s, (opt - s->sum_of_delta) - 269)) {
+    if (coap_s_write_uint16_(s, htons((opt - s->sum_of_delta) - 269))) {
       return COAP_ERR_LIMIT;
     }
   }
@@ -329,7 +570,7 @@ int coap_serializer_add_opt(coap_serializer_t* s, uint16_t opt, const char* val,
       return COAP_ERR_LIMIT;
     }
   } else {
-    if (coap_s_write_uint16_(s, len - 269)) {
+    if (coap_s_write_uint16_(s, htons(len - 269))) {
       return COAP_ERR_LIMIT;
     }
   }
@@ -344,360 +585,3819 @@ int coap_serializer_add_opt(coap_serializer_t* s, uint16_t opt, const char* val,
 
 int coap_serializer_add_opt_uint(coap_serializer_t* s, uint16_t opt,
                                  uint32_t val) {
-  uint8_t nbo8;
-  uint16_t nbo16;
-  uint32_t nbo32;
-  if (is_well_known_(opt)) {
-    switch (opt) {
-      case O_URI_PORT:
-      case O_CONTENT_FORMAT:
-      case O_ACCEPT:
-      case O_OBSERVE:
-      case O_MAX_AGE:
-      case O_SIZE1:
-        break;
-      default:
-        return COAP_ERR_ARG;
-    }
+  char enc[4];
+  size_t len;
+  if (s == NULL ||
+      (COAP_VALIDATE && !s->signaling && !is_uint_opt_(opt))) {
+    return COAP_ERR_ARG;
   }
-  if (val == 0) {
-    return coap_serializer_add_opt(s, opt, NULL, 0);
+  len = encode_uint_(val, enc);
+  return coap_serializer_add_opt(s, opt, len ? enc : NULL, len);
+}
+
+int coap_serializer_set_stats(coap_serializer_t* s, coap_stats_t* stats) {
+  if (s == NULL) {
+    return COAP_ERR_ARG;
   }
-  if (val < 256) {
-    nbo8 = (uint8_t)val;
-    return coap_serializer_add_opt(s, opt, (const char*)&nbo8, 1);
+  s->stats = stats;
+  return COAP_OK;
+}
+
+/**
+ * Count a finalized message, or a failure to finalize one.
+ */
+static int coap_s_count_(coap_serializer_t* s, int rc, const size_t* msg_len) {
+  if (s == NULL) {
+    return rc;
   }
-  if (val < 65536) {
-    nbo16 = htons((uint16_t)val);
-    return coap_serializer_add_opt(s, opt, (const char*)&nbo16, 2);
+  if (rc) {
+    COAP_STATS_ADD(s->stats, serialize_errors, 1);
+    return rc;
   }
-  nbo32 = htonl(val);
-  return coap_serializer_add_opt(s, opt, (const char*)&nbo32, 4);
+  COAP_STATS_ADD(s->stats, serialized, 1);
+  COAP_STATS_ADD(s->stats, serialized_bytes, *msg_len);
+  return rc;
 }
 
-int coap_serializer_exec(coap_serializer_t* s, uint16_t mid, const char* token,
-                         const char* payload, size_t payload_len,
-                         size_t* msg_len) {
+static int coap_s_exec_(coap_serializer_t* s, uint16_t mid, const char* token,
+                        const char* payload, size_t payload_len,
+                        size_t* msg_len) {
   uint16_t nbo_mid = htons(mid);
   if (s == NULL) {
     return COAP_ERR_ARG;
   }
+  if (s->framed) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  // Re-executing rewinds to the end of the options.
+  if (!s->executed) {
+    s->payload = s->cursor;
+    s->executed = 1;
+  }
+  s->cursor = s->payload;
   memcpy(&s->buf[2], &nbo_mid, 2);
   if (token) {
     memcpy(&s->buf[4], token, s->token_len);
   }
   if (payload == NULL || payload_len == 0) {
     *msg_len = s->cursor;
-    s->executed = 1;
     return COAP_OK;
   }
-  if (s->executed) {
-    s->cursor = s->payload;
-  }
-  if (!s->executed || s->sum_of_delta == 0) {
-    if (coap_s_write_uint8_(s, 0xFF)) {
-      return COAP_ERR_LIMIT;
-    }
-  }
-  s->payload = s->cursor;
-  if (coap_s_write_(s, payload, payload_len)) {
+  if (coap_s_write_uint8_(s, 0xFF) || coap_s_write_(s, payload, payload_len)) {
     return COAP_ERR_LIMIT;
   }
   *msg_len = s->cursor;
-  s->executed = 1;
   return COAP_OK;
 }
 
-int coap_parser_create(coap_parser_t** p, const char* buf, size_t len) {
-  if (buf == NULL || sizeof(coap_parser_t) > len) {
-    return COAP_ERR_ARG;
-  }
-  *p = (coap_parser_t*)buf;
-  memset(*p, 0, sizeof(coap_parser_t));
-  return COAP_OK;
+int coap_serializer_exec(coap_serializer_t* s, uint16_t mid, const char* token,
+                         const char* payload, size_t payload_len,
+                         size_t* msg_len) {
+  return coap_s_count_(
+    s, coap_s_exec_(s, mid, token, payload, payload_len, msg_len), msg_len);
 }
 
-int coap_parser_init(coap_parser_t* p, const coap_parser_settings_t* s) {
-  if (p == NULL) {
+int coap_serializer_exec_iov(coap_serializer_t* s, uint16_t mid,
+                             const char* token, const char* payload,
+                             size_t payload_len, struct iovec* iov,
+                             size_t* iov_len, size_t* msg_len) {
+  int rc;
+  if (iov == NULL || iov_len == NULL || msg_len == NULL) {
     return COAP_ERR_ARG;
   }
-  if (s == NULL) {
-    p->cookie = NULL;
-    p->on_begin = NULL;
-    p->on_header = NULL;
-    p->on_opt = NULL;
-    p->on_payload = NULL;
-    p->on_complete = NULL;
-  } else {
-    p->cookie = s->cookie;
-    p->on_begin = s->on_begin;
-    p->on_header = s->on_header;
-    p->on_opt = s->on_opt;
-    p->on_payload = s->on_payload;
-    p->on_complete = s->on_complete;
+  rc = coap_s_exec_(s, mid, token, NULL, 0, msg_len);
+  if (rc) {
+    return coap_s_count_(s, rc, msg_len);
   }
-  return COAP_OK;
+  iov[0].iov_base = s->buf;
+  if (payload == NULL || payload_len == 0) {
+    iov[0].iov_len = *msg_len;
+    *iov_len = 1;
+    return coap_s_count_(s, COAP_OK, msg_len);
+  }
+  if (coap_s_write_uint8_(s, 0xFF)) {
+    return coap_s_count_(s, COAP_ERR_LIMIT, msg_len);
+  }
+  iov[0].iov_len = s->cursor;
+  iov[1].iov_base = (void*)payload;
+  iov[1].iov_len = payload_len;
+  *iov_len = 2;
+  *msg_len = s->cursor + payload_len;
+  return coap_s_count_(s, COAP_OK, msg_len);
 }
 
-int coap_parser_exec(coap_parser_t* p, const char* buf, size_t len) {
-  uint32_t header;
-  if (p == NULL || buf == NULL || len == 0) {
+static int coap_s_exec_framed_(coap_serializer_t* s, const char* token,
+                               const char* payload, size_t payload_len,
+                               size_t* msg_len) {
+  static const uint32_t base[5] = {0, 13, 269, 0, 65805};
+  static const uint8_t nibble[5] = {0, 13, 14, 0, 15};
+  size_t opts_len, body, cursor;
+  uint32_t ext_val;
+  uint8_t ext;
+  int8_t shift;
+  if (s == NULL || msg_len == NULL) {
     return COAP_ERR_ARG;
   }
-  p->buf_len = len;
-  p->buf = buf;
-  p->cursor = 0;
-  p->executed = 0;
-
-  // Parse CoAP header.
-  if (p->on_begin) {
-    p->on_begin(p->cookie);
+  if (s->executed && !s->framed) {
+    return COAP_ERR_INVALID_CALL;
   }
-  if (coap_p_read_(p, (char*)&header, 4)) {
-    return COAP_ERR_SYNTAX;
+  if (!s->executed) {
+    s->payload = s->cursor;
+    s->executed = 1;
+    s->framed = 1;
   }
-  header = ntohl(header);
-  p->version = header >> 30;
-  if (p->version != 1) {
-    return COAP_ERR_SYNTAX;
+  if (payload == NULL) {
+    payload_len = 0;
   }
-  p->type = (header & 0x30000000) >> 28;
-  p->code = (header & 0x00FF0000) >> 16;
-  if (validate_type_code_(p->type, p->code)) {
-    return COAP_ERR_SYNTAX;
+  opts_len = s->payload - COAP_LEN_HEADER - s->token_len;
+  if (payload_len > s->buf_len) {
+    return COAP_ERR_LIMIT;
   }
-  p->mid = (header & 0x0000FFFF);
-  p->token_len = (header & 0x0F000000) >> 24;
-  if (p->token_len > 8) {
-    return COAP_ERR_SYNTAX;
+  body = opts_len + (payload_len > 0 ? 1 + payload_len : 0);
+  ext = body < 13 ? 0 : body < 269 ? 1 : body < 65805 ? 2 : 4;
+  if (body - base[ext] > 0xFFFFFFFF) {
+    return COAP_ERR_LIMIT;
+  }
+
+  // The frame header is 2 + |ext| bytes against 4 of a datagram, so the
+  // token and the options move by the difference.
+  shift = (int8_t)ext - 2;
+  if (2 + ext + s->token_len + body > s->buf_len) {
+    return COAP_ERR_LIMIT;
+  }
+  if (shift != s->shift) {
+    memmove(&s->buf[COAP_LEN_HEADER + shift],
+            &s->buf[COAP_LEN_HEADER + s->shift], s->token_len + opts_len);
+    s->shift = shift;
+  }
+  ext_val = htonl((uint32_t)(body - base[ext]));
+  s->buf[0] = (char)((ext ? nibble[ext] : body) << 4 | s->token_len);
+  memcpy(&s->buf[1], (const char*)&ext_val + 4 - ext, ext);
+  s->buf[1 + ext] = (char)s->code;
+  if (token) {
+    memcpy(&s->buf[2 + ext], token, s->token_len);
+  }
+  cursor = 2 + ext + s->token_len + opts_len;
+  if (payload_len > 0) {
+    s->buf[cursor++] = (char)0xFF;
+    memcpy(&s->buf[cursor], payload, payload_len);
+    cursor += payload_len;
+  }
+  s->cursor = cursor;
+  *msg_len = cursor;
+  return COAP_OK;
+}
+
+int coap_serializer_exec_framed(coap_serializer_t* s, const char* token,
+                                const char* payload, size_t payload_len,
+                                size_t* msg_len) {
+  if (s == NULL || msg_len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  return coap_s_count_(
+    s, coap_s_exec_framed_(s, token, payload, payload_len, msg_len), msg_len);
+}
+
+int coap_builder_create(coap_builder_t** b, void* buf, size_t len,
+                        char* dst_buf, size_t dst_len) {
+  coap_serializer_t* s = NULL;
+  if (buf == NULL || sizeof(coap_builder_t) > len) {
+    return COAP_ERR_ARG;
+  }
+  *b = (coap_builder_t*)buf;
+  memset(*b, 0, sizeof(coap_builder_t));
+  return coap_serializer_create(&s, &(*b)->s, sizeof(coap_serializer_t),
+                                dst_buf, dst_len);
+}
+
+int coap_builder_init(coap_builder_t* b, uint8_t type, uint8_t code,
+                      uint8_t token_len) {
+  if (b == NULL) {
+    return COAP_ERR_ARG;
+  }
+  b->opts_len = 0;
+  b->encoded = 0;
+  return coap_serializer_init(&b->s, type, code, token_len);
+}
+
+/**
+ * Check whether a non-repeatable option is staged already. The serializer
+ * would only reject it in coap_builder_exec, with part of the options
+ * encoded.
+ */
+static int coap_b_repeated_(const coap_builder_t* b, uint16_t opt) {
+  size_t i;
+  if (!COAP_VALIDATE || opt > 255 ||
+      (opt_desc_[opt].flags & COAP_OPT_REPEATABLE)) {
+    return 0;
+  }
+  for (i = 0; i < b->opts_len; i++) {
+    if (b->opts[i].num == opt) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int coap_builder_add_opt(coap_builder_t* b, uint16_t opt, const char* val,
+                         size_t len) {
+  if (b == NULL || (val == NULL && len > 0) || len > COAP_MAXLEN_OPT) {
+    return COAP_ERR_ARG;
+  }
+  if (b->encoded) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  if (COAP_VALIDATE && opt <= 255 && invalid_opt_(&opt_desc_[opt], len)) {
+    return COAP_ERR_ARG;
+  }
+  if (coap_b_repeated_(b, opt)) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  if (b->opts_len == COAP_MAXNUM_OPTS) {
+    return COAP_ERR_LIMIT;
+  }
+  b->opts[b->opts_len].val = val;
+  b->opts[b->opts_len].len = len;
+  b->opts[b->opts_len].num = opt;
+  b->opts_len++;
+  return COAP_OK;
+}
+
+int coap_builder_add_opt_uint(coap_builder_t* b, uint16_t opt, uint32_t val) {
+  coap_builder_opt_t* e;
+  if (b == NULL || (COAP_VALIDATE && !is_uint_opt_(opt))) {
+    return COAP_ERR_ARG;
+  }
+  if (b->encoded || coap_b_repeated_(b, opt)) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  if (b->opts_len == COAP_MAXNUM_OPTS) {
+    return COAP_ERR_LIMIT;
+  }
+  // The value is kept inline so that the caller does not have to keep it.
+  e = &b->opts[b->opts_len];
+  e->len = encode_uint_(val, e->uint_val);
+  if (COAP_VALIDATE && opt <= 255 &&
+      invalid_opt_(&opt_desc_[opt], e->len)) {
+    return COAP_ERR_ARG;
+  }
+  e->val = NULL;
+  e->num = opt;
+  b->opts_len++;
+  return COAP_OK;
+}
+
+int coap_builder_exec(coap_builder_t* b, uint16_t mid, const char* token,
+                      const char* payload, size_t payload_len,
+                      size_t* msg_len) {
+  coap_builder_opt_t tmp;
+  coap_builder_opt_t* e;
+  size_t i, j;
+  int rc;
+  if (b == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (!b->encoded) {
+    // Encode from the end of the token, so that a failed exec can be retried.
+    b->s.cursor = COAP_LEN_HEADER + b->s.token_len;
+    b->s.sum_of_delta = 0;
+    // Insertion sort keeps repeated options in the order they were added.
+    for (i = 1; i < b->opts_len; i++) {
+      tmp = b->opts[i];
+      for (j = i; j > 0 && b->opts[j - 1].num > tmp.num; j--) {
+        b->opts[j] = b->opts[j - 1];
+      }
+      b->opts[j] = tmp;
+    }
+    for (i = 0; i < b->opts_len; i++) {
+      e = &b->opts[i];
+      rc = coap_serializer_add_opt(&b->s, e->num, e->val ? e->val : e->uint_val,
+                                   e->len);
+      if (rc) {
+        return rc;
+      }
+    }
+    b->encoded = 1;
+  }
+  return coap_serializer_exec(&b->s, mid, token, payload, payload_len,
+                              msg_len);
+}
+
+int coap_template_create(coap_template_t** t, void* buf, size_t len,
+                         char* dst_buf, size_t dst_len) {
+  coap_serializer_t* s = NULL;
+  if (buf == NULL || sizeof(coap_template_t) > len) {
+    return COAP_ERR_ARG;
+  }
+  *t = (coap_template_t*)buf;
+  memset(*t, 0, sizeof(coap_template_t));
+  return coap_serializer_create(&s, &(*t)->s, sizeof(coap_serializer_t),
+                                dst_buf, dst_len);
+}
+
+int coap_template_init(coap_template_t* t, uint8_t type, uint8_t code,
+                       uint8_t token_len) {
+  if (t == NULL) {
+    return COAP_ERR_ARG;
+  }
+  t->slots_len = 0;
+  return coap_serializer_init(&t->s, type, code, token_len);
+}
+
+int coap_template_add_opt(coap_template_t* t, uint16_t opt, const char* val,
+                          size_t len) {
+  if (t == NULL) {
+    return COAP_ERR_ARG;
+  }
+  return coap_serializer_add_opt(&t->s, opt, val, len);
+}
+
+int coap_template_add_opt_uint(coap_template_t* t, uint16_t opt,
+                               uint32_t val) {
+  if (t == NULL) {
+    return COAP_ERR_ARG;
+  }
+  return coap_serializer_add_opt_uint(&t->s, opt, val);
+}
+
+int coap_template_add_opt_slot(coap_template_t* t, uint16_t opt,
+                               uint8_t width, uint8_t* slot) {
+  static const char zero[4] = {0};
+  int rc;
+  if (t == NULL || slot == NULL || width == 0 || width > 4) {
+    return COAP_ERR_ARG;
+  }
+  if (opt <= 255 && (opt_desc_[opt].flags & COAP_OPT_FORMAT) != COAP_OPT_UINT) {
+    return COAP_ERR_ARG;
+  }
+  if (t->slots_len == COAP_MAXNUM_SLOTS) {
+    return COAP_ERR_LIMIT;
+  }
+  rc = coap_serializer_add_opt(&t->s, opt, zero, width);
+  if (rc) {
+    return rc;
+  }
+  t->slots[t->slots_len].offset = t->s.cursor - width;
+  t->slots[t->slots_len].width = width;
+  *slot = t->slots_len++;
+  return COAP_OK;
+}
+
+int coap_template_exec(const coap_template_t* t, char* dst, size_t dst_len,
+                       uint16_t mid, const char* token, const uint32_t* vals,
+                       const char* payload, size_t payload_len,
+                       size_t* msg_len) {
+  size_t len;
+  uint32_t nbo;
+  uint8_t i;
+  if (t == NULL || dst == NULL || msg_len == NULL ||
+      (t->slots_len > 0 && vals == NULL)) {
+    return COAP_ERR_ARG;
+  }
+  len = t->s.cursor;
+  if (payload_len > 0 && payload != NULL) {
+    if (dst_len < len || dst_len - len < 1 + payload_len) {
+      return COAP_ERR_LIMIT;
+    }
+    dst[len] = (char)0xFF;
+    memcpy(&dst[len + 1], payload, payload_len);
+    *msg_len = len + 1 + payload_len;
+  } else {
+    if (dst_len < len) {
+      return COAP_ERR_LIMIT;
+    }
+    *msg_len = len;
+  }
+  memcpy(dst, t->s.buf, len);
+  dst[2] = (char)(mid >> 8);
+  dst[3] = (char)mid;
+  if (token) {
+    memcpy(&dst[COAP_LEN_HEADER], token, t->s.token_len);
+  }
+  for (i = 0; i < t->slots_len; i++) {
+    nbo = htonl(vals[i]);
+    memcpy(&dst[t->slots[i].offset], (const char*)&nbo + 4 - t->slots[i].width,
+           t->slots[i].width);
+  }
+  return COAP_OK;
+}
+
+int coap_parser_create(coap_parser_t** p, const char* buf, size_t len) {
+  if (buf == NULL || sizeof(coap_parser_t) > len) {
+    return COAP_ERR_ARG;
+  }
+  *p = (coap_parser_t*)buf;
+  memset(*p, 0, sizeof(coap_parser_t));
+  return COAP_OK;
+}
+
+int coap_parser_init(coap_parser_t* p, const coap_parser_settings_t* s) {
+  if (p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (!COAP_CALLBACKS && s != NULL &&
+      (s->on_begin || s->on_header || s->on_opt || s->on_payload ||
+       s->on_complete)) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  if (s == NULL) {
+    p->cookie = NULL;
+    p->on_begin = NULL;
+    p->on_header = NULL;
+    p->on_opt = NULL;
+    p->on_payload = NULL;
+    p->on_complete = NULL;
+  } else {
+    p->cookie = s->cookie;
+    p->on_begin = s->on_begin;
+    p->on_header = s->on_header;
+    p->on_opt = s->on_opt;
+    p->on_payload = s->on_payload;
+    p->on_complete = s->on_complete;
+  }
+  return COAP_OK;
+}
+
+int coap_parser_set_stats(coap_parser_t* p, coap_stats_t* stats) {
+  if (p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  p->stats = stats;
+  return COAP_OK;
+}
+
+/**
+ * Parse the fixed header and the token of a CoAP message. Callbacks are
+ * invoked only when |cb| is set so that coap_parser_exec and
+ * coap_parser_exec_batch share the same validation.
+ */
+static int coap_p_header_(coap_parser_t* p, const char* buf, size_t len,
+                          uint8_t cb) {
+  uint32_t header;
+  cb = cb && COAP_CALLBACKS;
+  p->buf_len = len;
+  p->buf = buf;
+  p->cursor = 0;
+  p->executed = 0;
+  p->finished = 0;
+  p->opts_len = 0;
+  p->opts_overflow = 0;
+  p->opts_present = 0;
+
+  // Parse CoAP header.
+  if (cb && p->on_begin) {
+    p->on_begin(p->cookie);
+  }
+  if (coap_p_read_(p, (char*)&header, 4)) {
+    return coap_stats_err_(p->stats, COAP_STATS_ERR_TRUNCATED,
+                           COAP_ERR_SYNTAX);
+  }
+  header = ntohl(header);
+  p->version = header >> 30;
+  if (p->version != 1) {
+    return coap_stats_err_(p->stats, COAP_STATS_ERR_VERSION, COAP_ERR_SYNTAX);
+  }
+  p->type = (header & 0x30000000) >> 28;
+  p->code = (header & 0x00FF0000) >> 16;
+  if (COAP_VALIDATE && validate_type_code_(p->type, p->code)) {
+    return coap_stats_err_(p->stats, COAP_STATS_ERR_TYPE_CODE,
+                           COAP_ERR_SYNTAX);
+  }
+  p->mid = (header & 0x0000FFFF);
+  p->token_len = (header & 0x0F000000) >> 24;
+  if (p->token_len > COAP_MAXLEN_TOKEN) {
+    return coap_stats_err_(p->stats, COAP_STATS_ERR_TOKEN, COAP_ERR_SYNTAX);
+  }
+  if (p->buf_len - p->cursor < p->token_len) {
+    return coap_stats_err_(p->stats, COAP_STATS_ERR_TRUNCATED,
+                           COAP_ERR_SYNTAX);
   }
-  if (p->on_header) {
-    p->on_header(p->cookie, p->type, p->code, p->mid, &p->buf[p->cursor],
-                 p->token_len);
+  if (cb && p->on_header) {
+    p->on_header(p->cookie, (coap_type_t)p->type, (coap_code_t)p->code,
+                 p->mid, &p->buf[p->cursor], p->token_len);
   }
   p->cursor += p->token_len;
+  return COAP_OK;
+}
 
-  // Parse CoAP options.
-  uint16_t sum_of_delta = 0;
-  uint16_t opt;
-  uint16_t opt_len;
+/**
+ * Parse the options and locate the payload of a CoAP message whose header
+ * has been parsed by coap_p_header_.
+ */
+static int coap_p_opts_(coap_parser_t* p, uint8_t cb) {
+  const coap_opt_desc_t* d;
+  uint32_t sum_of_delta = 0;
+  uint32_t opt;
+  uint32_t opt_len;
+  uint16_t ext;
   uint8_t b;
+  cb = cb && COAP_CALLBACKS;
   while (p->cursor < p->buf_len) {
     coap_p_read_(p, (char*)&b, 1);
     if (b == 0xFF) {
+      // A payload marker followed by a zero-length payload is a message
+      // format error.
+      if (p->cursor == p->buf_len) {
+        return coap_stats_err_(p->stats, COAP_STATS_ERR_PAYLOAD_MARKER,
+                               COAP_ERR_SYNTAX);
+      }
       p->payload = p->cursor;
-      p->executed = 1;
-      if (p->on_payload) {
+      if (cb && p->on_payload) {
         p->on_payload(p->cookie, &p->buf[p->cursor], p->buf_len - p->cursor);
       }
-      if (p->on_complete) {
+      if (cb && p->on_complete) {
         p->on_complete(p->cookie);
       }
+      COAP_STATS_ADD(p->stats, parsed, 1);
+      COAP_STATS_ADD(p->stats, parsed_bytes, p->buf_len);
       return COAP_OK;
     }
     opt = b >> 4;
     opt_len = 0x0F & b;
-    // if (i < 4) printf("opt:%d,%d\n", opt, opt_len);
 
     // Get the number of an option.
     if (opt < 13) {
     } else if (opt == 13) {
       if (coap_p_read_(p, (char*)&b, 1)) {
-        return COAP_ERR_SYNTAX;
+        return coap_stats_err_(p->stats, COAP_STATS_ERR_TRUNCATED,
+                               COAP_ERR_SYNTAX);
       }
       opt = b + 13;
     } else if (opt == 14) {
-      if (coap_p_read_(p, (char*)&opt, 2)) {
-        return COAP_ERR_SYNTAX;
+      if (coap_p_read_(p, (char*)&ext, 2)) {
+        return coap_stats_err_(p->stats, COAP_STATS_ERR_TRUNCATED,
+                               COAP_ERR_SYNTAX);
       }
-      opt = ntohs(opt) + 269;
+      opt = ntohs(ext) + 269;
     } else {
-      return COAP_ERR_SYNTAX;
+      return coap_stats_err_(p->stats, COAP_STATS_ERR_OPT_DELTA,
+                             COAP_ERR_SYNTAX);
     }
 
     // Get the length of an option.
     if (opt_len < 13) {
     } else if (opt_len == 13) {
       if (coap_p_read_(p, (char*)&b, 1)) {
-        return COAP_ERR_SYNTAX;
+        return coap_stats_err_(p->stats, COAP_STATS_ERR_TRUNCATED,
+                               COAP_ERR_SYNTAX);
       }
       opt_len = b + 13;
     } else if (opt_len == 14) {
-      if (coap_p_read_(p, (char*)&opt_len, 2)) {
-        return COAP_ERR_SYNTAX;
+      if (coap_p_read_(p, (char*)&ext, 2)) {
+        return coap_stats_err_(p->stats, COAP_STATS_ERR_TRUNCATED,
+                               COAP_ERR_SYNTAX);
       }
-      opt_len = ntohs(opt_len) + 269;
+      opt_len = ntohs(ext) + 269;
     } else {
-      return COAP_ERR_SYNTAX;
+      return coap_stats_err_(p->stats, COAP_STATS_ERR_OPT_LENGTH,
+                             COAP_ERR_SYNTAX);
+    }
+    if (sum_of_delta + opt > 65535) {
+      return coap_stats_err_(p->stats, COAP_STATS_ERR_OPT_DELTA,
+                             COAP_ERR_SYNTAX);
+    }
+    if (p->buf_len - p->cursor < opt_len) {
+      return coap_stats_err_(p->stats, COAP_STATS_ERR_TRUNCATED,
+                             COAP_ERR_SYNTAX);
     }
 
-    // Validate the option.
-    if (is_well_known_(sum_of_delta + opt)) {
-      switch (sum_of_delta + opt) {
-        // empty
-        case O_IF_NONE_MATCH:
-          if (opt_len != 0) {
-            return COAP_ERR_SYNTAX;
-          }
-          if (opt == 0) {
-            return COAP_ERR_SYNTAX;
-          }
-          break;
-        // opaque
-        case O_ETAG:
-          if (opt_len == 0) {
-            return COAP_ERR_SYNTAX;
-          }
-        case O_IF_MATCH:
-          if (opt_len > 8) {
-            return COAP_ERR_SYNTAX;
-          }
-          break;
-        // uint
-        case O_URI_PORT:
-        case O_CONTENT_FORMAT:
-        case O_ACCEPT:
-          if (opt_len > 2) {
-            return COAP_ERR_SYNTAX;
-          }
-          if (opt == 0) {
-            return COAP_ERR_SYNTAX;
-          }
-          break;
-        case O_OBSERVE:
-          if (opt_len > 3) {
-            return COAP_ERR_SYNTAX;
-          }
-          if (opt == 0) {
-            return COAP_ERR_SYNTAX;
-          }
-          break;
-        case O_MAX_AGE:
-        case O_SIZE1:
-          if (opt_len > 4) {
-            return COAP_ERR_SYNTAX;
-          }
-          if (opt == 0) {
-            return COAP_ERR_SYNTAX;
-          }
-          break;
-        // string
-        case O_URI_HOST:
-        case O_PROXY_SCHEME:
-          if (opt_len == 0 || opt_len > 255) {
-            return COAP_ERR_SYNTAX;
-          }
-          if (opt == 0) {
-            return COAP_ERR_SYNTAX;
-          }
-          break;
-        case O_LOCATION_PATH:
-        case O_URI_PATH:
-        case O_URI_QUERY:
-        case O_LOCATION_QUERY:
-          if (opt_len > 255) {
-            return COAP_ERR_SYNTAX;
-          }
-          break;
-        case O_PROXY_URI:
-          if (opt_len == 0 || opt_len > 1034) {
-            return COAP_ERR_SYNTAX;
-          }
-          if (opt == 0) {
-            return COAP_ERR_SYNTAX;
-          }
-          break;
-        default:
-          return COAP_ERR_SYNTAX;
+    if (COAP_MAXLEN_OPT < 65535 + 269 && opt_len > COAP_MAXLEN_OPT) {
+      return coap_stats_err_(p->stats, COAP_STATS_ERR_LIMIT, COAP_ERR_LIMIT);
+    }
+
+    // Validate the option. A delta of 0 repeats the previous option.
+    if (COAP_VALIDATE && sum_of_delta + opt <= 255) {
+      d = &opt_desc_[sum_of_delta + opt];
+      if (invalid_opt_(d, opt_len) ||
+          (opt == 0 && !(d->flags & COAP_OPT_REPEATABLE))) {
+        return coap_stats_opt_err_(p->stats, d, sum_of_delta + opt, opt_len);
       }
     }
     opt += sum_of_delta;
     sum_of_delta = opt;
-    if (p->on_opt) {
+    COAP_STATS_ADD(p->stats, opts[COAP_STATS_OPT(opt)], 1);
+    if (p->opts_len == COAP_MAXNUM_OPTS) {
+      // The message is still parsed for the callbacks; only the index of
+      // the options is incomplete.
+      p->opts_overflow = 1;
+    } else {
+      p->opts[p->opts_len].offset = p->cursor;
+      p->opts[p->opts_len].len = opt_len;
+      p->opts[p->opts_len].num = opt;
+      p->opts_len++;
+    }
+    if (opt < 64) {
+      p->opts_present |= (uint64_t)1 << opt;
+    }
+    if (cb && p->on_opt) {
       p->on_opt(p->cookie, opt, &p->buf[p->cursor], opt_len);
     }
     p->cursor += opt_len;
   }
-  p->executed = 1;
-  if (p->on_complete) {
+  p->payload = p->buf_len;
+  if (cb && p->on_complete) {
     p->on_complete(p->cookie);
   }
+  COAP_STATS_ADD(p->stats, parsed, 1);
+  COAP_STATS_ADD(p->stats, parsed_bytes, p->buf_len);
   return COAP_OK;
 }
 
-int coap_parser_get_type(const coap_parser_t* p, coap_type_t* res) {
-  if (p == NULL) {
-    return COAP_ERR_ARG;
+static int coap_p_exec_(coap_parser_t* p, const char* buf, size_t len,
+                        uint8_t cb) {
+  int rc = coap_p_header_(p, buf, len, cb);
+  if (rc) {
+    return rc;
   }
-  if (!p->executed) {
-    return COAP_ERR_INVALID_CALL;
+  rc = coap_p_opts_(p, cb);
+  if (rc) {
+    return rc;
   }
-  *res = p->type;
+  p->executed = 1;
+  p->finished = 1;
+  p->finish_status = COAP_OK;
   return COAP_OK;
 }
 
-int coap_parser_get_code(const coap_parser_t* p, coap_code_t* res) {
-  if (p == NULL) {
-    return COAP_ERR_ARG;
-  }
+/**
+ * Make sure that the options of the parsed message have been decoded. In
+ * lazy mode they are decoded on first use, so the parser is updated even
+ * through the const getters.
+ */
+static int coap_p_ready_(const coap_parser_t* p) {
   if (!p->executed) {
     return COAP_ERR_INVALID_CALL;
   }
-  *res = p->code;
-  return COAP_OK;
+  if (p->finished) {
+    return p->finish_status;
+  }
+  return coap_parser_finish((coap_parser_t*)p);
 }
 
-int coap_parser_get_mid(const coap_parser_t* p, uint16_t* res) {
-  if (p == NULL) {
+/**
+ * Like coap_p_ready_, for the getters that look options up in the index.
+ * COAP_ERR_LIMIT is returned if the message has more options than it holds.
+ */
+static int coap_p_index_(const coap_parser_t* p) {
+  int rc = coap_p_ready_(p);
+  if (rc) {
+    return rc;
+  }
+  return p->opts_overflow ? COAP_ERR_LIMIT : COAP_OK;
+}
+
+int coap_parser_exec(coap_parser_t* p, const char* buf, size_t len) {
+  if (p == NULL || buf == NULL || len == 0) {
     return COAP_ERR_ARG;
   }
-  if (!p->executed) {
-    return COAP_ERR_INVALID_CALL;
+  return coap_p_exec_(p, buf, len, 1);
+}
+
+int coap_parser_exec_lazy(coap_parser_t* p, const char* buf, size_t len) {
+  int rc;
+  if (p == NULL || buf == NULL || len == 0) {
+    return COAP_ERR_ARG;
   }
-  *res = p->mid;
+  rc = coap_p_header_(p, buf, len, 1);
+  if (rc) {
+    return rc;
+  }
+  p->executed = 1;
   return COAP_OK;
 }
 
-int coap_parser_get_token(const coap_parser_t* p, const char** res,
-                          uint8_t* len) {
+int coap_parser_finish(coap_parser_t* p) {
   if (p == NULL) {
     return COAP_ERR_ARG;
   }
   if (!p->executed) {
     return COAP_ERR_INVALID_CALL;
   }
-  *len = p->token_len;
-  if (p->token_len > 0) {
-    *res = &p->buf[4];
-  } else {
-    *res = NULL;
+  if (!p->finished) {
+    p->finish_status = coap_p_opts_(p, 1);
+    p->finished = 1;
   }
-  return COAP_OK;
+  return p->finish_status;
 }
 
-int coap_parser_get_path(const coap_parser_t* p, const char** res,
-                         size_t* len) {
-  if (p == NULL) {
+int coap_parser_exec_batch(coap_parser_t* p, const coap_datagram_t* msgs,
+                           size_t n, coap_batch_t* res) {
+  size_t i;
+  if (p == NULL || (n > 0 && (msgs == NULL || res == NULL))) {
     return COAP_ERR_ARG;
   }
-  if (!p->executed) {
-    return COAP_ERR_INVALID_CALL;
+  for (i = 0; i < n; i++) {
+    if (msgs[i].buf == NULL || msgs[i].len == 0) {
+      res->status[i] = COAP_ERR_ARG;
+      continue;
+    }
+    res->status[i] = coap_p_exec_(p, msgs[i].buf, msgs[i].len, 0);
+    if (res->status[i] != COAP_OK) {
+      continue;
+    }
+    res->type[i] = p->type;
+    res->code[i] = p->code;
+    res->mid[i] = p->mid;
+    res->token_offset[i] = COAP_LEN_HEADER;
+    res->token_len[i] = p->token_len;
+    res->payload_offset[i] = p->payload;
+    res->payload_len[i] = p->buf_len - p->payload;
   }
   return COAP_OK;
 }
 
-int coap_parser_get_payload(const coap_parser_t* p, const char** res,
-                            size_t* len) {
-  if (p == NULL) {
+int coap_reply_empty(const coap_parser_t* p, uint8_t type, char* dst,
+                     size_t dst_len, size_t* msg_len) {
+  uint32_t head;
+  if (p == NULL || dst == NULL || msg_len == NULL ||
+      (type != T_ACK && type != T_RST)) {
     return COAP_ERR_ARG;
   }
-  if (!p->executed) {
+  // Only the header is needed, so a lazily parsed message is enough.
+  if (!p->executed || p->type > T_NON || (type == T_ACK && p->type != T_CON)) {
     return COAP_ERR_INVALID_CALL;
   }
-  *res = &p->buf[p->payload];
+  if (dst_len < COAP_LEN_HEADER) {
+    return COAP_ERR_LIMIT;
+  }
+  head = htonl(COAP_VERSION | (uint32_t)type << 28 | p->mid);
+  memcpy(dst, &head, COAP_LEN_HEADER);
+  *msg_len = COAP_LEN_HEADER;
+  return COAP_OK;
+}
+
+int coap_reply_empty_batch(const coap_batch_t* res, size_t n, char* dst,
+                           size_t dst_len, size_t* idx, size_t* acked) {
+  uint32_t head;
+  size_t i, j = 0;
+  if ((n > 0 && res == NULL) || dst == NULL || acked == NULL) {
+    return COAP_ERR_ARG;
+  }
+  for (i = 0; i < n; i++) {
+    if (res->status[i] != COAP_OK || res->type[i] != T_CON) {
+      continue;
+    }
+    if (dst_len - j * COAP_LEN_HEADER < COAP_LEN_HEADER) {
+      *acked = j;
+      return COAP_ERR_LIMIT;
+    }
+    head = htonl(COAP_VERSION | (uint32_t)T_ACK << 28 | res->mid[i]);
+    memcpy(&dst[j * COAP_LEN_HEADER], &head, COAP_LEN_HEADER);
+    if (idx) {
+      idx[j] = i;
+    }
+    j++;
+  }
+  *acked = j;
+  return COAP_OK;
+}
+
+int coap_serializer_init_reply(coap_serializer_t* s, const coap_parser_t* p,
+                               uint8_t code, uint16_t mid) {
+  uint8_t type;
+  uint16_t nbo_mid;
+  int rc;
+  if (s == NULL || p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (!p->executed || p->type > T_NON || p->code == 0 || (p->code >> 5) != 0) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  // A CON request is answered by a piggybacked response in its ACK.
+  type = p->type == T_CON ? T_ACK : T_NON;
+  rc = coap_serializer_init(s, type, code, p->token_len);
+  if (rc) {
+    return rc;
+  }
+  nbo_mid = htons(type == T_ACK ? p->mid : mid);
+  memcpy(&s->buf[2], &nbo_mid, 2);
+  memcpy(&s->buf[COAP_LEN_HEADER], &p->buf[COAP_LEN_HEADER], p->token_len);
+  return COAP_OK;
+}
+
+int coap_serializer_exec_reply(coap_serializer_t* s, const char* payload,
+                               size_t payload_len, size_t* msg_len) {
+  uint16_t nbo_mid;
+  if (s == NULL) {
+    return COAP_ERR_ARG;
+  }
+  // The message id and the token are in place since init_reply.
+  memcpy(&nbo_mid, &s->buf[2], 2);
+  return coap_serializer_exec(s, ntohs(nbo_mid), NULL, payload, payload_len,
+                              msg_len);
+}
+
+int coap_stream_create(coap_stream_t** st, void* buf, size_t len,
+                       size_t max_opt_len, size_t max_len) {
+  if (st == NULL || buf == NULL || coap_stream_size(max_opt_len) > len) {
+    return COAP_ERR_ARG;
+  }
+  *st = (coap_stream_t*)buf;
+  memset(*st, 0, sizeof(coap_stream_t));
+  (*st)->max_len = max_len;
+  (*st)->max_opt_len = max_opt_len;
+  (*st)->scratch = (char*)buf + sizeof(coap_stream_t);
+  return COAP_OK;
+}
+
+int coap_stream_init(coap_stream_t* st, const coap_parser_settings_t* s) {
+  static const coap_parser_settings_t none = {0};
+  if (st == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (s == NULL) {
+    s = &none;
+  }
+  st->state = COAP_ST_LEN;
+  st->have = 0;
+  st->cookie = s->cookie;
+  st->on_begin = s->on_begin;
+  st->on_header = s->on_header;
+  st->on_opt = s->on_opt;
+  st->on_payload = s->on_payload;
+  st->on_complete = s->on_complete;
+  return COAP_OK;
+}
+
+/**
+ * Take the |need| bytes of the current field. The field is returned in
+ * place if it is whole in the chunk; otherwise it is gathered in |dst| and
+ * returned once complete. NULL means the chunk ran out.
+ */
+static const char* coap_st_take_(coap_stream_t* st, const char** buf,
+                                 size_t* len, char* dst) {
+  const char* field = *buf;
+  size_t n;
+  if (st->have == 0 && *len >= st->need) {
+    *buf += st->need;
+    *len -= st->need;
+    return field;
+  }
+  n = st->need - st->have;
+  n = n < *len ? n : *len;
+  memcpy(dst + st->have, *buf, n);
+  st->have += n;
+  *buf += n;
+  *len -= n;
+  if (st->have < st->need) {
+    return NULL;
+  }
+  st->have = 0;
+  return dst;
+}
+
+static uint32_t coap_st_uint_(const char* f, size_t len) {
+  uint32_t val = 0;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    val = val << 8 | (uint8_t)f[i];
+  }
+  return val;
+}
+
+/**
+ * Move on to the next option, or finish the frame if its body is consumed.
+ */
+static void coap_st_next_(coap_stream_t* st) {
+  if (st->body > 0) {
+    st->need = 1;
+    st->state = COAP_ST_OPT;
+    return;
+  }
+  st->state = COAP_ST_LEN;
+  COAP_STATS_ADD(st->stats, parsed, 1);
+  if (st->on_complete) {
+    st->on_complete(st->cookie);
+  }
+}
+
+static int coap_st_fail_(coap_stream_t* st, coap_stats_err_t reason,
+                         int rc) {
+  st->state = COAP_ST_FAILED;
+  return coap_stats_err_(st->stats, reason, rc);
+}
+
+int coap_stream_exec(coap_stream_t* st, const char* buf, size_t len) {
+  static const uint32_t base[16] = {0, 0, 0, 0, 0, 0, 0,  0,
+                                    0, 0, 0, 0, 0, 13, 269, 65805};
+  static const uint8_t ext[16] = {0, 0, 0, 0, 0, 0, 0, 0,
+                                  0, 0, 0, 0, 0, 1, 2,  4};
+  const coap_opt_desc_t* d;
+  const char* f;
+  uint32_t delta, opt_len;
+  uint64_t body;
+  size_t n;
+  uint8_t b;
+  if (st == NULL || (buf == NULL && len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  if (st->state != COAP_ST_FAILED) {
+    COAP_STATS_ADD(st->stats, parsed_bytes, len);
+  }
+  for (;;) {
+    switch (st->state) {
+      case COAP_ST_LEN:
+        if (len == 0) {
+          return COAP_OK;
+        }
+        b = (uint8_t)*buf++;
+        len--;
+        st->token_len = b & 0x0F;
+        if (st->token_len > COAP_MAXLEN_TOKEN) {
+          return coap_st_fail_(st, COAP_STATS_ERR_TOKEN, COAP_ERR_SYNTAX);
+        }
+        st->body = b >> 4;
+        st->need = ext[b >> 4];
+        if (st->on_begin) {
+          st->on_begin(st->cookie);
+        }
+        st->state = COAP_ST_EXT_LEN;
+        // fall through
+      case COAP_ST_EXT_LEN:
+        if ((f = coap_st_take_(st, &buf, &len, st->hdr)) == NULL) {
+          return COAP_OK;
+        }
+        if (st->need > 0) {
+          body = (uint64_t)coap_st_uint_(f, st->need) + base[st->body];
+          if (body > st->max_len) {
+            return coap_st_fail_(st, COAP_STATS_ERR_LIMIT, COAP_ERR_LIMIT);
+          }
+          st->body = (size_t)body;
+        } else if (st->body > st->max_len) {
+          return coap_st_fail_(st, COAP_STATS_ERR_LIMIT, COAP_ERR_LIMIT);
+        }
+        st->need = 1 + st->token_len;
+        st->state = COAP_ST_CODE;
+        // fall through
+      case COAP_ST_CODE:
+        if ((f = coap_st_take_(st, &buf, &len, st->hdr)) == NULL) {
+          return COAP_OK;
+        }
+        st->code = (uint8_t)f[0];
+        if (COAP_VALIDATE && validate_framed_code_(st->code)) {
+          return coap_st_fail_(st, COAP_STATS_ERR_TYPE_CODE, COAP_ERR_SYNTAX);
+        }
+        if (st->on_header) {
+          st->on_header(st->cookie, T_CON, (coap_code_t)st->code, 0, &f[1],
+                        st->token_len);
+        }
+        st->opt = 0;
+        coap_st_next_(st);
+        break;
+      case COAP_ST_OPT:
+        if (len == 0) {
+          return COAP_OK;
+        }
+        b = (uint8_t)*buf++;
+        len--;
+        st->body--;
+        if (b == 0xFF) {
+          // A payload marker followed by a zero-length payload is a message
+          // format error.
+          if (st->body == 0) {
+            return coap_st_fail_(st, COAP_STATS_ERR_PAYLOAD_MARKER,
+                                 COAP_ERR_SYNTAX);
+          }
+          st->state = COAP_ST_PAYLOAD;
+          break;
+        }
+        if ((b >> 4) == 15) {
+          return coap_st_fail_(st, COAP_STATS_ERR_OPT_DELTA, COAP_ERR_SYNTAX);
+        }
+        if ((b & 0x0F) == 15) {
+          return coap_st_fail_(st, COAP_STATS_ERR_OPT_LENGTH, COAP_ERR_SYNTAX);
+        }
+        st->hdr[0] = (char)b;
+        st->need = ext[b >> 4] + ext[b & 0x0F];
+        if (st->need > st->body) {
+          return coap_st_fail_(st, COAP_STATS_ERR_TRUNCATED, COAP_ERR_SYNTAX);
+        }
+        st->state = COAP_ST_OPT_EXT;
+        // fall through
+      case COAP_ST_OPT_EXT:
+        if ((f = coap_st_take_(st, &buf, &len, &st->hdr[1])) == NULL) {
+          return COAP_OK;
+        }
+        st->body -= st->need;
+        b = (uint8_t)st->hdr[0];
+        delta = b >> 4;
+        if (ext[delta]) {
+          delta = coap_st_uint_(f, ext[delta]) + base[delta];
+          f += ext[b >> 4];
+        }
+        opt_len = b & 0x0F;
+        if (ext[opt_len]) {
+          opt_len = coap_st_uint_(f, ext[opt_len]) + base[opt_len];
+        }
+        if (st->opt + delta > 65535) {
+          return coap_st_fail_(st, COAP_STATS_ERR_OPT_DELTA, COAP_ERR_SYNTAX);
+        }
+        if (opt_len > st->body) {
+          return coap_st_fail_(st, COAP_STATS_ERR_TRUNCATED, COAP_ERR_SYNTAX);
+        }
+
+        if (COAP_MAXLEN_OPT < 65535 + 269 && opt_len > COAP_MAXLEN_OPT) {
+          return coap_st_fail_(st, COAP_STATS_ERR_LIMIT, COAP_ERR_LIMIT);
+        }
+
+        // Validate the option. Signals number their options on their own.
+        if (COAP_VALIDATE && st->opt + delta <= 255 && (st->code >> 5) != 7) {
+          d = &opt_desc_[st->opt + delta];
+          if (invalid_opt_(d, opt_len) ||
+              (delta == 0 && !(d->flags & COAP_OPT_REPEATABLE))) {
+            st->state = COAP_ST_FAILED;
+            return coap_stats_opt_err_(st->stats, d, st->opt + delta,
+                                       opt_len);
+          }
+        }
+        st->opt += delta;
+        COAP_STATS_ADD(st->stats, opts[COAP_STATS_OPT(st->opt)], 1);
+        st->need = opt_len;
+        st->state = COAP_ST_OPT_VAL;
+        // fall through
+      case COAP_ST_OPT_VAL:
+        if (st->have == 0 && len < st->need) {
+          if (len == 0) {
+            return COAP_OK;
+          }
+          if (st->need > st->max_opt_len) {
+            return coap_st_fail_(st, COAP_STATS_ERR_LIMIT, COAP_ERR_LIMIT);
+          }
+        }
+        if ((f = coap_st_take_(st, &buf, &len, st->scratch)) == NULL) {
+          return COAP_OK;
+        }
+        st->body -= st->need;
+        if (st->on_opt) {
+          st->on_opt(st->cookie, (uint16_t)st->opt, f, (uint16_t)st->need);
+        }
+        coap_st_next_(st);
+        break;
+      case COAP_ST_PAYLOAD:
+        if (len == 0) {
+          return COAP_OK;
+        }
+        n = st->body < len ? st->body : len;
+        if (st->on_payload) {
+          st->on_payload(st->cookie, buf, n);
+        }
+        buf += n;
+        len -= n;
+        st->body -= n;
+        if (st->body == 0) {
+          coap_st_next_(st);
+        }
+        break;
+      default:
+        return COAP_ERR_INVALID_CALL;
+    }
+  }
+}
+
+int coap_stream_is_idle(const coap_stream_t* st) {
+  return st != NULL && st->state == COAP_ST_LEN;
+}
+
+int coap_stream_set_stats(coap_stream_t* st, coap_stats_t* stats) {
+  if (st == NULL) {
+    return COAP_ERR_ARG;
+  }
+  st->stats = stats;
+  return COAP_OK;
+}
+
+int coap_stats_add(coap_stats_t* dst, const coap_stats_t* src) {
+  const uint64_t* from = (const uint64_t*)src;
+  uint64_t* to = (uint64_t*)dst;
+  size_t i;
+  if (dst == NULL || src == NULL) {
+    return COAP_ERR_ARG;
+  }
+  for (i = 0; i < sizeof(coap_stats_t) / sizeof(uint64_t); i++) {
+    to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+  }
+  return COAP_OK;
+}
+
+int coap_parser_get_type(const coap_parser_t* p, coap_type_t* res) {
+  if (p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (!p->executed) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  *res = (coap_type_t)p->type;
+  return COAP_OK;
+}
+
+int coap_parser_get_code(const coap_parser_t* p, coap_code_t* res) {
+  if (p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (!p->executed) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  *res = (coap_code_t)p->code;
+  return COAP_OK;
+}
+
+int coap_parser_get_mid(const coap_parser_t* p, uint16_t* res) {
+  if (p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (!p->executed) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  *res = p->mid;
+  return COAP_OK;
+}
+
+int coap_parser_get_token(const coap_parser_t* p, const char** res,
+                          uint8_t* len) {
+  if (p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (!p->executed) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  *len = p->token_len;
+  if (p->token_len > 0) {
+    *res = &p->buf[4];
+  } else {
+    *res = NULL;
+  }
+  return COAP_OK;
+}
+
+int coap_parser_has_opt(const coap_parser_t* p, uint16_t opt) {
+  size_t i;
+  int rc;
+  if (p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_p_index_(p);
+  if (rc) {
+    return rc;
+  }
+  if (opt < 64) {
+    return (p->opts_present >> opt) & 1;
+  }
+  for (i = 0; i < p->opts_len; i++) {
+    if (p->opts[i].num == opt) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int coap_parser_get_opt(const coap_parser_t* p, uint16_t opt,
+                        const char** val, size_t* len) {
+  size_t it = 0;
+  return coap_parser_next_opt(p, opt, &it, val, len);
+}
+
+int coap_parser_next_opt(const coap_parser_t* p, uint16_t opt, size_t* it,
+                         const char** val, size_t* len) {
+  size_t i;
+  int rc;
+  if (p == NULL || it == NULL || val == NULL || len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_p_index_(p);
+  if (rc) {
+    return rc;
+  }
+  if (opt < 64 && !((p->opts_present >> opt) & 1)) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  // Options are recorded in ascending order of their numbers.
+  for (i = *it; i < p->opts_len && p->opts[i].num <= opt; i++) {
+    if (p->opts[i].num == opt) {
+      *val = &p->buf[p->opts[i].offset];
+      *len = p->opts[i].len;
+      *it = i + 1;
+      return COAP_OK;
+    }
+  }
+  *it = p->opts_len;
+  return COAP_ERR_NOT_FOUND;
+}
+
+int coap_parser_get_opt_at(const coap_parser_t* p, size_t i, uint16_t* opt,
+                           const char** val, size_t* len) {
+  int rc;
+  if (p == NULL || opt == NULL || val == NULL || len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_p_index_(p);
+  if (rc) {
+    return rc;
+  }
+  if (i >= p->opts_len) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  *opt = p->opts[i].num;
+  *val = &p->buf[p->opts[i].offset];
+  *len = p->opts[i].len;
+  return COAP_OK;
+}
+
+int coap_parser_get_path(const coap_parser_t* p, size_t* it, const char** res,
+                         size_t* len) {
+  return coap_parser_next_opt(p, O_URI_PATH, it, res, len);
+}
+
+int coap_parser_get_payload(const coap_parser_t* p, const char** res,
+                            size_t* len) {
+  int rc;
+  if (p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_p_ready_(p);
+  if (rc) {
+    return rc;
+  }
+  *res = &p->buf[p->payload];
   *len = p->buf_len - p->payload;
   return COAP_OK;
 }
 
+static int block_from_uint_(uint32_t v, coap_block_t* b) {
+  if ((v & 0x07) == 7) {
+    // SZX 7 is reserved.
+    return COAP_ERR_SYNTAX;
+  }
+  b->num = v >> 4;
+  b->more = (v >> 3) & 1;
+  b->szx = v & 0x07;
+  return COAP_OK;
+}
+
+int coap_block_decode(const char* val, size_t len, coap_block_t* b) {
+  uint32_t v = 0;
+  size_t i;
+  if ((val == NULL && len > 0) || b == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (len > 3) {
+    return COAP_ERR_SYNTAX;
+  }
+  for (i = 0; i < len; i++) {
+    v = (v << 8) | (uint8_t)val[i];
+  }
+  return block_from_uint_(v, b);
+}
+
+int coap_block_encode(const coap_block_t* b, uint32_t* val) {
+  if (b == NULL || val == NULL || b->num > 0xFFFFF || b->szx > 6) {
+    return COAP_ERR_ARG;
+  }
+  *val = b->num << 4 | (b->more ? 0x08 : 0) | b->szx;
+  return COAP_OK;
+}
+
+int coap_parser_get_block(const coap_parser_t* p, uint16_t opt,
+                          coap_block_t* b) {
+  const char* val;
+  size_t len;
+  int rc;
+  if (opt != O_BLOCK1 && opt != O_BLOCK2) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_parser_get_opt(p, opt, &val, &len);
+  if (rc) {
+    return rc;
+  }
+  return coap_block_decode(val, len, b);
+}
+
+/**
+ * Load a uint option value of up to 4 bytes without branching on its
+ * length: the 4 bytes ending with the value are loaded and masked. They are
+ * always inside a parsed message, as the 4 byte header and the option header
+ * precede every value. The callers reject values longer than 4 bytes.
+ */
+static uint32_t load_uint_(const char* val, size_t len) {
+  uint32_t nbo;
+  size_t n = len < 4 ? len : 4;
+  memcpy(&nbo, val + n - 4, 4);
+  return ntohl(nbo) & (uint32_t)((1ULL << (n * 8)) - 1);
+}
+
+int coap_parser_get_opt_uint(const coap_parser_t* p, uint16_t opt,
+                             uint32_t* res) {
+  const char* val;
+  size_t len;
+  int rc;
+  if (res == NULL || (COAP_VALIDATE && !is_uint_opt_(opt))) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_parser_get_opt(p, opt, &val, &len);
+  if (rc) {
+    return rc;
+  }
+  if (len > 4) {
+    return COAP_ERR_SYNTAX;
+  }
+  *res = load_uint_(val, len);
+  return COAP_OK;
+}
+
+int coap_parser_get_max_age(const coap_parser_t* p, uint32_t* res) {
+  int rc = coap_parser_get_opt_uint(p, O_MAX_AGE, res);
+  if (rc == COAP_ERR_NOT_FOUND) {
+    *res = COAP_DEFAULT_MAX_AGE;
+    return COAP_OK;
+  }
+  return rc;
+}
+
+int coap_parser_get_content_format(const coap_parser_t* p, uint16_t* res) {
+  uint32_t v;
+  int rc;
+  if (res == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_parser_get_opt_uint(p, O_CONTENT_FORMAT, &v);
+  if (rc) {
+    return rc;
+  }
+  if (v > 0xFFFF) {
+    return COAP_ERR_SYNTAX;
+  }
+  *res = (uint16_t)v;
+  return COAP_OK;
+}
+
+/**
+ * Slots of the uint options in coap_parser_get_uint_opts, plus one. Options
+ * 0 (reserved) and those with other formats have none.
+ */
+enum {
+  COAP_UINT_OBSERVE = 0,
+  COAP_UINT_URI_PORT,
+  COAP_UINT_CONTENT_FORMAT,
+  COAP_UINT_MAX_AGE,
+  COAP_UINT_ACCEPT,
+  COAP_UINT_BLOCK2,
+  COAP_UINT_BLOCK1,
+  COAP_UINT_SIZE2,
+  COAP_UINT_SIZE1,
+  COAP_UINT_MAX,
+};
+
+static const uint8_t uint_slot_[64] = {
+  0, 0, 0, 0, 0, 0,                                  // 0-5
+  COAP_UINT_OBSERVE + 1, COAP_UINT_URI_PORT + 1,     // 6-7
+  0, 0, 0, 0,                                        // 8-11
+  COAP_UINT_CONTENT_FORMAT + 1, 0,                   // 12-13
+  COAP_UINT_MAX_AGE + 1, 0, 0,                       // 14-16
+  COAP_UINT_ACCEPT + 1, 0, 0, 0, 0, 0,               // 17-22
+  COAP_UINT_BLOCK2 + 1, 0, 0, 0,                     // 23-26
+  COAP_UINT_BLOCK1 + 1, COAP_UINT_SIZE2 + 1,         // 27-28
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,    // 29-44
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,       // 45-59
+  COAP_UINT_SIZE1 + 1, 0, 0, 0,                      // 60-63
+};
+
+int coap_parser_get_uint_opts(const coap_parser_t* p, coap_uint_opts_t* res) {
+  // Slot 0 takes the other options, the rest are indexed by slot + 1.
+  uint32_t v[COAP_UINT_MAX + 1] = {0};
+  const coap_opt_ref_t* o;
+  size_t too_long = 0;
+  size_t i;
+  int rc;
+  if (p == NULL || res == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_p_index_(p);
+  if (rc) {
+    return rc;
+  }
+  v[COAP_UINT_CONTENT_FORMAT + 1] = COAP_FORMAT_NONE;
+  v[COAP_UINT_MAX_AGE + 1] = COAP_DEFAULT_MAX_AGE;
+  v[COAP_UINT_ACCEPT + 1] = COAP_FORMAT_NONE;
+  // Options are sorted, so all of the uint ones come before number 64.
+  for (i = 0; i < p->opts_len && p->opts[i].num < 64; i++) {
+    o = &p->opts[i];
+    too_long |= uint_slot_[o->num] && o->len > 4;
+    v[uint_slot_[o->num]] = load_uint_(&p->buf[o->offset], o->len);
+  }
+  if (too_long) {
+    return COAP_ERR_SYNTAX;
+  }
+  res->present = p->opts_present;
+  res->observe = v[COAP_UINT_OBSERVE + 1];
+  res->uri_port = v[COAP_UINT_URI_PORT + 1];
+  res->content_format = v[COAP_UINT_CONTENT_FORMAT + 1];
+  res->max_age = v[COAP_UINT_MAX_AGE + 1];
+  res->accept = v[COAP_UINT_ACCEPT + 1];
+  res->size2 = v[COAP_UINT_SIZE2 + 1];
+  res->size1 = v[COAP_UINT_SIZE1 + 1];
+  memset(&res->block2, 0, sizeof(res->block2));
+  memset(&res->block1, 0, sizeof(res->block1));
+  if (((p->opts_present >> O_BLOCK2) & 1) &&
+      block_from_uint_(v[COAP_UINT_BLOCK2 + 1], &res->block2)) {
+    return COAP_ERR_SYNTAX;
+  }
+  if (((p->opts_present >> O_BLOCK1) & 1) &&
+      block_from_uint_(v[COAP_UINT_BLOCK1 + 1], &res->block1)) {
+    return COAP_ERR_SYNTAX;
+  }
+  return COAP_OK;
+}
+
+/**
+ * Editor of a parsed message. The options of the parsed message that are
+ * kept are copied as raw runs, whose first option is re-encoded only if the
+ * option before it changed; added options are staged like in coap_builder_t
+ * and merged in by the embedded serializer.
+ */
+struct coap_editor_t {
+  coap_serializer_t s;
+  const coap_parser_t* p;
+  uint8_t type;
+  uint8_t code;
+  uint16_t mid;
+  uint8_t token_len;
+  const char* token;
+  const char* payload;
+  size_t payload_len;
+  uint16_t adds_len;
+  uint8_t removed[COAP_MAXNUM_OPTS];
+  coap_builder_opt_t adds[COAP_MAXNUM_OPTS];
+};
+
+int coap_editor_create(coap_editor_t** e, void* buf, size_t len,
+                       char* dst_buf, size_t dst_len) {
+  coap_serializer_t* s = NULL;
+  if (buf == NULL || sizeof(coap_editor_t) > len) {
+    return COAP_ERR_ARG;
+  }
+  *e = (coap_editor_t*)buf;
+  memset(*e, 0, sizeof(coap_editor_t));
+  return coap_serializer_create(&s, &(*e)->s, sizeof(coap_serializer_t),
+                                dst_buf, dst_len);
+}
+
+int coap_editor_init(coap_editor_t* e, const coap_parser_t* p) {
+  int rc;
+  if (e == NULL || p == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_p_index_(p);
+  if (rc) {
+    return rc;
+  }
+  e->p = p;
+  e->type = p->type;
+  e->code = p->code;
+  e->mid = p->mid;
+  e->token_len = p->token_len;
+  e->token = &p->buf[COAP_LEN_HEADER];
+  e->payload = &p->buf[p->payload];
+  e->payload_len = p->buf_len - p->payload;
+  e->adds_len = 0;
+  memset(e->removed, 0, p->opts_len);
+  return COAP_OK;
+}
+
+int coap_editor_set_header(coap_editor_t* e, uint8_t type, uint8_t code,
+                           uint16_t mid) {
+  if (e == NULL || (COAP_VALIDATE && validate_type_code_(type, code))) {
+    return COAP_ERR_ARG;
+  }
+  if (e->p == NULL) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  e->type = type;
+  e->code = code;
+  e->mid = mid;
+  return COAP_OK;
+}
+
+int coap_editor_set_token(coap_editor_t* e, const char* token,
+                          uint8_t token_len) {
+  if (e == NULL || (token == NULL && token_len > 0) ||
+      token_len > COAP_MAXLEN_TOKEN) {
+    return COAP_ERR_ARG;
+  }
+  if (e->p == NULL) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  e->token = token;
+  e->token_len = token_len;
+  return COAP_OK;
+}
+
+int coap_editor_set_payload(coap_editor_t* e, const char* payload,
+                            size_t payload_len) {
+  if (e == NULL || (payload == NULL && payload_len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  if (e->p == NULL) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  e->payload = payload;
+  e->payload_len = payload_len;
+  return COAP_OK;
+}
+
+int coap_editor_remove_opt(coap_editor_t* e, uint16_t opt) {
+  const coap_parser_t* p;
+  size_t i;
+  int rc = COAP_ERR_NOT_FOUND;
+  if (e == NULL) {
+    return COAP_ERR_ARG;
+  }
+  p = e->p;
+  if (p == NULL) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  if (opt < 64 && !((p->opts_present >> opt) & 1)) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  for (i = 0; i < p->opts_len && p->opts[i].num <= opt; i++) {
+    if (p->opts[i].num == opt) {
+      e->removed[i] = 1;
+      rc = COAP_OK;
+    }
+  }
+  return rc;
+}
+
+/**
+ * Stage an added option in order and return it. Repeated options stay in the
+ * order they were added.
+ */
+static coap_builder_opt_t* coap_e_add_(coap_editor_t* e, uint16_t opt) {
+  size_t i;
+  for (i = e->adds_len; i > 0 && e->adds[i - 1].num > opt; i--) {
+    e->adds[i] = e->adds[i - 1];
+  }
+  e->adds_len++;
+  e->adds[i].num = opt;
+  return &e->adds[i];
+}
+
+int coap_editor_add_opt(coap_editor_t* e, uint16_t opt, const char* val,
+                        size_t len) {
+  coap_builder_opt_t* a;
+  if (e == NULL || (val == NULL && len > 0) || len > COAP_MAXLEN_OPT) {
+    return COAP_ERR_ARG;
+  }
+  if (COAP_VALIDATE && opt <= 255 && invalid_opt_(&opt_desc_[opt], len)) {
+    return COAP_ERR_ARG;
+  }
+  if (e->p == NULL) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  if (e->adds_len == COAP_MAXNUM_OPTS) {
+    return COAP_ERR_LIMIT;
+  }
+  a = coap_e_add_(e, opt);
+  a->val = val;
+  a->len = len;
+  return COAP_OK;
+}
+
+int coap_editor_add_opt_uint(coap_editor_t* e, uint16_t opt, uint32_t val) {
+  coap_builder_opt_t* a;
+  char enc[4];
+  size_t len;
+  if (e == NULL || (COAP_VALIDATE && !is_uint_opt_(opt))) {
+    return COAP_ERR_ARG;
+  }
+  len = encode_uint_(val, enc);
+  if (COAP_VALIDATE && opt <= 255 && invalid_opt_(&opt_desc_[opt], len)) {
+    return COAP_ERR_ARG;
+  }
+  if (e->p == NULL) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  if (e->adds_len == COAP_MAXNUM_OPTS) {
+    return COAP_ERR_LIMIT;
+  }
+  // The value is kept inline so that the caller does not have to keep it.
+  a = coap_e_add_(e, opt);
+  memcpy(a->uint_val, enc, len);
+  a->val = NULL;
+  a->len = len;
+  return COAP_OK;
+}
+
+int coap_editor_exec(coap_editor_t* e, size_t* msg_len) {
+  const coap_parser_t* p;
+  const coap_opt_ref_t* o;
+  const coap_builder_opt_t* a;
+  coap_serializer_t* s;
+  size_t begin, end;
+  size_t i, j, k;
+  int rc;
+  if (e == NULL || msg_len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  p = e->p;
+  s = &e->s;
+  if (p == NULL) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  rc = coap_s_init_(s, e->type, e->code, e->token_len);
+  if (rc) {
+    return rc;
+  }
+  i = 0;
+  j = 0;
+  while (i < p->opts_len || j < e->adds_len) {
+    // Added options go after the parsed ones with the same number.
+    if (j < e->adds_len &&
+        (i == p->opts_len || e->adds[j].num < p->opts[i].num)) {
+      a = &e->adds[j++];
+      rc = coap_serializer_add_opt(s, a->num, a->val ? a->val : a->uint_val,
+                                   a->len);
+      if (rc) {
+        return rc;
+      }
+      continue;
+    }
+    if (e->removed[i]) {
+      i++;
+      continue;
+    }
+    // The run of kept options up to the next removed or added one.
+    for (k = i + 1; k < p->opts_len && !e->removed[k] &&
+                    (j == e->adds_len || e->adds[j].num >= p->opts[k].num);
+         k++) {
+    }
+    o = &p->opts[i];
+    if (i > 0 && s->sum_of_delta == p->opts[i - 1].num) {
+      begin = p->opts[i - 1].offset + p->opts[i - 1].len;
+    } else if (i == 0 && s->sum_of_delta == 0) {
+      begin = COAP_LEN_HEADER + p->token_len;
+    } else {
+      rc = coap_serializer_add_opt(s, o->num, &p->buf[o->offset], o->len);
+      if (rc) {
+        return rc;
+      }
+      begin = o->offset + o->len;
+      i++;
+    }
+    if (i < k) {
+      end = p->opts[k - 1].offset + p->opts[k - 1].len;
+      if (coap_s_write_(s, &p->buf[begin], end - begin)) {
+        return COAP_ERR_LIMIT;
+      }
+      s->sum_of_delta = p->opts[k - 1].num;
+    }
+    i = k;
+  }
+  return coap_serializer_exec(s, e->mid, e->token, e->payload,
+                              e->payload_len, msg_len);
+}
+
+/**
+ * An entry of the deduplication table.
+ */
+typedef struct coap_dedup_entry_t {
+  uint32_t expires;
+  uint32_t hash;
+  uint32_t res;
+  uint16_t res_len;
+  uint16_t mid;
+  uint8_t used;
+  uint8_t ep_len;
+  uint8_t ep[COAP_MAXLEN_ENDPOINT];
+} coap_dedup_entry_t;
+
+/**
+ * Message deduplication table. |entries| is an open-addressing hash table
+ * with linear probing and twice as many slots as |capacity|. Stored
+ * responses live in |responses|, |capacity| buffers of |res_size| bytes
+ * each, whose free buffers are chained through |res_free|.
+ */
+struct coap_dedup_t {
+  size_t capacity;
+  size_t count;
+  uint32_t mask;
+  uint32_t sweep;
+  size_t res_size;
+  uint32_t res_head;
+  coap_dedup_entry_t* entries;
+  char* responses;
+  uint32_t* res_free;
+};
+
+static uint32_t coap_hash_(const void* key, size_t len, uint32_t h) {
+  const uint8_t* k = (const uint8_t*)key;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ k[i]) * 16777619;
+  }
+  return h;
+}
+
+static int coap_expired_(uint32_t expires, uint32_t now) {
+  return (int32_t)(expires - now) <= 0;
+}
+
+static uint32_t coap_pow2_(size_t n) {
+  uint32_t r = 1;
+  while (r < n) {
+    r <<= 1;
+  }
+  return r;
+}
+
+uint32_t coap_clock_ms() {
+  struct timespec ts;
+#if defined(CLOCK_MONOTONIC_COARSE)
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+  return (uint32_t)ts.tv_sec * 1000 + (uint32_t)(ts.tv_nsec / 1000000);
+}
+
+size_t coap_dedup_size(size_t capacity, size_t max_response_len) {
+  // Without responses there are no response buffers to chain.
+  return sizeof(coap_dedup_t) +
+         coap_pow2_(capacity * 2) * sizeof(coap_dedup_entry_t) +
+         (max_response_len > 0
+            ? capacity * (max_response_len + sizeof(uint32_t))
+            : 0);
+}
+
+int coap_dedup_create(coap_dedup_t** d, void* buf, size_t len,
+                      size_t capacity, size_t max_response_len) {
+  size_t slots;
+  size_t i;
+  if (d == NULL || buf == NULL || capacity == 0 || capacity > 0x40000000 ||
+      max_response_len > 65535 ||
+      coap_dedup_size(capacity, max_response_len) > len) {
+    return COAP_ERR_ARG;
+  }
+  slots = coap_pow2_(capacity * 2);
+  *d = (coap_dedup_t*)buf;
+  memset(*d, 0, sizeof(coap_dedup_t));
+  (*d)->capacity = capacity;
+  (*d)->mask = slots - 1;
+  (*d)->res_size = max_response_len;
+  (*d)->entries = (coap_dedup_entry_t*)((char*)buf + sizeof(coap_dedup_t));
+  memset((*d)->entries, 0, slots * sizeof(coap_dedup_entry_t));
+  (*d)->res_head = COAP_NONE;
+  if (max_response_len == 0) {
+    return COAP_OK;
+  }
+  (*d)->res_free = (uint32_t*)&(*d)->entries[slots];
+  (*d)->responses = (char*)&(*d)->res_free[capacity];
+  for (i = 0; i < capacity; i++) {
+    (*d)->res_free[i] = i + 1 < capacity ? i + 1 : COAP_NONE;
+  }
+  (*d)->res_head = 0;
+  return COAP_OK;
+}
+
+/**
+ * Remove the entry at |i| and shift the following entries of the probe
+ * sequence back so that no tombstones are needed.
+ */
+static void coap_dedup_remove_(coap_dedup_t* d, uint32_t i) {
+  uint32_t j = i;
+  uint32_t k;
+  if (d->entries[i].res != COAP_NONE) {
+    d->res_free[d->entries[i].res] = d->res_head;
+    d->res_head = d->entries[i].res;
+  }
+  for (;;) {
+    j = (j + 1) & d->mask;
+    if (!d->entries[j].used) {
+      break;
+    }
+    k = d->entries[j].hash & d->mask;
+    // Keep the entry at j if its home slot lies cyclically in (i, j].
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    d->entries[i] = d->entries[j];
+    i = j;
+  }
+  d->entries[i].used = 0;
+  d->count--;
+}
+
+/**
+ * Find the entry for a key, removing expired entries on the way. Returns the
+ * slot of the entry or, if there is none, of the empty slot that ends the
+ * probe sequence.
+ */
+static uint32_t coap_dedup_find_(coap_dedup_t* d, const void* ep,
+                                 size_t ep_len, uint16_t mid, uint32_t hash,
+                                 uint32_t now, int* found) {
+  uint32_t i = hash & d->mask;
+  coap_dedup_entry_t* e;
+  // Sweep one more slot per lookup so that idle entries are reclaimed too.
+  d->sweep = (d->sweep + 1) & d->mask;
+  if (d->entries[d->sweep].used &&
+      coap_expired_(d->entries[d->sweep].expires, now)) {
+    coap_dedup_remove_(d, d->sweep);
+  }
+  for (;;) {
+    e = &d->entries[i];
+    if (!e->used) {
+      *found = 0;
+      return i;
+    }
+    if (coap_expired_(e->expires, now)) {
+      coap_dedup_remove_(d, i);
+      continue;
+    }
+    if (e->hash == hash && e->mid == mid && e->ep_len == ep_len &&
+        memcmp(e->ep, ep, ep_len) == 0) {
+      *found = 1;
+      return i;
+    }
+    i = (i + 1) & d->mask;
+  }
+}
+
+int coap_dedup_check(coap_dedup_t* d, const void* ep, size_t ep_len,
+                     uint16_t mid, uint32_t now, const char** res,
+                     size_t* res_len) {
+  coap_dedup_entry_t* e;
+  uint32_t hash;
+  uint32_t i;
+  int found;
+  if (d == NULL || ep == NULL || ep_len > COAP_MAXLEN_ENDPOINT ||
+      res == NULL || res_len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  hash = coap_hash_(&mid, sizeof(mid), coap_hash_(ep, ep_len, 2166136261u));
+  i = coap_dedup_find_(d, ep, ep_len, mid, hash, now, &found);
+  e = &d->entries[i];
+  if (found) {
+    *res = e->res != COAP_NONE ? &d->responses[e->res * d->res_size] : NULL;
+    *res_len = e->res_len;
+    return COAP_ERR_DUPLICATE;
+  }
+  if (d->count == d->capacity) {
+    // Reclaim every expired entry before giving up.
+    for (i = 0; i <= d->mask; i++) {
+      while (d->entries[i].used && coap_expired_(d->entries[i].expires, now)) {
+        coap_dedup_remove_(d, i);
+      }
+    }
+    if (d->count == d->capacity) {
+      return COAP_ERR_LIMIT;
+    }
+    i = coap_dedup_find_(d, ep, ep_len, mid, hash, now, &found);
+    e = &d->entries[i];
+  }
+  e->expires = now + COAP_EXCHANGE_LIFETIME;
+  e->hash = hash;
+  e->res = COAP_NONE;
+  e->res_len = 0;
+  e->mid = mid;
+  e->used = 1;
+  e->ep_len = ep_len;
+  memcpy(e->ep, ep, ep_len);
+  d->count++;
+  *res = NULL;
+  *res_len = 0;
+  return COAP_OK;
+}
+
+int coap_dedup_set_response(coap_dedup_t* d, const void* ep, size_t ep_len,
+                            uint16_t mid, uint32_t now, const char* msg,
+                            size_t len) {
+  coap_dedup_entry_t* e;
+  uint32_t hash;
+  uint32_t i;
+  int found;
+  if (d == NULL || ep == NULL || ep_len > COAP_MAXLEN_ENDPOINT ||
+      (msg == NULL && len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  // A table created without response buffers stores no responses.
+  if (d->res_size == 0 || len > d->res_size) {
+    return COAP_ERR_LIMIT;
+  }
+  hash = coap_hash_(&mid, sizeof(mid), coap_hash_(ep, ep_len, 2166136261u));
+  i = coap_dedup_find_(d, ep, ep_len, mid, hash, now, &found);
+  if (!found) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  e = &d->entries[i];
+  if (e->res == COAP_NONE) {
+    // There is one response buffer per entry, so this can not run out.
+    if (d->res_head == COAP_NONE) {
+      return COAP_ERR_LIMIT;
+    }
+    e->res = d->res_head;
+    d->res_head = d->res_free[e->res];
+  }
+  memcpy(&d->responses[e->res * d->res_size], msg, len);
+  e->res_len = len;
+  return COAP_OK;
+}
+
+/**
+ * NoCacheKey options (RFC 7252 section 5.4.6) are left out of the cache key.
+ */
+#define COAP_NO_CACHE_KEY(opt) (((opt) & 0x1e) == 0x1c)
+
+/**
+ * Longest freshness in seconds a coap_cache_t keeps, so that the expiry
+ * time stays comparable on the wrapping millisecond clock.
+ */
+#define COAP_CACHE_MAX_AGE (0x7FFFFFFF / 1000)
+
+/**
+ * An entry of the response cache. Its slab slot holds the cache key,
+ * followed by the response serialized without a token and with a 4-byte
+ * Max-Age at |max_age_at| that is patched on every hit.
+ */
+typedef struct coap_cache_entry_t {
+  uint32_t expires;
+  uint32_t hash;
+  uint16_t key_len;
+  uint16_t res_len;
+  uint16_t max_age_at;
+  uint16_t etag_at;
+  uint8_t etag_len;
+  uint8_t used;
+  uint8_t ref;
+} coap_cache_entry_t;
+
+/**
+ * Proxy response cache. |entries| and the slab of |capacity| slots of
+ * |slot_size| bytes are indexed alike and reclaimed in CLOCK order from
+ * |hand|. |index| is an open-addressing hash table over them with linear
+ * probing, holding entry + 1 and 0 for an empty slot. |key| is scratch
+ * space for the key of the request at hand.
+ */
+struct coap_cache_t {
+  size_t capacity;
+  size_t count;
+  size_t slot_size;
+  uint32_t mask;
+  uint32_t hand;
+  uint32_t* index;
+  coap_cache_entry_t* entries;
+  char* slab;
+  char* key;
+  coap_serializer_t s;
+};
+
+size_t coap_cache_size(size_t capacity, size_t max_entry_len) {
+  return sizeof(coap_cache_t) + coap_pow2_(capacity * 2) * sizeof(uint32_t) +
+         capacity * sizeof(coap_cache_entry_t) +
+         (capacity + 1) * max_entry_len;
+}
+
+int coap_cache_create(coap_cache_t** c, void* buf, size_t len,
+                      size_t capacity, size_t max_entry_len) {
+  size_t slots;
+  if (c == NULL || buf == NULL || capacity == 0 || capacity > 0x40000000 ||
+      max_entry_len < COAP_LEN_HEADER || max_entry_len > 65535 ||
+      coap_cache_size(capacity, max_entry_len) > len) {
+    return COAP_ERR_ARG;
+  }
+  slots = coap_pow2_(capacity * 2);
+  *c = (coap_cache_t*)buf;
+  memset(*c, 0, sizeof(coap_cache_t));
+  (*c)->capacity = capacity;
+  (*c)->slot_size = max_entry_len;
+  (*c)->mask = slots - 1;
+  (*c)->index = (uint32_t*)((char*)buf + sizeof(coap_cache_t));
+  (*c)->entries = (coap_cache_entry_t*)&(*c)->index[slots];
+  (*c)->slab = (char*)&(*c)->entries[capacity];
+  (*c)->key = &(*c)->slab[capacity * max_entry_len];
+  memset((*c)->index, 0, slots * sizeof(uint32_t));
+  memset((*c)->entries, 0, capacity * sizeof(coap_cache_entry_t));
+  return COAP_OK;
+}
+
+/**
+ * Hash a cache key 8 bytes at a time. Keys span all the options of a
+ * request, far longer than the endpoints coap_hash_ is used for.
+ */
+static uint32_t coap_cache_hash_(const char* key, size_t len) {
+  uint64_t h = len;
+  uint64_t w;
+  size_t i;
+  for (i = 0; i + 8 <= len; i += 8) {
+    memcpy(&w, &key[i], 8);
+    h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 29;
+  }
+  w = 0;
+  memcpy(&w, &key[i], len - i);
+  h = (h ^ w) * 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(h ^ h >> 32);
+}
+
+/**
+ * Write the cache key of a GET request into |c->key|: the method, then the
+ * number, length and value of every option but the NoCacheKey ones.
+ */
+static int coap_cache_key_(coap_cache_t* c, const coap_parser_t* p,
+                           size_t* key_len, uint32_t* hash) {
+  const coap_opt_ref_t* o;
+  size_t n = 1;
+  size_t i;
+  int rc = coap_p_index_(p);
+  if (rc) {
+    return rc;
+  }
+  if (p->type > T_NON || p->code != C_GET) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  c->key[0] = (char)p->code;
+  for (i = 0; i < p->opts_len; i++) {
+    o = &p->opts[i];
+    if (COAP_NO_CACHE_KEY(o->num)) {
+      continue;
+    }
+    if (n + 4 + o->len > c->slot_size) {
+      return COAP_ERR_LIMIT;
+    }
+    c->key[n++] = (char)(o->num >> 8);
+    c->key[n++] = (char)o->num;
+    c->key[n++] = (char)(o->len >> 8);
+    c->key[n++] = (char)o->len;
+    memcpy(&c->key[n], &p->buf[o->offset], o->len);
+    n += o->len;
+  }
+  *key_len = n;
+  *hash = coap_cache_hash_(c->key, n);
+  return COAP_OK;
+}
+
+/**
+ * Find the index slot of the entry for the key in |c->key|. Returns the slot
+ * of the entry or, if there is none, of the empty slot that ends the probe
+ * sequence.
+ */
+static uint32_t coap_cache_find_(const coap_cache_t* c, size_t key_len,
+                                 uint32_t hash, int* found) {
+  uint32_t i = hash & c->mask;
+  const coap_cache_entry_t* e;
+  for (;;) {
+    if (c->index[i] == 0) {
+      *found = 0;
+      return i;
+    }
+    e = &c->entries[c->index[i] - 1];
+    if (e->hash == hash && e->key_len == key_len &&
+        memcmp(&c->slab[(c->index[i] - 1) * c->slot_size], c->key,
+               key_len) == 0) {
+      *found = 1;
+      return i;
+    }
+    i = (i + 1) & c->mask;
+  }
+}
+
+/**
+ * Remove entry |n| and shift the following index slots of the probe
+ * sequence back so that no tombstones are needed.
+ */
+static void coap_cache_remove_(coap_cache_t* c, uint32_t n) {
+  uint32_t i = c->entries[n].hash & c->mask;
+  uint32_t j;
+  uint32_t k;
+  while (c->index[i] != n + 1) {
+    i = (i + 1) & c->mask;
+  }
+  for (j = i;;) {
+    j = (j + 1) & c->mask;
+    if (c->index[j] == 0) {
+      break;
+    }
+    k = c->entries[c->index[j] - 1].hash & c->mask;
+    // Keep the slot j if its home slot lies cyclically in (i, j].
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    c->index[i] = c->index[j];
+    i = j;
+  }
+  c->index[i] = 0;
+  c->entries[n].used = 0;
+  c->count--;
+}
+
+/**
+ * Pick the entry for a new response. While the cache is full, the CLOCK
+ * hand gives referenced fresh entries a second chance and reclaims the
+ * first stale or unreferenced one.
+ */
+static uint32_t coap_cache_alloc_(coap_cache_t* c, uint32_t now) {
+  coap_cache_entry_t* e;
+  uint32_t n;
+  for (;;) {
+    n = c->hand;
+    e = &c->entries[n];
+    c->hand = n + 1 < c->capacity ? n + 1 : 0;
+    if (!e->used) {
+      return n;
+    }
+    if (c->count < c->capacity) {
+      continue;
+    }
+    if (e->ref && !coap_expired_(e->expires, now)) {
+      e->ref = 0;
+      continue;
+    }
+    coap_cache_remove_(c, n);
+    return n;
+  }
+}
+
+static uint32_t coap_cache_expires_(uint32_t max_age, uint32_t now) {
+  if (max_age > COAP_CACHE_MAX_AGE) {
+    max_age = COAP_CACHE_MAX_AGE;
+  }
+  return now + max_age * 1000;
+}
+
+/**
+ * Serialize |res| into |dst| without its token and with its Max-Age, if
+ * any, replaced by a 4-byte one in its option order.
+ */
+static int coap_cache_store_(coap_cache_t* c, coap_cache_entry_t* e,
+                             const coap_parser_t* res, char* dst,
+                             size_t dst_len) {
+  static const char zero[4] = {0};
+  coap_serializer_t* s = &c->s;
+  const coap_opt_ref_t* o;
+  size_t msg_len = 0;
+  size_t i;
+  int max_age = 0;
+  int rc;
+  s->buf = dst;
+  s->buf_len = dst_len;
+  s->stats = NULL;
+  rc = coap_s_init_(s, T_ACK, res->code, 0);
+  e->etag_at = 0;
+  e->etag_len = 0;
+  for (i = 0; rc == COAP_OK && i <= res->opts_len; i++) {
+    o = i < res->opts_len ? &res->opts[i] : NULL;
+    if (!max_age && (o == NULL || o->num >= O_MAX_AGE)) {
+      rc = coap_serializer_add_opt(s, O_MAX_AGE, zero, 4);
+      e->max_age_at = s->cursor - 4;
+      max_age = 1;
+    }
+    if (o == NULL || o->num == O_MAX_AGE || rc) {
+      continue;
+    }
+    rc = coap_serializer_add_opt(s, o->num, &res->buf[o->offset], o->len);
+    if (o->num == O_ETAG && e->etag_len == 0) {
+      e->etag_at = s->cursor - o->len;
+      e->etag_len = o->len;
+    }
+  }
+  if (rc) {
+    return rc == COAP_ERR_LIMIT ? rc : COAP_ERR_SYNTAX;
+  }
+  rc = coap_serializer_exec(s, 0, NULL, &res->buf[res->payload],
+                            res->buf_len - res->payload, &msg_len);
+  e->res_len = msg_len;
+  return rc;
+}
+
+int coap_cache_get(coap_cache_t* c, const coap_parser_t* req, uint32_t now,
+                   uint16_t mid, char* dst, size_t dst_len,
+                   size_t* msg_len) {
+  const coap_cache_entry_t* e;
+  const char* res;
+  uint32_t hdr;
+  uint32_t max_age;
+  size_t key_len;
+  uint32_t hash;
+  uint32_t i;
+  int found;
+  int rc;
+  if (c == NULL || req == NULL || dst == NULL || msg_len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_cache_key_(c, req, &key_len, &hash);
+  if (rc) {
+    return rc;
+  }
+  i = coap_cache_find_(c, key_len, hash, &found);
+  if (!found) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  e = &c->entries[c->index[i] - 1];
+  if (coap_expired_(e->expires, now)) {
+    // A stale response is kept only to be revalidated by its ETag.
+    if (e->etag_len == 0) {
+      coap_cache_remove_(c, c->index[i] - 1);
+    }
+    return COAP_ERR_NOT_FOUND;
+  }
+  if (e->res_len + req->token_len > dst_len) {
+    return COAP_ERR_LIMIT;
+  }
+  res = &c->slab[(c->index[i] - 1) * c->slot_size + e->key_len];
+  // A CON request is answered by a piggybacked response in its ACK.
+  hdr = COAP_VERSION | (req->type == T_CON ? T_ACK : T_NON) << 28 |
+        req->token_len << 24 | (uint8_t)res[1] << 16 |
+        (req->type == T_CON ? req->mid : mid);
+  hdr = htonl(hdr);
+  memcpy(dst, &hdr, 4);
+  memcpy(&dst[COAP_LEN_HEADER], &req->buf[COAP_LEN_HEADER], req->token_len);
+  memcpy(&dst[COAP_LEN_HEADER + req->token_len], &res[COAP_LEN_HEADER],
+         e->res_len - COAP_LEN_HEADER);
+  max_age = htonl((e->expires - now) / 1000);
+  memcpy(&dst[e->max_age_at + req->token_len], &max_age, 4);
+  c->entries[c->index[i] - 1].ref = 1;
+  *msg_len = e->res_len + req->token_len;
+  return COAP_OK;
+}
+
+int coap_cache_get_etag(coap_cache_t* c, const coap_parser_t* req,
+                        const char** etag, size_t* etag_len) {
+  const coap_cache_entry_t* e;
+  size_t key_len;
+  uint32_t hash;
+  uint32_t i;
+  int found;
+  int rc;
+  if (c == NULL || req == NULL || etag == NULL || etag_len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_cache_key_(c, req, &key_len, &hash);
+  if (rc) {
+    return rc;
+  }
+  i = coap_cache_find_(c, key_len, hash, &found);
+  if (!found || c->entries[c->index[i] - 1].etag_len == 0) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  e = &c->entries[c->index[i] - 1];
+  *etag = &c->slab[(c->index[i] - 1) * c->slot_size + e->key_len + e->etag_at];
+  *etag_len = e->etag_len;
+  return COAP_OK;
+}
+
+int coap_cache_put(coap_cache_t* c, const coap_parser_t* req,
+                   const coap_parser_t* res, uint32_t now) {
+  coap_cache_entry_t* e;
+  const char* etag = NULL;
+  size_t etag_len = 0;
+  uint32_t max_age;
+  size_t key_len;
+  uint32_t hash;
+  uint32_t i;
+  uint32_t n;
+  int found;
+  int rc;
+  if (c == NULL || req == NULL || res == NULL) {
+    return COAP_ERR_ARG;
+  }
+  rc = coap_cache_key_(c, req, &key_len, &hash);
+  if (!rc) {
+    rc = coap_p_index_(res);
+  }
+  if (!rc) {
+    rc = coap_parser_get_max_age(res, &max_age);
+  }
+  if (rc) {
+    return rc;
+  }
+  i = coap_cache_find_(c, key_len, hash, &found);
+  if (res->code == C_VALID) {
+    // 2.03 Valid makes the stored response with the same ETag fresh again.
+    coap_parser_get_opt(res, O_ETAG, &etag, &etag_len);
+    if (!found) {
+      return COAP_ERR_NOT_FOUND;
+    }
+    e = &c->entries[c->index[i] - 1];
+    if (etag == NULL || etag_len != e->etag_len ||
+        memcmp(&c->slab[(c->index[i] - 1) * c->slot_size + e->key_len +
+                        e->etag_at],
+               etag, etag_len) != 0) {
+      return COAP_ERR_NOT_FOUND;
+    }
+    e->expires = coap_cache_expires_(max_age, now);
+    e->ref = 1;
+    return COAP_OK;
+  }
+  // Only 2.05 Content and error responses are cacheable (section 5.9).
+  if (res->code != C_CONTENT && (res->code >> 5) != 4 &&
+      (res->code >> 5) != 5) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  if (key_len + res->buf_len - res->token_len > c->slot_size) {
+    return COAP_ERR_LIMIT;
+  }
+  if (found) {
+    n = c->index[i] - 1;
+  } else {
+    n = coap_cache_alloc_(c, now);
+  }
+  e = &c->entries[n];
+  rc = coap_cache_store_(c, e, res, &c->slab[n * c->slot_size + key_len],
+                         c->slot_size - key_len);
+  if (rc) {
+    if (found) {
+      coap_cache_remove_(c, n);
+    }
+    return rc;
+  }
+  memcpy(&c->slab[n * c->slot_size], c->key, key_len);
+  e->expires = coap_cache_expires_(max_age, now);
+  e->hash = hash;
+  e->key_len = key_len;
+  e->ref = 0;
+  if (!found) {
+    // The eviction may have shifted the probe sequence.
+    i = coap_cache_find_(c, key_len, hash, &found);
+    c->index[i] = n + 1;
+    e->used = 1;
+    c->count++;
+  }
+  return COAP_OK;
+}
+
+/**
+ * Timer wheel geometry of coap_retx_t. The wheel ticks once per
+ * millisecond; level 0 has one slot per tick and every higher level has one
+ * slot per full turn of the level below.
+ */
+#define COAP_WHEEL_BITS0 8
+#define COAP_WHEEL_BITS 6
+#define COAP_WHEEL_LEVELS 4
+#define COAP_WHEEL_SLOTS \
+  ((1 << COAP_WHEEL_BITS0) + (COAP_WHEEL_LEVELS - 1) * (1 << COAP_WHEEL_BITS))
+
+/**
+ * An outstanding confirmable message.
+ */
+typedef struct coap_retx_entry_t {
+  const char* msg;
+  size_t len;
+  void* cookie;
+  uint32_t expires;
+  uint32_t timeout;
+  uint32_t prev;
+  uint32_t next;
+  uint32_t hnext;
+  uint32_t hash;
+  uint16_t slot;
+  uint16_t mid;
+  uint8_t retransmit;
+  uint8_t ep_len;
+  uint8_t ep[COAP_MAXLEN_ENDPOINT];
+} coap_retx_entry_t;
+
+/**
+ * Retransmission scheduler. Entries sit in the doubly linked list of a
+ * hierarchical timer wheel slot and in a hash chain keyed on (endpoint,
+ * MID), so both scheduling and cancellation are O(1).
+ */
+struct coap_retx_t {
+  size_t capacity;
+  uint32_t tick;
+  uint32_t rand;
+  uint32_t free;
+  uint32_t mask;
+  uint32_t wheel[COAP_WHEEL_SLOTS];
+  uint32_t* buckets;
+  coap_retx_entry_t* entries;
+};
+
+static uint32_t coap_rand_(uint32_t* state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static uint32_t coap_ep_hash_(const void* ep, size_t ep_len, uint16_t mid) {
+  return coap_hash_(&mid, sizeof(mid), coap_hash_(ep, ep_len, 2166136261u));
+}
+
+/**
+ * Get the wheel slot for an expiry time: the lowest level whose current
+ * turn contains it.
+ */
+static uint16_t coap_wheel_slot_(uint32_t tick, uint32_t expires) {
+  uint32_t shift = COAP_WHEEL_BITS0;
+  uint16_t base = 1 << COAP_WHEEL_BITS0;
+  int level;
+  if ((int32_t)(expires - tick) <= 0) {
+    return tick & ((1 << COAP_WHEEL_BITS0) - 1);
+  }
+  if ((expires >> shift) == (tick >> shift)) {
+    return expires & ((1 << COAP_WHEEL_BITS0) - 1);
+  }
+  for (level = 1; level < COAP_WHEEL_LEVELS - 1; level++) {
+    if ((expires >> (shift + COAP_WHEEL_BITS)) ==
+        (tick >> (shift + COAP_WHEEL_BITS))) {
+      break;
+    }
+    shift += COAP_WHEEL_BITS;
+    base += 1 << COAP_WHEEL_BITS;
+  }
+  return base + ((expires >> shift) & ((1 << COAP_WHEEL_BITS) - 1));
+}
+
+static void coap_wheel_link_(coap_retx_t* r, uint32_t i) {
+  coap_retx_entry_t* e = &r->entries[i];
+  e->slot = coap_wheel_slot_(r->tick, e->expires);
+  e->prev = COAP_NONE;
+  e->next = r->wheel[e->slot];
+  if (e->next != COAP_NONE) {
+    r->entries[e->next].prev = i;
+  }
+  r->wheel[e->slot] = i;
+}
+
+static void coap_wheel_unlink_(coap_retx_t* r, uint32_t i) {
+  coap_retx_entry_t* e = &r->entries[i];
+  if (e->prev != COAP_NONE) {
+    r->entries[e->prev].next = e->next;
+  } else {
+    r->wheel[e->slot] = e->next;
+  }
+  if (e->next != COAP_NONE) {
+    r->entries[e->next].prev = e->prev;
+  }
+}
+
+/**
+ * Move the entries of the higher level slots that start at the current tick
+ * down the wheel.
+ */
+static void coap_wheel_cascade_(coap_retx_t* r) {
+  uint32_t shift = COAP_WHEEL_BITS0;
+  uint16_t base = 1 << COAP_WHEEL_BITS0;
+  uint16_t slots[COAP_WHEEL_LEVELS - 1];
+  uint32_t i, next;
+  int levels = 0;
+  // Find the levels that turn over at this tick, then cascade from the top.
+  while (levels < COAP_WHEEL_LEVELS - 1 &&
+         (r->tick & ((1u << shift) - 1)) == 0) {
+    slots[levels++] =
+      base + ((r->tick >> shift) & ((1 << COAP_WHEEL_BITS) - 1));
+    shift += COAP_WHEEL_BITS;
+    base += 1 << COAP_WHEEL_BITS;
+  }
+  while (levels-- > 0) {
+    i = r->wheel[slots[levels]];
+    r->wheel[slots[levels]] = COAP_NONE;
+    for (; i != COAP_NONE; i = next) {
+      next = r->entries[i].next;
+      coap_wheel_link_(r, i);
+    }
+  }
+}
+
+size_t coap_retx_size(size_t capacity) {
+  return sizeof(coap_retx_t) +
+         coap_pow2_(capacity) * sizeof(uint32_t) +
+         capacity * sizeof(coap_retx_entry_t);
+}
+
+int coap_retx_create(coap_retx_t** r, void* buf, size_t len, size_t capacity,
+                     uint32_t now, uint32_t seed) {
+  uint32_t buckets;
+  size_t i;
+  if (r == NULL || buf == NULL || capacity == 0 || capacity >= COAP_NONE ||
+      coap_retx_size(capacity) > len) {
+    return COAP_ERR_ARG;
+  }
+  buckets = coap_pow2_(capacity);
+  *r = (coap_retx_t*)buf;
+  memset(*r, 0, sizeof(coap_retx_t));
+  (*r)->capacity = capacity;
+  (*r)->tick = now;
+  (*r)->rand = seed ? seed : 0x9E3779B9;
+  (*r)->mask = buckets - 1;
+  (*r)->entries = (coap_retx_entry_t*)((char*)buf + sizeof(coap_retx_t));
+  (*r)->buckets = (uint32_t*)&(*r)->entries[capacity];
+  memset((*r)->wheel, 0xFF, sizeof((*r)->wheel));
+  memset((*r)->buckets, 0xFF, buckets * sizeof(uint32_t));
+  for (i = 0; i < capacity; i++) {
+    (*r)->entries[i].next = i + 1 < capacity ? i + 1 : COAP_NONE;
+  }
+  (*r)->free = 0;
+  return COAP_OK;
+}
+
+/**
+ * Find the entry for (endpoint, MID) and the link that points to it in its
+ * hash chain.
+ */
+static uint32_t coap_retx_find_(coap_retx_t* r, const void* ep, size_t ep_len,
+                                uint16_t mid, uint32_t hash,
+                                uint32_t** link) {
+  uint32_t* l = &r->buckets[hash & r->mask];
+  coap_retx_entry_t* e;
+  for (; *l != COAP_NONE; l = &e->hnext) {
+    e = &r->entries[*l];
+    if (e->hash == hash && e->mid == mid && e->ep_len == ep_len &&
+        memcmp(e->ep, ep, ep_len) == 0) {
+      break;
+    }
+  }
+  *link = l;
+  return *l;
+}
+
+int coap_retx_add(coap_retx_t* r, const void* ep, size_t ep_len, uint16_t mid,
+                  const char* msg, size_t len, void* cookie, uint32_t now) {
+  coap_retx_entry_t* e;
+  uint32_t* link;
+  uint32_t hash;
+  uint32_t i;
+  if (r == NULL || ep == NULL || ep_len > COAP_MAXLEN_ENDPOINT ||
+      msg == NULL || len < COAP_LEN_HEADER) {
+    return COAP_ERR_ARG;
+  }
+  hash = coap_ep_hash_(ep, ep_len, mid);
+  if (coap_retx_find_(r, ep, ep_len, mid, hash, &link) != COAP_NONE) {
+    return COAP_ERR_DUPLICATE;
+  }
+  if (r->free == COAP_NONE) {
+    return COAP_ERR_LIMIT;
+  }
+  i = r->free;
+  e = &r->entries[i];
+  r->free = e->next;
+  e->msg = msg;
+  e->len = len;
+  e->cookie = cookie;
+  e->timeout = COAP_ACK_TIMEOUT +
+               coap_rand_(&r->rand) %
+                 (COAP_ACK_TIMEOUT * (COAP_ACK_RANDOM_FACTOR - 100) / 100 + 1);
+  e->expires = now + e->timeout;
+  e->hash = hash;
+  e->hnext = COAP_NONE;
+  e->mid = mid;
+  e->retransmit = 0;
+  e->ep_len = ep_len;
+  memcpy(e->ep, ep, ep_len);
+  *link = i;
+  coap_wheel_link_(r, i);
+  return COAP_OK;
+}
+
+static void coap_retx_release_(coap_retx_t* r, uint32_t i, uint32_t* link) {
+  *link = r->entries[i].hnext;
+  coap_wheel_unlink_(r, i);
+  r->entries[i].next = r->free;
+  r->free = i;
+}
+
+int coap_retx_cancel(coap_retx_t* r, const void* ep, size_t ep_len,
+                     uint16_t mid, void** cookie) {
+  uint32_t* link;
+  uint32_t i;
+  if (r == NULL || ep == NULL || ep_len > COAP_MAXLEN_ENDPOINT) {
+    return COAP_ERR_ARG;
+  }
+  i = coap_retx_find_(r, ep, ep_len, mid, coap_ep_hash_(ep, ep_len, mid),
+                      &link);
+  if (i == COAP_NONE) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  if (cookie) {
+    *cookie = r->entries[i].cookie;
+  }
+  coap_retx_release_(r, i, link);
+  return COAP_OK;
+}
+
+int coap_retx_poll(coap_retx_t* r, uint32_t now, coap_retx_event_t* events,
+                   size_t max, size_t* n) {
+  coap_retx_entry_t* e;
+  coap_retx_event_t* ev;
+  uint32_t* link;
+  uint16_t slot;
+  uint32_t i;
+  if (r == NULL || n == NULL || (max > 0 && events == NULL)) {
+    return COAP_ERR_ARG;
+  }
+  *n = 0;
+  if ((int32_t)(now - r->tick) < 0) {
+    now = r->tick;
+  }
+  for (;;) {
+    slot = r->tick & ((1 << COAP_WHEEL_BITS0) - 1);
+    while ((i = r->wheel[slot]) != COAP_NONE) {
+      if (*n == max) {
+        return COAP_OK;
+      }
+      e = &r->entries[i];
+      ev = &events[(*n)++];
+      ev->msg = e->msg;
+      ev->len = e->len;
+      ev->cookie = e->cookie;
+      ev->mid = e->mid;
+      ev->ep_len = e->ep_len;
+      memcpy(ev->ep, e->ep, e->ep_len);
+      if (e->retransmit < COAP_MAX_RETRANSMIT) {
+        ev->gave_up = 0;
+        e->retransmit++;
+        e->timeout *= 2;
+        e->expires = r->tick + e->timeout;
+        coap_wheel_unlink_(r, i);
+        coap_wheel_link_(r, i);
+      } else {
+        ev->gave_up = 1;
+        coap_retx_find_(r, e->ep, e->ep_len, e->mid, e->hash, &link);
+        coap_retx_release_(r, i, link);
+      }
+    }
+    if (r->tick == now) {
+      return COAP_OK;
+    }
+    r->tick++;
+    if ((r->tick & ((1 << COAP_WHEEL_BITS0) - 1)) == 0) {
+      coap_wheel_cascade_(r);
+    }
+  }
+}
+
+/**
+ * A pending client request. |next| chains free entries.
+ */
+typedef struct coap_exchange_entry_t {
+  void* cookie;
+  uint32_t hash;
+  uint32_t next;
+  uint16_t mid;
+  uint8_t has_mid;
+  uint8_t token_len;
+  char token[COAP_MAXLEN_TOKEN];
+} coap_exchange_entry_t;
+
+/**
+ * Exchange table. |tokens| and |mids| are open-addressing hash tables with
+ * linear probing over entry indexes, each with at least twice as many slots
+ * as |capacity|. |counter| feeds the token generator.
+ */
+struct coap_exchange_t {
+  size_t capacity;
+  size_t count;
+  uint32_t mask;
+  uint32_t free;
+  uint64_t counter;
+  uint64_t key;
+  uint32_t* tokens;
+  uint32_t* mids;
+  coap_exchange_entry_t* entries;
+};
+
+static uint32_t coap_mid_hash_(uint16_t mid) {
+  return mid * 2654435761u;
+}
+
+/**
+ * Mix a 64-bit value. The function is a bijection, so distinct counter
+ * values always give distinct 8 byte tokens.
+ */
+static uint64_t coap_mix64_(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+size_t coap_exchange_size(size_t capacity) {
+  return sizeof(coap_exchange_t) +
+         2 * coap_pow2_(capacity * 2) * sizeof(uint32_t) +
+         capacity * sizeof(coap_exchange_entry_t);
+}
+
+int coap_exchange_create(coap_exchange_t** x, void* buf, size_t len,
+                         size_t capacity, uint64_t seed) {
+  uint32_t slots;
+  size_t i;
+  if (x == NULL || buf == NULL || capacity == 0 || capacity > 0x40000000 ||
+      coap_exchange_size(capacity) > len) {
+    return COAP_ERR_ARG;
+  }
+  slots = coap_pow2_(capacity * 2);
+  *x = (coap_exchange_t*)buf;
+  memset(*x, 0, sizeof(coap_exchange_t));
+  (*x)->capacity = capacity;
+  (*x)->mask = slots - 1;
+  (*x)->key = coap_mix64_(seed);
+  (*x)->entries = (coap_exchange_entry_t*)((char*)buf + sizeof(coap_exchange_t));
+  (*x)->tokens = (uint32_t*)&(*x)->entries[capacity];
+  (*x)->mids = &(*x)->tokens[slots];
+  memset((*x)->tokens, 0xFF, 2 * slots * sizeof(uint32_t));
+  for (i = 0; i < capacity; i++) {
+    (*x)->entries[i].next = i + 1 < capacity ? i + 1 : COAP_NONE;
+  }
+  (*x)->free = 0;
+  return COAP_OK;
+}
+
+/**
+ * Find the slot of a token in |tokens|, or of the empty slot that ends its
+ * probe sequence.
+ */
+static uint32_t coap_exchange_find_(const coap_exchange_t* x,
+                                    const char* token, uint8_t token_len,
+                                    uint32_t hash) {
+  uint32_t i = hash & x->mask;
+  const coap_exchange_entry_t* e;
+  for (; x->tokens[i] != COAP_NONE; i = (i + 1) & x->mask) {
+    e = &x->entries[x->tokens[i]];
+    if (e->hash == hash && e->token_len == token_len &&
+        memcmp(e->token, token, token_len) == 0) {
+      break;
+    }
+  }
+  return i;
+}
+
+static uint32_t coap_exchange_find_mid_(const coap_exchange_t* x,
+                                        uint16_t mid) {
+  uint32_t i = coap_mid_hash_(mid) & x->mask;
+  for (; x->mids[i] != COAP_NONE; i = (i + 1) & x->mask) {
+    if (x->entries[x->mids[i]].mid == mid) {
+      break;
+    }
+  }
+  return i;
+}
+
+/**
+ * Clear the slot |i| of |tokens| or |mids| and shift the following entries
+ * of the probe sequence back so that no tombstones are needed.
+ */
+static void coap_exchange_unindex_(coap_exchange_t* x, uint32_t* slots,
+                                   uint32_t i) {
+  const coap_exchange_entry_t* e;
+  uint32_t j = i;
+  uint32_t k;
+  for (;;) {
+    j = (j + 1) & x->mask;
+    if (slots[j] == COAP_NONE) {
+      break;
+    }
+    e = &x->entries[slots[j]];
+    k = (slots == x->mids ? coap_mid_hash_(e->mid) : e->hash) & x->mask;
+    // Keep the entry at j if its home slot lies cyclically in (i, j].
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) {
+      continue;
+    }
+    slots[i] = slots[j];
+    i = j;
+  }
+  slots[i] = COAP_NONE;
+}
+
+int coap_exchange_insert(coap_exchange_t* x, uint16_t mid, const char* token,
+                         uint8_t token_len, void* cookie) {
+  coap_exchange_entry_t* e;
+  uint32_t hash;
+  uint32_t i, j;
+  if (x == NULL || token_len > COAP_MAXLEN_TOKEN ||
+      (token == NULL && token_len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  hash = coap_hash_(token, token_len, 2166136261u);
+  i = coap_exchange_find_(x, token, token_len, hash);
+  j = coap_exchange_find_mid_(x, mid);
+  if (x->tokens[i] != COAP_NONE || x->mids[j] != COAP_NONE) {
+    return COAP_ERR_DUPLICATE;
+  }
+  if (x->free == COAP_NONE) {
+    return COAP_ERR_LIMIT;
+  }
+  x->tokens[i] = x->mids[j] = x->free;
+  e = &x->entries[x->free];
+  x->free = e->next;
+  e->cookie = cookie;
+  e->hash = hash;
+  e->mid = mid;
+  e->has_mid = 1;
+  e->token_len = token_len;
+  memcpy(e->token, token, token_len);
+  x->count++;
+  return COAP_OK;
+}
+
+int coap_exchange_add(coap_exchange_t* x, uint16_t mid, char* token,
+                      uint8_t token_len, void* cookie) {
+  uint64_t t;
+  size_t tries;
+  int rc;
+  if (x == NULL || token == NULL || token_len == 0 ||
+      token_len > COAP_MAXLEN_TOKEN) {
+    return COAP_ERR_ARG;
+  }
+  if (x->mids[coap_exchange_find_mid_(x, mid)] != COAP_NONE) {
+    return COAP_ERR_DUPLICATE;
+  }
+  // Tokens shorter than 8 bytes can collide with a live exchange and are
+  // drawn again a bounded number of times.
+  for (tries = 0; tries <= x->count; tries++) {
+    t = coap_mix64_(x->counter++ ^ x->key);
+    memcpy(token, &t, token_len);
+    rc = coap_exchange_insert(x, mid, token, token_len, cookie);
+    if (rc != COAP_ERR_DUPLICATE) {
+      return rc;
+    }
+  }
+  return COAP_ERR_LIMIT;
+}
+
+int coap_exchange_match(const coap_exchange_t* x, const char* token,
+                        uint8_t token_len, void** cookie) {
+  uint32_t i;
+  if (x == NULL || token_len > COAP_MAXLEN_TOKEN ||
+      (token == NULL && token_len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  i = coap_exchange_find_(x, token, token_len,
+                          coap_hash_(token, token_len, 2166136261u));
+  if (x->tokens[i] == COAP_NONE) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  if (cookie) {
+    *cookie = x->entries[x->tokens[i]].cookie;
+  }
+  return COAP_OK;
+}
+
+int coap_exchange_match_mid(coap_exchange_t* x, uint16_t mid, void** cookie) {
+  uint32_t i;
+  if (x == NULL) {
+    return COAP_ERR_ARG;
+  }
+  i = coap_exchange_find_mid_(x, mid);
+  if (x->mids[i] == COAP_NONE) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  if (cookie) {
+    *cookie = x->entries[x->mids[i]].cookie;
+  }
+  x->entries[x->mids[i]].has_mid = 0;
+  coap_exchange_unindex_(x, x->mids, i);
+  return COAP_OK;
+}
+
+int coap_exchange_remove(coap_exchange_t* x, const char* token,
+                         uint8_t token_len, void** cookie) {
+  coap_exchange_entry_t* e;
+  uint32_t i, n;
+  if (x == NULL || token_len > COAP_MAXLEN_TOKEN ||
+      (token == NULL && token_len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  i = coap_exchange_find_(x, token, token_len,
+                          coap_hash_(token, token_len, 2166136261u));
+  if (x->tokens[i] == COAP_NONE) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  n = x->tokens[i];
+  e = &x->entries[n];
+  if (cookie) {
+    *cookie = e->cookie;
+  }
+  if (e->has_mid) {
+    coap_exchange_unindex_(x, x->mids, coap_exchange_find_mid_(x, e->mid));
+  }
+  coap_exchange_unindex_(x, x->tokens, i);
+  e->next = x->free;
+  x->free = n;
+  x->count--;
+  return COAP_OK;
+}
+
+/**
+ * A registered observer. Unused entries are chained through |hnext|.
+ */
+typedef struct coap_observer_t {
+  uint32_t hash;
+  uint32_t hnext;
+  uint32_t seq;
+  uint32_t last_con;
+  uint8_t used;
+  uint8_t con;
+  uint8_t token_len;
+  uint8_t ep_len;
+  char token[COAP_MAXLEN_TOKEN];
+  uint8_t ep[COAP_MAXLEN_ENDPOINT];
+} coap_observer_t;
+
+/**
+ * Observer registry of a resource. Observers are found through hash chains
+ * keyed on (endpoint, token). The notification being emitted is described
+ * by the byte ranges of |msg| before and after its Observe option.
+ */
+struct coap_observe_t {
+  size_t capacity;
+  size_t count;
+  uint32_t mask;
+  uint32_t free;
+  uint32_t seq;
+  uint32_t cursor;
+  const char* msg;
+  size_t pre;
+  size_t pre_len;
+  size_t tail;
+  size_t tail_len;
+  uint8_t code;
+  uint8_t delta;
+  uint32_t* buckets;
+  coap_observer_t* entries;
+};
+
+static uint32_t coap_observer_hash_(const void* ep, size_t ep_len,
+                                    const char* token, uint8_t token_len) {
+  return coap_hash_(token, token_len, coap_hash_(ep, ep_len, 2166136261u));
+}
+
+size_t coap_observe_size(size_t capacity) {
+  return sizeof(coap_observe_t) +
+         coap_pow2_(capacity) * sizeof(uint32_t) +
+         capacity * sizeof(coap_observer_t);
+}
+
+int coap_observe_create(coap_observe_t** o, void* buf, size_t len,
+                        size_t capacity) {
+  uint32_t buckets;
+  size_t i;
+  if (o == NULL || buf == NULL || capacity == 0 || capacity >= COAP_NONE ||
+      coap_observe_size(capacity) > len) {
+    return COAP_ERR_ARG;
+  }
+  buckets = coap_pow2_(capacity);
+  *o = (coap_observe_t*)buf;
+  memset(*o, 0, sizeof(coap_observe_t));
+  (*o)->capacity = capacity;
+  (*o)->mask = buckets - 1;
+  (*o)->cursor = capacity;
+  (*o)->entries = (coap_observer_t*)((char*)buf + sizeof(coap_observe_t));
+  (*o)->buckets = (uint32_t*)&(*o)->entries[capacity];
+  memset((*o)->buckets, 0xFF, buckets * sizeof(uint32_t));
+  for (i = 0; i < capacity; i++) {
+    (*o)->entries[i].used = 0;
+    (*o)->entries[i].hnext = i + 1 < capacity ? i + 1 : COAP_NONE;
+  }
+  (*o)->free = 0;
+  return COAP_OK;
+}
+
+/**
+ * Find the observer for (endpoint, token) and the link that points to it in
+ * its hash chain.
+ */
+static uint32_t coap_observe_find_(coap_observe_t* o, const void* ep,
+                                   size_t ep_len, const char* token,
+                                   uint8_t token_len, uint32_t hash,
+                                   uint32_t** link) {
+  uint32_t* l = &o->buckets[hash & o->mask];
+  coap_observer_t* e;
+  for (; *l != COAP_NONE; l = &e->hnext) {
+    e = &o->entries[*l];
+    if (e->hash == hash && e->token_len == token_len &&
+        e->ep_len == ep_len && memcmp(e->token, token, token_len) == 0 &&
+        memcmp(e->ep, ep, ep_len) == 0) {
+      break;
+    }
+  }
+  *link = l;
+  return *l;
+}
+
+int coap_observe_register(coap_observe_t* o, const void* ep, size_t ep_len,
+                          const char* token, uint8_t token_len, uint8_t con,
+                          uint32_t now, uint32_t* seq) {
+  coap_observer_t* e;
+  uint32_t* link;
+  uint32_t hash;
+  uint32_t i;
+  if (o == NULL || ep == NULL || ep_len > COAP_MAXLEN_ENDPOINT ||
+      token_len > COAP_MAXLEN_TOKEN || (token == NULL && token_len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  hash = coap_observer_hash_(ep, ep_len, token, token_len);
+  i = coap_observe_find_(o, ep, ep_len, token, token_len, hash, &link);
+  if (i == COAP_NONE) {
+    // A new entry; a repeated registration only updates the existing one.
+    if (o->free == COAP_NONE) {
+      return COAP_ERR_LIMIT;
+    }
+    i = o->free;
+    e = &o->entries[i];
+    o->free = e->hnext;
+    e->hash = hash;
+    e->hnext = COAP_NONE;
+    e->used = 1;
+    e->token_len = token_len;
+    e->ep_len = ep_len;
+    memcpy(e->token, token, token_len);
+    memcpy(e->ep, ep, ep_len);
+    *link = i;
+    o->count++;
+  }
+  e = &o->entries[i];
+  e->con = con;
+  e->last_con = now;
+  e->seq = o->seq;
+  if (seq) {
+    *seq = o->seq;
+  }
+  return COAP_OK;
+}
+
+int coap_observe_deregister(coap_observe_t* o, const void* ep, size_t ep_len,
+                            const char* token, uint8_t token_len) {
+  uint32_t* link;
+  uint32_t i;
+  if (o == NULL || ep == NULL || ep_len > COAP_MAXLEN_ENDPOINT ||
+      token_len > COAP_MAXLEN_TOKEN || (token == NULL && token_len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  i = coap_observe_find_(o, ep, ep_len, token, token_len,
+                         coap_observer_hash_(ep, ep_len, token, token_len),
+                         &link);
+  if (i == COAP_NONE) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  *link = o->entries[i].hnext;
+  o->entries[i].used = 0;
+  o->entries[i].hnext = o->free;
+  o->free = i;
+  o->count--;
+  return COAP_OK;
+}
+
+int coap_observe_notify(coap_observe_t* o, const char* msg, size_t len) {
+  coap_parser_t p;
+  size_t start;
+  size_t i;
+  int rc;
+  if (o == NULL || msg == NULL || len == 0) {
+    return COAP_ERR_ARG;
+  }
+  p.stats = NULL;
+  rc = coap_p_exec_(&p, msg, len, 0);
+  if (rc) {
+    return rc;
+  }
+  if (p.opts_overflow) {
+    return COAP_ERR_LIMIT;
+  }
+  for (i = 0; i < p.opts_len && p.opts[i].num != O_OBSERVE; i++) {
+  }
+  if (i == p.opts_len) {
+    return COAP_ERR_ARG;
+  }
+  // The Observe option is replaced per observer; everything before it
+  // after the token and everything after it is shared.
+  start = i > 0 ? p.opts[i - 1].offset + p.opts[i - 1].len
+                : COAP_LEN_HEADER + p.token_len;
+  o->msg = msg;
+  o->code = p.code;
+  o->delta = O_OBSERVE - (i > 0 ? p.opts[i - 1].num : 0);
+  o->pre = COAP_LEN_HEADER + p.token_len;
+  o->pre_len = start - o->pre;
+  o->tail = p.opts[i].offset + p.opts[i].len;
+  o->tail_len = len - o->tail;
+  o->seq = (o->seq + 1) & 0xFFFFFF;
+  o->cursor = 0;
+  return COAP_OK;
+}
+
+int coap_observe_emit(coap_observe_t* o, uint32_t now, uint16_t* mid,
+                      coap_notification_t* out, size_t max, size_t* n) {
+  coap_notification_t* m;
+  coap_observer_t* e;
+  uint8_t type;
+  size_t vlen;
+  if (o == NULL || mid == NULL || n == NULL || (max > 0 && out == NULL)) {
+    return COAP_ERR_ARG;
+  }
+  *n = 0;
+  for (; o->cursor < o->capacity && *n < max; o->cursor++) {
+    e = &o->entries[o->cursor];
+    if (!e->used) {
+      continue;
+    }
+    type = T_NON;
+    if (e->con || now - e->last_con >= COAP_OBSERVE_CON_INTERVAL) {
+      type = T_CON;
+      e->last_con = now;
+    }
+    e->seq = o->seq;
+    m = &out[(*n)++];
+    m->ep = e->ep;
+    m->ep_len = e->ep_len;
+    m->type = type;
+    m->mid = (*mid)++;
+    m->head[0] = (char)((COAP_VERSION >> 24) | (type << 4) | e->token_len);
+    m->head[1] = (char)o->code;
+    m->head[2] = (char)(m->mid >> 8);
+    m->head[3] = (char)m->mid;
+    memcpy(&m->head[COAP_LEN_HEADER], e->token, e->token_len);
+    vlen = encode_uint_(o->seq, &m->observe[1]);
+    m->observe[0] = (char)((o->delta << 4) | vlen);
+    m->iov_len = 0;
+    m->iov[m->iov_len].iov_base = m->head;
+    m->iov[m->iov_len++].iov_len = COAP_LEN_HEADER + e->token_len;
+    if (o->pre_len > 0) {
+      m->iov[m->iov_len].iov_base = (void*)&o->msg[o->pre];
+      m->iov[m->iov_len++].iov_len = o->pre_len;
+    }
+    m->iov[m->iov_len].iov_base = m->observe;
+    m->iov[m->iov_len++].iov_len = 1 + vlen;
+    if (o->tail_len > 0) {
+      m->iov[m->iov_len].iov_base = (void*)&o->msg[o->tail];
+      m->iov[m->iov_len++].iov_len = o->tail_len;
+    }
+    m->len = COAP_LEN_HEADER + e->token_len + o->pre_len + 1 + vlen +
+             o->tail_len;
+  }
+  return COAP_OK;
+}
+
+/**
+ * A Block1 transfer being reassembled into its body buffer.
+ */
+typedef struct coap_reasm_entry_t {
+  uint32_t expires;
+  uint32_t hash;
+  size_t len;
+  uint8_t used;
+  uint8_t done;
+  uint8_t token_len;
+  uint8_t ep_len;
+  char token[COAP_MAXLEN_TOKEN];
+  uint8_t ep[COAP_MAXLEN_ENDPOINT];
+} coap_reasm_entry_t;
+
+/**
+ * Block1 reassembly pool. Transfers are few and long-lived, so they are
+ * found by a scan over |entries| comparing hashes first. Entry i
+ * reassembles into the i-th |max_len| bytes of |bodies|.
+ */
+struct coap_reasm_t {
+  size_t capacity;
+  size_t max_len;
+  coap_reasm_entry_t* entries;
+  char* bodies;
+};
+
+size_t coap_reasm_size(size_t capacity, size_t max_len) {
+  return sizeof(coap_reasm_t) +
+         capacity * (sizeof(coap_reasm_entry_t) + max_len);
+}
+
+int coap_reasm_create(coap_reasm_t** r, void* buf, size_t len,
+                      size_t capacity, size_t max_len) {
+  if (r == NULL || buf == NULL || capacity == 0 || max_len == 0 ||
+      coap_reasm_size(capacity, max_len) > len) {
+    return COAP_ERR_ARG;
+  }
+  *r = (coap_reasm_t*)buf;
+  (*r)->capacity = capacity;
+  (*r)->max_len = max_len;
+  (*r)->entries = (coap_reasm_entry_t*)((char*)buf + sizeof(coap_reasm_t));
+  (*r)->bodies = (char*)&(*r)->entries[capacity];
+  memset((*r)->entries, 0, capacity * sizeof(coap_reasm_entry_t));
+  return COAP_OK;
+}
+
+/**
+ * Find the transfer for (endpoint, token). If |free| is not NULL, expired
+ * transfers are released on the way and |free| is set to an unused entry,
+ * if there is one.
+ */
+static coap_reasm_entry_t* coap_reasm_find_(coap_reasm_t* r, const void* ep,
+                                            size_t ep_len, const char* token,
+                                            uint8_t token_len, uint32_t now,
+                                            coap_reasm_entry_t** free) {
+  uint32_t hash = coap_observer_hash_(ep, ep_len, token, token_len);
+  coap_reasm_entry_t* e;
+  size_t i;
+  if (free) {
+    *free = NULL;
+  }
+  for (i = 0; i < r->capacity; i++) {
+    e = &r->entries[i];
+    if (free && e->used && coap_expired_(e->expires, now)) {
+      e->used = 0;
+    }
+    if (!e->used) {
+      if (free && *free == NULL) {
+        *free = e;
+      }
+      continue;
+    }
+    if (e->hash == hash && e->token_len == token_len &&
+        e->ep_len == ep_len && memcmp(e->token, token, token_len) == 0 &&
+        memcmp(e->ep, ep, ep_len) == 0) {
+      return e;
+    }
+  }
+  if (free && *free) {
+    (*free)->hash = hash;
+  }
+  return NULL;
+}
+
+int coap_reasm_add(coap_reasm_t* r, const void* ep, size_t ep_len,
+                   const char* token, uint8_t token_len,
+                   const coap_block_t* b, const char* payload,
+                   size_t payload_len, uint32_t now, const char** body,
+                   size_t* body_len) {
+  coap_reasm_entry_t* free;
+  coap_reasm_entry_t* e;
+  size_t size;
+  size_t offset;
+  if (r == NULL || ep == NULL || ep_len > COAP_MAXLEN_ENDPOINT ||
+      token_len > COAP_MAXLEN_TOKEN || (token == NULL && token_len > 0) ||
+      b == NULL || b->szx > 6 || (payload == NULL && payload_len > 0) ||
+      body == NULL || body_len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  *body = NULL;
+  *body_len = 0;
+  size = 16 << b->szx;
+  offset = (size_t)b->num * size;
+  e = coap_reasm_find_(r, ep, ep_len, token, token_len, now, &free);
+  if (b->num == 0 && (e == NULL || e->done)) {
+    // The first block (re)starts a transfer.
+    if (e == NULL) {
+      if (free == NULL) {
+        return COAP_ERR_LIMIT;
+      }
+      e = free;
+      e->used = 1;
+      e->token_len = token_len;
+      e->ep_len = ep_len;
+      memcpy(e->token, token, token_len);
+      memcpy(e->ep, ep, ep_len);
+    }
+    e->len = 0;
+    e->done = 0;
+  }
+  if (e == NULL) {
+    return COAP_ERR_INCOMPLETE;
+  }
+  if (offset + payload_len <= e->len) {
+    // A retransmitted block that is already in place.
+    if (e->done) {
+      *body = &r->bodies[(e - r->entries) * r->max_len];
+      *body_len = e->len;
+    }
+    return COAP_ERR_DUPLICATE;
+  }
+  if (offset != e->len || e->done) {
+    e->used = 0;
+    return COAP_ERR_INCOMPLETE;
+  }
+  if (b->more && payload_len != size) {
+    e->used = 0;
+    return COAP_ERR_SYNTAX;
+  }
+  if (r->max_len - e->len < payload_len) {
+    e->used = 0;
+    return COAP_ERR_LIMIT;
+  }
+  memcpy(&r->bodies[(e - r->entries) * r->max_len + e->len], payload,
+         payload_len);
+  e->len += payload_len;
+  e->expires = now + COAP_EXCHANGE_LIFETIME;
+  if (!b->more) {
+    e->done = 1;
+    *body = &r->bodies[(e - r->entries) * r->max_len];
+    *body_len = e->len;
+  }
+  return COAP_OK;
+}
+
+int coap_reasm_remove(coap_reasm_t* r, const void* ep, size_t ep_len,
+                      const char* token, uint8_t token_len) {
+  coap_reasm_entry_t* e;
+  if (r == NULL || ep == NULL || ep_len > COAP_MAXLEN_ENDPOINT ||
+      token_len > COAP_MAXLEN_TOKEN || (token == NULL && token_len > 0)) {
+    return COAP_ERR_ARG;
+  }
+  e = coap_reasm_find_(r, ep, ep_len, token, token_len, 0, NULL);
+  if (e == NULL) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  e->used = 0;
+  return COAP_OK;
+}
+
+int coap_block2_slice(const char* rep, size_t rep_len, const coap_block_t* req,
+                      uint8_t max_szx, coap_block_t* res, const char** chunk,
+                      size_t* chunk_len) {
+  uint32_t num;
+  uint8_t szx;
+  size_t offset;
+  size_t size;
+  if ((rep == NULL && rep_len > 0) || req == NULL || req->szx > 6 ||
+      max_szx > 6 || res == NULL || chunk == NULL || chunk_len == NULL) {
+    return COAP_ERR_ARG;
+  }
+  // Answer with the smaller block size if the request asks for more than
+  // the server wants to send.
+  szx = req->szx < max_szx ? req->szx : max_szx;
+  num = req->num << (req->szx - szx);
+  if (num > 0xFFFFF) {
+    return COAP_ERR_LIMIT;
+  }
+  size = 16 << szx;
+  offset = (size_t)num * size;
+  if (offset > rep_len || (offset == rep_len && num > 0)) {
+    return COAP_ERR_NOT_FOUND;
+  }
+  *chunk = rep + offset;
+  *chunk_len = rep_len - offset < size ? rep_len - offset : size;
+  res->num = num;
+  res->more = offset + *chunk_len < rep_len;
+  res->szx = szx;
+  return COAP_OK;
+}
+
+/**
+ * A node of the router trie for one path segment. While routes are added,
+ * children are chained through |child| and |next|. Compiling lays nodes
+ * out breadth first so that the literal children of a node are contiguous
+ * from |child| and sorted by segment; "*" and "**" children are kept apart
+ * in |wild| and |rest|.
+ */
+typedef struct coap_route_node_t {
+  uint32_t seg;
+  uint32_t child;
+  uint32_t next;
+  uint32_t wild;
+  uint32_t rest;
+  uint32_t route;
+  uint32_t methods;
+  uint16_t children;
+  uint8_t seg_len;
+} coap_route_node_t;
+
+/**
+ * A handler registered for one method of a node.
+ */
+typedef struct coap_route_t {
+  void* cookie;
+  uint32_t next;
+  uint8_t method;
+} coap_route_t;
+
+/**
+ * Uri-Path router. |nodes| and |chars| hold the trie while routes are
+ * added; compiling rebuilds it in |cnodes| and |cchars|.
+ */
+struct coap_router_t {
+  size_t max_nodes;
+  size_t max_routes;
+  size_t max_chars;
+  size_t nodes_len;
+  size_t routes_len;
+  size_t chars_len;
+  uint8_t compiled;
+  coap_route_node_t* nodes;
+  coap_route_node_t* cnodes;
+  coap_route_t* routes;
+  char* chars;
+  char* cchars;
+};
+
+size_t coap_router_size(size_t max_nodes, size_t max_routes,
+                        size_t max_chars) {
+  return sizeof(coap_router_t) + 2 * max_nodes * sizeof(coap_route_node_t) +
+         max_routes * sizeof(coap_route_t) + 2 * max_chars;
+}
+
+static uint32_t coap_router_node_(coap_router_t* r, const char* seg,
+                                  uint8_t seg_len) {
+  coap_route_node_t* n;
+  if (r->nodes_len == r->max_nodes || r->max_chars - r->chars_len < seg_len) {
+    return COAP_NONE;
+  }
+  n = &r->nodes[r->nodes_len];
+  memset(n, 0, sizeof(coap_route_node_t));
+  n->seg = r->chars_len;
+  n->seg_len = seg_len;
+  n->child = n->next = n->wild = n->rest = n->route = COAP_NONE;
+  memcpy(&r->chars[r->chars_len], seg, seg_len);
+  r->chars_len += seg_len;
+  return r->nodes_len++;
+}
+
+int coap_router_create(coap_router_t** r, void* buf, size_t len,
+                       size_t max_nodes, size_t max_routes,
+                       size_t max_chars) {
+  if (r == NULL || buf == NULL || max_nodes == 0 || max_nodes >= COAP_NONE ||
+      max_routes >= COAP_NONE || max_chars >= COAP_NONE ||
+      coap_router_size(max_nodes, max_routes, max_chars) > len) {
+    return COAP_ERR_ARG;
+  }
+  *r = (coap_router_t*)buf;
+  memset(*r, 0, sizeof(coap_router_t));
+  (*r)->max_nodes = max_nodes;
+  (*r)->max_routes = max_routes;
+  (*r)->max_chars = max_chars;
+  (*r)->nodes = (coap_route_node_t*)((char*)buf + sizeof(coap_router_t));
+  (*r)->cnodes = &(*r)->nodes[max_nodes];
+  (*r)->routes = (coap_route_t*)&(*r)->cnodes[max_nodes];
+  (*r)->chars = (char*)&(*r)->routes[max_routes];
+  (*r)->cchars = &(*r)->chars[max_chars];
+  // The root node stands for the empty path.
+  coap_router_node_(*r, NULL, 0);
+  return COAP_OK;
+}
+
+int coap_router_add(coap_router_t* r, const char* path, uint8_t method,
+                    void* cookie) {
+  coap_route_node_t* n;
+  coap_route_t* route;
+  const char* seg;
+  size_t seg_len;
+  uint32_t i = 0;
+  uint32_t* link;
+  if (r == NULL || path == NULL || method == 0 || method >= 32) {
+    return COAP_ERR_ARG;
+  }
+  if (r->compiled) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  while (*path == '/') {
+    path++;
+  }
+  while (*path) {
+    seg = path;
+    for (seg_len = 0; seg[seg_len] && seg[seg_len] != '/'; seg_len++) {
+    }
+    path += seg_len + (seg[seg_len] == '/');
+    if (seg_len > 255) {
+      return COAP_ERR_ARG;
+    }
+    n = &r->nodes[i];
+    if (seg_len == 1 && seg[0] == '*') {
+      link = &n->wild;
+    } else if (seg_len == 2 && seg[0] == '*' && seg[1] == '*') {
+      // "**" matches the rest of the path and must come last.
+      if (*path) {
+        return COAP_ERR_ARG;
+      }
+      link = &n->rest;
+    } else {
+      for (link = &n->child; *link != COAP_NONE;
+           link = &r->nodes[*link].next) {
+        if (r->nodes[*link].seg_len == seg_len &&
+            memcmp(&r->chars[r->nodes[*link].seg], seg, seg_len) == 0) {
+          break;
+        }
+      }
+    }
+    if (*link == COAP_NONE) {
+      i = coap_router_node_(r, seg, seg_len);
+      if (i == COAP_NONE) {
+        return COAP_ERR_LIMIT;
+      }
+      *link = i;
+    }
+    i = *link;
+  }
+  n = &r->nodes[i];
+  if ((n->methods >> method) & 1) {
+    return COAP_ERR_DUPLICATE;
+  }
+  if (r->routes_len == r->max_routes) {
+    return COAP_ERR_LIMIT;
+  }
+  route = &r->routes[r->routes_len];
+  route->cookie = cookie;
+  route->method = method;
+  route->next = n->route;
+  n->route = r->routes_len++;
+  n->methods |= 1u << method;
+  return COAP_OK;
+}
+
+static int coap_router_cmp_(const char* chars, const coap_route_node_t* a,
+                            const char* seg, size_t seg_len) {
+  if (a->seg_len != seg_len) {
+    return a->seg_len < seg_len ? -1 : 1;
+  }
+  return memcmp(&chars[a->seg], seg, seg_len);
+}
+
+int coap_router_compile(coap_router_t* r) {
+  coap_route_node_t* src;
+  coap_route_node_t* dst;
+  coap_route_node_t tmp;
+  uint32_t head = 0;
+  uint32_t tail = 1;
+  uint32_t i, j, k;
+  if (r == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (r->compiled) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  // Breadth first copy. |next| of a copied node keeps the index of its
+  // source node until its children have been copied.
+  r->cnodes[0] = r->nodes[0];
+  r->cnodes[0].next = 0;
+  r->chars_len = 0;
+  for (head = 0; head < tail; head++) {
+    dst = &r->cnodes[head];
+    src = &r->nodes[dst->next];
+    memcpy(&r->cchars[r->chars_len], &r->chars[src->seg], src->seg_len);
+    dst->seg = r->chars_len;
+    r->chars_len += src->seg_len;
+    dst->children = 0;
+    dst->child = tail;
+    for (i = src->child; i != COAP_NONE; i = r->nodes[i].next) {
+      r->cnodes[tail] = r->nodes[i];
+      r->cnodes[tail++].next = i;
+      dst->children++;
+    }
+    // Sort the literal children by segment for binary search.
+    for (j = dst->child + 1; j < tail; j++) {
+      tmp = r->cnodes[j];
+      for (k = j; k > dst->child &&
+                  coap_router_cmp_(r->chars, &r->cnodes[k - 1],
+                                   &r->chars[tmp.seg], tmp.seg_len) > 0;
+           k--) {
+        r->cnodes[k] = r->cnodes[k - 1];
+      }
+      r->cnodes[k] = tmp;
+    }
+    if (src->wild != COAP_NONE) {
+      r->cnodes[tail] = r->nodes[src->wild];
+      r->cnodes[tail].next = src->wild;
+      dst->wild = tail++;
+    }
+    if (src->rest != COAP_NONE) {
+      r->cnodes[tail] = r->nodes[src->rest];
+      r->cnodes[tail].next = src->rest;
+      dst->rest = tail++;
+    }
+  }
+  for (i = 0; i < tail; i++) {
+    r->cnodes[i].next = COAP_NONE;
+  }
+  r->compiled = 1;
+  return COAP_OK;
+}
+
+/**
+ * Find a node with a method in |mask| for the Uri-Path options from |i| on
+ * below node |n|. Literal segments are tried before "*" and "**",
+ * backtracking when a more specific branch has no route.
+ */
+static uint32_t coap_router_walk_(const coap_router_t* r,
+                                  const coap_parser_t* p, size_t i,
+                                  uint32_t n, uint32_t mask) {
+  const coap_route_node_t* node = &r->cnodes[n];
+  const char* seg;
+  size_t seg_len;
+  uint32_t lo, hi, mid;
+  uint32_t res;
+  int cmp;
+  if (i == p->opts_len || p->opts[i].num != O_URI_PATH) {
+    if (node->methods & mask) {
+      return n;
+    }
+  } else {
+    seg = &p->buf[p->opts[i].offset];
+    seg_len = p->opts[i].len;
+    lo = node->child;
+    hi = node->child + node->children;
+    while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      cmp = coap_router_cmp_(r->cchars, &r->cnodes[mid], seg, seg_len);
+      if (cmp == 0) {
+        res = coap_router_walk_(r, p, i + 1, mid, mask);
+        if (res != COAP_NONE) {
+          return res;
+        }
+        break;
+      }
+      if (cmp < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (node->wild != COAP_NONE) {
+      res = coap_router_walk_(r, p, i + 1, node->wild, mask);
+      if (res != COAP_NONE) {
+        return res;
+      }
+    }
+  }
+  if (node->rest != COAP_NONE && (r->cnodes[node->rest].methods & mask)) {
+    return node->rest;
+  }
+  return COAP_NONE;
+}
+
+int coap_router_match(const coap_router_t* r, const coap_parser_t* p,
+                      void** cookie, coap_code_t* res) {
+  const coap_route_t* route;
+  uint32_t n;
+  size_t i;
+  int rc;
+  if (r == NULL || p == NULL || cookie == NULL || res == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (!r->compiled) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  rc = coap_p_index_(p);
+  if (rc) {
+    return rc;
+  }
+  for (i = 0; i < p->opts_len && p->opts[i].num < O_URI_PATH; i++) {
+  }
+  n = p->code < 32 ? coap_router_walk_(r, p, i, 0, 1u << p->code) : COAP_NONE;
+  if (n == COAP_NONE) {
+    // Tell a path without the method from an unknown path.
+    *res = coap_router_walk_(r, p, i, 0, 0xFFFFFFFF) == COAP_NONE
+             ? C_NOT_FOUND
+             : C_METHOD_NOT_ALLOWED;
+    return COAP_ERR_NOT_FOUND;
+  }
+  for (route = &r->routes[r->cnodes[n].route]; route->method != p->code;
+       route = &r->routes[route->next]) {
+  }
+  *cookie = route->cookie;
+  return COAP_OK;
+}
+
+/**
+ * Cache line size that coap_pool_t aligns its head, counters and slots to.
+ */
+#define COAP_CACHELINE 64
+#define COAP_CACHELINE_ALIGN(n) \
+  (((n) + COAP_CACHELINE - 1) & ~(size_t)(COAP_CACHELINE - 1))
+
+/**
+ * A pool slot: the item handed out, followed by the parser, the serializer
+ * and the output buffer it points to. |next| links free slots.
+ */
+typedef struct coap_pool_slot_t {
+  coap_pool_item_t item;
+  uint32_t next;
+} coap_pool_slot_t;
+
+/**
+ * Object pool. |head| holds the index of the first free slot in its low 32
+ * bits and a tag that changes on every update in its high 32 bits, so that
+ * a stale compare-and-swap can not succeed (ABA). The head and the
+ * counters sit on cache lines of their own.
+ */
+struct coap_pool_t {
+  uint64_t head;
+  char pad0[COAP_CACHELINE - sizeof(uint64_t)];
+  size_t in_use;
+  size_t high_water;
+  uint64_t acquired;
+  uint64_t exhausted;
+  char pad1[COAP_CACHELINE - 2 * sizeof(size_t) - 2 * sizeof(uint64_t)];
+  size_t capacity;
+  size_t slot_size;
+  char* slots;
+};
+
+static size_t coap_pool_slot_size_(size_t buf_len) {
+  return COAP_CACHELINE_ALIGN(sizeof(coap_pool_slot_t)) +
+         COAP_CACHELINE_ALIGN(sizeof(coap_parser_t)) +
+         COAP_CACHELINE_ALIGN(sizeof(coap_serializer_t)) +
+         COAP_CACHELINE_ALIGN(buf_len);
+}
+
+static coap_pool_slot_t* coap_pool_slot_(const coap_pool_t* pool,
+                                         uint32_t i) {
+  return (coap_pool_slot_t*)(pool->slots + i * pool->slot_size);
+}
+
+size_t coap_pool_size(size_t capacity, size_t buf_len) {
+  return COAP_CACHELINE + COAP_CACHELINE_ALIGN(sizeof(coap_pool_t)) +
+         capacity * coap_pool_slot_size_(buf_len);
+}
+
+int coap_pool_create(coap_pool_t** pool, void* buf, size_t len,
+                     size_t capacity, size_t buf_len) {
+  coap_pool_slot_t* slot;
+  char* mem;
+  uint32_t i;
+  if (pool == NULL || buf == NULL || capacity == 0 || capacity >= COAP_NONE ||
+      (buf_len > 0 && buf_len < COAP_LEN_HEADER) ||
+      coap_pool_size(capacity, buf_len) > len) {
+    return COAP_ERR_ARG;
+  }
+  *pool = (coap_pool_t*)COAP_CACHELINE_ALIGN((uintptr_t)buf);
+  memset(*pool, 0, sizeof(coap_pool_t));
+  (*pool)->capacity = capacity;
+  (*pool)->slot_size = coap_pool_slot_size_(buf_len);
+  (*pool)->slots = (char*)*pool + COAP_CACHELINE_ALIGN(sizeof(coap_pool_t));
+  for (i = 0; i < capacity; i++) {
+    slot = coap_pool_slot_(*pool, i);
+    mem = (char*)slot + COAP_CACHELINE_ALIGN(sizeof(coap_pool_slot_t));
+    coap_parser_create(&slot->item.parser, mem, sizeof(coap_parser_t));
+    mem += COAP_CACHELINE_ALIGN(sizeof(coap_parser_t));
+    slot->item.serializer = (coap_serializer_t*)mem;
+    memset(slot->item.serializer, 0, sizeof(coap_serializer_t));
+    mem += COAP_CACHELINE_ALIGN(sizeof(coap_serializer_t));
+    slot->item.buf = buf_len > 0 ? mem : NULL;
+    slot->item.buf_len = buf_len;
+    if (buf_len > 0) {
+      coap_serializer_create(&slot->item.serializer,
+                             slot->item.serializer, sizeof(coap_serializer_t),
+                             mem, buf_len);
+    }
+    slot->next = i + 1 < capacity ? i + 1 : COAP_NONE;
+  }
+  (*pool)->head = 0;
+  return COAP_OK;
+}
+
+int coap_pool_acquire(coap_pool_t* pool, coap_pool_item_t** item) {
+  coap_pool_slot_t* slot;
+  uint64_t head, next;
+  size_t in_use, high;
+  if (pool == NULL || item == NULL) {
+    return COAP_ERR_ARG;
+  }
+  head = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+  do {
+    if ((uint32_t)head == COAP_NONE) {
+      __atomic_fetch_add(&pool->exhausted, 1, __ATOMIC_RELAXED);
+      return COAP_ERR_LIMIT;
+    }
+    // |next| may be stale if another thread took the slot meanwhile; the
+    // tag makes the compare-and-swap fail then.
+    slot = coap_pool_slot_(pool, (uint32_t)head);
+    next = __atomic_load_n(&slot->next, __ATOMIC_RELAXED);
+    next |= ((head >> 32) + 1) << 32;
+  } while (!__atomic_compare_exchange_n(&pool->head, &head, next, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  in_use = __atomic_add_fetch(&pool->in_use, 1, __ATOMIC_RELAXED);
+  high = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+  while (in_use > high &&
+         !__atomic_compare_exchange_n(&pool->high_water, &high, in_use, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  __atomic_fetch_add(&pool->acquired, 1, __ATOMIC_RELAXED);
+  *item = &slot->item;
+  return COAP_OK;
+}
+
+int coap_pool_release(coap_pool_t* pool, coap_pool_item_t* item) {
+  coap_pool_slot_t* slot = (coap_pool_slot_t*)item;
+  uint64_t head, next;
+  uint32_t i;
+  if (pool == NULL || item == NULL || (char*)slot < pool->slots ||
+      (size_t)((char*)slot - pool->slots) % pool->slot_size != 0 ||
+      (size_t)((char*)slot - pool->slots) / pool->slot_size >=
+        pool->capacity) {
+    return COAP_ERR_ARG;
+  }
+  i = ((char*)slot - pool->slots) / pool->slot_size;
+  // Count down before the slot can be taken again, so that |in_use| never
+  // exceeds the items actually held.
+  __atomic_fetch_sub(&pool->in_use, 1, __ATOMIC_RELAXED);
+  head = __atomic_load_n(&pool->head, __ATOMIC_RELAXED);
+  do {
+    __atomic_store_n(&slot->next, (uint32_t)head, __ATOMIC_RELAXED);
+    next = (((head >> 32) + 1) << 32) | i;
+  } while (!__atomic_compare_exchange_n(&pool->head, &head, next, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return COAP_OK;
+}
+
+int coap_pool_get_stats(const coap_pool_t* pool, coap_pool_stats_t* stats) {
+  if (pool == NULL || stats == NULL) {
+    return COAP_ERR_ARG;
+  }
+  stats->capacity = pool->capacity;
+  stats->in_use = __atomic_load_n(&pool->in_use, __ATOMIC_RELAXED);
+  stats->high_water = __atomic_load_n(&pool->high_water, __ATOMIC_RELAXED);
+  stats->acquired = __atomic_load_n(&pool->acquired, __ATOMIC_RELAXED);
+  stats->exhausted = __atomic_load_n(&pool->exhausted, __ATOMIC_RELAXED);
+  return COAP_OK;
+}
+
 size_t coap_serializer_size() { return sizeof(coap_serializer_t); }
 size_t coap_parser_size() { return sizeof(coap_parser_t); }
+size_t coap_template_size() { return sizeof(coap_template_t); }
+size_t coap_builder_size() { return sizeof(coap_builder_t); }
+size_t coap_editor_size() { return sizeof(coap_editor_t); }
+size_t coap_stream_size(size_t max_opt_len) {
+  return sizeof(coap_stream_t) + max_opt_len;
+}
@@ -6,8 +6,33 @@ extern "C" {
 #endif
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <stdint.h>
 
+/**
+ * Build modes. By default the API is linked from libgreencoap. Defining
+ * GREENCOAP_IMPLEMENTATION in one C file compiles the implementation into
+ * it instead. Defining GREENCOAP_STATIC in any C file gives it a private
+ * static inline copy that the compiler can inline into the caller.
+ *
+ * Compile-time switches for these modes (or for building the library):
+ * GREENCOAP_NO_VALIDATION skips the checks of message types, codes and
+ * options against RFC 7252 for trusted peers; bounds are still checked.
+ * GREENCOAP_NO_CALLBACKS removes the coap_parser_settings_t callbacks of
+ * coap_parser_t. COAP_MAXLEN_TOKEN and COAP_MAXLEN_OPT cap the token length
+ * and the option value length. COAP_MAXNUM_OPTS caps the options a parser
+ * indexes per message; the option getters of a message with more return
+ * COAP_ERR_LIMIT, but it is still parsed and its options passed to on_opt.
+ */
+#if defined(GREENCOAP_STATIC)
+#define COAP_API static inline
+#ifndef GREENCOAP_IMPLEMENTATION
+#define GREENCOAP_IMPLEMENTATION
+#endif
+#else
+#define COAP_API
+#endif
+
 /**
  * Status codes for greencoap APIs.
  */
@@ -20,8 +45,32 @@ typedef enum coap_status_t {
   COAP_ERR_SYSTEM = -5,
   COAP_ERR_INTERNAL = -6,
   COAP_ERR_UNKNOWN = -7,
+  COAP_ERR_NOT_FOUND = -8,
+  COAP_ERR_DUPLICATE = -9,
+  COAP_ERR_INCOMPLETE = -10,
 } coap_status_t;
 
+/**
+ * CoAP transmission parameters (RFC 7252 section 4.8). Times are in
+ * milliseconds; ACK_RANDOM_FACTOR is given in percent.
+ */
+#define COAP_ACK_TIMEOUT 2000
+#define COAP_ACK_RANDOM_FACTOR 150
+#define COAP_MAX_RETRANSMIT 4
+#define COAP_EXCHANGE_LIFETIME 247000
+#define COAP_NON_LIFETIME 145000
+
+/**
+ * Longest time in milliseconds between confirmable notifications to an
+ * observer (RFC 7641 section 4.5).
+ */
+#define COAP_OBSERVE_CON_INTERVAL 86400000
+
+/**
+ * Maximum length of an endpoint key, e.g. a struct sockaddr_in6.
+ */
+#define COAP_MAXLEN_ENDPOINT 28
+
 /**
  * CoAP message types.
  */
@@ -65,6 +114,12 @@ typedef enum coap_code_t {
   C_SERVICE_UNAVAILABLE = 5 << 5 | 3,     // 5.03
   C_GATEWAY_TIMEOUT = 5 << 5 | 4,         // 5.04
   C_PROXYING_NOT_SUPPORTED = 5 << 5 | 5,  // 5.05
+  // 7.xx, signals on reliable transports (RFC 8323)
+  C_CSM = 7 << 5 | 1,      // 7.01
+  C_PING = 7 << 5 | 2,     // 7.02
+  C_PONG = 7 << 5 | 3,     // 7.03
+  C_RELEASE = 7 << 5 | 4,  // 7.04
+  C_ABORT = 7 << 5 | 5,    // 7.05
 } coap_code_t;
 
 /**
@@ -79,6 +134,7 @@ typedef enum coap_opt_number_t {
   O_OBSERVE = 6,
   O_URI_PORT = 7,
   O_LOCATION_PATH = 8,
+  O_OSCORE = 9,
   O_URI_PATH = 11,
   O_CONTENT_FORMAT = 12,
   O_MAX_AGE = 14,
@@ -87,6 +143,7 @@ typedef enum coap_opt_number_t {
   O_LOCATION_QUERY = 20,
   O_BLOCK2 = 23,
   O_BLOCK1 = 27,
+  O_SIZE2 = 28,
   O_PROXY_URI = 35,
   O_PROXY_SCHEME = 39,
   O_SIZE1 = 60,
@@ -99,12 +156,12 @@ typedef enum coap_opt_number_t {
 /**
  * CoAP media types.
  */
-const uint16_t F_TEXT_PLAIN = 0;
-const uint16_t F_APPLICATION_LINK_FORMAT = 40;
-const uint16_t F_APPLICATION_XML = 41;
-const uint16_t F_APPLICATION_OCTET_STREAM = 42;
-const uint16_t F_APPLICATION_EXI = 47;
-const uint16_t F_APPLICATION_JSON = 50;
+static const uint16_t F_TEXT_PLAIN = 0;
+static const uint16_t F_APPLICATION_LINK_FORMAT = 40;
+static const uint16_t F_APPLICATION_XML = 41;
+static const uint16_t F_APPLICATION_OCTET_STREAM = 42;
+static const uint16_t F_APPLICATION_EXI = 47;
+static const uint16_t F_APPLICATION_JSON = 50;
 
 /** CoAP serializer */
 typedef struct coap_serializer_t coap_serializer_t;
@@ -112,6 +169,167 @@ typedef struct coap_serializer_t coap_serializer_t;
 /** CoAP parser */
 typedef struct coap_parser_t coap_parser_t;
 
+/** Streaming parser of CoAP over TCP and WebSockets frames */
+typedef struct coap_stream_t coap_stream_t;
+
+/** CoAP option builder accepting options in any order */
+typedef struct coap_builder_t coap_builder_t;
+
+/** CoAP message deduplication table */
+typedef struct coap_dedup_t coap_dedup_t;
+
+/** CoAP proxy response cache */
+typedef struct coap_cache_t coap_cache_t;
+
+/** CoAP retransmission scheduler for confirmable messages */
+typedef struct coap_retx_t coap_retx_t;
+
+/** CoAP client exchange table matching responses to requests */
+typedef struct coap_exchange_t coap_exchange_t;
+
+/** Observer registry of a resource */
+typedef struct coap_observe_t coap_observe_t;
+
+/**
+ * A notification to one observer handed back by coap_observe_emit. |iov|
+ * points into the struct itself and into the message given to
+ * coap_observe_notify, so neither may move until it is sent, e.g. with
+ * sendmmsg to |ep|.
+ */
+typedef struct coap_notification_t {
+  struct iovec iov[4];
+  size_t iov_len;
+  size_t len;
+  const void* ep;
+  uint8_t ep_len;
+  uint8_t type;
+  uint16_t mid;
+  char head[4 + 8];
+  char observe[4];
+} coap_notification_t;
+
+/** Block1/Block2 option value (RFC 7959) */
+typedef struct coap_block_t {
+  uint32_t num;
+  uint8_t more;
+  uint8_t szx;
+} coap_block_t;
+
+/** Block size for a size exponent */
+#define COAP_BLOCK_SIZE(szx) ((size_t)16 << (szx))
+
+/** Content-Format or Accept of a message without the option */
+#define COAP_FORMAT_NONE 0xFFFFFFFF
+
+/** Max-Age of a response without the option (RFC 7252 5.10.5) */
+#define COAP_DEFAULT_MAX_AGE 60
+
+/**
+ * The uint options of a parsed message. Bit n of |present| is set if option
+ * n is in the message. Absent options take their defaults: Max-Age is
+ * COAP_DEFAULT_MAX_AGE, Content-Format and Accept are COAP_FORMAT_NONE and
+ * the others are 0.
+ */
+typedef struct coap_uint_opts_t {
+  uint64_t present;
+  uint32_t observe;
+  uint32_t uri_port;
+  uint32_t content_format;
+  uint32_t max_age;
+  uint32_t accept;
+  uint32_t size2;
+  uint32_t size1;
+  coap_block_t block2;
+  coap_block_t block1;
+} coap_uint_opts_t;
+
+/** Block1 reassembly pool */
+typedef struct coap_reasm_t coap_reasm_t;
+
+/** Uri-Path resource router */
+typedef struct coap_router_t coap_router_t;
+
+/** Thread-safe pool of parser and serializer instances */
+typedef struct coap_pool_t coap_pool_t;
+
+/**
+ * A pool item. |serializer| writes to |buf| if the pool has output
+ * buffers; otherwise it has to be set up with coap_serializer_create on the
+ * caller's buffer first.
+ */
+typedef struct coap_pool_item_t {
+  coap_parser_t* parser;
+  coap_serializer_t* serializer;
+  char* buf;
+  size_t buf_len;
+} coap_pool_item_t;
+
+/** Usage counters of a coap_pool_t */
+typedef struct coap_pool_stats_t {
+  size_t capacity;
+  size_t in_use;
+  size_t high_water;
+  uint64_t acquired;
+  uint64_t exhausted;
+} coap_pool_stats_t;
+
+/**
+ * Reasons for rejecting a message, counted in coap_stats_t.
+ */
+typedef enum coap_stats_err_t {
+  COAP_STATS_ERR_TRUNCATED = 0,       // a field runs past the end
+  COAP_STATS_ERR_VERSION = 1,         // version other than 1
+  COAP_STATS_ERR_TYPE_CODE = 2,       // invalid type and code combination
+  COAP_STATS_ERR_TOKEN = 3,           // token length over 8
+  COAP_STATS_ERR_OPT_DELTA = 4,       // reserved delta or number over 65535
+  COAP_STATS_ERR_OPT_LENGTH = 5,      // reserved or out of range length
+  COAP_STATS_ERR_OPT_UNKNOWN = 6,     // unknown option number up to 255
+  COAP_STATS_ERR_OPT_REPEAT = 7,      // repeated non-repeatable option
+  COAP_STATS_ERR_PAYLOAD_MARKER = 8,  // payload marker without payload
+  COAP_STATS_ERR_LIMIT = 9,           // too large
+  COAP_STATS_ERR_MAX = 10,
+} coap_stats_err_t;
+
+/**
+ * Number of option histogram buckets in coap_stats_t. Option numbers from
+ * COAP_STATS_NUM_OPTS - 1 up share the last bucket.
+ */
+#define COAP_STATS_NUM_OPTS 64
+
+/**
+ * Counters of the parsers and serializers a coap_stats_t is attached to.
+ * They are kept only if the library is built with GREENCOAP_STATS. A
+ * coap_stats_t is written without locking, so it must not be shared by
+ * instances used on different threads; coap_stats_add aggregates them.
+ */
+typedef struct coap_stats_t {
+  uint64_t parsed;
+  uint64_t parsed_bytes;
+  uint64_t serialized;
+  uint64_t serialized_bytes;
+  uint64_t serialize_errors;
+  uint64_t errors[COAP_STATS_ERR_MAX];
+  uint64_t opt_length_errors[COAP_STATS_NUM_OPTS];  // per option number
+  uint64_t opts[COAP_STATS_NUM_OPTS];  // options parsed per option number
+} coap_stats_t;
+
+/** A due retransmission handed back by coap_retx_poll */
+typedef struct coap_retx_event_t {
+  const char* msg;
+  size_t len;
+  void* cookie;
+  uint16_t mid;
+  uint8_t gave_up;
+  uint8_t ep_len;
+  uint8_t ep[COAP_MAXLEN_ENDPOINT];
+} coap_retx_event_t;
+
+/** Pre-encoded CoAP message template */
+typedef struct coap_template_t coap_template_t;
+
+/** Editor of parsed CoAP messages */
+typedef struct coap_editor_t coap_editor_t;
+
 /** CoAP parser callback functions */
 typedef void (*coap_parser_cb_t)(void*);
 typedef void (*coap_parser_cb_header_t)(void*, coap_type_t, coap_code_t,
@@ -129,96 +347,856 @@ typedef struct coap_parser_settings_t {
   coap_parser_cb_t on_complete;
 } coap_parser_settings_t;
 
+/** A received datagram handed to coap_parser_exec_batch */
+typedef struct coap_datagram_t {
+  const char* buf;
+  size_t len;
+} coap_datagram_t;
+
+/**
+ * Structure-of-arrays result block filled by coap_parser_exec_batch. Each
+ * member points to a caller-provided array with at least as many elements as
+ * datagrams in the batch. Offsets are relative to the datagram buffer. Only
+ * |status| is set for datagrams that fail to parse.
+ */
+typedef struct coap_batch_t {
+  uint8_t* type;
+  uint8_t* code;
+  uint16_t* mid;
+  uint8_t* token_offset;
+  uint8_t* token_len;
+  size_t* payload_offset;
+  size_t* payload_len;
+  int* status;
+} coap_batch_t;
+
 /**
  * Create a CoAP serializer with fixed size memory space.
  */
-int coap_serializer_create(coap_serializer_t** s, void* buf, size_t len,
-                           char* dst_buf, size_t dst_len);
+COAP_API int coap_serializer_create(coap_serializer_t** s, void* buf,
+                                    size_t len, char* dst_buf, size_t dst_len);
 
 /**
  * Initialize the CoAP serializer with message type, code and token
  * length.
  */
-int coap_serializer_init(coap_serializer_t* s, uint8_t type, uint8_t code,
-                         uint8_t token_len);
+COAP_API int coap_serializer_init(coap_serializer_t* s, uint8_t type,
+                                  uint8_t code, uint8_t token_len);
 
 /**
  * Add an option.
  */
-int coap_serializer_add_opt(coap_serializer_t* s, uint16_t opt, const char* val,
-                            size_t len);
+COAP_API int coap_serializer_add_opt(coap_serializer_t* s, uint16_t opt,
+                                     const char* val, size_t len);
 /**
  * Add a uint option.
  */
-int coap_serializer_add_opt_uint(coap_serializer_t* s, uint16_t opt,
-                                 uint32_t val);
+COAP_API int coap_serializer_add_opt_uint(coap_serializer_t* s, uint16_t opt,
+                                          uint32_t val);
 
 /**
  * Execute (Finalize) the CoAP serializer with message id, token, and payload.
  */
-int coap_serializer_exec(coap_serializer_t* s, uint16_t mid, const char* token,
-                         const char* payload, size_t payload_len,
-                         size_t* msg_len);
+COAP_API int coap_serializer_exec(coap_serializer_t* s, uint16_t mid,
+                                  const char* token, const char* payload,
+                                  size_t payload_len, size_t* msg_len);
+
+/**
+ * Execute (Finalize) the CoAP serializer without copying the payload. Only
+ * the header, token, options and payload marker are written to the
+ * destination buffer. |iov| must have room for 2 entries; it is set to the
+ * destination buffer followed by the caller's payload, ready for sendmsg,
+ * and the number of entries used is stored in |iov_len|.
+ */
+COAP_API int coap_serializer_exec_iov(coap_serializer_t* s, uint16_t mid,
+                                      const char* token, const char* payload,
+                                      size_t payload_len, struct iovec* iov,
+                                      size_t* iov_len, size_t* msg_len);
+
+/**
+ * Count the messages of the serializer in |stats|, or stop if it is NULL.
+ */
+COAP_API int coap_serializer_set_stats(coap_serializer_t* s,
+                                       coap_stats_t* stats);
+
+/**
+ * Initialize the CoAP serializer for a message on a reliable transport
+ * (RFC 8323), which has no type and may carry a 7.xx signal.
+ */
+COAP_API int coap_serializer_init_framed(coap_serializer_t* s, uint8_t code,
+                                         uint8_t token_len);
+
+/**
+ * Execute (Finalize) the CoAP serializer as an RFC 8323 frame with the
+ * Len/TKL header and the extended length instead of the type and the
+ * message id. It can not be mixed with coap_serializer_exec on the same
+ * message.
+ */
+COAP_API int coap_serializer_exec_framed(coap_serializer_t* s,
+                                         const char* token, const char* payload,
+                                         size_t payload_len, size_t* msg_len);
+
+/**
+ * Create a CoAP option builder with fixed size memory space.
+ */
+COAP_API int coap_builder_create(coap_builder_t** b, void* buf, size_t len,
+                                 char* dst_buf, size_t dst_len);
+
+/**
+ * Initialize the CoAP option builder with message type, code and token
+ * length.
+ */
+COAP_API int coap_builder_init(coap_builder_t* b, uint8_t type, uint8_t code,
+                               uint8_t token_len);
+
+/**
+ * Stage an option. Options may be added in any order; repeated options keep
+ * the order in which they were added. |val| is referenced, not copied, and
+ * must stay valid until coap_builder_exec. A second non-repeatable option
+ * is rejected with COAP_ERR_INVALID_CALL.
+ */
+COAP_API int coap_builder_add_opt(coap_builder_t* b, uint16_t opt,
+                                  const char* val, size_t len);
+
+/**
+ * Stage a uint option. The encoded value is kept in the builder.
+ */
+COAP_API int coap_builder_add_opt_uint(coap_builder_t* b, uint16_t opt,
+                                       uint32_t val);
+
+/**
+ * Sort and encode the staged options, then execute (finalize) the message
+ * with message id, token, and payload as coap_serializer_exec does. If the
+ * options do not fit, the staged options are kept and exec can be retried.
+ */
+COAP_API int coap_builder_exec(coap_builder_t* b, uint16_t mid,
+                               const char* token, const char* payload,
+                               size_t payload_len, size_t* msg_len);
+
+/**
+ * Create a CoAP message template with fixed size memory space. The encoded
+ * header and options are kept in |dst_buf|.
+ */
+COAP_API int coap_template_create(coap_template_t** t, void* buf, size_t len,
+                                  char* dst_buf, size_t dst_len);
+
+/**
+ * Initialize the CoAP message template with message type, code and token
+ * length.
+ */
+COAP_API int coap_template_init(coap_template_t* t, uint8_t type, uint8_t code,
+                                uint8_t token_len);
+
+/**
+ * Add an option with a constant value to the template.
+ */
+COAP_API int coap_template_add_opt(coap_template_t* t, uint16_t opt,
+                                   const char* val, size_t len);
+
+/**
+ * Add a uint option with a constant value to the template.
+ */
+COAP_API int coap_template_add_opt_uint(coap_template_t* t, uint16_t opt,
+                                        uint32_t val);
+
+/**
+ * Add a uint option whose value is encoded in |width| bytes (1-4) and set on
+ * every coap_template_exec call, e.g. the Observe sequence number. The index
+ * of the value in the |vals| array of coap_template_exec is stored in |slot|.
+ * Values are truncated to |width| bytes.
+ */
+COAP_API int coap_template_add_opt_slot(coap_template_t* t, uint16_t opt,
+                                        uint8_t width, uint8_t* slot);
+
+/**
+ * Write a message from the template into |dst| with message id, token, slot
+ * values and payload.
+ */
+COAP_API int coap_template_exec(const coap_template_t* t, char* dst,
+                                size_t dst_len, uint16_t mid, const char* token,
+                                const uint32_t* vals, const char* payload,
+                                size_t payload_len, size_t* msg_len);
 
 /**
  * Create a CoAP parser (coap_parser_t) with fixed size memory space.
  */
-int coap_parser_create(coap_parser_t** p, const char* buf, size_t len);
+COAP_API int coap_parser_create(coap_parser_t** p, const char* buf, size_t len);
 
 /**
  * Initialize a CoAP parser (coap_parser_t) with fixed size memory space.
+ * Built with GREENCOAP_NO_CALLBACKS, settings with callbacks are rejected
+ * with COAP_ERR_INVALID_CALL.
  */
-int coap_parser_init(coap_parser_t* p, const coap_parser_settings_t* s);
+COAP_API int coap_parser_init(coap_parser_t* p,
+                              const coap_parser_settings_t* s);
 
 /**
  * Parse a given buffer as a CoAP message.
  */
-int coap_parser_exec(coap_parser_t* p, const char* buf, size_t len);
+COAP_API int coap_parser_exec(coap_parser_t* p, const char* buf, size_t len);
+
+/**
+ * Parse only the fixed header and the token of a given buffer. The type,
+ * code, message id and token getters can be used right away; the options and
+ * the payload are decoded and validated on the first call that needs them or
+ * by coap_parser_finish. on_opt, on_payload and on_complete are invoked at
+ * that point. That first call may be an option or payload getter: although
+ * they take a const coap_parser_t*, it updates the parser and fires the
+ * callbacks, so a lazily parsed message must not be read from two threads
+ * until it is finished.
+ */
+COAP_API int coap_parser_exec_lazy(coap_parser_t* p, const char* buf,
+                                   size_t len);
+
+/**
+ * Decode and validate the options and the payload of a message parsed by
+ * coap_parser_exec_lazy. Calling it again returns the same result.
+ */
+COAP_API int coap_parser_finish(coap_parser_t* p);
+
+/**
+ * Parse |n| datagrams in one call with the same validation as
+ * coap_parser_exec, without invoking callbacks, and store the per-message
+ * results in |res|. After the call the parser holds the state of the last
+ * datagram.
+ */
+COAP_API int coap_parser_exec_batch(coap_parser_t* p,
+                                    const coap_datagram_t* msgs, size_t n,
+                                    coap_batch_t* res);
+
+/**
+ * Write an empty ACK (to a CON) or RST (to a CON or NON) for the parsed
+ * message: 4 bytes echoing its message id. The message may be parsed lazily.
+ */
+COAP_API int coap_reply_empty(const coap_parser_t* p, uint8_t type, char* dst,
+                              size_t dst_len, size_t* msg_len);
+
+/**
+ * Write back to back the empty ACKs of all CON messages that parsed in the
+ * results of coap_parser_exec_batch, 4 bytes each, and store their number
+ * in |acked|. If |idx| is not NULL, idx[k] is set to the datagram of ACK k.
+ */
+COAP_API int coap_reply_empty_batch(const coap_batch_t* res, size_t n,
+                                    char* dst, size_t dst_len, size_t* idx,
+                                    size_t* acked);
+
+/**
+ * Initialize the CoAP serializer for the response to the parsed request
+ * with the token copied from the request: piggybacked in an ACK with the
+ * request's message id for a CON, or as a NON with message id |mid| for a
+ * NON. The message may be parsed lazily.
+ */
+COAP_API int coap_serializer_init_reply(coap_serializer_t* s,
+                                        const coap_parser_t* p, uint8_t code,
+                                        uint16_t mid);
+
+/**
+ * Execute (Finalize) a response started by coap_serializer_init_reply.
+ */
+COAP_API int coap_serializer_exec_reply(coap_serializer_t* s,
+                                        const char* payload,
+                                        size_t payload_len, size_t* msg_len);
+
+/**
+ * Count the messages and errors of the parser in |stats|, or stop if it is
+ * NULL. Lazily parsed messages count once their options are decoded.
+ */
+COAP_API int coap_parser_set_stats(coap_parser_t* p, coap_stats_t* stats);
 
 /**
  * Get the CoAP message type.
  */
-int coap_parser_get_type(const coap_parser_t* p, coap_type_t* res);
+COAP_API int coap_parser_get_type(const coap_parser_t* p, coap_type_t* res);
 
 /**
  * Get the CoAP message code.
  */
-int coap_parser_get_code(const coap_parser_t* p, coap_code_t* res);
+COAP_API int coap_parser_get_code(const coap_parser_t* p, coap_code_t* res);
 
 /**
  * Get the CoAP message id.
  */
-int coap_parser_get_mid(const coap_parser_t* p, uint16_t* res);
+COAP_API int coap_parser_get_mid(const coap_parser_t* p, uint16_t* res);
 
 /**
  * Get the CoAP message token.
  */
-int coap_parser_get_token(const coap_parser_t* p, const char** res,
-                          uint8_t* len);
+COAP_API int coap_parser_get_token(const coap_parser_t* p, const char** res,
+                                   uint8_t* len);
 
 /**
- * Get the value of path.
+ * Check whether the parsed message has an option. Returns 1 if it has and 0
+ * if not. Otherwise it returns a negative status:
+ * - COAP_ERR_ARG if |p| is NULL.
+ * - COAP_ERR_INVALID_CALL if nothing has been parsed.
+ * - COAP_ERR_SYNTAX if the options of a lazily parsed message are invalid.
+ * - COAP_ERR_LIMIT if the message has more than COAP_MAXNUM_OPTS options.
  */
-int coap_parser_get_path(const coap_parser_t* p, const char** buf, size_t* len);
+COAP_API int coap_parser_has_opt(const coap_parser_t* p, uint16_t opt);
+
+/**
+ * Get the value of the first occurrence of an option. The value points into
+ * the parsed buffer.
+ */
+COAP_API int coap_parser_get_opt(const coap_parser_t* p, uint16_t opt,
+                                 const char** val, size_t* len);
+
+/**
+ * Iterate over the occurrences of a (repeatable) option. |it| must be set to
+ * 0 before the first call. Returns COAP_ERR_NOT_FOUND when there are no more
+ * occurrences.
+ */
+COAP_API int coap_parser_next_opt(const coap_parser_t* p, uint16_t opt,
+                                  size_t* it, const char** val, size_t* len);
+
+/**
+ * Get the |i|-th option of the parsed message in wire order, which is the
+ * ascending order of the option numbers. Returns COAP_ERR_NOT_FOUND past the
+ * last option.
+ */
+COAP_API int coap_parser_get_opt_at(const coap_parser_t* p, size_t i,
+                                    uint16_t* opt, const char** val,
+                                    size_t* len);
+
+/**
+ * Iterate over the Uri-Path segments in the same way as coap_parser_next_opt.
+ */
+COAP_API int coap_parser_get_path(const coap_parser_t* p, size_t* it,
+                                  const char** buf, size_t* len);
 
 /**
  * Get a CoAP message payload.
  */
-int coap_parser_get_payload(const coap_parser_t* p, const char** buf,
-                            size_t* len);
+COAP_API int coap_parser_get_payload(const coap_parser_t* p, const char** buf,
+                                     size_t* len);
+
+/**
+ * Decode the value of a Block1 or Block2 option.
+ */
+COAP_API int coap_block_decode(const char* val, size_t len, coap_block_t* b);
+
+/**
+ * Encode a Block1 or Block2 option value for coap_serializer_add_opt_uint.
+ */
+COAP_API int coap_block_encode(const coap_block_t* b, uint32_t* val);
+
+/**
+ * Get and decode the Block1 or Block2 option of the parsed message.
+ */
+COAP_API int coap_parser_get_block(const coap_parser_t* p, uint16_t opt,
+                                   coap_block_t* b);
+
+/**
+ * Get the value of a uint option. Returns COAP_ERR_NOT_FOUND if the message
+ * does not have it and COAP_ERR_SYNTAX if it is longer than 4 bytes.
+ */
+COAP_API int coap_parser_get_opt_uint(const coap_parser_t* p, uint16_t opt,
+                                      uint32_t* res);
+
+/**
+ * Get the Max-Age of a response, COAP_DEFAULT_MAX_AGE if it has none.
+ */
+COAP_API int coap_parser_get_max_age(const coap_parser_t* p, uint32_t* res);
+
+/**
+ * Get the Content-Format of a message. Returns COAP_ERR_NOT_FOUND if it has
+ * none; it has no default.
+ */
+COAP_API int coap_parser_get_content_format(const coap_parser_t* p,
+                                            uint16_t* res);
+
+/**
+ * Decode all uint options of the parsed message in one pass over its
+ * options.
+ */
+COAP_API int coap_parser_get_uint_opts(const coap_parser_t* p,
+                                       coap_uint_opts_t* res);
+
+/**
+ * Create an editor of parsed messages with fixed size memory space. Edited
+ * messages are written to |dst_buf|, which must not overlap the parsed
+ * message.
+ */
+COAP_API int coap_editor_create(coap_editor_t** e, void* buf, size_t len,
+                                char* dst_buf, size_t dst_len);
+
+/**
+ * Start editing the message parsed by |p|. The parser and its buffer must
+ * not change until the edited message is written by coap_editor_exec.
+ */
+COAP_API int coap_editor_init(coap_editor_t* e, const coap_parser_t* p);
+
+/**
+ * Replace the type, code and message id.
+ */
+COAP_API int coap_editor_set_header(coap_editor_t* e, uint8_t type,
+                                    uint8_t code, uint16_t mid);
+
+/**
+ * Replace the token. |token| is read on exec.
+ */
+COAP_API int coap_editor_set_token(coap_editor_t* e, const char* token,
+                                   uint8_t token_len);
+
+/**
+ * Replace the payload. |payload| is read on exec.
+ */
+COAP_API int coap_editor_set_payload(coap_editor_t* e, const char* payload,
+                                     size_t payload_len);
+
+/**
+ * Remove all occurrences of an option of the parsed message. Returns
+ * COAP_ERR_NOT_FOUND if it has none.
+ */
+COAP_API int coap_editor_remove_opt(coap_editor_t* e, uint16_t opt);
+
+/**
+ * Add an option after the occurrences of the same option in the parsed
+ * message. |val| is read on exec.
+ */
+COAP_API int coap_editor_add_opt(coap_editor_t* e, uint16_t opt,
+                                 const char* val, size_t len);
+
+/**
+ * Add a uint option.
+ */
+COAP_API int coap_editor_add_opt_uint(coap_editor_t* e, uint16_t opt,
+                                      uint32_t val);
+
+/**
+ * Write the edited message. Runs of options that are kept are copied
+ * as they are; only the option after a removed or an added one is
+ * re-encoded, and the payload is copied as one block. It can be called again
+ * after further edits.
+ */
+COAP_API int coap_editor_exec(coap_editor_t* e, size_t* msg_len);
+
+/**
+ * Create a streaming parser of RFC 8323 frames with fixed size memory space
+ * of coap_stream_size() bytes. Option values of up to |max_opt_len| bytes
+ * may straddle chunks; frames whose options and payload exceed |max_len|
+ * bytes are rejected with COAP_ERR_LIMIT.
+ */
+COAP_API int coap_stream_create(coap_stream_t** st, void* buf, size_t len,
+                                size_t max_opt_len, size_t max_len);
+
+/**
+ * Set the callbacks and start at a frame boundary.
+ */
+COAP_API int coap_stream_init(coap_stream_t* st,
+                              const coap_parser_settings_t* s);
+
+/**
+ * Feed a chunk of the byte stream. Callbacks are invoked as soon as their
+ * field is complete, with pointers into the chunk unless the field
+ * straddles chunks. on_header gets T_CON and message id 0, and on_payload
+ * is invoked once per chunk the payload spans. After an error the stream
+ * is unusable (COAP_ERR_INVALID_CALL) until coap_stream_init.
+ */
+COAP_API int coap_stream_exec(coap_stream_t* st, const char* buf, size_t len);
+
+/**
+ * Check if the stream is between frames.
+ */
+COAP_API int coap_stream_is_idle(const coap_stream_t* st);
+
+/**
+ * Count the frames and errors of the stream in |stats|, or stop if it is
+ * NULL.
+ */
+COAP_API int coap_stream_set_stats(coap_stream_t* st, coap_stats_t* stats);
+
+/**
+ * Add the counters of |src| to |dst|. |src| may be updated concurrently by
+ * the thread that owns it; each counter is read atomically.
+ */
+COAP_API int coap_stats_add(coap_stats_t* dst, const coap_stats_t* src);
+
+/**
+ * Get a cheap monotonic clock in milliseconds for the time-based APIs. It
+ * wraps around after about 49 days, which the APIs take into account.
+ */
+COAP_API uint32_t coap_clock_ms();
+
+/**
+ * Create a deduplication table (RFC 7252 section 4.5) for |capacity| live
+ * messages with fixed size memory space of coap_dedup_size() bytes. Each
+ * entry can keep a serialized response of up to |max_response_len| bytes.
+ */
+COAP_API int coap_dedup_create(coap_dedup_t** d, void* buf, size_t len,
+                               size_t capacity, size_t max_response_len);
+
+/**
+ * Check whether a message with |mid| from the endpoint |ep| has been seen
+ * within EXCHANGE_LIFETIME. |ep| is an opaque key such as the peer's
+ * sockaddr with its padding zeroed. If it has not, it is recorded and
+ * COAP_OK is returned. Otherwise COAP_ERR_DUPLICATE is returned and |res|
+ * and |res_len| are set to the stored response, if any. |now| is a
+ * millisecond clock such as coap_clock_ms.
+ */
+COAP_API int coap_dedup_check(coap_dedup_t* d, const void* ep, size_t ep_len,
+                              uint16_t mid, uint32_t now, const char** res,
+                              size_t* res_len);
+
+/**
+ * Store the serialized response to a recorded message so that duplicates
+ * can be answered without calling the handler again.
+ */
+COAP_API int coap_dedup_set_response(coap_dedup_t* d, const void* ep,
+                                     size_t ep_len, uint16_t mid, uint32_t now,
+                                     const char* msg, size_t len);
+
+/**
+ * Create a response cache (RFC 7252 section 5.6) for |capacity| responses
+ * with fixed size memory space of coap_cache_size() bytes. Each entry is a
+ * slab slot of |max_entry_len| bytes that holds the cache key of the request
+ * and the serialized response. When the cache is full, entries are evicted
+ * in CLOCK order.
+ */
+COAP_API int coap_cache_create(coap_cache_t** c, void* buf, size_t len,
+                               size_t capacity, size_t max_entry_len);
+
+/**
+ * Look up a fresh response to the GET request |req| by its cache key, the
+ * method and all options but the NoCacheKey ones. On a hit the response is
+ * written to |dst| with the token of |req|, the remaining freshness as its
+ * Max-Age and the header of coap_serializer_init_reply: an ACK with the
+ * request's message id for a CON request, and a NON with |mid| otherwise.
+ * COAP_ERR_NOT_FOUND is returned on a miss or if the response is stale.
+ * |now| is a millisecond clock such as coap_clock_ms.
+ */
+COAP_API int coap_cache_get(coap_cache_t* c, const coap_parser_t* req,
+                            uint32_t now, uint16_t mid, char* dst,
+                            size_t dst_len, size_t* msg_len);
+
+/**
+ * Get the ETag of the response stored for |req|, fresh or stale, to ask the
+ * origin server whether it is still valid. The value points into the cache
+ * and is valid until the next coap_cache_put.
+ */
+COAP_API int coap_cache_get_etag(coap_cache_t* c, const coap_parser_t* req,
+                                 const char** etag, size_t* etag_len);
+
+/**
+ * Store the response |res| to the GET request |req|, fresh for its Max-Age
+ * (COAP_DEFAULT_MAX_AGE if it has none). A 2.03 Valid response with the
+ * ETag of the stored response makes it fresh again, and COAP_ERR_NOT_FOUND
+ * is returned if there is no such response. Responses other than 2.05,
+ * 4.xx and 5.xx are not cacheable and COAP_ERR_INVALID_CALL is returned.
+ * COAP_ERR_LIMIT is returned if the key and the response do not fit in an
+ * entry.
+ */
+COAP_API int coap_cache_put(coap_cache_t* c, const coap_parser_t* req,
+                            const coap_parser_t* res, uint32_t now);
+
+/**
+ * Create a retransmission scheduler for up to |capacity| outstanding
+ * confirmable messages with fixed size memory space of coap_retx_size()
+ * bytes. |now| is the current time of a millisecond clock such as
+ * coap_clock_ms, and |seed| seeds the random part of the timeouts.
+ */
+COAP_API int coap_retx_create(coap_retx_t** r, void* buf, size_t len,
+                              size_t capacity, uint32_t now, uint32_t seed);
+
+/**
+ * Schedule the retransmission of a confirmable message sent to |ep| (an
+ * opaque endpoint key). The serialized message |msg| is referenced, not
+ * copied, and must stay valid until it is acknowledged or given up on. The
+ * first timeout is chosen between ACK_TIMEOUT and ACK_TIMEOUT *
+ * ACK_RANDOM_FACTOR and doubles after each retransmission.
+ */
+COAP_API int coap_retx_add(coap_retx_t* r, const void* ep, size_t ep_len,
+                           uint16_t mid, const char* msg, size_t len,
+                           void* cookie, uint32_t now);
+
+/**
+ * Cancel the retransmission of a message when its ACK or RST arrives. The
+ * cookie given to coap_retx_add is stored in |cookie| if it is not NULL.
+ */
+COAP_API int coap_retx_cancel(coap_retx_t* r, const void* ep, size_t ep_len,
+                              uint16_t mid, void** cookie);
+
+/**
+ * Advance the scheduler to |now| and store up to |max| due events in
+ * |events|; their number is stored in |n|. An event either asks to resend
+ * |msg| as is or, after MAX_RETRANSMIT retransmissions, reports with
+ * |gave_up| set that the message is no longer tracked. When |events| fills
+ * up, the remaining events are returned by the next call.
+ */
+COAP_API int coap_retx_poll(coap_retx_t* r, uint32_t now,
+                            coap_retx_event_t* events, size_t max, size_t* n);
+
+/**
+ * Create an exchange table for up to |capacity| pending client requests
+ * with fixed size memory space of coap_exchange_size() bytes. |seed|
+ * randomizes the generated tokens. Tokens are matched without regard to the
+ * peer, so use one table per server or generated tokens only.
+ */
+COAP_API int coap_exchange_create(coap_exchange_t** x, void* buf, size_t len,
+                                  size_t capacity, uint64_t seed);
+
+/**
+ * Record a request with |mid| under a newly generated token of |token_len|
+ * (1-8) bytes that no other pending request uses. The token is stored in
+ * |token|. 8 byte tokens never repeat for the life of the table.
+ */
+COAP_API int coap_exchange_add(coap_exchange_t* x, uint16_t mid, char* token,
+                               uint8_t token_len, void* cookie);
+
+/**
+ * Record a request with |mid| under a token chosen by the caller.
+ * COAP_ERR_DUPLICATE is returned if the token or the MID is in use.
+ */
+COAP_API int coap_exchange_insert(coap_exchange_t* x, uint16_t mid,
+                                  const char* token, uint8_t token_len,
+                                  void* cookie);
+
+/**
+ * Find the pending request for the token of a response and store its cookie
+ * in |cookie|. The request stays pending, e.g. for Observe notifications.
+ */
+COAP_API int coap_exchange_match(const coap_exchange_t* x, const char* token,
+                                 uint8_t token_len, void** cookie);
+
+/**
+ * Find the pending request for the MID of an ACK or RST and store its
+ * cookie in |cookie|. The MID is released, so that an empty ACK is matched
+ * once and the separate response that follows is matched by token.
+ */
+COAP_API int coap_exchange_match_mid(coap_exchange_t* x, uint16_t mid,
+                                     void** cookie);
+
+/**
+ * Remove the pending request for a token once its exchange is complete.
+ */
+COAP_API int coap_exchange_remove(coap_exchange_t* x, const char* token,
+                                  uint8_t token_len, void** cookie);
+
+/**
+ * Create an observer registry (RFC 7641) for a resource with up to
+ * |capacity| observers with fixed size memory space of coap_observe_size()
+ * bytes.
+ */
+COAP_API int coap_observe_create(coap_observe_t** o, void* buf, size_t len,
+                                 size_t capacity);
+
+/**
+ * Register the observer identified by the endpoint |ep| and |token|, or
+ * update it if it is registered already. Notifications to it are
+ * confirmable if |con| is set and otherwise at least every
+ * COAP_OBSERVE_CON_INTERVAL. The current sequence number for the Observe
+ * option of the response is stored in |seq| if it is not NULL.
+ */
+COAP_API int coap_observe_register(coap_observe_t* o, const void* ep,
+                                   size_t ep_len, const char* token,
+                                   uint8_t token_len, uint8_t con, uint32_t now,
+                                   uint32_t* seq);
+
+/**
+ * Remove an observer, e.g. on a GET without Observe or an RST.
+ */
+COAP_API int coap_observe_deregister(coap_observe_t* o, const void* ep,
+                                     size_t ep_len, const char* token,
+                                     uint8_t token_len);
+
+/**
+ * Start notifying every observer of a new resource state. |msg| is the
+ * notification serialized once, with any type, MID and token and with an
+ * Observe option whose value is replaced by the next sequence number. It is
+ * referenced by the notifications and must stay valid until they are sent.
+ */
+COAP_API int coap_observe_notify(coap_observe_t* o, const char* msg,
+                                 size_t len);
+
+/**
+ * Store up to |max| notifications of the current state in |out|; their
+ * number is stored in |n|, which is 0 once every observer has been handed
+ * one. Each notification only differs from |msg| in its type, MID, token
+ * and Observe value. MIDs are taken from |mid|, which is advanced.
+ */
+COAP_API int coap_observe_emit(coap_observe_t* o, uint32_t now, uint16_t* mid,
+                               coap_notification_t* out, size_t max, size_t* n);
+
+/**
+ * Create a Block1 reassembly pool for up to |capacity| concurrent transfers
+ * of bodies of up to |max_len| bytes with fixed size memory space of
+ * coap_reasm_size() bytes.
+ */
+COAP_API int coap_reasm_create(coap_reasm_t** r, void* buf, size_t len,
+                               size_t capacity, size_t max_len);
+
+/**
+ * Add the payload of a request carrying the Block1 option |b| to the
+ * transfer of the endpoint |ep| and |token|. Block 0 starts a transfer.
+ * Returns COAP_OK when the block is accepted and, once the last block has
+ * arrived, points |body| at the reassembled body, which stays valid until
+ * coap_reasm_remove. A retransmitted block gives COAP_ERR_DUPLICATE, a
+ * missing block or transfer COAP_ERR_INCOMPLETE (4.08), and a body larger
+ * than |max_len| or a full pool COAP_ERR_LIMIT (4.13). Transfers without a
+ * block for EXCHANGE_LIFETIME are dropped.
+ */
+COAP_API int coap_reasm_add(coap_reasm_t* r, const void* ep, size_t ep_len,
+                            const char* token, uint8_t token_len,
+                            const coap_block_t* b, const char* payload,
+                            size_t payload_len, uint32_t now, const char** body,
+                            size_t* body_len);
+
+/**
+ * Release the transfer of the endpoint |ep| and |token|.
+ */
+COAP_API int coap_reasm_remove(coap_reasm_t* r, const void* ep, size_t ep_len,
+                               const char* token, uint8_t token_len);
+
+/**
+ * Get the block of the representation |rep| asked for by the Block2 option
+ * |req| without copying it. The block size is capped by |max_szx|. The
+ * Block2 option of the response is stored in |res|. COAP_ERR_NOT_FOUND is
+ * returned if the block lies beyond the representation.
+ */
+COAP_API int coap_block2_slice(const char* rep, size_t rep_len,
+                               const coap_block_t* req, uint8_t max_szx,
+                               coap_block_t* res, const char** chunk,
+                               size_t* chunk_len);
+
+/**
+ * Create a resource router with fixed size memory space of
+ * coap_router_size() bytes for up to |max_nodes| path segments in the trie
+ * (including the root), |max_routes| handlers and |max_chars| bytes of
+ * segment text.
+ */
+COAP_API int coap_router_create(coap_router_t** r, void* buf, size_t len,
+                                size_t max_nodes, size_t max_routes,
+                                size_t max_chars);
+
+/**
+ * Register |cookie| as the handler of |method| (e.g. C_GET) for |path|, such
+ * as "/sensors/ * /temp" without the spaces. A "*" segment matches any one
+ * segment and a final "**" matches the rest of the path. Literal segments
+ * take precedence over "*", and "*" over "**".
+ */
+COAP_API int coap_router_add(coap_router_t* r, const char* path, uint8_t method,
+                             void* cookie);
+
+/**
+ * Compile the registered routes into their lookup layout. No routes can be
+ * added afterwards.
+ */
+COAP_API int coap_router_compile(coap_router_t* r);
+
+/**
+ * Find the handler for the Uri-Path and method of a parsed request and
+ * store its cookie in |cookie|. Otherwise COAP_ERR_NOT_FOUND is returned
+ * and |res| is set to the response code, C_NOT_FOUND or
+ * C_METHOD_NOT_ALLOWED.
+ */
+COAP_API int coap_router_match(const coap_router_t* r, const coap_parser_t* p,
+                               void** cookie, coap_code_t* res);
+
+/**
+ * Create a pool of |capacity| parser and serializer pairs, each with an
+ * output buffer of |buf_len| bytes (none if 0), with fixed size memory
+ * space of coap_pool_size() bytes. Slots are cache line aligned, so
+ * |*pool| may point past the start of |buf|.
+ */
+COAP_API int coap_pool_create(coap_pool_t** pool, void* buf, size_t len,
+                              size_t capacity, size_t buf_len);
+
+/**
+ * Take an item from the pool. This is lock-free and can be called from any
+ * thread. COAP_ERR_LIMIT is returned if the pool is exhausted.
+ */
+COAP_API int coap_pool_acquire(coap_pool_t* pool, coap_pool_item_t** item);
+
+/**
+ * Return an item to the pool.
+ */
+COAP_API int coap_pool_release(coap_pool_t* pool, coap_pool_item_t* item);
+
+/**
+ * Get the usage counters of the pool.
+ */
+COAP_API int coap_pool_get_stats(const coap_pool_t* pool,
+                                 coap_pool_stats_t* stats);
 
 /**
  * Get the size of coap_serializer_t.
  */
-size_t coap_serializer_size();
+COAP_API size_t coap_serializer_size();
 
 /**
  * Get the size of coap_parser.
  */
-size_t coap_parser_size();
+COAP_API size_t coap_parser_size();
+
+/**
+ * Get the size of coap_template_t.
+ */
+COAP_API size_t coap_template_size();
+
+/**
+ * Get the size of coap_builder_t.
+ */
+COAP_API size_t coap_builder_size();
+
+/**
+ * Get the size of coap_editor_t.
+ */
+COAP_API size_t coap_editor_size();
+
+/**
+ * Get the size of a coap_dedup_t for |capacity| messages.
+ */
+COAP_API size_t coap_dedup_size(size_t capacity, size_t max_response_len);
+
+/**
+ * Get the size of a coap_cache_t for |capacity| entries.
+ */
+COAP_API size_t coap_cache_size(size_t capacity, size_t max_entry_len);
+
+/**
+ * Get the size of a coap_retx_t for |capacity| messages.
+ */
+COAP_API size_t coap_retx_size(size_t capacity);
+
+/**
+ * Get the size of a coap_exchange_t for |capacity| requests.
+ */
+COAP_API size_t coap_exchange_size(size_t capacity);
+
+/**
+ * Get the size of a coap_observe_t for |capacity| observers.
+ */
+COAP_API size_t coap_observe_size(size_t capacity);
+
+/**
+ * Get the size of a coap_reasm_t for |capacity| transfers of |max_len| bytes.
+ */
+COAP_API size_t coap_reasm_size(size_t capacity, size_t max_len);
+
+/**
+ * Get the size of a coap_router_t.
+ */
+COAP_API size_t coap_router_size(size_t max_nodes, size_t max_routes,
+                                 size_t max_chars);
+
+/**
+ * Get the size of a coap_pool_t for |capacity| items with |buf_len| byte
+ * output buffers.
+ */
+COAP_API size_t coap_pool_size(size_t capacity, size_t buf_len);
+
+/**
+ * Get the size of a coap_stream_t that gathers option values of up to
+ * |max_opt_len| bytes.
+ */
+COAP_API size_t coap_stream_size(size_t max_opt_len);
 
 #ifdef __cplusplus
 }
 #endif
 
+#ifdef GREENCOAP_IMPLEMENTATION
+#include "greencoap.c"
+#endif
+
 #endif /* !_GREENCOAP_H_ */
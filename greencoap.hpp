@@ -0,0 +1,421 @@
+#ifndef _GREENCOAP_HPP_
+#define _GREENCOAP_HPP_
+
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string_view>
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+#include "greencoap.h"
+
+/**
+ * C++17 wrapper of greencoap. Parser and Serializer own their C struct and
+ * are move-only; all views point into the parsed message or the serializer's
+ * buffer and are valid until the next exec. Methods return the coap_status_t
+ * codes of the C API. Define GREENCOAP_STATIC before the include to compile
+ * the library into the including translation unit instead of linking it.
+ */
+namespace greencoap {
+
+namespace detail {
+
+struct Free {
+  void operator()(void* p) const { ::operator delete(p); }
+};
+
+template <typename T>
+using Handle = std::unique_ptr<T, Free>;
+
+constexpr size_t kLenHeader = 4;
+
+constexpr uint8_t nibble(uint32_t v) {
+  return v < 13 ? (uint8_t)v : v < 269 ? 13 : 14;
+}
+
+}  // namespace detail
+
+/**
+ * Bytes of the extended delta or length field of an option for |v|.
+ */
+constexpr size_t opt_ext_len(uint32_t v) {
+  return v < 13 ? 0 : v < 269 ? 1 : 2;
+}
+
+/**
+ * Bytes of the header of an option |delta| numbers after the previous one
+ * with a |len| bytes long value.
+ */
+constexpr size_t opt_header_len(uint32_t delta, uint32_t len) {
+  return 1 + opt_ext_len(delta) + opt_ext_len(len);
+}
+
+/**
+ * Bytes of the shortest encoding of a uint option value.
+ */
+constexpr size_t uint_len(uint32_t v) {
+  return (v > 0xFFFFFF) + (v > 0xFFFF) + (v > 0xFF) + (v > 0);
+}
+
+/** An option of a parsed message. */
+struct Option {
+  uint16_t num;
+  std::string_view value;
+};
+
+/**
+ * Input iterator over the options of a parsed message in wire order, or over
+ * the occurrences of one option number.
+ */
+class OptionIterator {
+ public:
+  using iterator_category = std::input_iterator_tag;
+  using value_type = Option;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const Option*;
+  using reference = const Option&;
+
+  OptionIterator() = default;
+  OptionIterator(const coap_parser_t* p, int32_t num) : p_(p), num_(num) {
+    next_();
+  }
+
+  reference operator*() const { return opt_; }
+  pointer operator->() const { return &opt_; }
+  OptionIterator& operator++() {
+    next_();
+    return *this;
+  }
+  OptionIterator operator++(int) {
+    OptionIterator it = *this;
+    next_();
+    return it;
+  }
+  bool operator==(const OptionIterator& o) const {
+    return p_ == o.p_ && (p_ == nullptr || it_ == o.it_);
+  }
+  bool operator!=(const OptionIterator& o) const { return !(*this == o); }
+
+ private:
+  void next_() {
+    const char* val = nullptr;
+    size_t len = 0;
+    int rc;
+    if (num_ < 0) {
+      rc = coap_parser_get_opt_at(p_, it_++, &opt_.num, &val, &len);
+    } else {
+      opt_.num = (uint16_t)num_;
+      rc = coap_parser_next_opt(p_, opt_.num, &it_, &val, &len);
+    }
+    if (rc != COAP_OK) {
+      p_ = nullptr;
+      return;
+    }
+    opt_.value = std::string_view(val, len);
+  }
+
+  const coap_parser_t* p_ = nullptr;
+  int32_t num_ = -1;
+  size_t it_ = 0;
+  Option opt_ = {};
+};
+
+/** Range of options for range-for. */
+class Options {
+ public:
+  Options(const coap_parser_t* p, int32_t num) : p_(p), num_(num) {}
+  OptionIterator begin() const { return OptionIterator(p_, num_); }
+  OptionIterator end() const { return OptionIterator(); }
+  bool empty() const { return begin() == end(); }
+
+ private:
+  const coap_parser_t* p_;
+  int32_t num_;
+};
+
+/**
+ * CoAP parser. The accessors are valid after exec returned COAP_OK and give
+ * zero values otherwise.
+ */
+class Parser {
+ public:
+  Parser() {
+    void* mem = ::operator new(coap_parser_size());
+    coap_parser_t* p = nullptr;
+    coap_parser_create(&p, (const char*)mem, coap_parser_size());
+    p_.reset(p);
+  }
+
+  int init(const coap_parser_settings_t* settings = nullptr) {
+    return coap_parser_init(p_.get(), settings);
+  }
+  int exec(std::string_view msg) {
+    return coap_parser_exec(p_.get(), msg.data(), msg.size());
+  }
+  int exec_lazy(std::string_view msg) {
+    return coap_parser_exec_lazy(p_.get(), msg.data(), msg.size());
+  }
+  int finish() { return coap_parser_finish(p_.get()); }
+  int set_stats(coap_stats_t* stats) {
+    return coap_parser_set_stats(p_.get(), stats);
+  }
+
+  coap_type_t type() const {
+    coap_type_t res = T_CON;
+    coap_parser_get_type(p_.get(), &res);
+    return res;
+  }
+  coap_code_t code() const {
+    coap_code_t res = (coap_code_t)0;
+    coap_parser_get_code(p_.get(), &res);
+    return res;
+  }
+  uint16_t mid() const {
+    uint16_t res = 0;
+    coap_parser_get_mid(p_.get(), &res);
+    return res;
+  }
+  std::string_view token() const {
+    const char* res = nullptr;
+    uint8_t len = 0;
+    coap_parser_get_token(p_.get(), &res, &len);
+    return std::string_view(res, len);
+  }
+  std::string_view payload() const {
+    const char* res = nullptr;
+    size_t len = 0;
+    if (coap_parser_get_payload(p_.get(), &res, &len) != COAP_OK) {
+      return std::string_view();
+    }
+    return std::string_view(res, len);
+  }
+#if __cplusplus >= 202002L
+  std::span<const uint8_t> payload_bytes() const {
+    std::string_view res = payload();
+    return std::span<const uint8_t>((const uint8_t*)res.data(), res.size());
+  }
+#endif
+
+  bool has_opt(uint16_t opt) const {
+    return coap_parser_has_opt(p_.get(), opt) == 1;
+  }
+  /** The first occurrence of |opt|. */
+  std::optional<std::string_view> opt(uint16_t opt) const {
+    const char* val = nullptr;
+    size_t len = 0;
+    if (coap_parser_get_opt(p_.get(), opt, &val, &len) != COAP_OK) {
+      return std::nullopt;
+    }
+    return std::string_view(val, len);
+  }
+  /** The value of the uint option |opt|. */
+  std::optional<uint32_t> opt_uint(uint16_t opt) const {
+    uint32_t res = 0;
+    if (coap_parser_get_opt_uint(p_.get(), opt, &res) != COAP_OK) {
+      return std::nullopt;
+    }
+    return res;
+  }
+  /** All uint options with their defaults, see coap_uint_opts_t. */
+  int uint_opts(coap_uint_opts_t* res) const {
+    return coap_parser_get_uint_opts(p_.get(), res);
+  }
+  /** All options in wire order. */
+  Options opts() const { return Options(p_.get(), -1); }
+  /** The occurrences of |opt|, e.g. the Uri-Path segments. */
+  Options opts(uint16_t opt) const { return Options(p_.get(), opt); }
+
+  coap_parser_t* get() { return p_.get(); }
+  const coap_parser_t* get() const { return p_.get(); }
+
+ private:
+  detail::Handle<coap_parser_t> p_;
+};
+
+/**
+ * CoAP serializer writing into a caller's buffer or a buffer of its own.
+ */
+class Serializer {
+ public:
+  Serializer(char* buf, size_t len) { create_(buf, len); }
+  explicit Serializer(size_t len) : buf_(new char[len]) {
+    create_(buf_.get(), len);
+  }
+#if __cplusplus >= 202002L
+  explicit Serializer(std::span<char> buf) { create_(buf.data(), buf.size()); }
+#endif
+
+  int init(uint8_t type, uint8_t code, uint8_t token_len = 0) {
+    token_len_ = token_len;
+    return coap_serializer_init(s_.get(), type, code, token_len);
+  }
+  int add_opt(uint16_t opt, std::string_view val) {
+    return coap_serializer_add_opt(s_.get(), opt, val.data(), val.size());
+  }
+  int add_opt_uint(uint16_t opt, uint32_t val) {
+    return coap_serializer_add_opt_uint(s_.get(), opt, val);
+  }
+  /** |token| must be as long as the token length given to init. */
+  int exec(uint16_t mid, std::string_view token = {},
+           std::string_view payload = {}) {
+    if (token.size() != token_len_) {
+      return COAP_ERR_ARG;
+    }
+    msg_ = std::string_view();
+    size_t len = 0;
+    int rc = coap_serializer_exec(s_.get(), mid, token.data(), payload.data(),
+                                  payload.size(), &len);
+    if (rc == COAP_OK) {
+      msg_ = std::string_view(dst_, len);
+    }
+    return rc;
+  }
+  int set_stats(coap_stats_t* stats) {
+    return coap_serializer_set_stats(s_.get(), stats);
+  }
+
+  /** The message of the last successful exec. */
+  std::string_view message() const { return msg_; }
+
+  coap_serializer_t* get() { return s_.get(); }
+  const coap_serializer_t* get() const { return s_.get(); }
+
+ private:
+  void create_(char* buf, size_t len) {
+    void* mem = ::operator new(coap_serializer_size());
+    coap_serializer_t* s = nullptr;
+    if (coap_serializer_create(&s, mem, coap_serializer_size(), buf, len) !=
+        COAP_OK) {
+      ::operator delete(mem);
+      return;
+    }
+    s_.reset(s);
+    dst_ = buf;
+  }
+
+  std::unique_ptr<char[]> buf_;
+  detail::Handle<coap_serializer_t> s_;
+  char* dst_ = nullptr;
+  uint8_t token_len_ = 0;
+  std::string_view msg_;
+};
+
+/** Number and value length of an option of a Shape. */
+struct OptSpec {
+  uint16_t num;
+  uint16_t len;
+};
+
+/**
+ * Compile-time layout of a message with a fixed type, code, token length and
+ * option sequence whose values have fixed lengths. The option headers are
+ * encoded when the Shape is constructed, so a constexpr Shape writes a
+ * message with fixed-size copies only. Only the wire syntax is checked, not
+ * the option table: static_assert(shape.valid()).
+ */
+template <size_t N>
+class Shape {
+ public:
+  constexpr Shape(uint8_t type, uint8_t code, uint8_t token_len,
+                  const std::array<OptSpec, N>& opts)
+      : type_(type), code_(code), token_len_(token_len) {
+    uint16_t prev = 0;
+    size_t cursor = 0;
+    valid_ = type <= 3 && token_len <= 8;
+    for (size_t i = 0; i < N; i++) {
+      uint32_t delta = opts[i].num - prev;
+      uint32_t len = opts[i].len;
+      valid_ = valid_ && opts[i].num >= prev;
+      hdr_[cursor] = (uint8_t)(detail::nibble(delta) << 4 |
+                               detail::nibble(len));
+      hdr_len_[i] = (uint8_t)opt_header_len(delta, len);
+      cursor = ext_(cursor + 1, delta);
+      cursor = ext_(cursor, len);
+      val_len_[i] = opts[i].len;
+      len_ += hdr_len_[i] + val_len_[i];
+      prev = opts[i].num;
+    }
+    len_ += detail::kLenHeader + token_len;
+  }
+
+  constexpr bool valid() const { return valid_; }
+
+  /** Length of the message with a |payload_len| bytes long payload. */
+  constexpr size_t size(size_t payload_len = 0) const {
+    return len_ + (payload_len > 0 ? 1 + payload_len : 0);
+  }
+
+  /**
+   * Write the message into |dst|, which must have size(payload.size())
+   * bytes, and return its length. vals[i] must have the length of option i.
+   */
+  size_t write(char* dst, uint16_t mid, const char* token,
+               const std::array<std::string_view, N>& vals,
+               std::string_view payload = {}) const {
+    const uint8_t* hdr = hdr_.data();
+    char* cursor = dst + detail::kLenHeader + token_len_;
+    dst[0] = (char)(0x40 | type_ << 4 | token_len_);
+    dst[1] = (char)code_;
+    dst[2] = (char)(mid >> 8);
+    dst[3] = (char)mid;
+    if (token_len_ > 0) {
+      memcpy(&dst[detail::kLenHeader], token, token_len_);
+    }
+    for (size_t i = 0; i < N; i++) {
+      assert(vals[i].size() == val_len_[i]);
+      memcpy(cursor, hdr, hdr_len_[i]);
+      memcpy(cursor + hdr_len_[i], vals[i].data(), val_len_[i]);
+      hdr += hdr_len_[i];
+      cursor += hdr_len_[i] + val_len_[i];
+    }
+    if (!payload.empty()) {
+      *cursor++ = (char)0xFF;
+      memcpy(cursor, payload.data(), payload.size());
+      cursor += payload.size();
+    }
+    return (size_t)(cursor - dst);
+  }
+
+ private:
+  constexpr size_t ext_(size_t cursor, uint32_t v) {
+    if (v >= 269) {
+      hdr_[cursor++] = (uint8_t)((v - 269) >> 8);
+      hdr_[cursor++] = (uint8_t)(v - 269);
+    } else if (v >= 13) {
+      hdr_[cursor++] = (uint8_t)(v - 13);
+    }
+    return cursor;
+  }
+
+  uint8_t type_ = 0;
+  uint8_t code_ = 0;
+  uint8_t token_len_ = 0;
+  bool valid_ = false;
+  size_t len_ = 0;
+  std::array<uint8_t, N * 5> hdr_ = {};
+  std::array<uint8_t, N> hdr_len_ = {};
+  std::array<uint16_t, N> val_len_ = {};
+};
+
+/**
+ * Shape of a message with the options |opts|, e.g.
+ * make_shape(T_CON, C_GET, 2, OptSpec{O_URI_PATH, 6}).
+ */
+template <typename... O>
+constexpr Shape<sizeof...(O)> make_shape(uint8_t type, uint8_t code,
+                                         uint8_t token_len, O... opts) {
+  return Shape<sizeof...(O)>(type, code, token_len,
+                             std::array<OptSpec, sizeof...(O)>{opts...});
+}
+
+}  // namespace greencoap
+
+#endif /* !_GREENCOAP_HPP_ */
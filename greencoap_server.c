@@ -0,0 +1,765 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#ifdef GREENCOAP_HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "greencoap_server.h"
+
+#define COAP_SERVER_CACHELINE 64
+
+#ifdef GREENCOAP_HAVE_IO_URING
+/**
+ * Number of receive buffers in the io_uring provided buffer ring of a
+ * worker, a power of 2.
+ */
+#ifndef COAP_SERVER_URING_BUFS
+#define COAP_SERVER_URING_BUFS 256
+#endif
+
+/**
+ * io_uring user_data tags. Sends are tagged with the buffer id plus
+ * COAP_URING_SEND.
+ */
+#define COAP_URING_RECV 0
+#define COAP_URING_STOP 1
+#define COAP_URING_SEND 2
+
+/**
+ * An io_uring instance set up with raw system calls. Received datagrams
+ * land in the provided buffer ring |br|; buffer i is followed in |bufs| by
+ * the response buffer and the send message header that go with it, so a
+ * buffer is recycled once its response has been sent.
+ */
+typedef struct coap_uring_t {
+  int fd;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  struct io_uring_sqe* sqes;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+  void* sq_ptr;
+  size_t sq_len;
+  void* cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+  struct io_uring_buf_ring* br;
+  char* bufs;
+  size_t buf_size;
+  size_t rx_len;
+  size_t msg_at;
+  size_t bufs_len;
+  unsigned to_submit;
+  unsigned free_bufs;
+  uint16_t br_tail;
+  uint8_t armed;
+  struct msghdr rx_msg;
+} coap_uring_t;
+#else
+/**
+ * Without the io_uring uapi of Linux 6.0 the backend is left out:
+ * COAP_SERVER_IO_AUTO runs on epoll and COAP_SERVER_IO_URING fails to start.
+ */
+typedef struct coap_uring_t {
+  int fd;
+} coap_uring_t;
+#endif
+
+#define COAP_SERVER_ALIGN(n) \
+  (((n) + COAP_SERVER_CACHELINE - 1) & ~(size_t)(COAP_SERVER_CACHELINE - 1))
+
+/**
+ * A worker with its socket, its parser and serializer and its receive and
+ * send vectors. Workers are cache line aligned and share no writable data.
+ */
+typedef struct coap_server_worker_t {
+  coap_server_stats_t stats;
+  coap_stats_t counters;
+  coap_server_t* srv;
+  pthread_t thread;
+  int fd;
+  uint8_t started;
+  uint8_t io;
+  size_t index;
+  coap_uring_t ring;
+  coap_parser_t* p;
+  void* s_buf;
+  struct mmsghdr* rx;
+  struct mmsghdr* tx;
+  struct iovec* rx_iov;
+  struct iovec* tx_iov;
+  struct sockaddr_storage* addrs;
+  char* rx_buf;
+  char* tx_buf;
+} __attribute__((aligned(COAP_SERVER_CACHELINE))) coap_server_worker_t;
+
+struct coap_server_t {
+  coap_server_config_t c;
+  uint16_t port;
+  int efd;
+  coap_server_worker_t* workers;
+};
+
+/**
+ * Fill in the defaults of a configuration.
+ */
+static void coap_server_config_(const coap_server_config_t* c,
+                                coap_server_config_t* res) {
+  long cpus;
+  *res = *c;
+  if (res->workers == 0) {
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    res->workers = cpus > 0 ? cpus : 1;
+  }
+  if (res->batch == 0) {
+    res->batch = 32;
+  }
+  if (res->max_msg_len == 0) {
+    res->max_msg_len = 1152;
+  }
+}
+
+/**
+ * Get the size of the memory following a worker.
+ */
+static size_t coap_server_worker_size_(const coap_server_config_t* c) {
+  return COAP_SERVER_ALIGN(coap_parser_size()) +
+         COAP_SERVER_ALIGN(coap_serializer_size()) +
+         COAP_SERVER_ALIGN(c->batch * (2 * sizeof(struct mmsghdr) +
+                                       2 * sizeof(struct iovec) +
+                                       sizeof(struct sockaddr_storage))) +
+         COAP_SERVER_ALIGN(2 * c->batch * c->max_msg_len);
+}
+
+size_t coap_server_size(const coap_server_config_t* c) {
+  coap_server_config_t d;
+  if (c == NULL) {
+    return 0;
+  }
+  coap_server_config_(c, &d);
+  return sizeof(coap_server_t) + COAP_SERVER_CACHELINE +
+         d.workers * (sizeof(coap_server_worker_t) +
+                      coap_server_worker_size_(&d));
+}
+
+/**
+ * Open a UDP socket with SO_REUSEPORT bound to the configured address.
+ */
+static int coap_server_bind_(coap_server_t* srv) {
+  struct sockaddr_storage addr;
+  struct sockaddr_in* in4 = (struct sockaddr_in*)&addr;
+  struct sockaddr_in6* in6 = (struct sockaddr_in6*)&addr;
+  socklen_t addr_len;
+  int one = 1;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  if (srv->c.host && inet_pton(AF_INET6, srv->c.host, &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(srv->port);
+    addr_len = sizeof(*in6);
+  } else {
+    in4->sin_family = AF_INET;
+    in4->sin_port = htons(srv->port);
+    in4->sin_addr.s_addr = htonl(INADDR_ANY);
+    if (srv->c.host && inet_pton(AF_INET, srv->c.host, &in4->sin_addr) != 1) {
+      return -1;
+    }
+    addr_len = sizeof(*in4);
+  }
+  fd = socket(addr.ss_family, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) ||
+      bind(fd, (struct sockaddr*)&addr, addr_len)) {
+    close(fd);
+    return -1;
+  }
+  if (srv->port == 0) {
+    // Let the other workers join the ephemeral port of the first one.
+    if (getsockname(fd, (struct sockaddr*)&addr, &addr_len)) {
+      close(fd);
+      return -1;
+    }
+    srv->port = ntohs(addr.ss_family == AF_INET6 ? in6->sin6_port
+                                                 : in4->sin_port);
+  }
+  return fd;
+}
+
+int coap_server_create(coap_server_t** srv, void* buf, size_t len,
+                       const coap_server_config_t* c) {
+  coap_server_worker_t* w;
+  char* mem;
+  size_t i, j;
+  if (srv == NULL || buf == NULL || c == NULL || c->handler == NULL ||
+      c->batch > COAP_SERVER_MAXBATCH || c->io > COAP_SERVER_IO_EPOLL ||
+      coap_server_size(c) > len) {
+    return COAP_ERR_ARG;
+  }
+  *srv = (coap_server_t*)buf;
+  memset(*srv, 0, sizeof(coap_server_t));
+  coap_server_config_(c, &(*srv)->c);
+  (*srv)->port = c->port;
+  // Writing the eventfd stops every worker; it is never read.
+  (*srv)->efd = eventfd(0, EFD_CLOEXEC);
+  if ((*srv)->efd < 0) {
+    return COAP_ERR_SYSTEM;
+  }
+  (*srv)->workers = (coap_server_worker_t*)COAP_SERVER_ALIGN(
+    (uintptr_t)buf + sizeof(coap_server_t));
+  mem = (char*)&(*srv)->workers[(*srv)->c.workers];
+  for (i = 0; i < (*srv)->c.workers; i++) {
+    w = &(*srv)->workers[i];
+    memset(w, 0, sizeof(coap_server_worker_t));
+    w->srv = *srv;
+    w->index = i;
+    w->ring.fd = -1;
+    coap_parser_create(&w->p, mem, coap_parser_size());
+    coap_parser_set_stats(w->p, &w->counters);
+    mem += COAP_SERVER_ALIGN(coap_parser_size());
+    w->s_buf = mem;
+    mem += COAP_SERVER_ALIGN(coap_serializer_size());
+    w->rx = (struct mmsghdr*)mem;
+    w->tx = &w->rx[(*srv)->c.batch];
+    w->rx_iov = (struct iovec*)&w->tx[(*srv)->c.batch];
+    w->tx_iov = &w->rx_iov[(*srv)->c.batch];
+    w->addrs = (struct sockaddr_storage*)&w->tx_iov[(*srv)->c.batch];
+    mem = (char*)w->rx + COAP_SERVER_ALIGN((*srv)->c.batch *
+                                           (2 * sizeof(struct mmsghdr) +
+                                            2 * sizeof(struct iovec) +
+                                            sizeof(struct sockaddr_storage)));
+    w->rx_buf = mem;
+    w->tx_buf = mem + (*srv)->c.batch * (*srv)->c.max_msg_len;
+    mem += COAP_SERVER_ALIGN(2 * (*srv)->c.batch * (*srv)->c.max_msg_len);
+    memset(w->rx, 0, 2 * (*srv)->c.batch * sizeof(struct mmsghdr));
+    for (j = 0; j < (*srv)->c.batch; j++) {
+      w->rx_iov[j].iov_base = &w->rx_buf[j * (*srv)->c.max_msg_len];
+      w->rx_iov[j].iov_len = (*srv)->c.max_msg_len;
+      w->rx[j].msg_hdr.msg_iov = &w->rx_iov[j];
+      w->rx[j].msg_hdr.msg_iovlen = 1;
+      w->rx[j].msg_hdr.msg_name = &w->addrs[j];
+      w->tx_iov[j].iov_base = &w->tx_buf[j * (*srv)->c.max_msg_len];
+      w->tx[j].msg_hdr.msg_iov = &w->tx_iov[j];
+      w->tx[j].msg_hdr.msg_iovlen = 1;
+    }
+    w->fd = coap_server_bind_(*srv);
+    if (w->fd < 0) {
+      while (i-- > 0) {
+        close((*srv)->workers[i].fd);
+      }
+      close((*srv)->efd);
+      return COAP_ERR_SYSTEM;
+    }
+  }
+  return COAP_OK;
+}
+
+/**
+ * Parse and handle the request in |buf| from |peer|. Returns the length of
+ * the response serialized into |res|, or 0.
+ */
+static size_t coap_server_handle_(coap_server_worker_t* w, const char* buf,
+                                  size_t len, const void* peer,
+                                  size_t peer_len, char* res,
+                                  coap_server_stats_t* stats) {
+  const coap_server_config_t* c = &w->srv->c;
+  coap_serializer_t* s = NULL;
+  size_t res_len = 0;
+  stats->received++;
+  if (coap_parser_exec(w->p, buf, len)) {
+    stats->dropped++;
+    return 0;
+  }
+  coap_serializer_create(&s, w->s_buf, coap_serializer_size(), res,
+                         c->max_msg_len);
+  coap_serializer_set_stats(s, &w->counters);
+  c->handler(c->cookie, w->p, s, peer, peer_len, &res_len);
+  return res_len <= c->max_msg_len ? res_len : 0;
+}
+
+/**
+ * Publish the counters of a worker.
+ */
+static void coap_server_publish_(coap_server_worker_t* w,
+                                 const coap_server_stats_t* stats) {
+  __atomic_store_n(&w->stats.received, stats->received, __ATOMIC_RELAXED);
+  __atomic_store_n(&w->stats.sent, stats->sent, __ATOMIC_RELAXED);
+  __atomic_store_n(&w->stats.dropped, stats->dropped, __ATOMIC_RELAXED);
+}
+
+/**
+ * epoll loop: wait for the socket or the stop eventfd, then receive
+ * batches until the socket is drained and send the responses of each batch
+ * at once.
+ */
+static void coap_server_epoll_(coap_server_worker_t* w,
+                               coap_server_stats_t* stats) {
+  const coap_server_config_t* c = &w->srv->c;
+  struct epoll_event ev;
+  size_t res_len;
+  int ep, n, m, i, rc;
+
+  ep = epoll_create1(EPOLL_CLOEXEC);
+  if (ep < 0) {
+    return;
+  }
+  ev.events = EPOLLIN;
+  ev.data.fd = w->fd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, w->fd, &ev);
+  ev.data.fd = w->srv->efd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, w->srv->efd, &ev);
+  for (;;) {
+    if (epoll_wait(ep, &ev, 1, -1) <= 0) {
+      continue;
+    }
+    if (ev.data.fd == w->srv->efd) {
+      break;
+    }
+    do {
+      for (i = 0; i < (int)c->batch; i++) {
+        w->rx[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+      }
+      n = recvmmsg(w->fd, w->rx, c->batch, MSG_DONTWAIT, NULL);
+      for (i = 0, m = 0; i < n; i++) {
+        res_len = coap_server_handle_(w, w->rx_iov[i].iov_base,
+                                      w->rx[i].msg_len, &w->addrs[i],
+                                      w->rx[i].msg_hdr.msg_namelen,
+                                      w->tx_iov[m].iov_base, stats);
+        if (res_len == 0) {
+          continue;
+        }
+        w->tx[m].msg_hdr.msg_name = &w->addrs[i];
+        w->tx[m].msg_hdr.msg_namelen = w->rx[i].msg_hdr.msg_namelen;
+        w->tx_iov[m++].iov_len = res_len;
+      }
+      for (i = 0; i < m; i += rc) {
+        rc = sendmmsg(w->fd, &w->tx[i], m - i, 0);
+        if (rc < 0 && errno == EINTR) {
+          rc = 0;
+        } else if (rc <= 0) {
+          stats->dropped += m - i;
+          break;
+        }
+        stats->sent += rc;
+      }
+      coap_server_publish_(w, stats);
+    } while (n == (int)c->batch);
+  }
+  close(ep);
+}
+
+#ifdef GREENCOAP_HAVE_IO_URING
+static void coap_uring_free_(coap_uring_t* r) {
+  if (r->fd >= 0) {
+    close(r->fd);
+    r->fd = -1;
+  }
+  if (r->sqes) {
+    munmap(r->sqes, r->sqes_len);
+  }
+  if (r->cq_ptr && r->cq_ptr != r->sq_ptr) {
+    munmap(r->cq_ptr, r->cq_len);
+  }
+  if (r->sq_ptr) {
+    munmap(r->sq_ptr, r->sq_len);
+  }
+  if (r->br) {
+    munmap(r->br, r->bufs_len);
+  }
+  memset(r, 0, sizeof(coap_uring_t));
+  r->fd = -1;
+}
+
+/**
+ * Get a zeroed submission queue entry. The queue has room for one entry
+ * per buffer plus the receive and the stop poll, so it can not overflow.
+ */
+static struct io_uring_sqe* coap_uring_sqe_(coap_uring_t* r) {
+  unsigned tail = *r->sq_tail;
+  struct io_uring_sqe* sqe = &r->sqes[tail & r->sq_mask];
+  r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+  memset(sqe, 0, sizeof(*sqe));
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->to_submit++;
+  return sqe;
+}
+
+/**
+ * Hand receive buffer |bid| back to the kernel.
+ */
+static void coap_uring_recycle_(coap_uring_t* r, uint16_t bid) {
+  struct io_uring_buf* b =
+    &r->br->bufs[r->br_tail & (COAP_SERVER_URING_BUFS - 1)];
+  b->addr = (uint64_t)(uintptr_t)&r->bufs[bid * r->buf_size];
+  b->len = r->rx_len;
+  b->bid = bid;
+  __atomic_store_n(&r->br->tail, ++r->br_tail, __ATOMIC_RELEASE);
+  r->free_bufs++;
+}
+
+static void coap_uring_arm_(coap_uring_t* r, int fd) {
+  struct io_uring_sqe* sqe = coap_uring_sqe_(r);
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)&r->rx_msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = COAP_URING_RECV;
+  r->armed = 1;
+}
+
+/**
+ * Set up the io_uring of a worker: the rings, the provided buffer ring
+ * with a multishot recvmsg on the socket, and a poll on the stop eventfd.
+ */
+static int coap_uring_init_(coap_server_worker_t* w) {
+  coap_uring_t* r = &w->ring;
+  struct io_uring_params params;
+  struct io_uring_buf_reg reg;
+  struct io_uring_sqe* sqe;
+  size_t ring_len;
+  uint16_t i;
+
+  memset(r, 0, sizeof(coap_uring_t));
+  memset(&params, 0, sizeof(params));
+  r->fd = syscall(__NR_io_uring_setup, COAP_SERVER_URING_BUFS + 2, &params);
+  if (r->fd < 0) {
+    r->fd = -1;
+    return -1;
+  }
+  r->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  r->cq_len =
+    params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+  }
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    r->sq_ptr = NULL;
+    goto fail;
+  }
+  r->cq_ptr = r->sq_ptr;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+      r->cq_ptr = NULL;
+      goto fail;
+    }
+  }
+  r->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto fail;
+  }
+  r->sq_tail = (unsigned*)((char*)r->sq_ptr + params.sq_off.tail);
+  r->sq_mask = *(unsigned*)((char*)r->sq_ptr + params.sq_off.ring_mask);
+  r->sq_array = (unsigned*)((char*)r->sq_ptr + params.sq_off.array);
+  r->cq_head = (unsigned*)((char*)r->cq_ptr + params.cq_off.head);
+  r->cq_tail = (unsigned*)((char*)r->cq_ptr + params.cq_off.tail);
+  r->cq_mask = *(unsigned*)((char*)r->cq_ptr + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + params.cq_off.cqes);
+
+  // Buffer i: recvmsg header, peer address and datagram, then the response
+  // and, cache line aligned whatever max_msg_len is, its send header.
+  r->rx_len = sizeof(struct io_uring_recvmsg_out) +
+              sizeof(struct sockaddr_storage) + w->srv->c.max_msg_len;
+  r->msg_at = COAP_SERVER_ALIGN(r->rx_len + w->srv->c.max_msg_len);
+  r->buf_size = COAP_SERVER_ALIGN(r->msg_at + sizeof(struct msghdr) +
+                                  sizeof(struct iovec));
+  ring_len = COAP_SERVER_ALIGN(COAP_SERVER_URING_BUFS *
+                               sizeof(struct io_uring_buf));
+  r->bufs_len = ring_len + COAP_SERVER_URING_BUFS * r->buf_size;
+  r->br = mmap(NULL, r->bufs_len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->br == MAP_FAILED) {
+    r->br = NULL;
+    goto fail;
+  }
+  r->bufs = (char*)r->br + ring_len;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)r->br;
+  reg.ring_entries = COAP_SERVER_URING_BUFS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg,
+              1)) {
+    goto fail;
+  }
+  r->rx_msg.msg_namelen = sizeof(struct sockaddr_storage);
+  for (i = 0; i < COAP_SERVER_URING_BUFS; i++) {
+    coap_uring_recycle_(r, i);
+  }
+  coap_uring_arm_(r, w->fd);
+  sqe = coap_uring_sqe_(r);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = w->srv->efd;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = COAP_URING_STOP;
+  return 0;
+
+fail:
+  coap_uring_free_(r);
+  return -1;
+}
+
+/**
+ * io_uring loop. Datagrams are parsed in place in the provided buffers and
+ * the responses of every round are submitted together with one
+ * io_uring_enter, which also waits for the next completions. Returns -1 if
+ * the kernel does not support multishot recvmsg before any datagram was
+ * received, so that the caller can fall back to epoll.
+ */
+static int coap_server_uring_(coap_server_worker_t* w,
+                              coap_server_stats_t* stats) {
+  coap_uring_t* r = &w->ring;
+  const struct io_uring_recvmsg_out* out;
+  struct io_uring_cqe* cqe;
+  struct io_uring_sqe* sqe;
+  struct msghdr* msg;
+  struct iovec* iov;
+  unsigned head, tail;
+  uint16_t bid;
+  size_t res_len;
+  char* buf;
+  char* data;
+  int rc;
+
+  for (;;) {
+    rc = syscall(__NR_io_uring_enter, r->fd, r->to_submit, 1,
+                 IORING_ENTER_GETEVENTS, NULL, 0);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return 0;
+    }
+    r->to_submit -= rc;
+    head = *r->cq_head;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      cqe = &r->cqes[head & r->cq_mask];
+      if (cqe->user_data == COAP_URING_STOP) {
+        __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+        coap_server_publish_(w, stats);
+        return 0;
+      }
+      if (cqe->user_data >= COAP_URING_SEND) {
+        if (cqe->res >= 0) {
+          stats->sent++;
+        } else {
+          stats->dropped++;
+        }
+        coap_uring_recycle_(r, cqe->user_data - COAP_URING_SEND);
+        continue;
+      }
+      // A receive completion.
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        r->armed = 0;
+      }
+      if (cqe->res < 0) {
+        if (cqe->res == -EINVAL && stats->received == 0) {
+          return -1;
+        }
+        continue;
+      }
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      r->free_bufs--;
+      buf = &r->bufs[bid * r->buf_size];
+      out = (const struct io_uring_recvmsg_out*)buf;
+      data = buf + sizeof(*out) + r->rx_msg.msg_namelen;
+      if (out->flags & MSG_TRUNC) {
+        stats->received++;
+        stats->dropped++;
+        coap_uring_recycle_(r, bid);
+        continue;
+      }
+      res_len = coap_server_handle_(w, data, out->payloadlen, buf + sizeof(*out),
+                                    out->namelen,
+                                    data + w->srv->c.max_msg_len, stats);
+      if (res_len == 0) {
+        coap_uring_recycle_(r, bid);
+        continue;
+      }
+      // The buffer is recycled when the send completes.
+      msg = (struct msghdr*)(buf + r->msg_at);
+      iov = (struct iovec*)(msg + 1);
+      iov->iov_base = data + w->srv->c.max_msg_len;
+      iov->iov_len = res_len;
+      memset(msg, 0, sizeof(*msg));
+      msg->msg_name = buf + sizeof(*out);
+      msg->msg_namelen = out->namelen;
+      msg->msg_iov = iov;
+      msg->msg_iovlen = 1;
+      sqe = coap_uring_sqe_(r);
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = w->fd;
+      sqe->addr = (uint64_t)(uintptr_t)msg;
+      sqe->len = 1;
+      sqe->user_data = COAP_URING_SEND + bid;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    if (!r->armed && r->free_bufs > 0) {
+      coap_uring_arm_(r, w->fd);
+    }
+    coap_server_publish_(w, stats);
+  }
+}
+
+#else
+static void coap_uring_free_(coap_uring_t* r) {
+  r->fd = -1;
+}
+
+static int coap_uring_init_(coap_server_worker_t* w) {
+  return -1;
+}
+
+static int coap_server_uring_(coap_server_worker_t* w,
+                              coap_server_stats_t* stats) {
+  return -1;
+}
+#endif
+
+static void* coap_server_worker_(void* arg) {
+  coap_server_worker_t* w = (coap_server_worker_t*)arg;
+  coap_server_stats_t stats = {0, 0, 0};
+  cpu_set_t cpus;
+  long ncpus;
+
+  if (w->srv->c.pin) {
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    CPU_ZERO(&cpus);
+    CPU_SET(w->index % (ncpus > 0 ? ncpus : 1), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+  if (w->io == COAP_SERVER_IO_URING) {
+    if (coap_server_uring_(w, &stats) == 0 ||
+        w->srv->c.io == COAP_SERVER_IO_URING) {
+      return NULL;
+    }
+    coap_uring_free_(&w->ring);
+    __atomic_store_n(&w->io, COAP_SERVER_IO_EPOLL, __ATOMIC_RELAXED);
+  }
+  coap_server_epoll_(w, &stats);
+  return NULL;
+}
+
+int coap_server_start(coap_server_t* srv) {
+  coap_server_worker_t* w;
+  size_t i;
+  if (srv == NULL) {
+    return COAP_ERR_ARG;
+  }
+  // A stopped server has closed its sockets and can not be restarted.
+  if (srv->workers[0].started || srv->efd < 0) {
+    return COAP_ERR_INVALID_CALL;
+  }
+  for (i = 0; i < srv->c.workers; i++) {
+    w = &srv->workers[i];
+    w->io = COAP_SERVER_IO_EPOLL;
+    if (srv->c.io != COAP_SERVER_IO_EPOLL) {
+      if (coap_uring_init_(w) == 0) {
+        w->io = COAP_SERVER_IO_URING;
+      } else if (srv->c.io == COAP_SERVER_IO_URING) {
+        coap_server_stop(srv);
+        return COAP_ERR_SYSTEM;
+      }
+    }
+    if (pthread_create(&w->thread, NULL, coap_server_worker_, w)) {
+      coap_server_stop(srv);
+      return COAP_ERR_SYSTEM;
+    }
+    w->started = 1;
+  }
+  return COAP_OK;
+}
+
+int coap_server_stop(coap_server_t* srv) {
+  size_t i;
+  if (srv == NULL) {
+    return COAP_ERR_ARG;
+  }
+  if (srv->efd < 0) {
+    return COAP_OK;
+  }
+  eventfd_write(srv->efd, 1);
+  for (i = 0; i < srv->c.workers; i++) {
+    if (srv->workers[i].started) {
+      pthread_join(srv->workers[i].thread, NULL);
+      srv->workers[i].started = 0;
+    }
+    coap_uring_free_(&srv->workers[i].ring);
+    if (srv->workers[i].fd >= 0) {
+      close(srv->workers[i].fd);
+      srv->workers[i].fd = -1;
+    }
+  }
+  close(srv->efd);
+  srv->efd = -1;
+  return COAP_OK;
+}
+
+int coap_server_get_port(const coap_server_t* srv, uint16_t* port) {
+  if (srv == NULL || port == NULL) {
+    return COAP_ERR_ARG;
+  }
+  *port = srv->port;
+  return COAP_OK;
+}
+
+size_t coap_server_get_workers(const coap_server_t* srv) {
+  return srv ? srv->c.workers : 0;
+}
+
+int coap_server_get_io(const coap_server_t* srv, size_t worker) {
+  if (srv == NULL || worker >= srv->c.workers) {
+    return COAP_ERR_ARG;
+  }
+  return __atomic_load_n(&srv->workers[worker].io, __ATOMIC_RELAXED);
+}
+
+int coap_server_get_stats(const coap_server_t* srv, size_t worker,
+                          coap_server_stats_t* stats) {
+  const coap_server_worker_t* w;
+  if (srv == NULL || stats == NULL || worker >= srv->c.workers) {
+    return COAP_ERR_ARG;
+  }
+  w = &srv->workers[worker];
+  stats->received = __atomic_load_n(&w->stats.received, __ATOMIC_RELAXED);
+  stats->sent = __atomic_load_n(&w->stats.sent, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&w->stats.dropped, __ATOMIC_RELAXED);
+  return COAP_OK;
+}
+
+int coap_server_get_counters(const coap_server_t* srv, coap_stats_t* res) {
+  size_t i;
+  if (srv == NULL || res == NULL) {
+    return COAP_ERR_ARG;
+  }
+  memset(res, 0, sizeof(coap_stats_t));
+  for (i = 0; i < srv->c.workers; i++) {
+    coap_stats_add(res, &srv->workers[i].counters);
+  }
+  return COAP_OK;
+}
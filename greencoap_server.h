@@ -0,0 +1,122 @@
+#ifndef _GREENCOAP_SERVER_H_
+#define _GREENCOAP_SERVER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "greencoap.h"
+
+/**
+ * Maximum number of datagrams received or sent by one system call.
+ */
+#define COAP_SERVER_MAXBATCH 64
+
+/**
+ * I/O backends of the server. COAP_SERVER_IO_AUTO uses io_uring with
+ * multishot recvmsg into a provided buffer ring where the kernel supports
+ * it (Linux 6.0 and later) and epoll with recvmmsg/sendmmsg otherwise.
+ * io_uring is only built if the kernel headers have its 6.0 uapi.
+ */
+typedef enum coap_server_io_t {
+  COAP_SERVER_IO_AUTO = 0,
+  COAP_SERVER_IO_URING = 1,
+  COAP_SERVER_IO_EPOLL = 2,
+} coap_server_io_t;
+
+/** Multi-core CoAP over UDP server */
+typedef struct coap_server_t coap_server_t;
+
+/**
+ * Request handler. It is called on a worker thread for every request that
+ * parses, with the worker's serializer set up on the response buffer. To
+ * reply, the handler serializes the response with |s| and stores its length
+ * in |res_len|, which is 0 on entry. |peer| is the client's sockaddr. The
+ * request is parsed eagerly, so the getters of |p| do not modify it.
+ */
+typedef void (*coap_server_handler_t)(void* cookie, const coap_parser_t* p,
+                                      coap_serializer_t* s, const void* peer,
+                                      size_t peer_len, size_t* res_len);
+
+/**
+ * Server configuration. Zero fields take their defaults.
+ */
+typedef struct coap_server_config_t {
+  const char* host;    // IPv4 or IPv6 address to bind, default any IPv4
+  uint16_t port;       // 0 binds an ephemeral port, see coap_server_get_port
+  size_t workers;      // default one per online CPU
+  size_t batch;        // datagrams per recvmmsg/sendmmsg, default 32
+  size_t max_msg_len;  // default 1152
+  uint8_t pin;         // pin worker i to CPU i
+  coap_server_handler_t handler;
+  void* cookie;
+  uint8_t io;          // coap_server_io_t
+} coap_server_config_t;
+
+/**
+ * Per-worker counters, written by the worker only.
+ */
+typedef struct coap_server_stats_t {
+  uint64_t received;
+  uint64_t sent;
+  uint64_t dropped;
+} coap_server_stats_t;
+
+/**
+ * Create a server with fixed size memory space of coap_server_size() bytes.
+ * One UDP socket per worker is bound with SO_REUSEPORT, so the kernel
+ * spreads the clients over the workers and they share nothing.
+ */
+int coap_server_create(coap_server_t** srv, void* buf, size_t len,
+                       const coap_server_config_t* c);
+
+/**
+ * Start the worker threads. With COAP_SERVER_IO_URING, COAP_ERR_SYSTEM is
+ * returned if io_uring can not be set up.
+ */
+int coap_server_start(coap_server_t* srv);
+
+/**
+ * Stop and join the worker threads and close the sockets. A stopped server
+ * can not be started again.
+ */
+int coap_server_stop(coap_server_t* srv);
+
+/**
+ * Get the bound UDP port.
+ */
+int coap_server_get_port(const coap_server_t* srv, uint16_t* port);
+
+/**
+ * Get the number of workers.
+ */
+size_t coap_server_get_workers(const coap_server_t* srv);
+
+/**
+ * Get the I/O backend (coap_server_io_t) a started worker runs on.
+ */
+int coap_server_get_io(const coap_server_t* srv, size_t worker);
+
+/**
+ * Get the counters of a worker.
+ */
+int coap_server_get_stats(const coap_server_t* srv, size_t worker,
+                          coap_server_stats_t* stats);
+
+/**
+ * Sum the parser and serializer counters of all workers. They are kept only
+ * if the library is built with GREENCOAP_STATS.
+ */
+int coap_server_get_counters(const coap_server_t* srv, coap_stats_t* res);
+
+/**
+ * Get the size of a coap_server_t for the configuration |c|.
+ */
+size_t coap_server_size(const coap_server_config_t* c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !_GREENCOAP_SERVER_H_ */
@@ -3,6 +3,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#ifdef GREENCOAP_SERVER
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "greencoap_server.h"
+#endif
 
 #define L(x) (sizeof(x) - 1)
 
@@ -198,6 +205,405 @@ void test_coap_parser_size() {
   return;
 }
 
+static void count_opt_(void* cookie, uint16_t opt, const void* val,
+                       uint16_t len) {
+  __atomic_fetch_add((int*)cookie, 1, __ATOMIC_RELAXED);
+}
+
+void test_coap_parser_exec_lazy() {
+  char buf[64] = {};
+  char token = 0x20;
+  // Uri-Path option that runs past the end of the message.
+  const char bad[6] = {0x40, 0x01, 0x00, 0x05, 0xB4, 'a'};
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  coap_parser_settings_t settings = {};
+  const char* res = NULL;
+  size_t res_len = 0;
+  size_t msg_size = 0;
+  uint16_t mid = 0;
+  int opts = 0;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 64) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_PUT, 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "a", 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "b", 1) == COAP_OK);
+  assert(coap_serializer_exec(s, 7, &token, "xyz", 3, &msg_size) == COAP_OK);
+
+  settings.cookie = &opts;
+  settings.on_opt = count_opt_;
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_parser_init(p, &settings) == COAP_OK);
+  assert(coap_parser_finish(p) == COAP_ERR_INVALID_CALL);
+  assert(coap_parser_exec_lazy(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_get_mid(p, &mid) == COAP_OK && mid == 7);
+  assert(opts == 0);
+  assert(coap_parser_get_payload(p, &res, &res_len) == COAP_OK);
+  assert(res_len == 3 && strncmp(res, "xyz", 3) == 0);
+  assert(opts == 2);
+  assert(coap_parser_finish(p) == COAP_OK);
+  assert(opts == 2);
+
+  assert(coap_parser_exec_lazy(p, bad, sizeof(bad)) == COAP_OK);
+  assert(coap_parser_get_mid(p, &mid) == COAP_OK && mid == 5);
+  assert(coap_parser_has_opt(p, O_URI_PATH) == COAP_ERR_SYNTAX);
+  assert(coap_parser_get_payload(p, &res, &res_len) == COAP_ERR_SYNTAX);
+  assert(coap_parser_finish(p) == COAP_ERR_SYNTAX);
+  assert(coap_parser_exec(p, bad, sizeof(bad)) == COAP_ERR_SYNTAX);
+  assert(coap_parser_get_mid(p, &mid) == COAP_ERR_INVALID_CALL);
+  free(s);
+  free(p);
+  return;
+}
+
+void test_coap_parser_exec_many_opts() {
+  char buf[128] = {};
+  char token = 0x20;
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  coap_parser_settings_t settings = {};
+  coap_uint_opts_t u;
+  const char* val = NULL;
+  size_t len = 0;
+  size_t msg_size = 0;
+  size_t it = 0;
+  uint16_t opt = 0;
+  int opts = 0;
+  int i;
+
+  // More options than the parser indexes, e.g. a deep Uri-Path.
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 128) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_GET, 1) == COAP_OK);
+  for (i = 0; i < 40; i++) {
+    assert(coap_serializer_add_opt(s, O_URI_PATH, "a", 1) == COAP_OK);
+  }
+  assert(coap_serializer_add_opt_uint(s, O_ACCEPT, F_TEXT_PLAIN) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, &token, "xyz", 3, &msg_size) == COAP_OK);
+
+  settings.cookie = &opts;
+  settings.on_opt = count_opt_;
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_parser_init(p, &settings) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(opts == 41);
+  assert(coap_parser_get_payload(p, &val, &len) == COAP_OK);
+  assert(len == 3 && strncmp(val, "xyz", 3) == 0);
+  assert(coap_parser_has_opt(p, O_ACCEPT) == COAP_ERR_LIMIT);
+  assert(coap_parser_get_opt(p, O_URI_PATH, &val, &len) == COAP_ERR_LIMIT);
+  assert(coap_parser_get_path(p, &it, &val, &len) == COAP_ERR_LIMIT);
+  assert(coap_parser_get_opt_at(p, 0, &opt, &val, &len) == COAP_ERR_LIMIT);
+  assert(coap_parser_get_uint_opts(p, &u) == COAP_ERR_LIMIT);
+
+  // The index is complete again for the next message.
+  assert(coap_serializer_init(s, T_CON, C_GET, 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "a", 1) == COAP_OK);
+  assert(coap_serializer_exec(s, 2, &token, NULL, 0, &msg_size) == COAP_OK);
+  assert(coap_parser_exec_lazy(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_has_opt(p, O_URI_PATH) == 1);
+  free(s);
+  free(p);
+  return;
+}
+
+void test_coap_dedup_check() {
+  const char ep1[6] = {10, 0, 0, 1, 0x16, 0x33};
+  const char ep2[6] = {10, 0, 0, 2, 0x16, 0x33};
+  const char ack[4] = {0x60, 0x00, 0x00, 0x01};
+  size_t size = coap_dedup_size(64, 16);
+  void* buf = malloc(size);
+  coap_dedup_t* d = NULL;
+  const char* res = NULL;
+  size_t res_len = 0;
+  uint32_t now = 0xFFFFF000;  // Wraps around during the test.
+  int i;
+
+  assert(coap_dedup_create(&d, buf, size - 1, 64, 16) == COAP_ERR_ARG);
+  assert(coap_dedup_create(&d, buf, size, 64, 16) == COAP_OK);
+  assert(coap_dedup_check(d, ep1, 6, 1, now, &res, &res_len) == COAP_OK);
+  assert(coap_dedup_check(d, ep1, 6, 1, now, &res, &res_len) ==
+         COAP_ERR_DUPLICATE);
+  assert(res == NULL && res_len == 0);
+  assert(coap_dedup_check(d, ep2, 6, 1, now, &res, &res_len) == COAP_OK);
+  assert(coap_dedup_set_response(d, ep1, 6, 1, now, ack, 4) == COAP_OK);
+  assert(coap_dedup_set_response(d, ep1, 6, 2, now, ack, 4) ==
+         COAP_ERR_NOT_FOUND);
+  assert(coap_dedup_check(d, ep1, 6, 1, now + 1000, &res, &res_len) ==
+         COAP_ERR_DUPLICATE);
+  assert(res_len == 4 && memcmp(res, ack, 4) == 0);
+
+  // Fill the table, then let everything expire.
+  for (i = 2; i < 64; i++) {
+    assert(coap_dedup_check(d, ep1, 6, i, now, &res, &res_len) == COAP_OK);
+  }
+  assert(coap_dedup_check(d, ep1, 6, 64, now, &res, &res_len) ==
+         COAP_ERR_LIMIT);
+  now += COAP_EXCHANGE_LIFETIME;
+  assert(coap_dedup_check(d, ep1, 6, 1, now, &res, &res_len) == COAP_OK);
+  for (i = 2; i <= 64; i++) {
+    assert(coap_dedup_check(d, ep2, 6, i, now, &res, &res_len) == COAP_OK);
+  }
+  for (i = 2; i <= 64; i++) {
+    assert(coap_dedup_check(d, ep2, 6, i, now + 1, &res, &res_len) ==
+           COAP_ERR_DUPLICATE);
+    assert(coap_dedup_check(d, ep1, 6, i, now + 1, &res, &res_len) ==
+           COAP_ERR_LIMIT);
+  }
+
+  // A table without response buffers only detects duplicates.
+  size = coap_dedup_size(16, 0);
+  assert(coap_dedup_create(&d, buf, size, 16, 0) == COAP_OK);
+  assert(coap_dedup_check(d, ep1, 6, 1, now, &res, &res_len) == COAP_OK);
+  assert(coap_dedup_set_response(d, ep1, 6, 1, now, "", 0) ==
+         COAP_ERR_LIMIT);
+  assert(coap_dedup_set_response(d, ep1, 6, 1, now, ack, 4) ==
+         COAP_ERR_LIMIT);
+  assert(coap_dedup_check(d, ep1, 6, 1, now, &res, &res_len) ==
+         COAP_ERR_DUPLICATE);
+  assert(res == NULL && res_len == 0);
+  free(d);
+  return;
+}
+
+/**
+ * Serialize a GET of coap://h/|path| with a Size2 option if |size2|.
+ */
+static size_t cache_request_(char* buf, uint8_t type, uint16_t mid,
+                             const char* token, const char* path, int size2) {
+  coap_serializer_t* s = NULL;
+  size_t len = 0;
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 64) == COAP_OK);
+  assert(coap_serializer_init(s, type, C_GET, 2) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_HOST, "h", 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, path, strlen(path)) ==
+         COAP_OK);
+  if (size2) {
+    assert(coap_serializer_add_opt_uint(s, O_SIZE2, 0) == COAP_OK);
+  }
+  assert(coap_serializer_exec(s, mid, token, NULL, 0, &len) == COAP_OK);
+  free(s);
+  return len;
+}
+
+/**
+ * Serialize a response with an ETag and a Max-Age if they are not NULL and
+ * not 0.
+ */
+static size_t cache_response_(char* buf, uint8_t code, const char* etag,
+                              uint32_t max_age, const char* payload) {
+  coap_serializer_t* s = NULL;
+  size_t len = 0;
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 64) == COAP_OK);
+  assert(coap_serializer_init(s, T_ACK, code, 1) == COAP_OK);
+  if (etag != NULL) {
+    assert(coap_serializer_add_opt(s, O_ETAG, etag, strlen(etag)) == COAP_OK);
+  }
+  assert(coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN) ==
+         COAP_OK);
+  if (max_age) {
+    assert(coap_serializer_add_opt_uint(s, O_MAX_AGE, max_age) == COAP_OK);
+  }
+  assert(coap_serializer_exec(s, 7, "u", payload, strlen(payload), &len) ==
+         COAP_OK);
+  free(s);
+  return len;
+}
+
+void test_coap_cache_get() {
+  char req[64] = {};
+  char res[64] = {};
+  char out[64] = {};
+  const char* paths[5] = {"a", "b", "c", "d", "e"};
+  size_t size = coap_cache_size(4, 64);
+  void* buf = malloc(size);
+  coap_cache_t* c = NULL;
+  coap_parser_t* p = NULL;
+  coap_parser_t* q = NULL;
+  const char* val = NULL;
+  size_t len = 0;
+  size_t req_size = 0, res_size = 0, out_size = 0;
+  coap_type_t t = T_CON;
+  coap_code_t code = C_GET;
+  uint16_t mid = 0;
+  uint8_t tkl = 0;
+  uint32_t max_age = 0;
+  uint32_t now = 0xFFFFF000;  // Wraps around during the test.
+  int i;
+
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_parser_create(&q, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_cache_create(&c, buf, size - 1, 4, 64) == COAP_ERR_ARG);
+  assert(coap_cache_create(&c, buf, size, 4, 64) == COAP_OK);
+
+  req_size = cache_request_(req, T_CON, 0x1234, "t1", "temp", 0);
+  res_size = cache_response_(res, C_CONTENT, "v1", 30, "22.3 C");
+  assert(coap_parser_exec(p, req, req_size) == COAP_OK);
+  assert(coap_parser_exec(q, res, res_size) == COAP_OK);
+  assert(coap_cache_get(c, p, now, 0, out, 64, &out_size) ==
+         COAP_ERR_NOT_FOUND);
+  assert(coap_cache_put(c, p, q, now) == COAP_OK);
+
+  // A NON request with another token and a NoCacheKey option hits.
+  req_size = cache_request_(req, T_NON, 0x2000, "t2", "temp", 1);
+  assert(coap_parser_exec(p, req, req_size) == COAP_OK);
+  assert(coap_cache_get(c, p, now + 10500, 0x3000, out, 64, &out_size) ==
+         COAP_OK);
+  assert(coap_cache_get(c, p, now, 0x3000, out, 20, &out_size) ==
+         COAP_ERR_LIMIT);
+  assert(coap_parser_exec(q, out, out_size) == COAP_OK);
+  assert(coap_parser_get_type(q, &t) == COAP_OK && t == T_NON);
+  assert(coap_parser_get_code(q, &code) == COAP_OK && code == C_CONTENT);
+  assert(coap_parser_get_mid(q, &mid) == COAP_OK && mid == 0x3000);
+  assert(coap_parser_get_token(q, &val, &tkl) == COAP_OK);
+  assert(tkl == 2 && memcmp(val, "t2", 2) == 0);
+  assert(coap_parser_get_max_age(q, &max_age) == COAP_OK && max_age == 19);
+  assert(coap_parser_get_opt(q, O_ETAG, &val, &len) == COAP_OK);
+  assert(len == 2 && memcmp(val, "v1", 2) == 0);
+  assert(coap_parser_get_payload(q, &val, &len) == COAP_OK);
+  assert(len == 6 && memcmp(val, "22.3 C", 6) == 0);
+
+  // A CON request is answered in the ACK.
+  req_size = cache_request_(req, T_CON, 0x2001, "t3", "temp", 0);
+  assert(coap_parser_exec(p, req, req_size) == COAP_OK);
+  assert(coap_cache_get(c, p, now, 0x3000, out, 64, &out_size) == COAP_OK);
+  assert(coap_parser_exec(q, out, out_size) == COAP_OK);
+  assert(coap_parser_get_type(q, &t) == COAP_OK && t == T_ACK);
+  assert(coap_parser_get_mid(q, &mid) == COAP_OK && mid == 0x2001);
+  assert(coap_parser_get_max_age(q, &max_age) == COAP_OK && max_age == 30);
+
+  // Revalidate the stale response by its ETag.
+  now += 30000;
+  assert(coap_cache_get(c, p, now, 0, out, 64, &out_size) ==
+         COAP_ERR_NOT_FOUND);
+  assert(coap_cache_get_etag(c, p, &val, &len) == COAP_OK);
+  assert(len == 2 && memcmp(val, "v1", 2) == 0);
+  res_size = cache_response_(res, C_VALID, "v2", 10, "");
+  assert(coap_parser_exec(q, res, res_size) == COAP_OK);
+  assert(coap_cache_put(c, p, q, now) == COAP_ERR_NOT_FOUND);
+  res_size = cache_response_(res, C_VALID, "v1", 10, "");
+  assert(coap_parser_exec(q, res, res_size) == COAP_OK);
+  assert(coap_cache_put(c, p, q, now) == COAP_OK);
+  assert(coap_cache_get(c, p, now, 0, out, 64, &out_size) == COAP_OK);
+  assert(coap_parser_exec(q, out, out_size) == COAP_OK);
+  assert(coap_parser_get_max_age(q, &max_age) == COAP_OK && max_age == 10);
+  assert(coap_parser_get_payload(q, &val, &len) == COAP_OK);
+  assert(len == 6 && memcmp(val, "22.3 C", 6) == 0);
+
+  // Without an ETag a stale response is dropped.
+  res_size = cache_response_(res, C_NOT_FOUND, NULL, 0, "");
+  assert(coap_parser_exec(q, res, res_size) == COAP_OK);
+  assert(coap_cache_put(c, p, q, now) == COAP_OK);
+  assert(coap_cache_get(c, p, now + 59999, 0, out, 64, &out_size) ==
+         COAP_OK);
+  assert(coap_parser_exec(q, out, out_size) == COAP_OK);
+  assert(coap_parser_get_code(q, &code) == COAP_OK && code == C_NOT_FOUND);
+  assert(coap_parser_get_max_age(q, &max_age) == COAP_OK && max_age == 0);
+  assert(coap_cache_get(c, p, now + 60000, 0, out, 64, &out_size) ==
+         COAP_ERR_NOT_FOUND);
+  assert(coap_cache_get_etag(c, p, &val, &len) == COAP_ERR_NOT_FOUND);
+
+  // Not cacheable.
+  res_size = cache_response_(res, C_CHANGED, NULL, 0, "");
+  assert(coap_parser_exec(q, res, res_size) == COAP_OK);
+  assert(coap_cache_put(c, p, q, now) == COAP_ERR_INVALID_CALL);
+  assert(coap_cache_put(c, q, q, now) == COAP_ERR_INVALID_CALL);
+  res_size = cache_response_(res, C_CONTENT, NULL, 0,
+                             "a payload that does not fit in the entry");
+  assert(coap_parser_exec(q, res, res_size) == COAP_OK);
+  assert(coap_cache_put(c, p, q, now) == COAP_ERR_LIMIT);
+
+  // CLOCK eviction skips the entry that has been hit since.
+  res_size = cache_response_(res, C_CONTENT, NULL, 0, "x");
+  assert(coap_parser_exec(q, res, res_size) == COAP_OK);
+  for (i = 0; i < 5; i++) {
+    req_size = cache_request_(req, T_CON, i, "t1", paths[i], 0);
+    assert(coap_parser_exec(p, req, req_size) == COAP_OK);
+    assert(coap_cache_put(c, p, q, now) == COAP_OK);
+    if (i == 0) {
+      assert(coap_cache_get(c, p, now, 0, out, 64, &out_size) == COAP_OK);
+    }
+  }
+  for (i = 0; i < 5; i++) {
+    req_size = cache_request_(req, T_CON, i, "t1", paths[i], 0);
+    assert(coap_parser_exec(p, req, req_size) == COAP_OK);
+    assert(coap_cache_get(c, p, now, 0, out, 64, &out_size) ==
+           (i == 1 ? COAP_ERR_NOT_FOUND : COAP_OK));
+  }
+  free(c);
+  free(q);
+  free(p);
+  return;
+}
+
+void test_coap_retx_poll() {
+  const char ep[6] = {10, 0, 0, 1, 0x16, 0x33};
+  const char msg[4] = {0x40, 0x01, 0x00, 0x01};
+  size_t size = coap_retx_size(4);
+  coap_retx_t* r = NULL;
+  coap_retx_event_t events[4];
+  uint32_t start = 0xFFFFFF00;  // Wraps around during the test.
+  uint32_t now = start;
+  uint32_t last = start;
+  uint32_t interval = 0;
+  size_t n = 0;
+  int resent = 0;
+  int gave_up = 0;
+  void* cookie = NULL;
+
+  assert(coap_retx_create(&r, malloc(size), size, 4, now, 1) == COAP_OK);
+  assert(coap_retx_add(r, ep, 6, 1, msg, 4, (void*)1, now) == COAP_OK);
+  assert(coap_retx_add(r, ep, 6, 1, msg, 4, NULL, now) == COAP_ERR_DUPLICATE);
+  assert(coap_retx_add(r, ep, 6, 2, msg, 4, (void*)2, now) == COAP_OK);
+  assert(coap_retx_add(r, ep, 6, 3, msg, 4, NULL, now) == COAP_OK);
+  assert(coap_retx_add(r, ep, 6, 4, msg, 4, NULL, now) == COAP_OK);
+  assert(coap_retx_add(r, ep, 6, 5, msg, 4, NULL, now) == COAP_ERR_LIMIT);
+  assert(coap_retx_cancel(r, ep, 6, 3, NULL) == COAP_OK);
+  assert(coap_retx_cancel(r, ep, 6, 4, NULL) == COAP_OK);
+  assert(coap_retx_cancel(r, ep, 6, 4, NULL) == COAP_ERR_NOT_FOUND);
+
+  now += COAP_ACK_TIMEOUT - 1;
+  assert(coap_retx_poll(r, now, events, 4, &n) == COAP_OK && n == 0);
+  now = start + COAP_ACK_TIMEOUT * COAP_ACK_RANDOM_FACTOR / 100;
+  assert(coap_retx_poll(r, now, events, 1, &n) == COAP_OK && n == 1);
+  assert(coap_retx_poll(r, now, events + 1, 1, &n) == COAP_OK && n == 1);
+  assert(events[0].mid + events[1].mid == 3);
+  assert(!events[0].gave_up && events[0].msg == msg && events[0].len == 4);
+  assert(events[0].ep_len == 6 && memcmp(events[0].ep, ep, 6) == 0);
+  assert(coap_retx_cancel(r, ep, 6, 2, &cookie) == COAP_OK);
+  assert(cookie == (void*)2);
+
+  // Message 1 is resent MAX_RETRANSMIT times in total with the timeout
+  // doubling each time, then given up on.
+  resent = 1;
+  while (!gave_up) {
+    now++;
+    assert(coap_retx_poll(r, now, events, 4, &n) == COAP_OK && n <= 1);
+    if (n == 1) {
+      assert(events[0].mid == 1 && events[0].cookie == (void*)1);
+      if (interval > 0) {
+        assert(now - last == interval * 2);
+      }
+      interval = resent > 1 ? now - last : 0;
+      last = now;
+      resent += !events[0].gave_up;
+      gave_up = events[0].gave_up;
+    }
+  }
+  assert(now - start >= COAP_ACK_TIMEOUT * 31);
+  assert(now - start <= COAP_ACK_TIMEOUT * 31 * COAP_ACK_RANDOM_FACTOR / 100);
+  assert(resent == COAP_MAX_RETRANSMIT);
+  assert(coap_retx_cancel(r, ep, 6, 1, NULL) == COAP_ERR_NOT_FOUND);
+  free(r);
+  return;
+}
+
 void test_coap_sample_readme() {
   char buf[64] = {};
   char token = 0x20;
@@ -234,6 +640,1476 @@ void test_coap_sample_readme() {
   return;
 }
 
+void test_coap_serializer_add_opt_extended() {
+  char buf[512] = {};
+  char uri[300];
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  size_t msg_size = 0;
+
+  memset(uri, 'a', sizeof(uri));
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 512) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_GET, 0) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_BLOCK2, 0x116) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_PROXY_URI, uri, sizeof(uri)) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, NULL, NULL, 0, &msg_size) == COAP_OK);
+  // Block2 (delta 13 + 10, length 2), then Proxy-Uri (delta 12, length
+  // 14 + 2 bytes in network byte order).
+  assert(msg_size == 4 + 4 + 3 + sizeof(uri));
+  assert((uint8_t)buf[8] == 0xCE);
+  assert(buf[9] == 0 && buf[10] == sizeof(uri) - 269);
+
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  free(s);
+  free(p);
+  return;
+}
+
+void test_coap_parser_exec_batch() {
+  char buf[64] = {};
+  char token = 0x20;
+  const char ack[4] = {0x60, 0x00, 0x12, 0x34};
+  const char bad[4] = {0x80, 0x01, 0x00, 0x01};
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  size_t msg_size = 0;
+  coap_datagram_t msgs[3];
+  uint8_t type[3], code[3], token_offset[3], token_len[3];
+  uint16_t mid[3];
+  size_t payload_offset[3], payload_len[3];
+  int status[3];
+  coap_batch_t res = {type,      code,           mid,         token_offset,
+                      token_len, payload_offset, payload_len, status};
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 64) == COAP_OK);
+  assert(coap_serializer_init(s, T_NON, C_PUT, 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "a", 1) == COAP_OK);
+  assert(coap_serializer_exec(s, 7, &token, "xyz", 3, &msg_size) == COAP_OK);
+  msgs[0].buf = buf;
+  msgs[0].len = msg_size;
+  msgs[1].buf = bad;
+  msgs[1].len = sizeof(bad);
+  msgs[2].buf = ack;
+  msgs[2].len = sizeof(ack);
+
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_parser_exec_batch(p, msgs, 3, &res) == COAP_OK);
+  assert(status[0] == COAP_OK);
+  assert(type[0] == T_NON && code[0] == C_PUT && mid[0] == 7);
+  assert(token_offset[0] == 4 && token_len[0] == 1);
+  assert(payload_len[0] == 3);
+  assert(strncmp(&buf[payload_offset[0]], "xyz", 3) == 0);
+  assert(status[1] == COAP_ERR_SYNTAX);
+  assert(status[2] == COAP_OK);
+  assert(type[2] == T_ACK && code[2] == 0 && mid[2] == 0x1234);
+  assert(token_len[2] == 0 && payload_len[2] == 0);
+  free(s);
+  free(p);
+  return;
+}
+
+void test_coap_parser_get_opt() {
+  char buf[128] = {};
+  char token = 0x20;
+  const char* segments[] = {"api", "v1", "temperature"};
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  const char* val = NULL;
+  size_t len = 0;
+  size_t msg_size = 0;
+  size_t it = 0;
+  int i = 0;
+  uint16_t opt = 0;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 128) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_GET, 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_HOST, "example.com",
+                                 L("example.com")) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "api", L("api")) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "v1", L("v1")) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "temperature",
+                                 L("temperature")) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_ACCEPT, F_APPLICATION_JSON) ==
+         COAP_OK);
+  assert(coap_serializer_add_opt(s, 300, "x", 1) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, &token, NULL, 0, &msg_size) == COAP_OK);
+
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_parser_get_opt(p, O_URI_HOST, &val, &len) ==
+         COAP_ERR_INVALID_CALL);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_has_opt(p, O_URI_HOST) == 1);
+  assert(coap_parser_has_opt(p, O_ACCEPT) == 1);
+  assert(coap_parser_has_opt(p, 300) == 1);
+  assert(coap_parser_has_opt(p, O_CONTENT_FORMAT) == 0);
+  assert(coap_parser_has_opt(p, 301) == 0);
+  assert(coap_parser_get_opt(p, O_URI_HOST, &val, &len) == COAP_OK);
+  assert(len == L("example.com") && strncmp(val, "example.com", len) == 0);
+  assert(coap_parser_get_opt(p, O_ACCEPT, &val, &len) == COAP_OK);
+  assert(len == 1 && val[0] == F_APPLICATION_JSON);
+  assert(coap_parser_get_opt(p, O_CONTENT_FORMAT, &val, &len) ==
+         COAP_ERR_NOT_FOUND);
+  assert(coap_parser_get_opt(p, 300, &val, &len) == COAP_OK);
+  assert(len == 1 && val[0] == 'x');
+
+  while (coap_parser_get_path(p, &it, &val, &len) == COAP_OK) {
+    assert(len == strlen(segments[i]));
+    assert(strncmp(val, segments[i], len) == 0);
+    i++;
+  }
+  assert(i == 3);
+
+  // All options in wire order.
+  assert(coap_parser_get_opt_at(p, 0, &opt, &val, &len) == COAP_OK);
+  assert(opt == O_URI_HOST && len == L("example.com"));
+  assert(coap_parser_get_opt_at(p, 3, &opt, &val, &len) == COAP_OK);
+  assert(opt == O_URI_PATH && strncmp(val, "temperature", len) == 0);
+  assert(coap_parser_get_opt_at(p, 5, &opt, &val, &len) == COAP_OK);
+  assert(opt == 300 && len == 1);
+  assert(coap_parser_get_opt_at(p, 6, &opt, &val, &len) ==
+         COAP_ERR_NOT_FOUND);
+  free(s);
+  free(p);
+  return;
+}
+
+void test_coap_parser_get_uint_opts() {
+  char buf[128] = {};
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  coap_uint_opts_t u;
+  coap_block_t b = {5, 1, 6};
+  uint32_t block = 0;
+  uint32_t val = 0;
+  uint16_t format = 0;
+  size_t msg_size = 0;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 128) == COAP_OK);
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_block_encode(&b, &block) == COAP_OK);
+  // Content-Format 0 is an empty value right after the header.
+  assert(coap_serializer_init(s, T_ACK, C_CONTENT, 0) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_OBSERVE, 0x123456) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN) ==
+         COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_QUERY, "x=1", L("x=1")) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_BLOCK2, block) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_SIZE2, 0xDEADBEEF) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, NULL, "{}", 2, &msg_size) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+
+  assert(coap_parser_get_opt_uint(p, O_OBSERVE, &val) == COAP_OK);
+  assert(val == 0x123456);
+  assert(coap_parser_get_opt_uint(p, O_SIZE2, &val) == COAP_OK);
+  assert(val == 0xDEADBEEF);
+  assert(coap_parser_get_opt_uint(p, O_CONTENT_FORMAT, &val) == COAP_OK);
+  assert(val == 0);
+  assert(coap_parser_get_opt_uint(p, O_ACCEPT, &val) == COAP_ERR_NOT_FOUND);
+  assert(coap_parser_get_content_format(p, &format) == COAP_OK);
+  assert(format == F_TEXT_PLAIN);
+  assert(coap_parser_get_max_age(p, &val) == COAP_OK);
+  assert(val == COAP_DEFAULT_MAX_AGE);
+
+  assert(coap_parser_get_uint_opts(p, &u) == COAP_OK);
+  assert(u.present == (1ULL << O_OBSERVE | 1ULL << O_CONTENT_FORMAT |
+                       1ULL << O_URI_QUERY | 1ULL << O_BLOCK2 |
+                       1ULL << O_SIZE2));
+  assert(u.observe == 0x123456 && u.content_format == F_TEXT_PLAIN);
+  assert(u.max_age == COAP_DEFAULT_MAX_AGE && u.accept == COAP_FORMAT_NONE);
+  assert(u.size2 == 0xDEADBEEF && u.size1 == 0 && u.uri_port == 0);
+  assert(u.block2.num == 5 && u.block2.more == 1 && u.block2.szx == 6);
+  assert(u.block1.num == 0 && u.block1.szx == 0);
+
+  // A request with no options takes all defaults; Max-Age 0 is kept.
+  assert(coap_serializer_init(s, T_CON, C_GET, 0) == COAP_OK);
+  assert(coap_serializer_exec(s, 2, NULL, NULL, 0, &msg_size) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_get_uint_opts(p, &u) == COAP_OK);
+  assert(u.present == 0 && u.content_format == COAP_FORMAT_NONE);
+  assert(u.max_age == COAP_DEFAULT_MAX_AGE);
+  assert(coap_parser_get_content_format(p, &format) == COAP_ERR_NOT_FOUND);
+  assert(coap_serializer_init(s, T_ACK, C_CONTENT, 0) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_MAX_AGE, 0) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_ACCEPT, 0x1234) == COAP_OK);
+  assert(coap_serializer_exec(s, 3, NULL, NULL, 0, &msg_size) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_get_max_age(p, &val) == COAP_OK && val == 0);
+  assert(coap_parser_get_uint_opts(p, &u) == COAP_OK);
+  assert(u.max_age == 0 && u.accept == 0x1234);
+  assert(coap_parser_get_opt_uint(p, O_URI_HOST, &val) == COAP_ERR_ARG);
+  free(s);
+  free(p);
+  return;
+}
+
+/**
+ * Serialize the request a forward proxy receives, or, with |proxied|, the
+ * one it sends with Proxy-Uri split into Uri-* options.
+ */
+static size_t editor_request_(char* buf, uint8_t proxied, int drop_observe) {
+  coap_serializer_t* s = NULL;
+  size_t msg_size = 0;
+  const char* uri = "coap://example.com:5684/a/b?x=1";
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 128) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_GET, proxied ? 3 : 2) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_IF_MATCH, "e1", 2) == COAP_OK);
+  if (proxied) {
+    assert(coap_serializer_add_opt(s, O_URI_HOST, "example.com",
+                                   L("example.com")) == COAP_OK);
+  }
+  if (!drop_observe) {
+    assert(coap_serializer_add_opt_uint(s, O_OBSERVE, 7) == COAP_OK);
+  }
+  if (proxied) {
+    assert(coap_serializer_add_opt_uint(s, O_URI_PORT, 5684) == COAP_OK);
+    assert(coap_serializer_add_opt(s, O_URI_PATH, "a", 1) == COAP_OK);
+    assert(coap_serializer_add_opt(s, O_URI_PATH, "b", 1) == COAP_OK);
+    assert(coap_serializer_add_opt(s, O_URI_QUERY, "x=1", 3) == COAP_OK);
+  }
+  assert(coap_serializer_add_opt_uint(s, O_ACCEPT, F_APPLICATION_JSON) ==
+         COAP_OK);
+  if (!proxied) {
+    assert(coap_serializer_add_opt(s, O_PROXY_URI, uri, strlen(uri)) ==
+           COAP_OK);
+  }
+  assert(coap_serializer_add_opt_uint(s, O_SIZE1, 1000) == COAP_OK);
+  assert(coap_serializer_exec(s, proxied ? 0x2222 : 0x1111,
+                              proxied ? "xyz" : "ab", "body", 4,
+                              &msg_size) == COAP_OK);
+  free(s);
+  return msg_size;
+}
+
+void test_coap_editor_exec() {
+  char buf[128] = {};
+  char expected[128] = {};
+  char out[128] = {};
+  coap_parser_t* p = NULL;
+  coap_editor_t* e = NULL;
+  const char* uri = NULL;
+  size_t uri_len = 0;
+  size_t msg_size = editor_request_(buf, 0, 0);
+  size_t expected_size = 0;
+  size_t out_size = 0;
+
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_editor_create(&e, malloc(coap_editor_size()), coap_editor_size(),
+                            out, sizeof(out)) == COAP_OK);
+  assert(coap_editor_exec(e, &out_size) == COAP_ERR_INVALID_CALL);
+  assert(coap_editor_init(e, p) == COAP_ERR_INVALID_CALL);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_editor_init(e, p) == COAP_OK);
+
+  // Without edits the message is copied as it is.
+  assert(coap_editor_exec(e, &out_size) == COAP_OK);
+  assert(out_size == msg_size && memcmp(out, buf, msg_size) == 0);
+
+  // Proxy-Uri "coap://example.com:5684/a/b?x=1" into Uri-* options; the
+  // values point into the parsed message.
+  assert(coap_parser_get_opt(p, O_PROXY_URI, &uri, &uri_len) == COAP_OK);
+  assert(coap_editor_remove_opt(e, O_PROXY_URI) == COAP_OK);
+  assert(coap_editor_remove_opt(e, O_URI_HOST) == COAP_ERR_NOT_FOUND);
+  assert(coap_editor_add_opt(e, O_URI_QUERY, &uri[28], 3) == COAP_OK);
+  assert(coap_editor_add_opt(e, O_URI_PATH, &uri[24], 1) == COAP_OK);
+  assert(coap_editor_add_opt(e, O_URI_PATH, &uri[26], 1) == COAP_OK);
+  assert(coap_editor_add_opt(e, O_URI_HOST, &uri[7], 11) == COAP_OK);
+  assert(coap_editor_add_opt_uint(e, O_URI_PORT, 5684) == COAP_OK);
+  assert(coap_editor_set_header(e, T_CON, C_GET, 0x2222) == COAP_OK);
+  assert(coap_editor_set_token(e, "xyz", 3) == COAP_OK);
+  assert(coap_editor_exec(e, &out_size) == COAP_OK);
+  expected_size = editor_request_(expected, 1, 0);
+  assert(out_size == expected_size);
+  assert(memcmp(out, expected, out_size) == 0);
+
+  // Further edits apply on top; a non-repeatable option can not be doubled.
+  assert(coap_editor_remove_opt(e, O_OBSERVE) == COAP_OK);
+  assert(coap_editor_exec(e, &out_size) == COAP_OK);
+  expected_size = editor_request_(expected, 1, 1);
+  assert(out_size == expected_size);
+  assert(memcmp(out, expected, out_size) == 0);
+  assert(coap_editor_add_opt_uint(e, O_ACCEPT, 0) == COAP_OK);
+  assert(coap_editor_exec(e, &out_size) == COAP_ERR_INVALID_CALL);
+
+  // Only the parsed options are edited by a new init.
+  assert(coap_editor_init(e, p) == COAP_OK);
+  assert(coap_editor_remove_opt(e, O_OBSERVE) == COAP_OK);
+  assert(coap_editor_set_payload(e, NULL, 0) == COAP_OK);
+  assert(coap_editor_exec(e, &out_size) == COAP_OK);
+  assert(coap_parser_exec(p, out, out_size) == COAP_OK);
+  assert(coap_parser_has_opt(p, O_OBSERVE) == 0);
+  assert(coap_parser_get_opt(p, O_PROXY_URI, &uri, &uri_len) == COAP_OK);
+  assert(uri_len == L("coap://example.com:5684/a/b?x=1"));
+  assert(coap_parser_get_payload(p, &uri, &uri_len) == COAP_OK);
+  assert(uri_len == 0);
+
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_editor_create(&e, e, coap_editor_size(), out, 16) == COAP_OK);
+  assert(coap_editor_init(e, p) == COAP_OK);
+  assert(coap_editor_exec(e, &out_size) == COAP_ERR_LIMIT);
+  free(e);
+  free(p);
+  return;
+}
+
+void test_coap_reply() {
+  char req[64] = {};
+  char non[64] = {};
+  char buf[64] = {};
+  char acks[16] = {};
+  const char token[2] = {0x5a, 0x3c};
+  const char con_post[4] = {0x40, 0x02, 0x00, 0x09};
+  const char bad[4] = {0x80, 0x01, 0x00, 0x01};
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  const char* val = NULL;
+  size_t len = 0;
+  coap_type_t t = T_CON;
+  coap_code_t c = C_GET;
+  uint16_t m = 0;
+  uint8_t tkl = 0;
+  size_t req_size = 0, non_size = 0, msg_size = 0;
+  size_t idx[4] = {0};
+  size_t acked = 0;
+  coap_datagram_t msgs[4];
+  uint8_t type[4], code[4], token_offset[4], token_len[4];
+  uint16_t mid[4];
+  size_t payload_offset[4], payload_len[4];
+  int status[4];
+  coap_batch_t res = {type,      code,           mid,         token_offset,
+                      token_len, payload_offset, payload_len, status};
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), req, 64) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_GET, 2) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "temp", 4) == COAP_OK);
+  assert(coap_serializer_exec(s, 0x1234, token, NULL, 0, &req_size) ==
+         COAP_OK);
+  assert(coap_serializer_create(&s, s, coap_serializer_size(), non, 64) ==
+         COAP_OK);
+  assert(coap_serializer_init(s, T_NON, C_GET, 2) == COAP_OK);
+  assert(coap_serializer_exec(s, 0x5678, token, NULL, 0, &non_size) ==
+         COAP_OK);
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_serializer_create(&s, s, coap_serializer_size(), buf, 64) ==
+         COAP_OK);
+
+  // Empty ACK and RST, from the header of a lazily parsed CON.
+  assert(coap_reply_empty(p, T_ACK, buf, 64, &msg_size) ==
+         COAP_ERR_INVALID_CALL);
+  assert(coap_parser_exec_lazy(p, req, req_size) == COAP_OK);
+  assert(coap_reply_empty(p, T_ACK, buf, 64, &msg_size) == COAP_OK);
+  assert(msg_size == 4 && memcmp(buf, "\x60\x00\x12\x34", 4) == 0);
+  assert(coap_reply_empty(p, T_RST, buf, 64, &msg_size) == COAP_OK);
+  assert(msg_size == 4 && memcmp(buf, "\x70\x00\x12\x34", 4) == 0);
+  assert(coap_reply_empty(p, T_CON, buf, 64, &msg_size) == COAP_ERR_ARG);
+  assert(coap_reply_empty(p, T_ACK, buf, 3, &msg_size) == COAP_ERR_LIMIT);
+
+  // Piggybacked response to the CON.
+  assert(coap_serializer_init_reply(s, p, C_CONTENT, 0) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN) ==
+         COAP_OK);
+  assert(coap_serializer_exec_reply(s, "22.3 C", 6, &msg_size) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_get_type(p, &t) == COAP_OK && t == T_ACK);
+  assert(coap_parser_get_code(p, &c) == COAP_OK && c == C_CONTENT);
+  assert(coap_parser_get_mid(p, &m) == COAP_OK && m == 0x1234);
+  assert(coap_parser_get_token(p, &val, &tkl) == COAP_OK);
+  assert(tkl == 2 && memcmp(val, token, 2) == 0);
+  assert(coap_parser_get_payload(p, &val, &len) == COAP_OK);
+  assert(len == 6 && memcmp(val, "22.3 C", 6) == 0);
+  // A response can not be replied to.
+  assert(coap_serializer_init_reply(s, p, C_CONTENT, 0) ==
+         COAP_ERR_INVALID_CALL);
+
+  // A NON is answered by a NON with a new message id, and may only be reset.
+  assert(coap_parser_exec(p, non, non_size) == COAP_OK);
+  assert(coap_reply_empty(p, T_ACK, buf, 64, &msg_size) ==
+         COAP_ERR_INVALID_CALL);
+  assert(coap_serializer_init_reply(s, p, C_NOT_FOUND, 0x0101) == COAP_OK);
+  assert(coap_serializer_exec_reply(s, NULL, 0, &msg_size) == COAP_OK);
+  assert(msg_size == 6);
+  assert(memcmp(buf, "\x52\x84\x01\x01\x5a\x3c", 6) == 0);
+
+  // Batch: ACK the two CONs that parse.
+  msgs[0].buf = req;
+  msgs[0].len = req_size;
+  msgs[1].buf = non;
+  msgs[1].len = non_size;
+  msgs[2].buf = bad;
+  msgs[2].len = sizeof(bad);
+  msgs[3].buf = con_post;
+  msgs[3].len = sizeof(con_post);
+  assert(coap_parser_exec_batch(p, msgs, 4, &res) == COAP_OK);
+  assert(coap_reply_empty_batch(&res, 4, acks, sizeof(acks), idx, &acked) ==
+         COAP_OK);
+  assert(acked == 2 && idx[0] == 0 && idx[1] == 3);
+  assert(memcmp(acks, "\x60\x00\x12\x34\x60\x00\x00\x09", 8) == 0);
+  assert(coap_reply_empty_batch(&res, 4, acks, 7, NULL, &acked) ==
+         COAP_ERR_LIMIT);
+  assert(acked == 1);
+  free(s);
+  free(p);
+  return;
+}
+
+void test_coap_serializer_add_opt_validation() {
+  char buf[64] = {};
+  const char unknown[] = {0x40, 0x01, 0x00, 0x01, 0x20};
+  const char repeated[] = {0x40, 0x01, 0x00, 0x01, 0x61, 0x01, 0x01, 0x02};
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  size_t msg_size = 0;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 64) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_GET, 0) == COAP_OK);
+  assert(coap_serializer_add_opt(s, 2, "a", 1) == COAP_ERR_ARG);
+  assert(coap_serializer_add_opt(s, O_ETAG, NULL, 0) == COAP_ERR_ARG);
+  assert(coap_serializer_add_opt(s, O_ETAG, "123456789", 9) == COAP_ERR_ARG);
+  assert(coap_serializer_add_opt(s, O_ETAG, "1", 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_ETAG, "2", 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_IF_NONE_MATCH, "", 1) == COAP_ERR_ARG);
+  assert(coap_serializer_add_opt_uint(s, O_OBSERVE, 0x1000000) ==
+         COAP_ERR_ARG);
+  assert(coap_serializer_add_opt_uint(s, O_OBSERVE, 1) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_OBSERVE, 2) ==
+         COAP_ERR_INVALID_CALL);
+  assert(coap_serializer_add_opt_uint(s, O_URI_PATH, 1) == COAP_ERR_ARG);
+  assert(coap_serializer_add_opt_uint(s, O_SIZE2, 1024) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, 1000, 1) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, NULL, NULL, 0, &msg_size) == COAP_OK);
+
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_exec(p, unknown, sizeof(unknown)) == COAP_ERR_SYNTAX);
+  assert(coap_parser_exec(p, repeated, sizeof(repeated)) == COAP_ERR_SYNTAX);
+  free(s);
+  free(p);
+  return;
+}
+
+void test_coap_serializer_exec_iov() {
+  char buf[64] = {};
+  char msg[2048] = {};
+  char payload[1024];
+  char token = 0x20;
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  struct iovec iov[2];
+  size_t iov_len = 0;
+  size_t msg_size = 0;
+  const char* res = NULL;
+  size_t res_len = 0;
+
+  memset(payload, 0x5A, sizeof(payload));
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 64) == COAP_OK);
+  assert(coap_serializer_init(s, T_ACK, C_CONTENT, 1) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_BLOCK2, 0x0E) == COAP_OK);
+  assert(coap_serializer_exec_iov(s, 3, &token, payload, sizeof(payload), iov,
+                                  &iov_len, &msg_size) == COAP_OK);
+  assert(iov_len == 2);
+  assert(iov[0].iov_base == buf && iov[0].iov_len == 9);
+  assert((uint8_t)buf[8] == 0xFF);
+  assert(iov[1].iov_base == payload && iov[1].iov_len == sizeof(payload));
+  assert(msg_size == 9 + sizeof(payload));
+
+  memcpy(msg, iov[0].iov_base, iov[0].iov_len);
+  memcpy(&msg[iov[0].iov_len], iov[1].iov_base, iov[1].iov_len);
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_parser_exec(p, msg, msg_size) == COAP_OK);
+  assert(coap_parser_get_payload(p, &res, &res_len) == COAP_OK);
+  assert(res_len == sizeof(payload));
+
+  assert(coap_serializer_exec_iov(s, 4, &token, NULL, 0, iov, &iov_len,
+                                  &msg_size) == COAP_OK);
+  assert(iov_len == 1 && iov[0].iov_len == 8 && msg_size == 8);
+  free(s);
+  free(p);
+  return;
+}
+
+void test_coap_builder_exec() {
+  char expected[128] = {};
+  char buf[128] = {};
+  char token = 0x20;
+  coap_serializer_t* s = NULL;
+  coap_builder_t* b = NULL;
+  size_t expected_size = 0;
+  size_t msg_size = 0;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), expected,
+                                128) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_POST, 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_HOST, "example.com",
+                                 L("example.com")) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_OBSERVE, 0x10000) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_URI_PORT, 5683) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "a", 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "b", 1) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN) ==
+         COAP_OK);
+  assert(coap_serializer_add_opt(s, 1000, "z", 1) == COAP_OK);
+  assert(coap_serializer_exec(s, 9, &token, "22.3 C", L("22.3 C"),
+                              &expected_size) == COAP_OK);
+
+  assert(coap_builder_create(&b, malloc(coap_builder_size()),
+                             coap_builder_size(), buf, 128) == COAP_OK);
+  assert(coap_builder_init(b, T_CON, C_POST, 1) == COAP_OK);
+  assert(coap_builder_add_opt(b, 1000, "z", 1) == COAP_OK);
+  assert(coap_builder_add_opt(b, O_URI_PATH, "a", 1) == COAP_OK);
+  assert(coap_builder_add_opt_uint(b, O_CONTENT_FORMAT, F_TEXT_PLAIN) ==
+         COAP_OK);
+  assert(coap_builder_add_opt_uint(b, O_URI_PORT, 5683) == COAP_OK);
+  assert(coap_builder_add_opt(b, O_URI_PATH, "b", 1) == COAP_OK);
+  assert(coap_builder_add_opt_uint(b, O_OBSERVE, 0x10000) == COAP_OK);
+  assert(coap_builder_add_opt(b, O_URI_HOST, "example.com",
+                              L("example.com")) == COAP_OK);
+  assert(coap_builder_add_opt(b, O_ETAG, NULL, 0) == COAP_ERR_ARG);
+  assert(coap_builder_exec(b, 9, &token, "22.3 C", L("22.3 C"), &msg_size) ==
+         COAP_OK);
+  assert(msg_size == expected_size);
+  assert(memcmp(buf, expected, msg_size) == 0);
+  assert(coap_builder_add_opt(b, O_URI_PATH, "c", 1) == COAP_ERR_INVALID_CALL);
+
+  // A repeated non-repeatable option is rejected when it is staged.
+  assert(coap_builder_init(b, T_CON, C_GET, 0) == COAP_OK);
+  assert(coap_builder_add_opt_uint(b, O_ACCEPT, 0) == COAP_OK);
+  assert(coap_builder_add_opt_uint(b, O_ACCEPT, 1) == COAP_ERR_INVALID_CALL);
+  assert(coap_builder_add_opt(b, O_ACCEPT, "\x01", 1) ==
+         COAP_ERR_INVALID_CALL);
+  assert(coap_builder_add_opt(b, O_URI_PATH, "a", 1) == COAP_OK);
+  assert(coap_builder_exec(b, 9, NULL, NULL, 0, &msg_size) == COAP_OK);
+  assert(msg_size == 4 + 2 + 1);
+
+  // Options that do not fit leave the builder ready for another exec.
+  assert(coap_builder_create(&b, b, coap_builder_size(), buf, 12) ==
+         COAP_OK);
+  assert(coap_builder_init(b, T_CON, C_GET, 0) == COAP_OK);
+  assert(coap_builder_add_opt(b, O_URI_PATH, "example", L("example")) ==
+         COAP_OK);
+  assert(coap_builder_add_opt(b, O_URI_HOST, "h", 1) == COAP_OK);
+  assert(coap_builder_exec(b, 9, NULL, NULL, 0, &msg_size) ==
+         COAP_ERR_LIMIT);
+  assert(coap_builder_exec(b, 9, NULL, NULL, 0, &msg_size) ==
+         COAP_ERR_LIMIT);
+  free(s);
+  free(b);
+  return;
+}
+
+void test_coap_template_exec() {
+  char tmpl_buf[64] = {};
+  char buf[64] = {};
+  const char token[2] = {0x0a, 0x0b};
+  coap_template_t* t = NULL;
+  coap_parser_t* p = NULL;
+  const char* val = NULL;
+  size_t len = 0;
+  size_t msg_size = 0;
+  uint8_t slot = 0;
+  uint16_t mid = 0;
+  uint32_t vals[1];
+
+  assert(coap_template_create(&t, malloc(coap_template_size()),
+                              coap_template_size(), tmpl_buf,
+                              64) == COAP_OK);
+  assert(coap_template_init(t, T_NON, C_CONTENT, 2) == COAP_OK);
+  assert(coap_template_add_opt_slot(t, O_URI_PATH, 3, &slot) == COAP_ERR_ARG);
+  assert(coap_template_add_opt_slot(t, O_OBSERVE, 3, &slot) == COAP_OK);
+  assert(slot == 0);
+  assert(coap_template_add_opt_uint(t, O_CONTENT_FORMAT, F_TEXT_PLAIN) ==
+         COAP_OK);
+  assert(coap_template_add_opt_uint(t, O_MAX_AGE, 30) == COAP_OK);
+
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  vals[0] = 0x123456;
+  assert(coap_template_exec(t, buf, 64, 0x4321, token, vals, "22.3 C",
+                            L("22.3 C"), &msg_size) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_get_mid(p, &mid) == COAP_OK && mid == 0x4321);
+  assert(coap_parser_get_opt(p, O_OBSERVE, &val, &len) == COAP_OK);
+  assert(len == 3 && memcmp(val, "\x12\x34\x56", 3) == 0);
+  assert(coap_parser_get_payload(p, &val, &len) == COAP_OK);
+  assert(len == L("22.3 C") && strncmp(val, "22.3 C", len) == 0);
+
+  vals[0] = 7;
+  assert(coap_template_exec(t, buf, 64, 0x4322, token, vals, NULL, 0,
+                            &msg_size) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_size) == COAP_OK);
+  assert(coap_parser_get_opt(p, O_OBSERVE, &val, &len) == COAP_OK);
+  assert(len == 3 && memcmp(val, "\x00\x00\x07", 3) == 0);
+  assert(coap_parser_get_payload(p, &val, &len) == COAP_OK && len == 0);
+  assert(coap_template_exec(t, buf, 8, 1, token, vals, NULL, 0, &msg_size) ==
+         COAP_ERR_LIMIT);
+  free(t);
+  free(p);
+  return;
+}
+
+void test_coap_exchange_match() {
+  size_t size = coap_exchange_size(300);
+  void* buf = malloc(size);
+  coap_exchange_t* x = NULL;
+  char tokens[300][8];
+  char token[8];
+  void* cookie = NULL;
+  size_t i;
+
+  assert(coap_exchange_create(&x, buf, size - 1, 300, 7) == COAP_ERR_ARG);
+  assert(coap_exchange_create(&x, buf, size, 300, 7) == COAP_OK);
+  for (i = 0; i < 300; i++) {
+    assert(coap_exchange_add(x, i, tokens[i], 8, &tokens[i]) == COAP_OK);
+  }
+  assert(coap_exchange_add(x, 300, token, 8, NULL) == COAP_ERR_LIMIT);
+  assert(coap_exchange_add(x, 299, token, 8, NULL) == COAP_ERR_DUPLICATE);
+  for (i = 0; i < 300; i++) {
+    assert(coap_exchange_match(x, tokens[i], 8, &cookie) == COAP_OK);
+    assert(cookie == &tokens[i]);
+  }
+  assert(coap_exchange_match(x, "none", 4, &cookie) == COAP_ERR_NOT_FOUND);
+
+  // An empty ACK releases the MID; the separate response matches by token.
+  assert(coap_exchange_match_mid(x, 10, &cookie) == COAP_OK);
+  assert(cookie == &tokens[10]);
+  assert(coap_exchange_match_mid(x, 10, &cookie) == COAP_ERR_NOT_FOUND);
+  assert(coap_exchange_remove(x, tokens[10], 8, &cookie) == COAP_OK);
+  assert(cookie == &tokens[10]);
+  assert(coap_exchange_match(x, tokens[10], 8, &cookie) ==
+         COAP_ERR_NOT_FOUND);
+  assert(coap_exchange_remove(x, tokens[20], 8, NULL) == COAP_OK);
+  assert(coap_exchange_match_mid(x, 20, NULL) == COAP_ERR_NOT_FOUND);
+  assert(coap_exchange_match_mid(x, 21, NULL) == COAP_OK);
+
+  // Short tokens are still unique among pending requests.
+  for (i = 0; i < 300; i++) {
+    if (i != 10 && i != 20) {
+      assert(coap_exchange_remove(x, tokens[i], 8, NULL) == COAP_OK);
+    }
+  }
+  for (i = 0; i < 200; i++) {
+    assert(coap_exchange_add(x, i, tokens[i], 1, NULL) == COAP_OK);
+  }
+  for (i = 0; i < 200; i++) {
+    assert(coap_exchange_insert(x, 1000, tokens[i], 1, NULL) ==
+           COAP_ERR_DUPLICATE);
+  }
+  assert(coap_exchange_insert(x, 1000, NULL, 0, NULL) == COAP_OK);
+  assert(coap_exchange_match(x, NULL, 0, &cookie) == COAP_OK);
+  free(x);
+  return;
+}
+
+static size_t flatten_(const coap_notification_t* m, char* dst) {
+  size_t len = 0;
+  size_t i;
+  for (i = 0; i < m->iov_len; i++) {
+    memcpy(&dst[len], m->iov[i].iov_base, m->iov[i].iov_len);
+    len += m->iov[i].iov_len;
+  }
+  return len;
+}
+
+void test_coap_observe_emit() {
+  const char ep1[6] = {10, 0, 0, 1, 0x16, 0x33};
+  const char ep2[6] = {10, 0, 0, 2, 0x16, 0x33};
+  char buf[64] = {};
+  char msg[64] = {};
+  size_t size = coap_observe_size(4);
+  void* obuf = malloc(size);
+  coap_observe_t* o = NULL;
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  coap_notification_t out[4];
+  uint16_t mid = 0xFFFF;
+  uint32_t seq = 0;
+  size_t msg_len = 0;
+  size_t n = 0;
+  const char* res = NULL;
+  size_t res_len = 0;
+  coap_type_t type;
+  uint16_t res_mid;
+  uint8_t token_len;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 64) == COAP_OK);
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_observe_create(&o, obuf, size - 1, 4) == COAP_ERR_ARG);
+  assert(coap_observe_create(&o, obuf, size, 4) == COAP_OK);
+  assert(coap_observe_register(o, ep1, 6, "ab", 2, 0, 0, &seq) == COAP_OK);
+  assert(seq == 0);
+  assert(coap_observe_register(o, ep1, 6, "c", 1, 1, 0, NULL) == COAP_OK);
+  assert(coap_observe_register(o, ep2, 6, "ab", 2, 0, 0, NULL) == COAP_OK);
+  assert(coap_observe_register(o, ep2, 6, "ab", 2, 0, 0, NULL) == COAP_OK);
+  assert(coap_observe_register(o, ep2, 6, "cd", 2, 0, 0, NULL) == COAP_OK);
+  assert(coap_observe_register(o, ep2, 6, "ef", 2, 0, 0, NULL) ==
+         COAP_ERR_LIMIT);
+  assert(coap_observe_deregister(o, ep2, 6, "cd", 2) == COAP_OK);
+  assert(coap_observe_deregister(o, ep2, 6, "cd", 2) == COAP_ERR_NOT_FOUND);
+
+  // A notification without Observe can not be fanned out.
+  assert(coap_serializer_init(s, T_CON, C_CONTENT, 0) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, NULL, "x", 1, &msg_len) == COAP_OK);
+  assert(coap_observe_notify(o, buf, msg_len) == COAP_ERR_ARG);
+
+  assert(coap_serializer_init(s, T_CON, C_CONTENT, 0) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_ETAG, "e1", 2) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_OBSERVE, 0) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, 0) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, NULL, "22.5", 4, &msg_len) == COAP_OK);
+  assert(coap_observe_notify(o, buf, msg_len) == COAP_OK);
+  assert(coap_observe_emit(o, 1000, &mid, out, 2, &n) == COAP_OK);
+  assert(n == 2);
+  assert(coap_observe_emit(o, 1000, &mid, &out[2], 2, &n) == COAP_OK);
+  assert(n == 1);
+  assert(coap_observe_emit(o, 1000, &mid, &out[3], 1, &n) == COAP_OK);
+  assert(n == 0);
+
+  assert(out[0].ep_len == 6 && memcmp(out[0].ep, ep1, 6) == 0);
+  assert(out[1].type == T_CON && out[2].type == T_NON);
+  assert(out[0].mid == 0xFFFF && out[1].mid == 0 && out[2].mid == 1);
+  assert(flatten_(&out[1], msg) == out[1].len);
+  assert(coap_parser_exec(p, msg, out[1].len) == COAP_OK);
+  assert(coap_parser_get_type(p, &type) == COAP_OK && type == T_CON);
+  assert(coap_parser_get_mid(p, &res_mid) == COAP_OK && res_mid == 0);
+  assert(coap_parser_get_token(p, &res, &token_len) == COAP_OK);
+  assert(token_len == 1 && res[0] == 'c');
+  assert(coap_parser_get_opt(p, O_ETAG, &res, &res_len) == COAP_OK);
+  assert(res_len == 2 && memcmp(res, "e1", 2) == 0);
+  assert(coap_parser_get_opt(p, O_OBSERVE, &res, &res_len) == COAP_OK);
+  assert(res_len == 1 && res[0] == 1);
+  assert(coap_parser_has_opt(p, O_CONTENT_FORMAT));
+  assert(coap_parser_get_payload(p, &res, &res_len) == COAP_OK);
+  assert(res_len == 4 && memcmp(res, "22.5", 4) == 0);
+
+  // Non-confirmable observers get a confirmable notification once a day.
+  assert(coap_observe_notify(o, buf, msg_len) == COAP_OK);
+  assert(coap_observe_emit(o, COAP_OBSERVE_CON_INTERVAL, &mid, out, 4, &n) ==
+         COAP_OK);
+  assert(n == 3);
+  assert(out[0].type == T_CON && out[2].type == T_CON);
+  assert(coap_observe_notify(o, buf, msg_len) == COAP_OK);
+  assert(coap_observe_emit(o, COAP_OBSERVE_CON_INTERVAL + 1000, &mid, out, 4,
+                           &n) == COAP_OK);
+  assert(out[0].type == T_NON && out[1].type == T_CON);
+  assert(out[2].type == T_NON);
+  assert(flatten_(&out[2], msg) == out[2].len);
+  assert(coap_parser_exec(p, msg, out[2].len) == COAP_OK);
+  assert(coap_parser_get_opt(p, O_OBSERVE, &res, &res_len) == COAP_OK);
+  assert(res_len == 1 && res[0] == 3);
+  free(s);
+  free(p);
+  free(o);
+  return;
+}
+
+void test_coap_block() {
+  const char ep[6] = {10, 0, 0, 1, 0x16, 0x33};
+  char rep[100];
+  char buf[64] = {};
+  size_t size = coap_reasm_size(2, 100);
+  void* rbuf = malloc(size);
+  coap_reasm_t* r = NULL;
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  coap_block_t b = {0, 0, 0};
+  coap_block_t res;
+  const char* body = NULL;
+  size_t body_len = 0;
+  size_t msg_len;
+  uint32_t val;
+  uint32_t now = 0;
+  int i;
+
+  for (i = 0; i < 100; i++) {
+    rep[i] = (char)i;
+  }
+  assert(coap_block_decode("\x1A", 1, &b) == COAP_OK);
+  assert(b.num == 1 && b.more == 1 && b.szx == 2);
+  assert(coap_block_decode("\x12\x34\x5E", 3, &b) == COAP_OK);
+  assert(b.num == 0x12345 && b.more == 1 && b.szx == 6);
+  assert(coap_block_decode("\x0F", 1, &b) == COAP_ERR_SYNTAX);
+  assert(coap_block_decode(NULL, 0, &b) == COAP_OK);
+  assert(b.num == 0 && b.more == 0 && b.szx == 0);
+  b.num = 0x100000;
+  assert(coap_block_encode(&b, &val) == COAP_ERR_ARG);
+  b.num = 0x12345;
+  b.more = 1;
+  b.szx = 6;
+  assert(coap_block_encode(&b, &val) == COAP_OK && val == 0x12345E);
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 64) == COAP_OK);
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_PUT, 0) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_BLOCK1, val) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, NULL, NULL, 0, &msg_len) == COAP_OK);
+  assert(coap_parser_exec(p, buf, msg_len) == COAP_OK);
+  assert(coap_parser_get_block(p, O_BLOCK1, &res) == COAP_OK);
+  assert(res.num == 0x12345 && res.more == 1 && res.szx == 6);
+  assert(coap_parser_get_block(p, O_BLOCK2, &res) == COAP_ERR_NOT_FOUND);
+
+  // Block2: 100 bytes in 32 byte blocks; a request for 64 bytes is capped.
+  b.num = 0;
+  b.szx = 2;
+  assert(coap_block2_slice(rep, 100, &b, 1, &res, &body, &body_len) ==
+         COAP_OK);
+  assert(res.num == 0 && res.more == 1 && res.szx == 1);
+  assert(body == rep && body_len == 32);
+  b.num = 1;
+  b.szx = 1;
+  assert(coap_block2_slice(rep, 100, &b, 6, &res, &body, &body_len) ==
+         COAP_OK);
+  assert(res.num == 1 && res.more == 1 && res.szx == 1);
+  assert(body == rep + 32 && body_len == 32);
+  b.num = 3;
+  assert(coap_block2_slice(rep, 100, &b, 6, &res, &body, &body_len) ==
+         COAP_OK);
+  assert(res.more == 0 && body == rep + 96 && body_len == 4);
+  b.num = 4;
+  assert(coap_block2_slice(rep, 100, &b, 6, &res, &body, &body_len) ==
+         COAP_ERR_NOT_FOUND);
+
+  // Block1: reassemble 100 bytes sent in 32 byte blocks.
+  assert(coap_reasm_create(&r, rbuf, size - 1, 2, 100) == COAP_ERR_ARG);
+  assert(coap_reasm_create(&r, rbuf, size, 2, 100) == COAP_OK);
+  b.num = 1;
+  b.more = 1;
+  b.szx = 1;
+  assert(coap_reasm_add(r, ep, 6, "t", 1, &b, rep + 32, 32, now, &body,
+                        &body_len) == COAP_ERR_INCOMPLETE);
+  for (i = 0; i < 3; i++) {
+    b.num = i;
+    assert(coap_reasm_add(r, ep, 6, "t", 1, &b, rep + i * 32, 32, now, &body,
+                          &body_len) == COAP_OK);
+    assert(body == NULL);
+  }
+  b.num = 1;
+  assert(coap_reasm_add(r, ep, 6, "t", 1, &b, rep + 32, 32, now, &body,
+                        &body_len) == COAP_ERR_DUPLICATE);
+  b.num = 3;
+  b.more = 0;
+  assert(coap_reasm_add(r, ep, 6, "t", 1, &b, rep + 96, 4, now, &body,
+                        &body_len) == COAP_OK);
+  assert(body_len == 100 && memcmp(body, rep, 100) == 0);
+  assert(coap_reasm_add(r, ep, 6, "t", 1, &b, rep + 96, 4, now, &body,
+                        &body_len) == COAP_ERR_DUPLICATE);
+  assert(body_len == 100);
+
+  // Out of order blocks, short blocks and oversized bodies end a transfer.
+  b.num = 0;
+  b.more = 1;
+  assert(coap_reasm_add(r, ep, 6, "u", 1, &b, rep, 32, now, &body,
+                        &body_len) == COAP_OK);
+  assert(coap_reasm_add(r, ep, 6, "v", 1, &b, rep, 32, now, &body,
+                        &body_len) == COAP_ERR_LIMIT);
+  b.num = 2;
+  assert(coap_reasm_add(r, ep, 6, "u", 1, &b, rep, 32, now, &body,
+                        &body_len) == COAP_ERR_INCOMPLETE);
+  b.num = 1;
+  assert(coap_reasm_add(r, ep, 6, "u", 1, &b, rep, 32, now, &body,
+                        &body_len) == COAP_ERR_INCOMPLETE);
+  assert(coap_reasm_remove(r, ep, 6, "t", 1) == COAP_OK);
+  assert(coap_reasm_remove(r, ep, 6, "t", 1) == COAP_ERR_NOT_FOUND);
+  b.num = 0;
+  b.szx = 6;
+  assert(coap_reasm_add(r, ep, 6, "v", 1, &b, rep, 100, now, &body,
+                        &body_len) == COAP_ERR_SYNTAX);
+  for (i = 0; i < 2; i++) {
+    b.num = i;
+    b.szx = 2;
+    assert(coap_reasm_add(r, ep, 6, "v", 1, &b, rep, 64, now, &body,
+                          &body_len) == (i == 0 ? COAP_OK : COAP_ERR_LIMIT));
+  }
+
+  // Idle transfers time out.
+  b.num = 0;
+  assert(coap_reasm_add(r, ep, 6, "w", 1, &b, rep, 64, now, &body,
+                        &body_len) == COAP_OK);
+  assert(coap_reasm_add(r, ep, 6, "x", 1, &b, rep, 64, now, &body,
+                        &body_len) == COAP_OK);
+  now += COAP_EXCHANGE_LIFETIME;
+  b.num = 1;
+  assert(coap_reasm_add(r, ep, 6, "w", 1, &b, rep, 64, now, &body,
+                        &body_len) == COAP_ERR_INCOMPLETE);
+  free(s);
+  free(p);
+  free(r);
+  return;
+}
+
+static int route_(const coap_router_t* r, coap_parser_t* p, uint8_t code,
+                  const char* path, void** cookie, coap_code_t* res) {
+  static char buf[128];
+  coap_serializer_t* s = NULL;
+  const char* seg;
+  size_t len = 0;
+  int rc;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 128) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, code, 0) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_HOST, "h", 1) == COAP_OK);
+  for (seg = path; *seg; seg += len + (seg[len] == '/')) {
+    for (len = 0; seg[len] && seg[len] != '/'; len++) {
+    }
+    assert(coap_serializer_add_opt(s, O_URI_PATH, seg, len) == COAP_OK);
+  }
+  assert(coap_serializer_add_opt(s, O_URI_QUERY, "q", 1) == COAP_OK);
+  assert(coap_serializer_exec(s, 1, NULL, NULL, 0, &len) == COAP_OK);
+  assert(coap_parser_exec(p, buf, len) == COAP_OK);
+  rc = coap_router_match(r, p, cookie, res);
+  free(s);
+  return rc;
+}
+
+void test_coap_router_match() {
+  static int h[7];
+  size_t size = coap_router_size(16, 8, 64);
+  void* buf = malloc(size);
+  coap_router_t* r = NULL;
+  coap_parser_t* p = NULL;
+  coap_code_t res = 0;
+  void* cookie = NULL;
+
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_router_create(&r, buf, size - 1, 16, 8, 64) == COAP_ERR_ARG);
+  assert(coap_router_create(&r, buf, size, 16, 8, 64) == COAP_OK);
+  assert(coap_router_add(r, "/", C_GET, &h[0]) == COAP_OK);
+  assert(coap_router_add(r, "/sensors", C_GET, &h[1]) == COAP_OK);
+  assert(coap_router_add(r, "/sensors/*/temp", C_GET, &h[2]) == COAP_OK);
+  assert(coap_router_add(r, "/sensors/42/temp", C_PUT, &h[3]) == COAP_OK);
+  assert(coap_router_add(r, "files/**", C_GET, &h[4]) == COAP_OK);
+  assert(coap_router_add(r, "/sensors/*", C_DELETE, &h[5]) == COAP_OK);
+  assert(coap_router_add(r, "/a/b", C_GET, &h[6]) == COAP_OK);
+  assert(coap_router_add(r, "/sensors", C_GET, NULL) == COAP_ERR_DUPLICATE);
+  assert(coap_router_add(r, "/files/**/x", C_GET, NULL) == COAP_ERR_ARG);
+  assert(coap_router_match(r, p, &cookie, &res) == COAP_ERR_INVALID_CALL);
+  assert(coap_router_compile(r) == COAP_OK);
+  assert(coap_router_add(r, "/x", C_GET, NULL) == COAP_ERR_INVALID_CALL);
+
+  assert(route_(r, p, C_GET, "", &cookie, &res) == COAP_OK);
+  assert(cookie == &h[0]);
+  assert(route_(r, p, C_GET, "sensors", &cookie, &res) == COAP_OK);
+  assert(cookie == &h[1]);
+  assert(route_(r, p, C_GET, "sensors/42/temp", &cookie, &res) == COAP_OK);
+  assert(cookie == &h[2]);
+  assert(route_(r, p, C_PUT, "sensors/42/temp", &cookie, &res) == COAP_OK);
+  assert(cookie == &h[3]);
+  assert(route_(r, p, C_PUT, "sensors/7/temp", &cookie, &res) ==
+         COAP_ERR_NOT_FOUND);
+  assert(res == C_METHOD_NOT_ALLOWED);
+  assert(route_(r, p, C_DELETE, "sensors/42", &cookie, &res) == COAP_OK);
+  assert(cookie == &h[5]);
+  assert(route_(r, p, C_GET, "files", &cookie, &res) == COAP_OK);
+  assert(cookie == &h[4]);
+  assert(route_(r, p, C_GET, "files/fw/v2.bin", &cookie, &res) == COAP_OK);
+  assert(cookie == &h[4]);
+  assert(route_(r, p, C_GET, "a/b", &cookie, &res) == COAP_OK);
+  assert(cookie == &h[6]);
+  assert(route_(r, p, C_GET, "a", &cookie, &res) == COAP_ERR_NOT_FOUND);
+  assert(res == C_NOT_FOUND);
+  assert(route_(r, p, C_GET, "sensors/42/hum", &cookie, &res) ==
+         COAP_ERR_NOT_FOUND);
+  assert(res == C_NOT_FOUND);
+  assert(route_(r, p, C_POST, "", &cookie, &res) == COAP_ERR_NOT_FOUND);
+  assert(res == C_METHOD_NOT_ALLOWED);
+  free(p);
+  free(r);
+  return;
+}
+
+void test_coap_pool_acquire() {
+  size_t size = coap_pool_size(3, 64);
+  void* buf = malloc(size);
+  coap_pool_t* pool = NULL;
+  coap_pool_item_t* items[4];
+  coap_pool_stats_t stats;
+  size_t len;
+
+  assert(coap_pool_create(&pool, buf, size - 1, 3, 64) == COAP_ERR_ARG);
+  assert(coap_pool_create(&pool, buf, size, 0, 64) == COAP_ERR_ARG);
+  assert(coap_pool_create(&pool, buf, size, 3, 64) == COAP_OK);
+  assert(((uintptr_t)pool & 63) == 0);
+  assert(coap_pool_acquire(pool, &items[0]) == COAP_OK);
+  assert(coap_pool_acquire(pool, &items[1]) == COAP_OK);
+  assert(coap_pool_acquire(pool, &items[2]) == COAP_OK);
+  assert(coap_pool_acquire(pool, &items[3]) == COAP_ERR_LIMIT);
+  assert(items[0] != items[1] && items[1] != items[2]);
+  assert(((uintptr_t)items[1]->parser & 63) == 0);
+  assert(((uintptr_t)items[1]->buf & 63) == 0);
+  assert(items[1]->buf_len == 64);
+
+  // The serializer writes to the item's buffer.
+  assert(coap_serializer_init(items[1]->serializer, T_CON, C_GET, 0) ==
+         COAP_OK);
+  assert(coap_serializer_exec(items[1]->serializer, 7, NULL, NULL, 0, &len) ==
+         COAP_OK);
+  assert(coap_parser_exec(items[1]->parser, items[1]->buf, len) == COAP_OK);
+
+  assert(coap_pool_release(pool, (coap_pool_item_t*)buf) == COAP_ERR_ARG);
+  assert(coap_pool_release(pool, items[1]) == COAP_OK);
+  assert(coap_pool_acquire(pool, &items[3]) == COAP_OK);
+  assert(items[3] == items[1]);
+  assert(coap_pool_get_stats(pool, &stats) == COAP_OK);
+  assert(stats.capacity == 3 && stats.in_use == 3 && stats.high_water == 3);
+  assert(stats.acquired == 4 && stats.exhausted == 1);
+  assert(coap_pool_release(pool, items[0]) == COAP_OK);
+  assert(coap_pool_release(pool, items[2]) == COAP_OK);
+  assert(coap_pool_get_stats(pool, &stats) == COAP_OK);
+  assert(stats.in_use == 1 && stats.high_water == 3);
+
+  // Without output buffers the serializer is left to the caller.
+  size = coap_pool_size(1, 0);
+  buf = realloc(buf, size);
+  assert(coap_pool_create(&pool, buf, size, 1, 0) == COAP_OK);
+  assert(coap_pool_acquire(pool, &items[0]) == COAP_OK);
+  assert(items[0]->buf == NULL && items[0]->buf_len == 0);
+  free(buf);
+  return;
+}
+
+/**
+ * What the stream callbacks saw. |chunk| is the chunk being fed, to tell
+ * fields handed out in place from gathered ones.
+ */
+typedef struct stream_rec_t {
+  const char* chunk;
+  size_t chunk_len;
+  int begins;
+  int completes;
+  int in_place;
+  uint8_t codes[8];
+  size_t codes_len;
+  uint32_t opts;
+  char payload[512];
+  size_t payload_len;
+} stream_rec_t;
+
+static void stream_begin_(void* cookie) { ((stream_rec_t*)cookie)->begins++; }
+
+static void stream_header_(void* cookie, coap_type_t type, coap_code_t code,
+                           uint16_t mid, const char* token,
+                           uint8_t token_len) {
+  stream_rec_t* r = cookie;
+  assert(type == T_CON && mid == 0);
+  assert(token_len == 0 || memcmp(token, "tok", token_len) == 0);
+  r->codes[r->codes_len++] = code;
+}
+
+static void stream_opt_(void* cookie, uint16_t opt, const void* val,
+                        uint16_t len) {
+  stream_rec_t* r = cookie;
+  const char* v = val;
+  r->opts = r->opts * 31 + opt * 7 + len + (len > 0 ? (uint8_t)v[0] : 0);
+  if (v >= r->chunk && v + len <= r->chunk + r->chunk_len) {
+    r->in_place++;
+  }
+}
+
+static void stream_payload_(void* cookie, const char* buf, size_t len) {
+  stream_rec_t* r = cookie;
+  memcpy(&r->payload[r->payload_len], buf, len);
+  r->payload_len += len;
+}
+
+static void stream_complete_(void* cookie) {
+  ((stream_rec_t*)cookie)->completes++;
+}
+
+static void stream_feed_(coap_stream_t* st, stream_rec_t* r, const char* buf,
+                         size_t len, size_t chunk) {
+  size_t i, n;
+  for (i = 0; i < len; i += n) {
+    n = len - i < chunk ? len - i : chunk;
+    r->chunk = &buf[i];
+    r->chunk_len = n;
+    assert(coap_stream_exec(st, &buf[i], n) == COAP_OK);
+  }
+}
+
+void test_coap_stream_exec() {
+  // 0.01 GET with Uri-Path "a" and 7.02 Ping.
+  const char get[4] = {0x20, 0x01, (char)0xB1, 'a'};
+  const char ping[2] = {0x00, (char)0xE2};
+  char payload[300];
+  char stream[1024];
+  char buf[512];
+  size_t stream_len = 0;
+  coap_serializer_t* s = NULL;
+  coap_stream_t* st = NULL;
+  coap_parser_settings_t settings = {};
+  stream_rec_t whole = {};
+  stream_rec_t split = {};
+  size_t size = coap_stream_size(32);
+  char* big;
+  size_t len = 0;
+
+  memset(payload, 'p', sizeof(payload));
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf,
+                                sizeof(buf)) == COAP_OK);
+  assert(coap_serializer_init_framed(s, C_GET, 0) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "a", 1) == COAP_OK);
+  assert(coap_serializer_exec_framed(s, NULL, NULL, 0, &len) == COAP_OK);
+  assert(len == sizeof(get) && memcmp(buf, get, len) == 0);
+  assert(coap_serializer_exec(s, 1, NULL, NULL, 0, &len) ==
+         COAP_ERR_INVALID_CALL);
+  memcpy(&stream[stream_len], buf, len);
+  stream_len += len;
+
+  // Re-executing with a payload grows the header by the extended length.
+  assert(coap_serializer_init_framed(s, C_CONTENT, 3) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_LOCATION_PATH, "abcdefghijklmnopq",
+                                 17) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, O_CONTENT_FORMAT, F_TEXT_PLAIN) ==
+         COAP_OK);
+  assert(coap_serializer_exec_framed(s, "tok", "x", 1, &len) == COAP_OK);
+  assert(len == 2 + 3 + 1 + 20 + 2 && (uint8_t)buf[0] == (13 << 4 | 3));
+  assert(coap_serializer_exec_framed(s, "tok", payload, 300, &len) ==
+         COAP_OK);
+  assert(len == 4 + 3 + 20 + 301 && (uint8_t)buf[0] == (14 << 4 | 3));
+  assert((uint8_t)buf[1] == 0 && (uint8_t)buf[2] == 321 - 269);
+  assert((uint8_t)buf[3] == C_CONTENT && memcmp(&buf[4], "tok", 3) == 0);
+  memcpy(&stream[stream_len], buf, len);
+  stream_len += len;
+
+  // Signals number their options on their own.
+  assert(coap_serializer_init(s, T_CON, C_CSM, 0) == COAP_ERR_ARG);
+  assert(coap_serializer_init_framed(s, C_CSM, 0) == COAP_OK);
+  assert(coap_serializer_add_opt_uint(s, 2, 1152) == COAP_OK);
+  assert(coap_serializer_add_opt(s, 4, NULL, 0) == COAP_OK);
+  assert(coap_serializer_exec_framed(s, NULL, NULL, 0, &len) == COAP_OK);
+  memcpy(&stream[stream_len], buf, len);
+  stream_len += len;
+  memcpy(&stream[stream_len], ping, sizeof(ping));
+  stream_len += sizeof(ping);
+
+  settings.on_begin = stream_begin_;
+  settings.on_header = stream_header_;
+  settings.on_opt = stream_opt_;
+  settings.on_payload = stream_payload_;
+  settings.on_complete = stream_complete_;
+  assert(coap_stream_create(&st, stream, size - 1, 32, 512) == COAP_ERR_ARG);
+  assert(coap_stream_create(&st, malloc(size), size, 32, 512) == COAP_OK);
+  settings.cookie = &whole;
+  assert(coap_stream_init(st, &settings) == COAP_OK);
+  stream_feed_(st, &whole, stream, stream_len, stream_len);
+  assert(coap_stream_is_idle(st));
+  assert(whole.begins == 4 && whole.completes == 4);
+  assert(whole.codes_len == 4 && whole.codes[0] == C_GET);
+  assert(whole.codes[1] == C_CONTENT && whole.codes[2] == C_CSM);
+  assert(whole.codes[3] == C_PING);
+  assert(whole.in_place == 5);
+  assert(whole.payload_len == 300 && memcmp(whole.payload, payload, 300) == 0);
+
+  // Byte by byte the callbacks see the same, with fields gathered.
+  settings.cookie = &split;
+  assert(coap_stream_init(st, &settings) == COAP_OK);
+  stream_feed_(st, &split, stream, 1, 1);
+  assert(!coap_stream_is_idle(st));
+  stream_feed_(st, &split, &stream[1], stream_len - 1, 1);
+  assert(split.begins == 4 && split.completes == 4);
+  assert(memcmp(split.codes, whole.codes, 4) == 0);
+  assert(split.opts == whole.opts && split.in_place == 3);
+  assert(split.payload_len == 300 && memcmp(split.payload, payload, 300) == 0);
+
+  // TKL 9 is reserved and a failed stream stays failed.
+  assert(coap_stream_init(st, NULL) == COAP_OK);
+  assert(coap_stream_exec(st, "\x09\x01", 2) == COAP_ERR_SYNTAX);
+  assert(coap_stream_exec(st, get, sizeof(get)) == COAP_ERR_INVALID_CALL);
+  // A payload marker with no payload.
+  assert(coap_stream_init(st, NULL) == COAP_OK);
+  assert(coap_stream_exec(st, "\x10\x45\xFF", 3) == COAP_ERR_SYNTAX);
+  // 1.00 is not a code.
+  assert(coap_stream_init(st, NULL) == COAP_OK);
+  assert(coap_stream_exec(st, "\x00\x20", 2) == COAP_ERR_SYNTAX);
+  // More than |max_len| bytes of options and payload.
+  assert(coap_stream_init(st, NULL) == COAP_OK);
+  assert(coap_stream_exec(st, "\xE0\x01", 2) == COAP_OK);
+  assert(coap_stream_exec(st, "\x00", 1) == COAP_ERR_LIMIT);
+  // An option value longer than 32 bytes straddles the chunks.
+  assert(coap_stream_init(st, NULL) == COAP_OK);
+  assert(coap_stream_exec(st, "\xD0\x20\x01\x8D\x14", 5) == COAP_OK);
+  assert(coap_stream_exec(st, "x", 1) == COAP_ERR_LIMIT);
+
+
+  // Frames of 65805 bytes and more take a 4 byte extended length.
+  big = malloc(70016 + 70016);
+  assert(coap_serializer_create(&s, s, coap_serializer_size(), big, 70016) ==
+         COAP_OK);
+  assert(coap_serializer_init_framed(s, C_CONTENT, 0) == COAP_OK);
+  assert(coap_serializer_exec_framed(s, NULL, &big[70016], 70010, &len) ==
+         COAP_ERR_LIMIT);
+  assert(coap_serializer_exec_framed(s, NULL, &big[70016], 69999, &len) ==
+         COAP_OK);
+  // 70000 - 65805 = 0x1063
+  assert(len == 6 + 70000 && (uint8_t)big[0] == 15 << 4);
+  assert(big[1] == 0 && big[2] == 0 && big[3] == 0x10 && big[4] == 0x63);
+  assert((uint8_t)big[5] == C_CONTENT && (uint8_t)big[6] == 0xFF);
+  assert(coap_stream_create(&st, st, size, 32, 70000) == COAP_OK);
+  assert(coap_stream_init(st, NULL) == COAP_OK);
+  assert(coap_stream_exec(st, big, 1000) == COAP_OK);
+  assert(coap_stream_exec(st, &big[1000], len - 1000) == COAP_OK);
+  assert(coap_stream_is_idle(st));
+  free(big);
+  free(st);
+  free(s);
+  return;
+}
+
+// Counters stay at 0 unless the library counts them.
+#ifdef GREENCOAP_STATS
+#define STATS_(n) (n)
+#else
+#define STATS_(n) 0
+#endif
+
+void test_coap_stats() {
+  static const struct {
+    const char* buf;
+    size_t len;
+  } bad[] = {
+    {"\x40\x01\x00", 3},                          // truncated
+    {"\x80\x01\x00\x01", 4},                      // version 2
+    {"\x60\x01\x00\x01", 4},                      // ACK GET
+    {"\x49\x01\x00\x01", 4},                      // TKL 9
+    {"\x40\x01\x00\x01\xF0", 5},                  // delta 15
+    {"\x40\x01\x00\x01\x1F", 5},                  // length 15
+    {"\x40\x01\x00\x01\x20", 5},                  // option 2
+    {"\x40\x01\x00\x01\x51\x00", 6},              // If-None-Match of 1
+    {"\x40\x01\x00\x01\x31\x61\x01\x62", 8},      // Uri-Host twice
+    {"\x40\x01\x00\x01\xFF", 5},                  // no payload
+  };
+  coap_stats_t stats = {};
+  coap_stats_t sum = {};
+  coap_serializer_t* s = NULL;
+  coap_parser_t* p = NULL;
+  coap_stream_t* st = NULL;
+  struct iovec iov[2];
+  size_t iov_len;
+  char buf[64];
+  size_t len = 0;
+  size_t i;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf,
+                                sizeof(buf)) == COAP_OK);
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+  assert(coap_serializer_set_stats(NULL, &stats) == COAP_ERR_ARG);
+  assert(coap_serializer_set_stats(s, &stats) == COAP_OK);
+  assert(coap_parser_set_stats(p, &stats) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_GET, 0) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "a", 1) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_PATH, "b", 1) == COAP_OK);
+  assert(coap_serializer_exec_iov(s, 1, NULL, "xy", 2, iov, &iov_len, &len) ==
+         COAP_OK);
+  assert(coap_serializer_exec(s, 1, NULL, buf, 64, &len) == COAP_ERR_LIMIT);
+  assert(coap_serializer_exec(s, 1, NULL, NULL, 0, &len) == COAP_OK);
+  assert(coap_parser_exec(p, buf, len) == COAP_OK);
+  for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    assert(coap_parser_exec(p, bad[i].buf, bad[i].len) == COAP_ERR_SYNTAX);
+  }
+  assert(stats.serialized == STATS_(2));
+  assert(stats.serialized_bytes == STATS_(len + len + 3));
+  assert(stats.serialize_errors == STATS_(1));
+  assert(stats.parsed == STATS_(1) && stats.parsed_bytes == STATS_(len));
+  // The reserved length nibble and If-None-Match both are length errors.
+  for (i = 0; i < COAP_STATS_ERR_LIMIT; i++) {
+    assert(stats.errors[i] == STATS_(i == COAP_STATS_ERR_OPT_LENGTH ? 2 : 1));
+  }
+  assert(stats.errors[COAP_STATS_ERR_LIMIT] == 0);
+  assert(stats.opt_length_errors[O_IF_NONE_MATCH] == STATS_(1));
+  assert(stats.opts[O_URI_PATH] == STATS_(2));
+  assert(stats.opts[O_URI_HOST] == STATS_(1));
+
+  // Frames of a stream, and one with a 7.xx code that is not a signal.
+  assert(coap_stream_create(&st, malloc(coap_stream_size(0)),
+                            coap_stream_size(0), 0, 1152) == COAP_OK);
+  assert(coap_stream_init(st, NULL) == COAP_OK);
+  assert(coap_stream_set_stats(st, &stats) == COAP_OK);
+  assert(coap_stream_exec(st, "\x00\xE2\x20\x01\xB1\x61", 6) == COAP_OK);
+  assert(coap_stream_exec(st, "\x00\xE7", 2) == COAP_ERR_SYNTAX);
+  assert(stats.parsed == STATS_(3) && stats.parsed_bytes == STATS_(len + 8));
+  assert(stats.errors[COAP_STATS_ERR_TYPE_CODE] == STATS_(2));
+  assert(stats.opts[O_URI_PATH] == STATS_(3));
+
+  // Per-thread counters are summed up for a snapshot.
+  assert(coap_stats_add(&sum, &stats) == COAP_OK);
+  assert(coap_stats_add(&sum, &stats) == COAP_OK);
+  assert(sum.parsed == 2 * stats.parsed);
+  assert(sum.opts[O_URI_PATH] == 2 * stats.opts[O_URI_PATH]);
+  assert(coap_stats_add(&sum, NULL) == COAP_ERR_ARG);
+  free(st);
+  free(s);
+  free(p);
+  return;
+}
+
+#ifdef GREENCOAP_SERVER
+static void* pool_worker_(void* arg) {
+  coap_pool_t* pool = arg;
+  coap_pool_item_t* item;
+  int i;
+  for (i = 0; i < 100000; i++) {
+    if (coap_pool_acquire(pool, &item) != COAP_OK) {
+      continue;
+    }
+    // Two threads holding the same item would trip this.
+    assert(__atomic_exchange_n(&item->buf[0], 1, __ATOMIC_ACQ_REL) == 0);
+    __atomic_store_n(&item->buf[0], 0, __ATOMIC_RELEASE);
+    assert(coap_pool_release(pool, item) == COAP_OK);
+  }
+  return NULL;
+}
+
+void test_coap_pool_threads() {
+  size_t size = coap_pool_size(2, 16);
+  void* buf = calloc(1, size);
+  coap_pool_t* pool = NULL;
+  coap_pool_stats_t stats;
+  pthread_t threads[4];
+  size_t i;
+
+  assert(coap_pool_create(&pool, buf, size, 2, 16) == COAP_OK);
+  for (i = 0; i < 4; i++) {
+    assert(pthread_create(&threads[i], NULL, pool_worker_, pool) == 0);
+  }
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  assert(coap_pool_get_stats(pool, &stats) == COAP_OK);
+  assert(stats.in_use == 0 && stats.high_water <= 2);
+  assert(stats.acquired + stats.exhausted == 400000);
+  free(buf);
+  return;
+}
+#endif
+
+#ifdef GREENCOAP_SERVER
+static void echo_handler_(void* cookie, const coap_parser_t* p,
+                          coap_serializer_t* s, const void* peer,
+                          size_t peer_len, size_t* res_len) {
+  const char* token;
+  uint8_t token_len;
+  uint16_t mid;
+  __atomic_fetch_add((int*)cookie, 1, __ATOMIC_RELAXED);
+  coap_parser_get_mid(p, &mid);
+  coap_parser_get_token(p, &token, &token_len);
+  coap_serializer_init(s, T_ACK, C_CONTENT, token_len);
+  coap_serializer_exec(s, mid, token, "ok", 2, res_len);
+}
+
+static void server_loopback_(uint8_t io, size_t max_msg_len) {
+  coap_server_config_t c = {"127.0.0.1", 0, 2, 8, max_msg_len, 0,
+                            echo_handler_, NULL, io};
+  size_t size = coap_server_size(&c);
+  void* buf = malloc(size);
+  coap_server_t* srv = NULL;
+  coap_server_stats_t stats;
+  coap_stats_t counters;
+  coap_parser_t* p = NULL;
+  struct sockaddr_in addr;
+  struct timeval tv = {2, 0};
+  char req[16] = {0x41, 0x01, 0x00, 0x00, 0x5A};
+  char res[64];
+  const char* payload;
+  size_t payload_len;
+  uint16_t mid;
+  uint16_t port;
+  uint64_t received = 0;
+  int handled = 0;
+  ssize_t len;
+  size_t i;
+  int fd;
+
+  c.cookie = &handled;
+  assert(coap_server_create(&srv, buf, size - 1, &c) == COAP_ERR_ARG);
+  assert(coap_server_create(&srv, buf, size, &c) == COAP_OK);
+  assert(coap_server_get_workers(srv) == 2);
+  assert(coap_server_get_port(srv, &port) == COAP_OK && port != 0);
+  if (coap_server_start(srv) != COAP_OK) {
+    // io_uring is not available on this kernel.
+    assert(io == COAP_SERVER_IO_URING);
+    free(srv);
+    return;
+  }
+  assert(coap_parser_create(&p, malloc(coap_parser_size()),
+                            coap_parser_size()) == COAP_OK);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  assert(fd >= 0);
+  assert(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0);
+  for (i = 0; i < 16; i++) {
+    req[3] = (char)i;
+    assert(sendto(fd, req, 5, 0, (struct sockaddr*)&addr, sizeof(addr)) == 5);
+  }
+  // A malformed datagram is counted and dropped.
+  assert(sendto(fd, "\xFF", 1, 0, (struct sockaddr*)&addr, sizeof(addr)) ==
+         1);
+  for (i = 0; i < 16; i++) {
+    len = recv(fd, res, sizeof(res), 0);
+    assert(len > 0);
+    assert(coap_parser_exec(p, res, len) == COAP_OK);
+    assert(coap_parser_get_mid(p, &mid) == COAP_OK && mid < 16);
+    assert(coap_parser_get_payload(p, &payload, &payload_len) == COAP_OK);
+    assert(payload_len == 2 && memcmp(payload, "ok", 2) == 0);
+  }
+  assert(coap_server_stop(srv) == COAP_OK);
+  assert(coap_server_start(srv) == COAP_ERR_INVALID_CALL);
+  assert(handled == 16);
+  for (i = 0; i < coap_server_get_workers(srv); i++) {
+    assert(coap_server_get_stats(srv, i, &stats) == COAP_OK);
+    received += stats.received;
+  }
+  assert(received == 17);
+  assert(coap_server_get_counters(srv, &counters) == COAP_OK);
+  assert(counters.parsed == STATS_(16) && counters.serialized == STATS_(16));
+  assert(counters.errors[COAP_STATS_ERR_TRUNCATED] == STATS_(1));
+  if (io != COAP_SERVER_IO_AUTO) {
+    assert(coap_server_get_io(srv, 0) == io);
+  }
+  close(fd);
+  free(p);
+  free(srv);
+  return;
+}
+
+void test_coap_server_loopback() {
+  server_loopback_(COAP_SERVER_IO_AUTO, 256);
+  server_loopback_(COAP_SERVER_IO_URING, 256);
+  server_loopback_(COAP_SERVER_IO_EPOLL, 256);
+  // The send headers behind odd-sized buffers must stay aligned.
+  server_loopback_(COAP_SERVER_IO_URING, 1153);
+  server_loopback_(COAP_SERVER_IO_EPOLL, 1153);
+}
+#endif
+
 int main(void) {
   test_coap_serializer_size();
   test_coap_serializer_create();
@@ -244,6 +2120,32 @@ int main(void) {
 
   test_coap_parser_size();
 
+  test_coap_serializer_add_opt_extended();
+  test_coap_serializer_add_opt_validation();
+  test_coap_parser_exec_batch();
+  test_coap_parser_get_opt();
+  test_coap_parser_get_uint_opts();
+  test_coap_editor_exec();
+  test_coap_reply();
+  test_coap_serializer_exec_iov();
+  test_coap_builder_exec();
+  test_coap_template_exec();
+  test_coap_parser_exec_lazy();
+  test_coap_parser_exec_many_opts();
+  test_coap_dedup_check();
+  test_coap_cache_get();
+  test_coap_retx_poll();
+  test_coap_exchange_match();
+  test_coap_observe_emit();
+  test_coap_block();
+  test_coap_router_match();
+  test_coap_pool_acquire();
+  test_coap_stream_exec();
+  test_coap_stats();
+#ifdef GREENCOAP_SERVER
+  test_coap_pool_threads();
+  test_coap_server_loopback();
+#endif
   test_coap_sample_readme();
   printf("ok.\n");
   return 0;
@@ -0,0 +1,146 @@
+#include "greencoap.hpp"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define L(x) (sizeof(x) - 1)
+
+using greencoap::OptSpec;
+
+static_assert(greencoap::opt_ext_len(12) == 0, "");
+static_assert(greencoap::opt_ext_len(13) == 1, "");
+static_assert(greencoap::opt_ext_len(269) == 2, "");
+static_assert(greencoap::opt_header_len(11, 4) == 1, "");
+static_assert(greencoap::opt_header_len(35, 300) == 4, "");
+static_assert(greencoap::uint_len(0) == 0, "");
+static_assert(greencoap::uint_len(256) == 2, "");
+
+void test_parser() {
+  char buf[128] = {};
+  char token[2] = {0x12, 0x34};
+  const char* segments[] = {"api", "v1", "temperature"};
+  coap_serializer_t* s = NULL;
+  size_t msg_len = 0;
+  size_t i = 0;
+
+  assert(coap_serializer_create(&s, malloc(coap_serializer_size()),
+                                coap_serializer_size(), buf, 128) == COAP_OK);
+  assert(coap_serializer_init(s, T_CON, C_GET, 2) == COAP_OK);
+  assert(coap_serializer_add_opt(s, O_URI_HOST, "example.com",
+                                 L("example.com")) == COAP_OK);
+  for (i = 0; i < 3; i++) {
+    assert(coap_serializer_add_opt(s, O_URI_PATH, segments[i],
+                                   strlen(segments[i])) == COAP_OK);
+  }
+  assert(coap_serializer_add_opt_uint(s, O_ACCEPT, F_APPLICATION_JSON) ==
+         COAP_OK);
+  assert(coap_serializer_exec(s, 0x1234, token, "{}", 2, &msg_len) ==
+         COAP_OK);
+  free(s);
+
+  greencoap::Parser p;
+  assert(p.opts().empty());
+  assert(p.exec(std::string_view(buf, msg_len)) == COAP_OK);
+  assert(p.type() == T_CON && p.code() == C_GET && p.mid() == 0x1234);
+  assert(p.token() == std::string_view(token, 2));
+  assert(p.payload() == "{}");
+  assert(p.has_opt(O_ACCEPT) && !p.has_opt(O_CONTENT_FORMAT));
+  assert(p.opt(O_URI_HOST) == "example.com");
+  assert(!p.opt(O_CONTENT_FORMAT));
+  assert(p.opt_uint(O_ACCEPT) == F_APPLICATION_JSON);
+  assert(!p.opt_uint(O_MAX_AGE));
+
+  i = 0;
+  for (const greencoap::Option& o : p.opts(O_URI_PATH)) {
+    assert(o.num == O_URI_PATH && o.value == segments[i]);
+    i++;
+  }
+  assert(i == 3);
+  assert(p.opts(O_IF_MATCH).empty());
+
+  std::vector<uint16_t> nums;
+  for (const greencoap::Option& o : p.opts()) {
+    nums.push_back(o.num);
+  }
+  assert((nums == std::vector<uint16_t>{O_URI_HOST, O_URI_PATH, O_URI_PATH,
+                                         O_URI_PATH, O_ACCEPT}));
+
+  // Moving keeps the parsed message.
+  greencoap::Parser q = std::move(p);
+  assert(q.opt(O_URI_HOST) == "example.com");
+  assert(q.exec(std::string_view(buf, 3)) == COAP_ERR_SYNTAX);
+  return;
+}
+
+void test_serializer() {
+  char buf[64] = {};
+  greencoap::Serializer s(buf, sizeof(buf));
+  greencoap::Serializer owned(64);
+  greencoap::Parser p;
+
+  assert(s.init(T_CON, C_POST, 1) == COAP_OK);
+  assert(s.add_opt(O_URI_PATH, "sensors") == COAP_OK);
+  assert(s.add_opt_uint(O_CONTENT_FORMAT, F_TEXT_PLAIN) == COAP_OK);
+  assert(s.exec(7, "") == COAP_ERR_ARG);
+  assert(s.message().empty());
+  assert(s.exec(7, "t", "22.3 C") == COAP_OK);
+  assert(s.message().data() == buf);
+  assert(p.exec(s.message()) == COAP_OK);
+  assert(p.mid() == 7 && p.token() == "t" && p.payload() == "22.3 C");
+  assert(p.opt(O_URI_PATH) == "sensors");
+
+  assert(owned.init(T_ACK, C_CONTENT) == COAP_OK);
+  assert(owned.exec(8) == COAP_OK);
+  greencoap::Serializer moved = std::move(owned);
+  assert(moved.message().size() == 4);
+  assert(p.exec(moved.message()) == COAP_OK);
+  assert(p.type() == T_ACK && p.code() == C_CONTENT && p.mid() == 8);
+  return;
+}
+
+void test_shape() {
+  static constexpr auto get = greencoap::make_shape(
+      T_CON, C_GET, 2, OptSpec{O_URI_HOST, 11}, OptSpec{O_URI_PATH, 7},
+      OptSpec{O_URI_PATH, 4}, OptSpec{O_ACCEPT, 1}, OptSpec{300, 1});
+  static constexpr auto bad =
+      greencoap::make_shape(T_CON, C_GET, 0, OptSpec{O_ACCEPT, 1},
+                            OptSpec{O_URI_PATH, 1});
+  static constexpr auto empty = greencoap::make_shape(T_ACK, 0, 0);
+  static_assert(get.valid() && !bad.valid() && empty.valid(), "");
+  static_assert(get.size() == 4 + 2 + 12 + 8 + 5 + 2 + 4, "");
+  static_assert(empty.size() == 4, "");
+  char buf[64] = {};
+  char expected[64] = {};
+  char token[2] = {0x12, 0x34};
+  size_t len = 0;
+  greencoap::Serializer s(expected, sizeof(expected));
+
+  assert(s.init(T_CON, C_GET, 2) == COAP_OK);
+  assert(s.add_opt(O_URI_HOST, "example.com") == COAP_OK);
+  assert(s.add_opt(O_URI_PATH, "sensors") == COAP_OK);
+  assert(s.add_opt(O_URI_PATH, "temp") == COAP_OK);
+  assert(s.add_opt_uint(O_ACCEPT, F_APPLICATION_JSON) == COAP_OK);
+  assert(s.add_opt(300, "x") == COAP_OK);
+  assert(s.exec(0x1234, std::string_view(token, 2), "{}") == COAP_OK);
+
+  std::string accept(1, (char)F_APPLICATION_JSON);
+  len = get.write(buf, 0x1234, token,
+                  {"example.com", "sensors", "temp", accept, "x"}, "{}");
+  assert(len == get.size(2) && len == s.message().size());
+  assert(memcmp(buf, expected, len) == 0);
+  assert(empty.write(buf, 9, NULL, {}) == 4);
+  assert(memcmp(buf, "\x60\x00\x00\x09", 4) == 0);
+  return;
+}
+
+int main(void) {
+  test_parser();
+  test_serializer();
+  test_shape();
+  printf("ok.\n");
+  return 0;
+}